@@ -192,6 +192,9 @@ namespace Logger
 
     /** Set the sink to use */
     extern void setDefaultSink(OutputSink * newSink);
+    /** Set the sink to use, without deleting the previous one
+        @return The previous sink, the caller owns it (unless it's the static console sink) */
+    extern OutputSink * swapDefaultSink(OutputSink * newSink);
     /** Get a reference on the currently selected default sink */
     extern OutputSink & getDefaultSink();
 
@@ -716,6 +716,64 @@ namespace Network
             /** Default constructor */
             Ethernet(const uint8 * _address = 0, const int len = 0, const uint16 type = IPv4) : protocol(type) { memset(address, 0, ArrSz(address)); if (_address && len == 6) memcpy(address, _address, len); }
         };
+  #endif
+  #if _LINUX == 1
+        /** A Unix domain socket address, a path in the file system.
+            Only a BerkeleySocket understands it: it's bound on the path instead of an IP address and port.
+            The clients connecting to such a socket are usually not bound, so their address has an empty path */
+        class Unix : public BaseAddress
+        {
+            // Type definition and enumeration
+        public:
+            /** The maximum path length (the size of sockaddr_un's sun_path, with the terminating zero) */
+            enum { MaxPathLength = 108 };
+
+            // Members
+        private:
+            /** The socket path, zero terminated */
+            char path[MaxPathLength];
+
+        public:
+            /** Get the address as a UTF-8 textual value (like "unix:/run/server.sock", or "unix" for an unbound socket) */
+            virtual String asText() const { return path[0] ? String("unix:") + path : String("unix"); }
+            /** Set the address as a UTF-8 textual value (the "unix:" prefix is optional)
+                @return false if the path is too long */
+            virtual bool asText(const String & textualValue) { String value = textualValue.fromFirst("unix:"); if (!value) value = textualValue; if (value.getLength() >= MaxPathLength) return false; memset(path, 0, sizeof(path)); memcpy(path, (const char*)value, value.getLength()); return true; }
+
+            /** There is no port for this address */
+            virtual uint16 getPort() const { return 0; }
+            virtual bool setPort(const uint16) { return false; }
+            /** There is no protocol for this address */
+            virtual Protocol getProtocol() const { return Unknown; }
+            virtual bool setProtocol(const Protocol) { return false; }
+
+            /** Check if the address is valid (it has a path) */
+            virtual bool isValid() const { return path[0] != 0; }
+            /** Get a complete address string (used for debugging mainly) */
+            virtual String identify() const { return asText(); }
+
+            /** Get a bindable address, this address */
+            virtual const BaseAddress & getBindableAddress() const { return *this; }
+            /** Get the low level object for this address (the path)
+                @warning Don't use this, it's not what you think it is */
+            virtual const void * getLowLevelObject() const { return path; }
+            /** Get the low level object size for this address (the path length)
+                @warning Don't use this, it's not what you think it is */
+            virtual const int getLowLevelObjectSize() const { return (int)strlen(path); }
+
+            /** Get type id for this address.
+                This is used instead of RTTI */
+            virtual int getTypeID() const { return 6; }
+            /** Clone this address
+                @return a pointer on a new allocated address you must delete. */
+            virtual BaseAddress * clone() const { return new Unix(path); }
+
+            // Construction and Destruction
+        public:
+            /** Build the address from the given path (truncated to MaxPathLength - 1 bytes)
+                @param len  The path length, or -1 for a zero terminated path */
+            Unix(const char * _path = 0, const int len = -1) { memset(path, 0, sizeof(path)); if (_path) { size_t size = len < 0 ? strlen(_path) : strnlen(_path, (size_t)len); memcpy(path, _path, size < sizeof(path) ? size : sizeof(path) - 1); } }
+        };
   #endif
         /** A NAT address hold 2 addresses, usually the private address (default), and the public address */
         class NAT : public IPV4
@@ -74,7 +74,7 @@ namespace Network
 
             // Interface
         public:
-            /** Reset the structure but don't delete the private data */
+            /** Reset the structure but don't delete the private data (nor the received data that's not parsed yet) */
             void Reset();
             /** Call this to reset the lingering connection timestamp (and avoid being auto-closed) */
             void touchConnection();
@@ -227,10 +227,12 @@ namespace Network
                 serverIndex = 0;
                 if (!this->pool.getSize()) return false;
 
-                for (uint32 i = 0; i < this->pool.getSize(); i++)
+                // The server sockets are moved to the clients pool, so the next one takes the place of the moved one
+                for (uint32 i = 0; i < this->pool.getSize();)
                 {   // Set socket as non blocking
                     BaseSocket * socket = this->pool[i];
-                    if (socket)
+                    if (!socket) i++;
+                    else
                     {
                         // Make sure the server socket is correclty set up
                         if (socket->getState() < Network::Socket::BaseSocket::Bound) return false;
@@ -299,8 +301,13 @@ namespace Network
                                              // Ok, the client was accepted
                                              client->getPrivateField() = (void *)new InternalObject;
                                              client->setOption(Network::Socket::BaseSocket::Blocking, 0);
-                                             if (!this->acceptedNewClient(*client, *address))
-                                                 closeClientSocket(client);
+                                             int action = this->acceptedNewClient(*client, *address);
+                                             if (!action) closeClientSocket(client);
+                                             else if (action == T::CaptureClient)
+                                             {   // The callback takes the socket once the server does not use it anymore
+                                                 forgetClientSocket(client);
+                                                 this->clientSocketForgotten(*client);
+                                             }
                                          }
                                      }
                                      // Not needed anymore
@@ -323,27 +330,8 @@ namespace Network
 
                             if (intern->getRecvBuffer().getSize() > minRecvSize)
                             {   // Have enough data to tell the client ?
-                                if (!this->clientReadPossible(*socket, *intern))
-                                {   // Ok, close the connection
-                                    closeClientSocket(socket);
-                                    return false;
-                                }
-                                // Check if we need to forget this socket
-                                if (intern->shouldForgetSocket())
-                                {
-                                    // That's the only case where we send data in the receiving part, since after forgetting, there is no link to the socket any more
-                                    if (intern->hasDataToSend())
-                                        sendPendingData(socket, intern);
-                                    forgetClientSocket(socket);
-                                }
-                                else
-                                {
-                                    // Ok, the connection progressed, so let's touch it
-                                    intern->touchConnection();
-                                    // Check if the clients should be written too (if so, add to the writer pool)
-                                    if (intern->hasDataToSend())
-                                        writers->appendSocket(socket);
-                                }
+                                // A closed connection changes the pool, so stop iterating it (like above), it does not stop the server
+                                if (!processReceivedData(socket, intern)) break;
                             }
                         }
                         clientIndex = clients.getNextReadySocket(clientIndex);
@@ -351,6 +339,8 @@ namespace Network
                 }
                 if (action & 2)
                 {   // Writing
+                    // The clients that have sent another request while the previous answer was being sent
+                    Container::PlainOldData<BaseSocket *>::Array pipelined;
                     uint32 clientIndex = writers->getNextReadySocket(-1);
                     while (clientIndex != (uint32)-1)
                     {
@@ -379,10 +369,14 @@ namespace Network
                                         // Reset doesn't manage the private field
                                         intern->Reset();
                                         this->deletePrivateField(intern->getPrivateField());
+                                        // The next request might be received already, it'll be answered once the writer pool is iterated
+                                        if (intern->getRecvBuffer().getSize() > this->minimumAmountToRead())
+                                            pipelined.Append(socket);
                                     }
                                     // A client close connection might be requested
                                     if (this->wantToMonitorWrite() && !intern->hasDataToSend() && !this->clientWritePossible(*socket, *intern))
                                     {
+                                        if (pipelined.getSize() && pipelined[pipelined.getSize() - 1] == socket) pipelined.Remove(pipelined.getSize() - 1);
                                         closeClientSocket(socket);
                                         intern = 0;
                                     }
@@ -394,6 +388,9 @@ namespace Network
                         clientIndex = writers->getNextReadySocket(clientIndex);
                     }
                     this->writeLoopFinished();
+
+                    for (size_t i = 0; i < pipelined.getSize(); i++)
+                        processReceivedData(pipelined[i], (InternalObject*)pipelined[i]->getPrivateField());
                 }
 
                 // Look through the client array to remove lingering one
@@ -409,6 +406,16 @@ namespace Network
                 }
                 return true;
             }
+            /** Give back a socket that was captured, so its next requests are answered by the server.
+                This must be called from the thread running the server loop.
+                @return false if the socket can't be monitored (the socket is not owned in that case) */
+            inline bool adoptClientSocket(BaseSocket * socket)
+            {
+                if (!socket || !clients.appendSocket(socket)) return false;
+                socket->getPrivateField() = (void *)new InternalObject;
+                socket->setOption(Network::Socket::BaseSocket::Blocking, 0);
+                return true;
+            }
             /** Stop the server */
             inline bool stopServer()
             {
@@ -442,6 +449,35 @@ namespace Network
                 writers->forgetSocket(socket);
                 clients.removeSocket(socket);
             }
+            /** Tell the callback about the received data, and start sending the answer if any.
+                @return false if the connection was closed */
+            bool processReceivedData(BaseSocket * socket, InternalObject * intern)
+            {
+                if (!this->clientReadPossible(*socket, *intern))
+                {   // Ok, close the connection
+                    closeClientSocket(socket);
+                    return false;
+                }
+                // Check if we need to forget this socket
+                if (intern->shouldForgetSocket())
+                {
+                    // That's the only case where we send data in the receiving part, since after forgetting, there is no link to the socket any more
+                    if (intern->hasDataToSend())
+                        sendPendingData(socket, intern);
+                    forgetClientSocket(socket);
+                    // The server does not use the socket anymore, so the capturing code can take it
+                    this->clientSocketForgotten(*socket);
+                }
+                else
+                {
+                    // Ok, the connection progressed, so let's touch it
+                    intern->touchConnection();
+                    // Check if the clients should be written too (if so, add to the writer pool)
+                    if (intern->hasDataToSend())
+                        writers->appendSocket(socket);
+                }
+                return true;
+            }
             /** Forget client socket */
             inline void forgetClientSocket(Network::Socket::BaseSocket * socket)
             {
@@ -547,6 +583,9 @@ namespace Network
                 No action is required from this callback, since the server will immediately close the socket
                 when you return from this function. */
             void clientLingering(const BaseSocket & client);
+            /** A captured client socket was forgotten by the server.
+                The server does not use the socket anymore, so it's now safe to hand it to another thread (or to delete it). */
+            void clientSocketForgotten(BaseSocket & client);
             /** Minimum amount of bytes to read before triggering the clientReadPossible callback.
                 This is useful for example, if your protocol is fixed size message, you don't have to deal with reconstructing the buffers yourselves.
                 This is also useful for textual protocol, where parsing a line can be slow, you can 'prebuffer' a given amount
@@ -593,8 +632,91 @@ namespace Network
         public:
             /** The string we are using */
             typedef Strings::FastString String;
-            /** The header map we are using */
-            typedef Container::HashTable<String, String, Container::HashKey<String>, Container::DeletionWithDelete<String> > HeaderMap;
+            /** The headers of a request or of an answer, kept in the connection's context.
+                The storage works like an arena that's rewound for each request: the headers and their strings are not freed when
+                they are cleared, but overwritten by the next request's headers, so a persistent connection stops allocating once it
+                has seen its largest request. The headers are found by a linear search, which is faster than hashing for the usual
+                count of headers, and they are iterated in their insertion order */
+            class HeaderMap
+            {
+                /** A header's name and value */
+                struct Header
+                {
+                    String name;
+                    String value;
+                };
+                /** The headers storage (owned), only the first used items are valid */
+                Container::NotConstructible<Header>::IndexList headers;
+                /** The number of valid headers */
+                size_t used;
+
+                /** Copy the given text to the string, reusing its buffer if it's large enough */
+                static void assign(String & dest, const char * text, const int length)
+                {
+                    struct tagbstring t;
+                    t.mlen = -1; t.slen = length; t.data = (unsigned char*)text;
+                    dest = t;
+                }
+
+            public:
+                /** Get the value for the given header name.
+                    @return A pointer on the value (valid until the headers are cleared), or 0 if not found */
+                String * getValue(const char * name, const int length) const
+                {
+                    for (size_t i = 0; i < used; i++)
+                    {
+                        Header * header = headers.getElementAtUncheckedPosition(i);
+                        if (header->name.getLength() == length && !memcmp(header->name.getData(), name, length)) return &header->value;
+                    }
+                    return 0;
+                }
+                /** Get the value for the given header name (or 0 if not found) */
+                inline String * getValue(const String & name) const { return getValue(name.getData(), name.getLength()); }
+                /** Get the value for the given header name (or 0 if not found), without building a string */
+                inline String * getValue(const char * name) const { return getValue(name, (int)strlen(name)); }
+                /** Check if the given header exists */
+                inline bool containsKey(const String & name) const { return getValue(name) != 0; }
+                /** Store a header, its value is replaced if it exists already
+                    @return false if the header can't be allocated */
+                bool setValue(const char * name, const int nameLength, const char * value, const int valueLength)
+                {
+                    String * existing = getValue(name, nameLength);
+                    if (existing) { assign(*existing, value, valueLength); return true; }
+                    if (used == headers.getSize())
+                    {
+                        Header * header = new Header;
+                        if (!header) return false;
+                        headers.Append(header);
+                    }
+                    Header * header = headers.getElementAtUncheckedPosition(used++);
+                    assign(header->name, name, nameLength);
+                    assign(header->value, value, valueLength);
+                    return true;
+                }
+                /** Store a header, its value is replaced if it exists already */
+                inline bool setValue(const String & name, const String & value) { return setValue(name.getData(), name.getLength(), value.getData(), value.getLength()); }
+                /** Get the number of headers */
+                inline size_t getSize() const { return used; }
+                /** Call the given method for each header, in their insertion order */
+                template <class Obj>
+                void iterateAllEntries(Obj & obj, int (Obj::*callback)(const String &, const String *)) const
+                {
+                    for (size_t i = 0; i < used; i++)
+                        (obj.*callback)(headers.getElementAtUncheckedPosition(i)->name, &headers.getElementAtUncheckedPosition(i)->value);
+                }
+                /** Clear the headers, their storage is kept for the next ones */
+                inline void clearTable() { used = 0; }
+
+                HeaderMap() : used(0) {}
+            };
+
+            /** What to do with an accepted connection */
+            enum AcceptAction
+            {
+                RefuseClient    =   0,  //!< Close the connection
+                ServeClient     =   1,  //!< Answer the requests on the connection
+                CaptureClient   =   2,  //!< The server forgets the socket and tells clientSocketForgotten, the socket then belongs to the callback
+            };
 
             /** The possible parsing error */
             enum ParsingError
@@ -604,6 +726,35 @@ namespace Network
                 NotEnoughData   =  -2,
             };
 
+            /** A pre-rendered answer.
+                The answers that don't change between requests (like static pages) are rendered once, and then sent with a single write */
+            struct PrerenderedAnswer
+            {
+                /** The status line and the headers, each ending with CRLF but without the final empty line, so the connection's headers can still be added */
+                Utils::MemoryBlock                  head;
+                /** The answer's content */
+                Utils::MemoryBlock                  content;
+
+                /** Render the answer.
+                    @param statusLine   The answer's first line, without CRLF
+                    @param contentType  The content's type (the header is omitted if empty)
+                    @param content      The answer's content, its length is added in the headers */
+                void render(const String & statusLine, const String & contentType, const String & content);
+                /** Forget the answer */
+                inline void clear() { head.stripTo(0); content.stripTo(0); }
+                /** Check if the answer is rendered */
+                inline operator bool() const { return head.getSize() != 0; }
+                /** Copy the given answer (the buffers are reused) */
+                PrerenderedAnswer & operator = (const PrerenderedAnswer & other)
+                {
+                    if (this == &other) return *this;
+                    clear();
+                    head.Append(other.head.getConstBuffer(), other.head.getSize());
+                    content.Append(other.content.getConstBuffer(), other.content.getSize());
+                    return *this;
+                }
+            };
+
             /** The request parsing context */
             struct Context
             {
@@ -613,11 +764,29 @@ namespace Network
                 HeaderMap                           answer;
                 /** The client socket (when provided, it can change) */
                 const BaseSocket *                      client;
+                /** If rendered, this answer is sent instead of the one built from the answer headers (which are added to it) */
+                PrerenderedAnswer                       prerendered;
 
-                inline void Reset() { query.clearTable(); answer.clearTable(); }
-                /** Constructor
-                    Limit the hash table default bucket size */
-                Context() : query(33), answer(11), client(0) {}
+                /** A line of the request being received.
+                    The reception buffer can be reallocated while receiving, so the line is stored as offsets in it */
+                struct Line
+                {
+                    uint32                          start;
+                    uint32                          end;
+                    Line(const uint32 start = 0, const uint32 end = 0) : start(start), end(end) {}
+                };
+                /** The lines of the request found so far */
+                Container::PlainOldData<Line>::Array    lines;
+                /** The amount of the reception buffer already scanned for the request's end, and where the current line starts */
+                uint32                                  scanned, lineStart;
+                /** The end of line used by the request (a Platform::EndOfLine value, or 0 until the first line ends) */
+                uint32                                  eol;
+
+                /** Reset the headers (the parsing state is kept, since the request might be still incomplete) */
+                inline void Reset() { query.clearTable(); answer.clearTable(); prerendered.clear(); }
+                /** Reset the parsing state for the next request */
+                inline void resetParsing() { lines.Clear(); scanned = lineStart = eol = 0; }
+                Context() : client(0), scanned(0), lineStart(0), eol(0) {}
             };
 
         protected:
@@ -629,6 +798,8 @@ namespace Network
             static bool addAnswerHeader(Context & context, const String & header, const String & value);
             /** Merge all headers to data */
             bool mergeAnswerHeaders(InternalObject & intern);
+            /** Merge the pre-rendered answer and the answer headers to data */
+            bool mergePrerenderedAnswer(InternalObject & intern);
 
 
 
@@ -644,12 +815,13 @@ namespace Network
             {
                 Logger::log(Logger::Connection | Logger::Error, "Refused connection from: (%s:%d) [NO FREE SLOT]", (const char*)address.asText(), address.getPort());
             }
-            /** A client has been accepted */
-            bool acceptedNewClient(BaseSocket & a, const BaseAddress & address)
+            /** A client has been accepted
+                @return An AcceptAction value */
+            int acceptedNewClient(BaseSocket & a, const BaseAddress & address)
             {
                 Logger::log(Logger::Dump, "Accepted connection from: (%s:%d) [SUCCESS]", (const char*)address.asText(), address.getPort());
                 changeSocketOptions(a, true);
-                return true;
+                return acceptClient(a);
             }
             /** The client (or server) closed its connection with the server (or client) */
             void clientConnectionClosed(const BaseSocket & client, InternalObject & intern)
@@ -670,6 +842,8 @@ namespace Network
                     Logger::log(Logger::Connection | Logger::Deletion, "Connection from: (%s:%d) is inactive for too long, closing it [SUCCESS]", (const char*)address->asText(), address->getPort());
                 delete address;
             }
+            /** A captured client socket was forgotten by the server (nothing to do by default) */
+            void clientSocketForgotten(BaseSocket &) {}
 
             /** Clean our private stuff */
             bool deletePrivateField(void *& toDelete)
@@ -763,8 +937,9 @@ namespace Network
             bool parseRequestLine(InternalObject & intern, const String & protocol, String line);
             /** Parsing an header line
                 @param intern   The received object when parsing the request lines
-                @param line     The first request line to parse */
-            bool parseHeader(InternalObject & intern, String line);
+                @param line     The header line to parse (it's not copied, only the trimmed name and value are)
+                @param length   The line length in bytes */
+            bool parseHeader(InternalObject & intern, const char * line, const uint32 length);
             /** The server is stopping (this is called before any internal closing action happened) */
             void serverStopping() {}
             /** The server is going to loop once (this is called before any internal loop action happened) */
@@ -786,6 +961,10 @@ namespace Network
                 @param client       The socket to change options (if required)
                 @param accepting    If true, the socket has just been accepted. If false, then the socket just finished sending its before last packet */
             virtual void changeSocketOptions(BaseSocket & client, const bool accepting) {}
+            /** Called once a socket is accepted, before any request is read from it (like for starting a handshake on the raw socket).
+                @param client       The accepted socket (it's in non blocking mode)
+                @return What to do with the connection */
+            virtual AcceptAction acceptClient(BaseSocket & client) { return ServeClient; }
 
             // Construction and destruction
         public:
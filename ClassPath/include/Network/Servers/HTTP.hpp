@@ -55,8 +55,15 @@ namespace Network
             virtual bool handleRequest(InternalObject & intern, const BaseSocket & client);
             /** Create the main response header */
             bool createAnswerHeader(Context & context, const Protocol::HTTP::StatusCode code);
+            /** Get the response's status line for the given code (without CRLF), like "HTTP/1.1 200 OK" */
+            static String getStatusLine(const Protocol::HTTP::StatusCode code);
+            /** Keep or close the connection once the answer is sent, and tell the client about it */
+            bool setConnectionPersistence(InternalObject & intern, Context & context, const bool persistent);
             /** Check if the method is allowed */
             virtual bool isMethodSupported(const String & method) const;
+            /** Check if the client wants a persistent connection.
+                HTTP/1.1 connections are persistent unless the client sent "Connection: close", HTTP/1.0 ones only if it sent "Connection: keep-alive" */
+            static bool wantsPersistentConnection(const HeaderMap & query);
 
             // The interface you must provide
         public:
@@ -127,6 +134,16 @@ namespace Network
                     statusCode = stream ? Protocol::HTTP::Ok : Protocol::HTTP::NotFound;
                     return stream;
                 }
+                /** A socket captured in clientRequestedEx (with the CapturedSocket status code) was forgotten by the server.
+                    Until this is called, the server might still use the socket, so it must not be deleted (or given to another thread that could delete it) before.
+                    @param client       The captured socket */
+                virtual void clientSocketForgotten(BaseSocket & client) {}
+                /** A client connection was accepted, before any request is read from it.
+                    This is called from the accepting thread, so it delays the other connections while it runs.
+                    A callback needing to wait for the client (like for a handshake) captures the socket, and gives it back with adoptClientSocket once done.
+                    @param client       The accepted socket (it's in non blocking mode)
+                    @return What to do with the connection (if captured, clientSocketForgotten is called once the server forgot the socket) */
+                virtual AcceptAction clientAccepted(BaseSocket & client) { return ServeClient; }
                 /** Requested destructor */
                 virtual ~Callback() {}
 
@@ -180,9 +197,13 @@ namespace Network
             virtual bool handleRequest(InternalObject & intern, const BaseSocket & client);
             /** Implement the socket option changing  */
             virtual void changeSocketOptions(BaseSocket & client, const bool accepting) { if (accepting) client.setOption(BaseSocket::NoDelay, 1); }
+            /** Let the callback accept the connection */
+            virtual AcceptAction acceptClient(BaseSocket & client) { return callback.clientAccepted(client); }
             
             // Interface
         public:
+            /** A captured socket was forgotten by the server, tell the callback */
+            void clientSocketForgotten(BaseSocket & client) { callback.clientSocketForgotten(client); }
             /** The unique constructor 
                 @param callback     The callback to use when receiving requests
                 @param serverPool   The pool of sockets to monitor */
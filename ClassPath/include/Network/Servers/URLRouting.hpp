@@ -7,6 +7,10 @@
 #include "../../Signal/Delegate.hpp"
 // We need Ternary search tree too
 #include "../../Tree/TS.hpp"
+#if _LINUX == 1
+    // We need stat to find the stale Unix domain sockets
+    #include <sys/stat.h>
+#endif
 
 namespace Network
 {
@@ -41,10 +45,20 @@ namespace Network
             typedef EventHTTP::HeaderMap HeaderMap;
             /** The context we are using */
             typedef TextualHeadersServer::Context Context;
+            /** The pre-rendered answers we are using */
+            typedef TextualHeadersServer::PrerenderedAnswer PrerenderedAnswer;
 
             struct Comm;
             /** The routing delegate */
             typedef Signal::Delegate<Stream::InputStream * (Comm &)> URLTrigger;
+            /** The function called by each reactor thread when it starts */
+            typedef void (*ThreadStarted)();
+            /** The delegate called when a captured socket is forgotten by the server */
+            typedef Signal::Delegate<void (Network::Socket::BaseSocket &)> CaptureTrigger;
+            /** What to do with an accepted connection */
+            typedef TextualHeadersServer::AcceptAction AcceptAction;
+            /** The delegate called when a connection is accepted, it returns what to do with the connection */
+            typedef Signal::Delegate<AcceptAction (Network::Socket::BaseSocket &)> AcceptTrigger;
             /** The search tree for the routing table */
             typedef Tree::TernarySearch::Tree<URLTrigger, char, Policy> RoutingTable;
 
@@ -58,10 +72,13 @@ namespace Network
                     Strings::StringArray capts;
                     uint32 maxCapture = (uint32)maxCaptureCount;
 
-                    uint32 * captArray = (uint32*)captures.getBuffer();
-                    URLTrigger * trigger = table.searchForWithCapture((const char*)url, captArray, &maxCapture, url.getLength());
+                    // The captures positions are per request, since the routes might be called from multiple threads
+                    uint32 stackCaptures[2 * StackCaptures];
+                    Utils::MemoryBlock heapCaptures(maxCapture > StackCaptures ? maxCapture * 2 * sizeof(uint32) : 0);
+                    uint32 * captArray = maxCapture > StackCaptures ? (uint32*)heapCaptures.getBuffer() : stackCaptures;
+                    URLTrigger * trigger = findRoute(url, captArray, &maxCapture);
                     if (!trigger) trigger = defaultHandler;
-                    if (!trigger) { statusCode = Protocol::HTTP::NotFound; return new Stream::InputStringStream(notFound); }
+                    if (!trigger) { statusCode = Protocol::HTTP::NotFound; context.prerendered = notFoundAnswer; return 0; }
 
                     // Convert captures positions to captured text if any
                     for (int i = 0; i < maxCapture; i++)
@@ -72,22 +89,84 @@ namespace Network
                     Stream::InputStream * res = (*trigger)(comm);
                     if (!res && comm.returnText) return new Stream::InputStringStream(comm.returnText);
                     // Intercept not found value to all look consistent
-                    if (!res && statusCode == Protocol::HTTP::NotFound) return new Stream::InputStringStream(notFound);
+                    if (!res && statusCode == Protocol::HTTP::NotFound && !context.prerendered) context.prerendered = notFoundAnswer;
                     return res;
                 }
+                virtual void clientSocketForgotten(Network::Socket::BaseSocket & client) { if (capturedHandler) (*capturedHandler)(client); }
+                virtual AcceptAction clientAccepted(Network::Socket::BaseSocket & client) { return acceptHandler ? (*acceptHandler)(client) : EventHTTP::ServeClient; }
                 friend struct Comm;
                 /** The routing table */
                 RoutingTable table;
+                /** The routes without any capture are also in a hash table (open addressing, filled to half its size at most), so most requests
+                    are routed with a hash and a single comparison instead of walking the tree. The triggers are owned by the tree */
+                struct StaticRoute
+                {
+                    uint32          hash;
+                    String          route;
+                    URLTrigger *    trigger;
+                    StaticRoute() : hash(0), trigger(0) {}
+                };
+                enum { StaticRoutesSlots = 64 };
+                StaticRoute staticRoutes[StaticRoutesSlots];
+                uint32 staticRoutesCount;
+                /** The hash of a route (FNV-1a) */
+                static uint32 hashRoute(const char * route, const uint32 length)
+                {
+                    uint32 hash = 2166136261U;
+                    for (uint32 i = 0; i < length; i++) hash = (hash ^ (uint8)route[i]) * 16777619U;
+                    return hash;
+                }
+                /** Add a route to the routing table
+                    @return false if the route already exists or not enough memory */
+                bool addRoute(const String & route, URLTrigger * trigger)
+                {
+                    if (!table.insertInTree((const char*)route, trigger, route.getLength())) return false;
+                    // The routes with captures, and the ones that don't fit in the hash table anymore, are only found in the tree
+                    if (route.Find("#") != -1 || route.Find("\"") != -1 || route.Find("*") != -1 || staticRoutesCount >= StaticRoutesSlots / 2) return true;
+                    uint32 hash = hashRoute(route, route.getLength()), slot = hash & (StaticRoutesSlots - 1);
+                    while (staticRoutes[slot].trigger) slot = (slot + 1) & (StaticRoutesSlots - 1);
+                    staticRoutes[slot].hash = hash; staticRoutes[slot].route = route; staticRoutes[slot].trigger = trigger;
+                    staticRoutesCount++;
+                    return true;
+                }
+                /** Remove all the routes (and delete their triggers) */
+                void removeAllRoutes()
+                {
+                    for (uint32 i = 0; i < StaticRoutesSlots; i++) staticRoutes[i] = StaticRoute();
+                    staticRoutesCount = 0;
+                    maxCaptureCount = 0;
+                    table.Free();
+                }
+                /** Find the route for the given URL
+                    @param captures     On output, the captures' start and end positions in the URL
+                    @param captureCount On input, the maximum number of captures, on output, the number of captures
+                    @return The route's trigger, or 0 if none matches */
+                URLTrigger * findRoute(const String & url, uint32 * captures, uint32 * captureCount) const
+                {
+                    uint32 hash = hashRoute(url, url.getLength());
+                    for (uint32 slot = hash & (StaticRoutesSlots - 1); staticRoutes[slot].trigger; slot = (slot + 1) & (StaticRoutesSlots - 1))
+                        if (staticRoutes[slot].hash == hash && staticRoutes[slot].route == url) { *captureCount = 0; return staticRoutes[slot].trigger; }
+                    return table.searchForWithCapture((const char*)url, captures, captureCount, url.getLength());
+                }
+                /** The number of captures whose positions are stored on the stack */
+                enum { StackCaptures = 8 };
                 /** The maximum number of captures (if known beforehand), else will be auto detected */
                 int maxCaptureCount;
-                /** The container of captures positions */
-                Utils::MemoryBlock captures;
                 /** The default text to return when a resource is not found */
                 String notFound;
+                /** The answer when a resource is not found (it's rendered once) */
+                PrerenderedAnswer notFoundAnswer;
                 /** A default trigger if none provided */
                 Utils::ScopePtr<URLTrigger> defaultHandler;
+                /** The trigger for the captured sockets, if any */
+                Utils::ScopePtr<CaptureTrigger> capturedHandler;
+                /** The trigger for the accepted sockets, if any */
+                Utils::ScopePtr<AcceptTrigger> acceptHandler;
+
+                /** Set the text to return when a resource is not found */
+                void setNotFound(const String & text) { notFound = text; notFoundAnswer.render(EventHTTP::getStatusLine(Protocol::HTTP::NotFound), "", notFound); }
 
-                HTTPServer() : maxCaptureCount(0), notFound("The requested document is not found") {}
+                HTTPServer() : staticRoutesCount(0), maxCaptureCount(0) { setNotFound("The requested document is not found"); }
             };
 
             /** The argument that the Delegate takes as input/output.
@@ -129,6 +208,15 @@ namespace Network
                     @param timeout    The maximum time to fetch the complete request, in milliseconds.
                     @return A pointer to a new allocated stream that's contains the complete request, or 0 on timeout or socket error */
                 Stream::InputStream * getCompleteRequest(const Time::TimeOut & timeout = DefaultTimeOut) { return server.getCompleteRequest(headers, inputStream, timeout); }
+                /** Check if the connection can be used for other requests once the answer on a captured socket is sent.
+                    This is the case if the client asked for a persistent connection and did not pipeline other requests behind this one,
+                    since the server drops the data received after the request when the socket is captured.
+                    @sa URLRoutingT::adoptSocket */
+                bool canReuseCapturedSocket() const
+                {
+                    Stream::SuccessiveStream * stream = dynamic_cast<Stream::SuccessiveStream *>(inputStream);
+                    return HTTP::wantsPersistentConnection(headers) && stream && !stream->getFirstStream().fullSize();
+                }
                 /** Create a error code with some text describing the error (if the default does not fit).
                     This is just a convenient helper to make the usage code smaller and less error prone.
                     @param error      The error text to include
@@ -165,6 +253,16 @@ namespace Network
                 Stream::InputStream * sendError(const String & error, Protocol::HTTP::StatusCode code, const bool logError = true) { statusCode = code;	returnText = error; if (logError) Logger::log(Logger::Network | Logger::Connection, error); return 0; }
                 /** Add a header to the answer */
                 inline bool addAnswerHeader(const String & header, const String & value) { return server.addAnswerHeader(context, header, value); }
+                /** Answer with a pre-rendered answer.
+                    It's copied, so it can be rendered again once this returns. The headers added with addAnswerHeader are still sent.
+                    @code
+                        // Rendered once at startup
+                        page.render(EventHTTP::getStatusLine(Protocol::HTTP::Ok), "text/html", "<html>...</html>");
+                        // And in the route
+                        return comm.sendPrerendered(page);
+                    @endcode
+                    @return 0, so it can be returned by the route */
+                Stream::InputStream * sendPrerendered(const PrerenderedAnswer & answer, Protocol::HTTP::StatusCode code = Protocol::HTTP::Ok) { statusCode = code; context.prerendered = answer; return 0; }
 
                 /** Construct the Comm object */
                 Comm(const String & method, const String & url, HeaderMap & headers, Stream::InputStream * inputStream, Network::Address::BaseAddress & client,
@@ -180,11 +278,67 @@ namespace Network
         private:
             /** The server socket */
             Utils::ScopePtr<Network::Socket::BerkeleySocket> socket;
+            /** The Unix domain server socket, if any, and its path */
+            Utils::ScopePtr<Network::Socket::BerkeleySocket> unixSocket;
+            String                          unixPath;
             /** The internal HTTP server is using monothreaded policy by default */
             Utils::ScopePtr<MonothreadedPolicy<EventHTTP> >  server;
+            /** The internal HTTP server when using a thread pool (the routes are then called from any pool thread) */
+            Utils::ScopePtr<ThreadPoolPolicy<EventHTTP> >    poolServer;
             /** The actual HTTP responder */
             HTTPServer                      httpCB;
 
+            /** An additional server loop, running in its own thread with its own listening socket on the same port */
+            struct Reactor : public Threading::Thread
+            {
+                /** The listening socket */
+                Utils::ScopePtr<Network::Socket::BerkeleySocket> socket;
+                /** The server using this socket */
+                Utils::ScopePtr<MonothreadedPolicy<EventHTTP> >  server;
+                /** Called in this thread before it serves any request, if set */
+                ThreadStarted started;
+
+                uint32 runThread() { if (started) started(); while (isRunning() && server->serverLoop(500)) {} return 0; }
+                Reactor(ThreadStarted started) : Threading::Thread("HTTPReactor"), started(started) {}
+                ~Reactor() { destroyThread(); if (server) server->stopServer(); server = 0; }
+            };
+            /** The additional reactors (the kernel spreads the connections between the listening sockets) */
+            typename Container::NotConstructible<Reactor>::IndexList reactors;
+            /** The function the reactor threads call when they start */
+            ThreadStarted reactorStarted;
+
+            /** Create a listening socket bound on the given port, or 0 on error
+                @param shared   If true, other sockets can listen on the same port */
+            static Network::Socket::BerkeleySocket * createListener(const uint16 port, const bool shared)
+            {
+                Network::Socket::BerkeleySocket * listener = new Network::Socket::BerkeleySocket(Network::Socket::BerkeleySocket::Stream);
+                listener->setOption(Network::Socket::BaseSocket::ReuseAddress, 1);
+                if ((shared && !listener->setOption(Network::Socket::BaseSocket::ReusePort, 1)) || listener->bindOnAllInterfaces(port) != Network::Socket::BaseSocket::Success)
+                {
+                    delete listener;
+                    return 0;
+                }
+                return listener;
+            }
+
+#if _LINUX == 1
+            /** Create a listening socket bound on the given Unix domain socket path, or 0 on error.
+                A stale socket file at this path is removed first, and the socket can be used by any local user (like a TCP socket on the loopback) */
+            static Network::Socket::BerkeleySocket * createUnixListener(const String & path)
+            {
+                struct stat st;
+                if (::lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) ::unlink(path);
+                Network::Socket::BerkeleySocket * listener = new Network::Socket::BerkeleySocket(Network::Socket::BerkeleySocket::Stream);
+                if (path.getLength() >= Network::Address::Unix::MaxPathLength || listener->bind(Network::Address::Unix(path)) != Network::Socket::BaseSocket::Success
+                    || ::chmod(path, 0666) != 0)
+                {
+                    delete listener;
+                    return 0;
+                }
+                return listener;
+            }
+#endif
+
             // Interface
         public:
             /** Register a route to match.
@@ -195,12 +349,11 @@ namespace Network
             {
                 // Check for special capture char
                 int countCapture = route.Count("#") + route.Count("\"");
-                if (countCapture > httpCB.maxCaptureCount)
-                {   // Reallocate the captures's buffer
-                    httpCB.captures.ensureSize(countCapture * 2 * sizeof(uint32));
-                    httpCB.maxCaptureCount = countCapture;
-                }
-                return httpCB.table.insertInTree((const char*)route, new URLTrigger(action), route.getLength());
+                if (countCapture > httpCB.maxCaptureCount) httpCB.maxCaptureCount = countCapture;
+                URLTrigger * trigger = new URLTrigger(action);
+                if (httpCB.addRoute(route, trigger)) return true;
+                delete trigger;
+                return false;
             }
             /** Register the default route to use when none match.
                 @param action   The delegate's action */
@@ -209,6 +362,23 @@ namespace Network
                 httpCB.defaultHandler = new URLTrigger(action);
             }
 
+            /** Register the delegate to call once a captured socket is forgotten by the server.
+                A route capturing the socket (with the CapturedSocket status code) must not delete it before this is called,
+                since the server still uses it when the route returns.
+                @param action   The delegate's action */
+            void registerCapturedHandler(const CaptureTrigger & action)
+            {
+                httpCB.capturedHandler = new CaptureTrigger(action);
+            }
+            /** Register the delegate to call once a connection is accepted, before any request is read from it.
+                It's called from the accepting thread (so it should be quick). A delegate that must wait for the client (like for a handshake)
+                captures the socket, it's then given to the captured handler once the server forgot it, and given back with adoptSocket() once done.
+                @param action   The delegate's action */
+            void registerAcceptHandler(const AcceptTrigger & action)
+            {
+                httpCB.acceptHandler = new AcceptTrigger(action);
+            }
+
             /** List all routes (used for debugging) */
             String listAllRoutes() const
             {
@@ -225,33 +395,94 @@ namespace Network
                 return ret;
             }
             /** Unregister all routes (you can not remove a single route from the table) */
-            void unregisterAllRoutes()                  { httpCB.maxCaptureCount = 0; httpCB.table.Free(); }
+            void unregisterAllRoutes()                  { httpCB.removeAllRoutes(); }
             /** Set the not found message to use */
-            void setNotFound(const String & notFound)   { httpCB.notFound = notFound; }
+            void setNotFound(const String & notFound)   { httpCB.setNotFound(notFound); }
             /** Get the base for the URL */
-            String getBaseURL() const                   { return String::Print("http://%s:%hu", (const char*)::Network::Address::IPV4::getLocalInterfaceAddress(1).asText(), Utils::ScopePtr<::Network::Address::BaseAddress>(socket->getBoundAddress())->getPort()); }
+            String getBaseURL() const                   { if (!socket) return "http+unix:" + unixPath; return String::Print("http://%s:%hu", (const char*)::Network::Address::IPV4::getLocalInterfaceAddress(1).asText(), Utils::ScopePtr<::Network::Address::BaseAddress>(socket->getBoundAddress())->getPort()); }
 
             /** Check if the server is started */
-            bool isServerStarted() const { return server != 0; }
-            /** Start HTTP server on the given port */
-            bool startServer(const uint16 port = 80)
+            bool isServerStarted() const { return server != 0 || poolServer != 0; }
+            /** Start HTTP server on the given port
+                @param port                 The port to listen on
+                @param clientsPerThread     If not 0, the requests are processed by a thread pool, with at most this number of clients per thread.
+                                            In that case, the routes' delegates must be thread safe.
+                                            Else, the requests are processed in the thread calling loop()
+                @param clientPool           The pool monitoring the clients when processed in the thread calling loop(), it must own its sockets
+                                            and it's owned (a FastBerkeleyPool is used if 0)
+                @param reactorsCount        If more than 1 (and clientsPerThread is 0), this number of server loops listen on the port, each one with
+                                            its own socket and pool (SO_REUSEPORT, so the kernel spreads the connections between them). The first one
+                                            runs in the thread calling loop(), the other ones in their own thread.
+                                            In that case, the routes' delegates must be thread safe. See setReactorStarted() to set up these threads.
+                @param unixSocketPath       If set, the server also listens on a Unix domain socket bound on this path (only the first server loop
+                                            listens on it with several reactors). If the port is 0, the server only listens on this socket. */
+            bool startServer(const uint16 port = 80, const size_t clientsPerThread = 0, Network::Socket::MonitoringPool * clientPool = 0, const size_t reactorsCount = 1, const char * unixSocketPath = 0)
             {
-                socket = new Network::Socket::BerkeleySocket(Network::Socket::BerkeleySocket::Stream);
-                socket->setOption(Network::Socket::BaseSocket::ReuseAddress, 1);
-
-                // Tell the server to listen on all address and port 1081
-                if (socket->bindOnAllInterfaces(port) != Network::Socket::BaseSocket::Success) return false;
-                server = new MonothreadedPolicy<EventHTTP>(socket->appendToMonitoringPool(0), new Network::Socket::FastBerkeleyPool(true), httpCB);
+                const bool tcp = port || !unixSocketPath || !*unixSocketPath;
+                const bool shared = tcp && !clientsPerThread && reactorsCount > 1;
+                // Tell the server to listen on all address and port
+                if (tcp)
+                {
+                    socket = createListener(port, shared);
+                    if (!socket) { delete clientPool; return false; }
+                }
+                Network::Socket::MonitoringPool * listeners = tcp ? socket->appendToMonitoringPool(0) : 0;
+                if (unixSocketPath && *unixSocketPath)
+                {
+#if _LINUX == 1
+                    unixSocket = createUnixListener(unixSocketPath);
+#endif
+                    if (!unixSocket) { delete listeners; delete clientPool; return false; }
+                    unixPath = unixSocketPath;
+                    listeners = unixSocket->appendToMonitoringPool(listeners);
+                }
+                if (clientsPerThread)
+                {
+                    delete clientPool;
+                    poolServer = new ThreadPoolPolicy<EventHTTP>(listeners, httpCB, clientsPerThread);
+                    return poolServer->startServer();
+                }
+                if (!clientPool) clientPool = new Network::Socket::FastBerkeleyPool(true);
+                for (size_t i = 1; shared && i < reactorsCount; i++)
+                {
+                    Reactor * reactor = new Reactor(reactorStarted);
+                    reactors.Append(reactor);
+                    reactor->socket = createListener(port, true);
+                    if (!reactor->socket) { delete clientPool; return false; }
+                    reactor->server = new MonothreadedPolicy<EventHTTP>(reactor->socket->appendToMonitoringPool(0), clientPool->createEmpty(true), httpCB);
+                    if (!reactor->server->startServer() || !reactor->createThread()) { delete clientPool; return false; }
+                }
+                server = new MonothreadedPolicy<EventHTTP>(listeners, clientPool, httpCB);
 
                 return server->startServer();
             }
+            /** Set the function the reactor threads call when they start, before serving any request (like for setting their scheduling).
+                This must be called before startServer() */
+            void setReactorStarted(ThreadStarted started) { reactorStarted = started; }
+            /** Give back a socket captured by a route once its answer is sent, so the server answers the next requests on this connection.
+                This must be called from the thread calling loop(), unless canAdoptFromAnyThread() is true.
+                @return false if the server can't monitor the socket, the socket is not owned in that case */
+            bool adoptSocket(Network::Socket::BaseSocket * socket) { if (poolServer) return poolServer->adoptClientSocket(socket); return server && server->adoptClientSocket(socket); }
+            /** Check if adoptSocket() can be called from any thread (this is the case with a thread pool) */
+            bool canAdoptFromAnyThread() const { return poolServer != 0; }
             /** Run a single loop of this server */
-            bool loop(const Time::TimeOut & timeout = DefaultTimeOut) { if (!server) return false; return server->serverLoop(timeout); }
+            bool loop(const Time::TimeOut & timeout = DefaultTimeOut) { if (poolServer) return poolServer->serverLoop(timeout); if (!server) return false; return server->serverLoop(timeout); }
             /** Stop the HTTP server */
-            bool stopServer() { if (!server) return false; return server->stopServer(); }
+            bool stopServer()
+            {
+                reactors.Clear();
+#if _LINUX == 1
+                // The socket file is not removed by the kernel
+                if (unixPath) { ::unlink(unixPath); unixPath = ""; }
+#endif
+                if (poolServer) return poolServer->stopServer();
+                if (!server) return false;
+                return server->stopServer();
+            }
 
+            URLRoutingT() : reactorStarted(0) {}
             // Ensure destruction order is good
-            ~URLRoutingT() { stopServer(); server = 0; }
+            ~URLRoutingT() { stopServer(); server = 0; poolServer = 0; }
         };
 
         /** @copydoc URLRoutingT
@@ -81,6 +81,10 @@ namespace Network
                 NoDelay             =  11,  //!< Disable Nagle's algorithm
                 TCPMaxSeg           =  12,  //!< The TCP maximum segment size (could be asked for or set)
                 NoSigPipe           =  13,  //!< Prevent sending a SIGPIPE message if the socket is closed on the remote side
+                ZeroCopy            =  14,  //!< Allow sending without copying the data when sent with the MSG_ZEROCOPY flag (the data must stay valid until the completion is reported)
+                NotSentLowAt        =  15,  //!< The maximum number of bytes not sent yet in the send buffer, the socket is not writable above (Linux), param is in bytes
+                UnsentSize          =  16,  //!< The number of bytes in the send buffer not sent yet (Linux, can only be asked for)
+                ReusePort           =  17,  //!< Allow multiple sockets to listen on the same port, the connections are spread between them (Linux 3.9 and BSD), param is 0 or 1
                 Descriptor          =  99,  //!< Might return the socket file descriptor on some platform. You don't need this usually.
             };
             /** The possible error code */
@@ -190,6 +194,14 @@ namespace Network
             virtual int sendReliably(const char * buffer, const int bufferSize, const unsigned int splitSize = 0, const Time::TimeOut & timeout = DefaultTimeOut) const;
             /** This method is used to shorcut the split size parameter and avoid a timeout to splitSize implicit conversion when used improperly */
             inline int sendReliably(const char * buffer, const int bufferSize, const Time::TimeOut & timeout) const { return sendReliably(buffer, bufferSize, 0, timeout); }
+            /** Send data from multiple buffers reliably, with as few gathered writes as possible.
+                This waits for the socket to become writable, then write as much as possible in loop until the timeout expires or all the buffers are sent.
+                @param  buffers         An array of pointers to the buffers to send (up to 16)
+                @param  buffersSize     An array of buffer sizes in bytes
+                @param  buffersCount    The number of buffers to send
+                @param  timeout         The time to wait before timing out, in milliseconds.
+                @return -1 on error, if this method returns less than the buffers total size, the connection was closed or the timeout expired. */
+            int sendBuffersReliably(const char ** buffers, const int * buffersSize, const int buffersCount, const Time::TimeOut & timeout = DefaultTimeOut) const;
             /** Send data and file asynchronously on the socket.
                 Not all sockets support this feature, and is emulated with a thread if not supported.
                 @param  prefixBuffer    If set, these data are sent before the file is sent.
@@ -230,6 +242,13 @@ namespace Network
                 }
                 return ret;
             }
+            /** Fetch a zero copy send completion.
+                When the ZeroCopy option is set, each send call with the MSG_ZEROCOPY flag is numbered from 0, and the data
+                it refers to must stay valid until the call is reported as completed.
+                @param  first   On output, the number of the first completed send call
+                @param  last    On output, the number of the last completed send call (inclusive)
+                @return true if a completion was fetched, false if none is pending (or unsupported) */
+            virtual bool getZeroCopyCompletion(uint32 & first, uint32 & last) const { return false; }
             /** Send data from multiple buffer at once to the specified address (this only works for datagram sockets).
                 This can be implemented efficiently in some OS, so the best method is used whenever applicable.
                 The default implementation iterate over the given buffers (this works for TCP not for UDP
@@ -417,6 +436,11 @@ namespace Network
                 @param  flags           Any sending flags
                 @return -1 on error, the number of bytes sent */
             virtual int sendBuffers(const char ** buffers, const int * buffersSize, const int buffersCount, const int flags = 0) const;
+            /** Fetch a zero copy send completion.
+                @param  first   On output, the number of the first completed send call
+                @param  last    On output, the number of the last completed send call (inclusive)
+                @return true if a completion was fetched, false if none is pending (or unsupported) */
+            virtual bool getZeroCopyCompletion(uint32 & first, uint32 & last) const;
             /** Send data from multiple buffer at once to the specified address (this only works for datagram sockets).
                 This can be implemented efficiently in some OS, so the best method is used whenever applicable.
                 The default implementation iterate over the given buffers (this works for TCP not for UDP
@@ -447,6 +471,8 @@ namespace Network
             virtual int getTypeID() const { return 1; }
             /** Get the socket state  */
             virtual State getState() const { return state; }
+            /** Get the native socket descriptor (for the system calls this class does not wrap) */
+            inline sock_t getDescriptor() const { return descriptor; }
             /** Get the peer name for a connected socket
                 @return a pointer to an Address you must delete on success, or 0 on error */
             virtual Address * getPeerName() const;
@@ -470,6 +496,10 @@ namespace Network
 #ifdef _POSIX
             /** The epoll/kqueue mechanism requires file descriptor */
             friend class FastBerkeleyPool;
+#endif
+#ifdef _LINUX
+            /** The io_uring requests too */
+            friend class URingPool;
 #endif
             friend struct WaitingThread;
 
@@ -1092,6 +1122,8 @@ namespace Network
         public:
             /** The maximum number of socket in the pool */
             enum { MaxQueueLen = 16384 };
+            /** The maximum number of events reported by a single select (epoll reports the other ready sockets in the next select) */
+            enum { MaxEvents = 256 };
 
 
             // Members
@@ -1100,20 +1132,39 @@ namespace Network
             BerkeleySocket **   pool;
             /** The pool size */
             uint32              size;
-            /** The epoll/kqueue FD set for reading */
-            int                 rd;
+            /** The epoll/kqueue FD set for reading (under Linux, each set is only created when it's first selected) */
+            mutable int         rd;
             /** The epoll/kqueue FD set for writing */
-            int                 wd;
+            mutable int         wd;
             /** The epoll/kqueue FD set for both event */
-            int                 bd;
+            mutable int         bd;
             /** The events array to monitor */
-            void *              events;
+            mutable void *      events;
             /** The last request triggered event's count */
             mutable int         triggerCount;
+            /** The allocated size of the pool array (it grows geometrically) */
+            uint32              capacity;
+            /** The position of each socket in the pool, indexed by the socket descriptor (so a socket is found without searching) */
+            uint32 *            slots;
+            /** The allocated size of the slots array */
+            uint32              slotsSize;
+            /** The epoll set combining our reading set and another pool's writing set for selectMultiple (it's reused while the sets are the same) */
+            mutable int         md;
+            mutable const FastBerkeleyPool * mdOther;
+            mutable uint32      mdGeneration, mdOtherGeneration;
+            /** Incremented each time a set is created or closed */
+            mutable uint32      generation;
 
             /** Are we owning the sockets ? */
             bool                own;
 
+            // Helpers
+        private:
+            /** Get the set for the given interest, it's created (with the sockets in the pool) if it's not used yet */
+            int getSet(const uint32 interest) const;
+            /** Make sure the arrays can hold the given number of sockets and descriptors */
+            bool reserve(const uint32 count, const uint32 descriptors);
+
             // Monitoring pool interface
         public:
             /** Append a socket to this pool */
@@ -1178,11 +1229,185 @@ namespace Network
         public:
             /** Build a pool using epoll or kqueue when available.
                 @param own  When set to true, the poll own the socket passed in. */
-            FastBerkeleyPool(const bool own = false) : pool(0), size(0), rd(-1), wd(-1), bd(-1), events(0), triggerCount(0), own(own) { }
+            FastBerkeleyPool(const bool own = false) : pool(0), size(0), rd(-1), wd(-1), bd(-1), events(0), triggerCount(0), capacity(0), slots(0), slotsSize(0), md(-1), mdOther(0), mdGeneration(0), mdOtherGeneration(0), generation(0), own(own) { }
             ~FastBerkeleyPool();
         };
 #endif
 
+#ifdef _LINUX
+        /** The monitoring pool for Berkeley sockets using io_uring.
+            Each socket is watched with a one shot poll request, so the pool behaves like the other pools (level triggered):
+            a socket reported ready is watched again on the next select, and the kernel checks its state as soon as the request is submitted.
+            Only the sockets that were reported ready (or appended) get a new request, and the requests are submitted and the completions
+            waited for in a single system call, instead of one epoll_ctl call per change and one epoll_wait call.
+            If the kernel does not support io_uring (or is older than 5.11), isValid() returns false and the pool must not be used.
+            @sa MonitoringPool */
+        class URingPool : public MonitoringPool
+        {
+            // Type definition and enumeration
+        public:
+            /** The maximum number of socket in the pool */
+            enum { MaxQueueLen = 16384 };
+            /** The submission queue size (more requests are submitted in several batches) */
+            enum { RingSize = 256 };
+
+        private:
+            /** A socket in the pool */
+            struct Entry
+            {
+                /** The socket */
+                BerkeleySocket *    socket;
+                /** The poll events of the request in flight (0 if none) */
+                uint32              armed;
+                /** The poll events the last completion reported */
+                uint32              ready;
+                /** The token of the request in flight, a completion with another token is for a request that was removed */
+                uint32              token;
+            };
+            /** Set in a slot when the descriptor is in the queued list */
+            enum { Queued = 0x80000000, SlotMask = 0x7FFFFFFF };
+
+            // Members
+        private:
+            /** The socket pool */
+            mutable Entry *     pool;
+            /** The pool size */
+            uint32              size;
+            /** The allocated size of the pool array (it grows geometrically) */
+            uint32              capacity;
+            /** The position of each socket in the pool, indexed by the socket descriptor (and the Queued bit) */
+            mutable uint32 *    slots;
+            /** The allocated size of the slots array */
+            uint32              slotsSize;
+            /** The descriptors that need a new request (appended, or reported ready since), it has the same size as the slots array */
+            mutable uint32 *    queued;
+            /** The queued descriptors count */
+            mutable uint32      queuedCount;
+            /** The descriptors of the sockets the last select reported ready */
+            mutable uint32 *    readyList;
+            /** The last select ready sockets count */
+            mutable int         triggerCount;
+            /** The poll events used for the requests in flight */
+            mutable uint32      interest;
+            /** The last request token */
+            mutable uint32      lastToken;
+            /** The ring descriptor */
+            int                 ring;
+            /** The mapped rings */
+            void *              sqRing;
+            void *              cqRing;
+            void *              sqes;
+            uint32              sqRingSize, cqRingSize, sqesSize;
+            /** The rings pointers */
+            uint32 *            sqHead, * sqTail, * sqArray, sqMask;
+            uint32 *            cqHead, * cqTail, cqMask;
+            void *              cqes;
+            /** The number of requests queued and not submitted yet */
+            mutable uint32      pending;
+            /** The other pool whose ring is watched by a request in our ring for selectMultiple, and this request's token (0 if none) */
+            mutable const URingPool *   watched;
+            mutable uint32              watchToken;
+            /** Are we owning the sockets ? */
+            bool                own;
+
+            // Helpers
+        private:
+            /** Make sure the arrays can hold the given number of sockets and descriptors */
+            bool reserve(const uint32 count, const uint32 descriptors);
+            /** Get the pool position of the given descriptor (size if not found) */
+            uint32 slotOf(const int descriptor) const { uint32 slot = descriptor >= 0 && (uint32)descriptor < slotsSize ? slots[descriptor] & SlotMask : size; return slot < size ? slot : size; }
+            /** Queue the given descriptor for a new request in the next select */
+            void requeue(const int descriptor) const;
+            /** Get a new request token */
+            uint32 nextToken() const { if (!++lastToken) ++lastToken; return lastToken; }
+            /** Queue a request, the queued requests are submitted first if the ring is full
+                @return false if the request could not be queued */
+            bool queue(const uint8 opcode, const int fd, const uint32 events, const uint64 address, const uint64 userData) const;
+            /** Queue a poll request for each queued descriptor, for the given events (the requests for other events are removed) */
+            void arm(const uint32 events) const;
+            /** Submit the queued requests and wait for a completion if asked to
+                @param wait     The time to wait for in millisecond, or negative to only submit
+                @return the number of submitted requests (0 on timeout) or -1 on error */
+            int enter(const int wait) const;
+            /** Check if there are some unread completions */
+            bool hasCompletions() const;
+            /** Read the completions, and append the ready sockets to the ready list */
+            void harvest() const;
+            /** Submit the requests and wait for a socket to be ready in our pool (and in the other pool if given)
+                @return 0 on timeout or error, 1 if our pool got socket(s) ready, 2 if the other pool got socket(s) ready (or 3 if both are ready) */
+            int wait(const URingPool * other, const Time::TimeOut & timeout) const;
+
+            // Monitoring pool interface
+        public:
+            /** Append a socket to this pool */
+            virtual bool    appendSocket(BaseSocket * socket);
+            /** Remove a socket from the pool */
+            virtual bool    removeSocket(BaseSocket * socket);
+            /** Forget a socket from the pool.
+                The socket is not deleted, even if the pool own the sockets. */
+            virtual bool    forgetSocket(BaseSocket * socket);
+            /** Get the pool size */
+            virtual uint32  getSize() const { return size; }
+            /** Get the pool type. This is used as a poor man RTTI */
+            virtual int getTypeID() const { return 4; }
+            /** Create an empty pool similar to this one you must delete */
+            virtual MonitoringPool * createEmpty(const bool own = false) const { return new URingPool(own); }
+
+            /** Select the pool for at least an element that is ready
+                @param reading When true, the select return true as soon as the socket has read data available
+                @param writing When true, the select return true as soon as the socket is ready to be written to
+                @param timeout The timeout in millisecond to wait for before returning (negative for infinite time)
+                @return false on timeout or error, or true if at least one socket in the pool is ready */
+            virtual bool select(const bool reading, const bool writing, const Time::TimeOut & timeout = DefaultTimeOut) const;
+
+            /** Check if at least a socket in the pool is ready for reading */
+            virtual bool isReadPossible(const Time::TimeOut & timeout = DefaultTimeOut) const { return select(true, false, timeout); }
+            /** Check if at least a socket in the pool is ready for writing */
+            virtual bool isWritePossible(const Time::TimeOut & timeout = DefaultTimeOut) const { return select(false, true, timeout); }
+            /** Check if a socket is connected.
+                @warning this put the sockets in non blocking mode, and put them back in blocking mode automatically after this call */
+            virtual bool isConnected(const Time::TimeOut & timeout = DefaultTimeOut);
+
+            /** Check which socket was ready in the given pool
+                @param index    Start by this index when searching (start by -1)
+                @return index of the next ready socket (use getReadySocketAt() to get the socket), or -1 if none are ready */
+            virtual int getNextReadySocket(const int index = -1) const { return index + 1 < triggerCount ? index + 1 : -1; }
+            /** Get the socket at the given position */
+            virtual BaseSocket * operator[] (const int index) { return index >= 0 && index < (int)size ? pool[index].socket : 0; }
+            /** Get the socket at the given position */
+            virtual const BaseSocket * operator[] (const int index) const { return index >= 0 && index < (int)size ? pool[index].socket : 0; }
+            /** Get the ready socket at the given position
+                @param index    The socket index as returned by getNextReadySocket() (this is not necessarly the socket's index in the pool)
+                @param writing  If provided, will be set to true if the socket is ready for writing
+                @return A pointer on a socket that's ready for operation or 0 on error */
+            virtual BaseSocket * getReadyAt(const int index, bool * writing = 0);
+            /** Get the index of the given socket in the pool
+                @return getSize() if not found, or the index in the pool */
+            virtual uint32 indexOf(BaseSocket * socket) const;
+            /** Check if we already have the given socket in the pool */
+            virtual bool haveSocket(BaseSocket * socket) const { return indexOf(socket) != size; }
+            /** Clear the pool from all its sockets */
+            virtual void clearPool();
+
+            /** Select our pool for reading, and the other pool for writing.
+                The other pool's ring is watched by a request in our ring, so both are waited for in a single system call.
+                @param other    The other pool to select for writing (it must be an URingPool)
+                @param timeout  The timeout in millisecond to wait for before returning (negative for infinite time)
+                @return 0 if no socket are ready or timed-out, 1 if the our pool got socket(s) ready, 2 if the other pool got socket(s) ready (or 3 if both are ready) */
+            virtual int selectMultiple(MonitoringPool * other, const Time::TimeOut & timeout = DefaultTimeOut) const;
+
+            /** Check if the ring was created */
+            bool isValid() const { return ring >= 0; }
+
+            // Construction and destruction
+        public:
+            /** Build a pool with its ring.
+                @param own  When set to true, the poll own the socket passed in. */
+            URingPool(const bool own = false);
+            ~URingPool();
+        };
+#endif
+
 
 #if UsingUDT
         /** The monitoring pool for UDT sockets
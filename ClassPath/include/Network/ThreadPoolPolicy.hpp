@@ -187,6 +187,8 @@ protected:
                             else if (res == -1)
                             {
                                 forgetFromPools(socket);
+                                // The server does not use the socket anymore, so the capturing code can take it
+                                server.clientSocketForgotten(*socket);
                                 break;
                             }
                             else
@@ -604,7 +606,8 @@ private:
         if (!receiveAsMuchAsPossible(socket, intern))
             return 0;
 
-        if (intern->getRecvBuffer().getSize() > minRecvSize)
+        // Several requests might have been received at once (pipelining), so answer them in order
+        while (intern->getRecvBuffer().getSize() > minRecvSize)
         {   // Have enough data to tell the client ?
             if (!this->clientReadPossible(*socket, *intern))
             {   // Ok, close the connection
@@ -622,9 +625,12 @@ private:
             }
             // Ok, the connection progressed, so let's touch it
             intern->touchConnection();
+            // The request is not complete yet
+            if (!intern->hasDataToSend()) break;
 
             // Check if we have a file to send and in that case, use OS's send_file method, or default to IO vector sending
-            if (intern->getFilePathToSend())
+            const bool asyncSending = intern->getFilePathToSend();
+            if (asyncSending)
             {
                 if (!socket->sendDataAndFile((const char*)intern->getPrefixBuffer().getBuffer(), intern->getPrefixBuffer().getSize(), intern->getFilePathToSend(), 0, 0, (const char*)intern->getSuffixBuffer().getBuffer(), intern->getSuffixBuffer().getSize(), *thread))
                 {
@@ -659,7 +665,14 @@ private:
                     }
                 }
             }
+            if (!asyncSending && (intern->shouldCloseAfterSending() || intern->shouldCloseConnectionOnReply()))
+            {   // The answer is sent, and the client (or the answer) asked for closing the connection
+                closeClientSocket(socket);
+                return 0;
+            }
             if (intern->shouldResetAfterSending()) intern->Reset();
+            // The next request is only answered once the file is sent
+            if (asyncSending || intern->hasDataToSend()) break;
         }
         return 1;
     }
@@ -772,6 +785,7 @@ private:
         if (intern)
         {
             this->clientConnectionClosed(*socket, *intern);
+            this->deletePrivateField(intern->getPrivateField());
             // Then clean the asynchronous file
             if (intern->hasDataToSend())
                 socket->cancelAsyncSend();
@@ -785,6 +799,7 @@ private:
         AsyncInternalObject *& intern = (AsyncInternalObject *&)socket->getPrivateField();
         if (intern)
         {
+            this->deletePrivateField(intern->getPrivateField());
             // Then clean the asynchronous file
             if (intern->hasDataToSend())
                 socket->cancelAsyncSend();
@@ -900,12 +915,20 @@ public:
                         client->getPrivateField() = (void *)(AsyncInternalObject*)newField;
                         client->setOption(Network::Socket::BaseSocket::Blocking, 0);
                         // Tell the callback that the client was accepted
-                        if (!this->acceptedNewClient(*client, *address))
+                        int action = this->acceptedNewClient(*client, *address);
+                        if (!action)
                         {
                             this->rejectedNewClient(*client, *address);
                             clientIndex = server.getNextReadySocket(clientIndex);
                             continue;
                         }
+                        if (action == T::CaptureClient)
+                        {   // The callback takes the socket, no client thread monitors it
+                            client->getPrivateField() = 0;
+                            this->clientSocketForgotten(*client.Forget());
+                            clientIndex = server.getNextReadySocket(clientIndex);
+                            continue;
+                        }
 
                         // Find a free client thread to accept this client
                         int i = (int)clientArray.getSize() - 1;
@@ -952,7 +975,10 @@ public:
                                     return false;
                                 }
                                 // Ok, great, let's append the thread to our pool
-                                clientArray.Append(thread);
+                                {
+                                    Threading::ScopedLock scope(cleaningLock);
+                                    clientArray.Append(thread);
+                                }
 
                                 // Then start the thread
                                 if (!thread->startMonitoring())
@@ -974,13 +1000,46 @@ public:
         return true;
     }
 
+    /** Give back a socket that was captured, so its next requests are answered by the server.
+        This can be called from any thread.
+        @return false if no client thread can monitor the socket (the socket is not owned in that case) */
+    inline bool adoptClientSocket(BaseSocket * socket)
+    {
+        if (!socket) return false;
+        // The server loop only modifies the client threads array with this lock taken
+        Threading::ScopedLock scope(cleaningLock);
+        AsyncInternalObject *& intern = (AsyncInternalObject *&)socket->getPrivateField();
+        intern = new AsyncInternalObject;
+        socket->setOption(Network::Socket::BaseSocket::Blocking, 0);
+        for (size_t i = clientArray.getSize(); intern && i > 0; i--)
+        {
+            ClientThread * thread = clientArray.getElementAtUncheckedPosition((uint32)i - 1);
+            if (thread && thread->canHandleClient(socket)) return true;
+        }
+        // All threads are busy, so start another one (like when accepting a client)
+        ClientThread * thread = intern ? new ClientThread(*this, maxClientPerThread) : 0;
+        if (thread && thread->canHandleClient(socket))
+        {
+            clientArray.Append(thread);
+            // The thread owns the socket now, even if it fails starting (it'll be deleted in the clientArray purge)
+            thread->startMonitoring();
+            return true;
+        }
+        delete thread;
+        delete0(intern);
+        return false;
+    }
+
     /** Stop the server */
     inline bool stopServer()
     {
         this->serverStopping();
 
         if (!this->pool.getSize()) return false;
-        clientArray.Clear();
+        {
+            Threading::ScopedLock scope(cleaningLock);
+            clientArray.Clear();
+        }
 
         for (uint32 i = 0; i < this->pool.getSize(); i++)
         {   // Set socket as non blocking
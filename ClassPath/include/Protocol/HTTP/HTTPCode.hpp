@@ -47,6 +47,7 @@ namespace Protocol
             UnsupportedMIME = 415,  //!< The given media type is not supported
             RequestRange    = 416,  //!< Requested range is not correct
             ExpectationFail = 417,  //!< Expectation failed
+            TooManyRequests = 429,  //!< The client sent too many requests
 
 
             InternalServerError     = 500,  //!< The server present an internal error
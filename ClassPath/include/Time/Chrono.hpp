@@ -201,8 +201,50 @@ namespace Time
 #define PROFILER(X) (void)(X)
 #endif 
     
+    /** A probe timing a scope for the application's profiler, with a low overhead.
+        The duration is only measured if the application set a sink (else the probe only tests it), and the sink aggregates it (it's called
+        from any thread, so it must not lock). The probes are identified by a number: the library's own probes are listed here, the application's
+        ones follow them.
+        @code
+        {
+            PROBE(MyHotPath);
+            [...] // The code to time
+        } // The sink receives (MyHotPath, duration in seconds)
+        @endcode */
+    class ScopedProbe
+    {
+    public:
+        /** The library's probes */
+        enum LibraryProbes
+        {
+            ParseRequest            = 0,    //!< Parsing a HTTP request
+            SendPendingData         = 1,    //!< Sending a client's pending answer data
+            FirstApplicationProbe   = 2,    //!< The application's first probe
+        };
+        /** The function receiving the probes durations, in seconds */
+        typedef void (*Sink)(const int probe, const double duration);
+        /** The current sink, 0 for none */
+        static Sink sink;
+
+        ScopedProbe(const int probe) : to(sink), probe(probe), start(to ? getPreciseTime() : 0) {}
+        ~ScopedProbe() { if (to) to(probe, getPreciseTime() - start); }
+    private:
+        const Sink      to;
+        const int       probe;
+        const double    start;
+    };
+
     #define HasTimedProfiling 1
 #endif
 }
 
+#define _PROBECONCAT(X,Y) X ## _ ## Y
+#define _PROBEEVAL(X,Y) _PROBECONCAT(X,Y)
+#if (WantTimedProfiling==1)
+/** Time the current scope for the application's profiler (see ScopedProbe), this does nothing unless built with WantTimedProfiling */
+#define PROBE(X) ::Time::ScopedProbe _PROBEEVAL(__probe__,__LINE__) (X)
+#else
+#define PROBE(X) do {} while(0)
+#endif
+
 #endif 
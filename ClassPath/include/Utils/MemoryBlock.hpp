@@ -58,7 +58,7 @@ namespace Utils
             @return false if the (re)allocation failed, or you tried to extract more data than the block contains. */
         bool Extract(uint8 * buffer, const uint32 size);
         /** Check if a given pattern can be found in the block.
-            This is using a O(M*N) algorithm, so don't use this on large array, you should better use a BoyerMoore class for that.
+            The search is linear in the block size (even with many partial matches of the pattern).
             @return the pattern position or -1 if not found */
         uint32 lookFor(const uint8 * pattern, const uint32 patternLen, const uint32 startPos = 0) const;
 
@@ -98,6 +98,11 @@ namespace Utils
             @param newSize     The new allocated size for this buffer
             @param setSizeToo  If true, the consumed size is set to the allocated size */
         bool ensureSize(const uint32 newSize, const bool setSizeToo = false) { if (!resizeBuffer(newSize)) return false; if (setSizeToo) size = newSize; return true; }
+        /** Set the consumed size, enlarging the buffer if required.
+            Unlike ensureSize, the buffer is never shrunk, so a recycled block keeps its allocation.
+            @param newSize     The new consumed size for this buffer
+            @return false on allocation error */
+        bool setSize(const uint32 newSize) { if (newSize > allocSize && !resizeBuffer(newSize)) return false; size = newSize; return true; }
         /** Swap with the other block.
             This actually exchange the memory block internal pointers, and sizes.
             @param other    The block to swap with. */
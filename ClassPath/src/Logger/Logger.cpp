@@ -69,6 +69,13 @@ namespace Logger
         if (&getDefaultSink() != getStaticSink()) delete &getDefaultSink();
         getDefaultSinkPointer() = newSink;
     }
+    // Change the default sink, the previous one is given to the caller
+    OutputSink * swapDefaultSink(OutputSink * newSink)
+    {
+        OutputSink * previous = getDefaultSinkPointer();
+        getDefaultSinkPointer() = newSink;
+        return previous;
+    }
 
 #if defined(_WIN32) || defined(_POSIX)
     void FileOutputSink::gotMessage(const char * message, const unsigned int flags)
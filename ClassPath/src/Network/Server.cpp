@@ -6,6 +6,8 @@
 #include "../../include/Utils/ScopeGuard.hpp"
 // We need textual headers too
 #include "../../include/Network/Clients/TextualHeaders.hpp"
+// We need the profiling probes
+#include "../../include/Time/Chrono.hpp"
 
 namespace Network
 {
@@ -17,7 +19,7 @@ namespace Network
         {
             resetAfterSend = clientAskedConnectionClose = corkSocket = false;
             getPrefixBuffer().stripTo(0);
-            getRecvBuffer().stripTo(0);
+            // The reception buffer is kept, it might already contain the next (pipelined) request
             getSuffixBuffer().stripTo(0);
             delete0(streamToSend);
             sentSize = 0; tcpMSS = 0;
@@ -50,6 +52,7 @@ namespace Network
         int sendPendingDataImpl(BaseSocket * socket, InternalObject * intern)
         {
             if (!socket || !intern) return 0;
+            PROBE(Time::ScopedProbe::SendPendingData);
             // Send the initial data if any
             if (intern->getPrefixBuffer().getSize())
             {
@@ -189,13 +192,13 @@ namespace Network
         // Add a header to the query
         bool TextualHeadersServer::addQueryHeader(Context & context, const String & header, const String & value)
         {
-            return context.query.storeValue(header, new String(value), true);
+            return context.query.setValue(header, value);
         }
 
         // Add a header to the answer 
         bool TextualHeadersServer::addAnswerHeader(Context & context, const String & header, const String & value)
         {
-            return context.answer.storeValue(header, new String(value), true);
+            return context.answer.setValue(header, value);
         }
 
         struct Merger 
@@ -231,19 +234,68 @@ namespace Network
             intern.getPrefixBuffer().Append(output, output.getLength());
             return true;
         }
+
+        // Merge the pre-rendered answer and the answer headers to data
+        bool TextualHeadersServer::mergePrerenderedAnswer(InternalObject & intern)
+        {
+            Context & context = *(Context*)intern.getPrivateField();
+            const PrerenderedAnswer & answer = context.prerendered;
+            String output;
+            Merger merge(output);
+            context.answer.iterateAllEntries(merge, &Merger::MergeHeader);
+            output += "\r\n";
+            Utils::MemoryBlock & prefix = intern.getPrefixBuffer();
+            return prefix.Append(answer.head.getConstBuffer(), answer.head.getSize())
+                && prefix.Append(output, output.getLength())
+                && prefix.Append(answer.content.getConstBuffer(), answer.content.getSize());
+        }
+
+        // Render the answer
+        void TextualHeadersServer::PrerenderedAnswer::render(const String & statusLine, const String & contentType, const String & content)
+        {
+            String output = statusLine + "\r\n";
+            if (contentType) output += "Content-Type:" + contentType + "\r\n";
+            output += String::Print("Content-Length:%d\r\n", content.getLength());
+            clear();
+            head.Append(output, output.getLength());
+            this->content.Append(content, content.getLength());
+        }
         
+        // The headers' name and value are separated by spaces or tabulations
+        static inline bool isBlank(const char c) { return c == ' ' || c == '\t'; }
+
         // Parsing headers method definition
-        bool TextualHeadersServer::parseHeader(InternalObject & intern, String headerLine)
+        bool TextualHeadersServer::parseHeader(InternalObject & intern, const char * line, const uint32 length)
         {
             Context & context = *(Context*)intern.getPrivateField();
-            String headerName = headerLine.splitFrom(':');
-            if (headerName)
+            const char * nameEnd = (const char*)memchr(line, ':', length);
+            if (!nameEnd) return true;
+            // Trim the name and the value in place, so they are the only copies made
+            const char * value = nameEnd + 1, * end = line + length;
+            while (line < nameEnd && isBlank(*line)) line++;
+            while (nameEnd > line && isBlank(nameEnd[-1])) nameEnd--;
+            while (value < end && isBlank(*value)) value++;
+            while (end > value && isBlank(end[-1])) end--;
+            if (nameEnd > line)
             {
-                headerName = Client::TextualHeaders::fixHeaderName(headerName.Trimmed());
-                headerLine.Trim();
-                if (!addQueryHeader(context, headerName, headerLine)) return false;
-                if (headerName == "Content-Type" && headerLine.Find("multipart") != -1)
+                // Fix the name's case (like "Content-Type") on the stack, so the only copies are in the (reused) headers strings
+                char name[128];
+                const int nameLength = (int)(nameEnd - line);
+                if (nameLength > (int)sizeof(name))
+                {
+                    String headerName = Client::TextualHeaders::fixHeaderName(String((const void*)line, nameLength));
+                    return context.query.setValue(headerName.getData(), headerName.getLength(), value, (int)(end - value));
+                }
+                for (int i = 0; i < nameLength; i++)
+                {
+                    char c = line[i];
+                    bool upper = !i || line[i - 1] == '-';
+                    name[i] = upper ? (c >= 'a' && c <= 'z' ? c - 32 : c) : (c >= 'A' && c <= 'Z' ? c + 32 : c);
+                }
+                if (!context.query.setValue(name, nameLength, value, (int)(end - value))) return false;
+                if (nameLength == 12 && !memcmp(name, "Content-Type", 12) && memmem(value, end - value, "multipart", 9))
                 {
+                    String headerLine((const void*)value, (int)(end - value));
                     String boundary = headerLine.fromFirst("boundary").Trimmed(" =\"\r\n");
                     // Now we have the boundary, so save it
                     int boundaryLen = min(boundary.getLength(), 70);
@@ -4,6 +4,8 @@
 #include "../../../include/Streams/SocketStream.hpp"
 // And scoped pointer too
 #include "../../../include/Utils/ScopePtr.hpp"
+// We need the profiling probes
+#include "../../../include/Time/Chrono.hpp"
 
 
 namespace Network
@@ -22,67 +24,71 @@ namespace Network
         // Parse a client request.
         HTTP::ParsingError HTTP::parseRequest(InternalObject & intern, const BaseSocket & client)
         {
-            Platform::EndOfLine EOLType = Platform::CRLF;
-            // Try to find the request end
-            if (intern.getRecvBuffer().lookFor((uint8*)"\r\n\r\n", 4) == (uint32)-1)
-            {
-                // Check for \n\n end of request
-                if (intern.getRecvBuffer().lookFor((uint8*)"\n\n", 2) == (uint32)-1)
-                {
-                    // Check for \r\r end of request
-                    if (intern.getRecvBuffer().lookFor((uint8*)"\r\r", 2) == (uint32)-1)
-                        return intern.getRecvBuffer().getSize() < 4096 ? NotEnoughData : BadRequest;
-                    EOLType = Platform::CR;
-                } else EOLType = Platform::LF;
-            } else EOLType = Platform::CRLF;
-
-            // Request is complete
-            // Ok, then parse each line (first line is a bit different)
+            PROBE(Time::ScopedProbe::ParseRequest);
+            Context & context = *(Context *)intern.getPrivateField();
+            const uint8 * data = intern.getRecvBuffer().getConstBuffer();
+            const uint32 size = (uint32)intern.getRecvBuffer().getSize();
 
-            // Set the line separator
-            const uint8 * lineSep = EOLType == Platform::LF ? (const uint8*)"\n" : (EOLType == Platform::CR ? (const uint8*)"\r" : (const uint8*)"\r\n");
-            const uint32 lineSepSize = EOLType == Platform::CRLF ? 2 : 1;
-            if (intern.getRecvBuffer().lookFor(lineSep, lineSepSize) == 0)
+            // Only scan the data received since the last call, and remember where each line is, so the request is scanned once
+            uint32 requestEnd = 0, & pos = context.scanned;
+            while (pos < size && !requestEnd)
             {
-                // Empty line, probably between a Keep Alive connection, so let's accept this any way
-                intern.getRecvBuffer().Extract(0, lineSepSize);
+                const uint8 c = data[pos];
+                if (c != '\r' && c != '\n') { pos++; continue; }
+                // A CR might be followed by a LF that's not received yet
+                if (c == '\r' && pos + 1 == size && (!context.eol || context.eol == Platform::CRLF)) break;
+                // The first end of line gives the one used in the whole request
+                if (!context.eol) context.eol = c == '\n' ? Platform::LF : (data[pos + 1] == '\n' ? Platform::CRLF : Platform::CR);
+                const uint32 eolSize = context.eol == Platform::CRLF ? 2 : 1;
+                if (context.eol == Platform::LF ? c != '\n' : (context.eol == Platform::CR ? c != '\r' : c != '\r' || data[pos + 1] != '\n')) { pos++; continue; }
+
+                if (pos == context.lineStart)
+                {   // An empty line ends the request. Empty lines before the request (between keep alive requests) are accepted any way
+                    if (context.lines.getSize()) requestEnd = pos + eolSize;
+                } else context.lines.Append(Context::Line(context.lineStart, pos));
+                pos += eolSize;
+                context.lineStart = pos;
             }
+            if (!requestEnd) return size < 4096 ? NotEnoughData : BadRequest;
 
-            uint32 currentPos = 0, firstLineEndPos = intern.getRecvBuffer().lookFor(lineSep, lineSepSize);
-
-            // Ok, now parse the request line
-            String requestLine(intern.getRecvBuffer().getBuffer(), firstLineEndPos);
-            Context & context = *(Context *)intern.getPrivateField();
+            // Request is complete
+            // Ok, now parse the request line (first line is a bit different)
+            const Context::Line & first = context.lines[0];
+            String requestLine((const void*)(data + first.start), (int)(first.end - first.start));
             if (!addQueryHeader(context, "##REQUEST##", requestLine)) return BadRequest;
             if (!parseRequestLine(intern, "HTTP/", requestLine) || !isMethodSupported(*context.query.getValue("##METHOD##"))) return BadRequest;
             String * value = context.query.getValue("##RESOURCE##");
             Logger::log(Logger::Dump, "Client asked for %s", value ? (const char*)*value : (const char*)requestLine);
 
             // Parse all remaining headers
-            currentPos = firstLineEndPos + lineSepSize;
-            while (currentPos < intern.getRecvBuffer().getSize())
+            for (size_t i = 1; i < context.lines.getSize(); i++)
             {
-                uint32 endLinePos = intern.getRecvBuffer().lookFor(lineSep, lineSepSize, currentPos);
-                if (endLinePos - currentPos < 3) { currentPos = endLinePos + lineSepSize; break; }
-                String header(intern.getRecvBuffer().getBuffer() + currentPos, endLinePos - currentPos);
-                if (!parseHeader(intern, header)) return BadRequest;
-                currentPos = endLinePos + lineSepSize;
+                const Context::Line & line = context.lines[i];
+                if (!parseHeader(intern, (const char*)data + line.start, line.end - line.start)) return BadRequest;
             }
 
-            if(context.query.containsKey("Connection"))
-            {
-                String * connectionValue = context.query.getValue("Connection");
-                if(connectionValue && *connectionValue == "close")
-                    intern.closeConnectionOnReply(true);
-            }
+            if (!wantsPersistentConnection(context.query))
+                intern.closeConnectionOnReply(true);
 
-            // Check if we should purge recv buffer
-            intern.getRecvBuffer().Extract(0, currentPos);
+            // Purge the request from the recv buffer, and get ready for the next one
+            intern.getRecvBuffer().Extract(0, requestEnd);
+            context.resetParsing();
             // Hack to stop the server
             if (value && *value == "stop") { running = false; return BadRequest; }
             return Success;
         }
 
+        // Check if the client wants a persistent connection
+        bool HTTP::wantsPersistentConnection(const HeaderMap & query)
+        {
+            String * connectionValue = query.getValue("Connection");
+            if (connectionValue && connectionValue->caselessFind("close") != -1) return false;
+            String * version = query.getValue("##VERSION##");
+            // HTTP/1.0 clients must ask for it
+            if (version && *version == "1.0") return connectionValue && connectionValue->caselessFind("keep-alive") != -1;
+            return true;
+        }
+
         // Helper method
         static Stream::InputStream * readFromSocketStream(Stream::InputStream * inputStream, const Time::TimeOut & timeout, uint64 amount)
         {
@@ -173,18 +179,13 @@ namespace Network
         {
             // Check if the resource is available
             Context & context = *(Context *)intern.getPrivateField();
-            String * connectionValue = context.query.getValue("Connection");
-            if(connectionValue && *connectionValue == "close")
-            {
-                intern.closeConnectionOnReply(true);
-                intern.closeAfterSending();
-            } else intern.resetAfterSending();
+            bool persistent = wantsPersistentConnection(context.query);
             intern.corkConnection();
             String * value = context.query.getValue("##RESOURCE##");
             String * method = context.query.getValue("##METHOD##");
             if (!value || !method)
             {
-                if (!createAnswerHeader(context, Protocol::HTTP::NotFound)) return false;
+                if (!setConnectionPersistence(intern, context, persistent) || !createAnswerHeader(context, Protocol::HTTP::NotFound)) return false;
                 Logger::log(Logger::Error | Logger::Connection, "Resource not found [ERROR]");
                 return mergeAnswerHeaders(intern);
             }
@@ -205,6 +206,23 @@ namespace Network
             if (!intern.setStreamToSend(input))
                 return false;
 
+            // Remove the request's body from the reception buffer, only the pipelined requests must stay in there
+            String * contentLength = context.query.getValue("Content-Length");
+            uint64 bodySize = max(remainingStream.currentPosition(), contentLength ? (uint64)contentLength->parseInt(10) : (uint64)0);
+            if (bodySize > intern.getRecvBuffer().getSize())
+            {   // The body is still (partly) in the socket, so we can't find where the next request starts
+                persistent = false;
+                bodySize = intern.getRecvBuffer().getSize();
+            }
+            intern.getRecvBuffer().Extract(0, (uint32)bodySize);
+            if (!setConnectionPersistence(intern, context, persistent)) return false;
+
+            if (context.prerendered)
+            {   // Already rendered, so send it as is (with the connection's headers)
+                Logger::log(Logger::Connection, "[%s] %s %s: %d (pre-rendered)", (const char*)remoteAddr->asText(), (const char*)*method, (const char*)*value, (int)code);
+                return mergePrerenderedAnswer(intern);
+            }
+
             // Check for any data to send
             int64 streamSize = intern.getStreamToSend() && intern.getStreamToSend()->fullSize() > 0 ? (int64)intern.getStreamToSend()->fullSize() : 0;
             addAnswerHeader(context, "Content-Length", String::Print(PF_LLD, streamSize));
@@ -220,12 +238,7 @@ namespace Network
         {
             // Check if the resource is available
             Context & context = *(Context *)intern.getPrivateField();
-            String * connectionValue = context.query.getValue("Connection");
-            if(connectionValue && *connectionValue == "close")
-            {
-                intern.closeConnectionOnReply(true);
-                intern.closeAfterSending();
-            } else intern.resetAfterSending();
+            if (!setConnectionPersistence(intern, context, wantsPersistentConnection(context.query))) return false;
             intern.corkConnection();
             String * value = context.query.getValue("##RESOURCE##");
             if (!value)
@@ -270,13 +283,31 @@ namespace Network
             return false;
         }
 
+        // Keep or close the connection once the answer is sent
+        bool HTTP::setConnectionPersistence(InternalObject & intern, Context & context, const bool persistent)
+        {
+            if (!persistent)
+            {
+                intern.closeConnectionOnReply(true);
+                intern.closeAfterSending();
+                return addAnswerHeader(context, "Connection", "close");
+            }
+            intern.resetAfterSending();
+            // HTTP/1.1 connections are persistent by default, but HTTP/1.0 ones must be told so
+            String * version = context.query.getValue("##VERSION##");
+            return !version || *version != "1.0" || addAnswerHeader(context, "Connection", "keep-alive");
+        }
+
+        // Get the response's status line for the given code
+        String HTTP::getStatusLine(const Protocol::HTTP::StatusCode code)
+        {
+            return String::Print("HTTP/1.1 %d %s", (int)code, Protocol::HTTP::getMessageForStatusCode(code));
+        }
+
         // Create the main response header
         bool HTTP::createAnswerHeader(Context & context, const Protocol::HTTP::StatusCode code)
         {
-            String output;
-            output.Format("HTTP/1.1 %d %s", (int)code, Protocol::HTTP::getMessageForStatusCode(code));
-
-            if (!addAnswerHeader(context, "", output)) return false;
+            if (!addAnswerHeader(context, "", getStatusLine(code))) return false;
             // Add a default Content-Length if none provided on error
             if (code != Protocol::HTTP::Ok && context.answer.getValue("Content-Length") == 0)
                 return addAnswerHeader(context, "Content-Length", "0");
@@ -6,6 +6,10 @@
 #include "../../include/Threading/Threads.hpp"
 // We need containers too
 #include "../../include/Container/Container.hpp"
+#if _LINUX == 1
+    #include <sys/un.h>
+    #include <stddef.h>
+#endif
 
 #if DEBUG==1
   // We need scope ptr too
@@ -77,6 +81,15 @@
     #include <net/if.h>
     // We need writev
     #include <sys/uio.h>
+    // We need zero copy completion notifications
+    #include <linux/errqueue.h>
+    // We need the unsent size of the send buffer
+    #include <linux/sockios.h>
+    // We need io_uring for the URingPool
+    #include <linux/io_uring.h>
+    #include <sys/syscall.h>
+    #include <sys/mman.h>
+    #include <poll.h>
     // We need raw Ethernet code too
     #include <sys/ioctl.h>
     #include <netinet/ether.h>
@@ -169,6 +182,38 @@ namespace Network
             }
             return len;
         }
+        // Send multiple buffers on the socket reliably
+        int BaseSocket::sendBuffersReliably(const char ** buffers, const int * buffersSize, const int buffersCount, const Time::TimeOut & timeout) const
+        {
+            if (buffers == 0 || buffersSize == 0 || buffersCount > 16) return -1;
+            // The buffers are advanced in a local copy as they are sent
+            const char * left[16]; int leftSize[16];
+            int count = 0, len = 0;
+            for (int i = 0; i < buffersCount; i++) if (buffersSize[i]) { left[count] = buffers[i]; leftSize[count++] = buffersSize[i]; }
+            int first = 0;
+            while (first < count && select(false, true, timeout))
+            {
+                int result = sendBuffers(&left[first], &leftSize[first], count - first, 0);
+                if (result < 0)
+                {
+                    if (getLastError() == InProgress) continue;
+                    return -1;
+                }
+                if (result == 0)
+                {
+                    return len;
+                }
+                len += result;
+                while (first < count && result >= leftSize[first]) result -= leftSize[first++];
+                if (first < count) { left[first] += result; leftSize[first] -= result; }
+            }
+            if (len == 0 && first < count)
+            {
+                lastError = InProgress;
+                return -1;
+            }
+            return len;
+        }
         // Receive data from the socket reliably
         int BaseSocket::receiveReliably(char * buffer, const int bufferSize, const Time::TimeOut & timeout) const
         {
@@ -399,17 +444,16 @@ namespace Network
         const BaseSocket * FastBerkeleyPool::operator[] (const int index) const { return index >= 0 && index < (int)size ?  pool[index] : 0; }
 
         // Check if we already have the given socket in the pool
-        bool FastBerkeleyPool::haveSocket(BaseSocket * socket) const
-        {
-            for (uint32 i = 0; i < size; i++)
-            {
-                if (pool[i] == socket) return true;
-            }
-            return false;
-        }
+        bool FastBerkeleyPool::haveSocket(BaseSocket * socket) const { return indexOf(socket) != size; }
         // Get the index of the given socket in the pool
         uint32 FastBerkeleyPool::indexOf(BaseSocket * socket) const
         {
+  #ifdef _LINUX
+            // The position is found from the descriptor (unless the socket was closed while in the pool)
+            int descriptor = socket && socket->getTypeID() == 1 ? ((BerkeleySocket*)socket)->descriptor : -1;
+            uint32 slot = descriptor >= 0 && (uint32)descriptor < slotsSize ? slots[descriptor] : size;
+            if (slot < size && pool[slot] == socket) return slot;
+  #endif
             for (uint32 i = 0; i < size; i++)
                 if (pool[i] == socket) return i;
             return size;
@@ -427,12 +471,18 @@ namespace Network
             size = 0;
             Platform::safeRealloc(pool, 0);
             Platform::safeRealloc(events, 0);
+            Platform::safeRealloc(slots, 0);
             if (rd >= 0) close(rd); rd = -1;
             if (wd >= 0) close(wd); wd = -1;
             if (bd >= 0) close(bd); bd = -1;
+            if (md >= 0) close(md); md = -1;
+            mdOther = 0;
+            generation = 0;
             triggerCount = 0;
             events = 0;
             pool = 0;
+            slots = 0;
+            capacity = slotsSize = 0;
         }
 
         FastBerkeleyPool::~FastBerkeleyPool()
@@ -441,95 +491,103 @@ namespace Network
         }
 
 #ifdef _LINUX
-        // Append a socket to this pool
-        bool FastBerkeleyPool::appendSocket(BaseSocket * _socket)
-        {
-            if (!_socket || _socket->getTypeID() != 1) return false;
-            BerkeleySocket * socket = (BerkeleySocket*)(_socket);
-            if (size >= MaxQueueLen) return false;
-
-            if (rd < 0) rd = epoll_create(MaxQueueLen);
-            if (wd < 0) wd = epoll_create(MaxQueueLen);
-            if (bd < 0) bd = epoll_create(MaxQueueLen);
-
-            if (rd < 0 || wd < 0 || bd < 0) return false;
-
+        // The sets generations are unique between all the pools, so a combined set is never reused for a new pool at the same address
+        static uint32 nextGeneration() { static volatile uint32 generations = 0; return __sync_add_and_fetch(&generations, 1); }
+        // Get the set for the given interest, it's created with the sockets already in the pool
+        int FastBerkeleyPool::getSet(const uint32 interest) const
+        {
+            int & fd = interest == EPOLLIN ? rd : interest == EPOLLOUT ? wd : bd;
+            if (fd >= 0) return fd;
+            fd = epoll_create1(EPOLL_CLOEXEC);
+            if (fd < 0) return -1;
+            generation = nextGeneration();
             struct epoll_event ev = {0};
-            ev.events = EPOLLIN;
-            ev.data.ptr = socket;
-            if (epoll_ctl(rd, EPOLL_CTL_ADD, socket->descriptor, &ev) != 0) return false;
-            ev.events = EPOLLIN | EPOLLOUT;
-            if (epoll_ctl(bd, EPOLL_CTL_ADD, socket->descriptor, &ev) != 0)
+            ev.events = interest;
+            for (uint32 i = 0; i < size; i++)
             {
-                epoll_ctl(rd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-                return false;
+                ev.data.ptr = pool[i];
+                if (epoll_ctl(fd, EPOLL_CTL_ADD, pool[i]->descriptor, &ev) != 0) { close(fd); fd = -1; return -1; }
             }
-            ev.events = EPOLLOUT;
-            if (epoll_ctl(wd, EPOLL_CTL_ADD, socket->descriptor, &ev) != 0)
+            return fd;
+        }
+        // Make sure the arrays can hold the given number of sockets and descriptors (they grow geometrically, so appending is amortized constant time)
+        bool FastBerkeleyPool::reserve(const uint32 count, const uint32 descriptors)
+        {
+            if (!events && (events = Platform::safeRealloc(0, MaxEvents * sizeof(struct epoll_event))) == 0) return false;
+            if (count > capacity)
             {
-                epoll_ctl(rd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-                epoll_ctl(bd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-                return false;
+                uint32 newCapacity = max(capacity * 2, (uint32)16);
+                BerkeleySocket ** newPool = (BerkeleySocket **)Platform::realloc(pool, newCapacity * sizeof(*pool));
+                if (!newPool) return false;
+                pool = newPool; capacity = newCapacity;
             }
-
-
-            // Size has not been already incremented : will be only if all previous operations will succeed
-            struct epoll_event * _events = (struct epoll_event *)Platform::safeRealloc(events, (size + 1) * sizeof(*_events));
-            if (_events == NULL)
+            if (descriptors > slotsSize)
             {
-                epoll_ctl(rd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-                epoll_ctl(bd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-                epoll_ctl(wd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-                return false;
+                uint32 newSize = max(max(slotsSize * 2, descriptors), (uint32)64);
+                uint32 * newSlots = (uint32 *)Platform::realloc(slots, newSize * sizeof(*slots));
+                if (!newSlots) return false;
+                // An unused slot points past the pool
+                for (uint32 i = slotsSize; i < newSize; i++) newSlots[i] = (uint32)-1;
+                slots = newSlots; slotsSize = newSize;
             }
-            events = _events;
+            return true;
+        }
 
-            BerkeleySocket ** newPool = (BerkeleySocket **)Platform::safeRealloc(pool, ( size + 1) * sizeof(*pool));
-            if (newPool == NULL)
+        // Append a socket to this pool
+        bool FastBerkeleyPool::appendSocket(BaseSocket * _socket)
+        {
+            if (!_socket || _socket->getTypeID() != 1) return false;
+            BerkeleySocket * socket = (BerkeleySocket*)(_socket);
+            if (size >= MaxQueueLen || socket->descriptor < 0) return false;
+            if (!reserve(size + 1, (uint32)socket->descriptor + 1)) return false;
+            // A descriptor can only be monitored once
+            uint32 slot = slots[socket->descriptor];
+            if (slot < size && pool[slot]->descriptor == socket->descriptor) return false;
+
+            // Only the sets used so far are updated
+            const int sets[3] = { rd, wd, bd };
+            const uint32 interests[3] = { EPOLLIN, EPOLLOUT, EPOLLIN | EPOLLOUT };
+            struct epoll_event ev = {0};
+            ev.data.ptr = socket;
+            for (int i = 0; i < 3; i++)
             {
-                epoll_ctl(rd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-                epoll_ctl(bd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-                epoll_ctl(wd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-
-                Platform::safeRealloc(events, size * sizeof(*_events));
-                return false;
+                if (sets[i] < 0) continue;
+                ev.events = interests[i];
+                if (epoll_ctl(sets[i], EPOLL_CTL_ADD, socket->descriptor, &ev) != 0)
+                {
+                    while (i--) if (sets[i] >= 0) epoll_ctl(sets[i], EPOLL_CTL_DEL, socket->descriptor, &ev);
+                    return false;
+                }
             }
-            pool = newPool;
+            slots[socket->descriptor] = size;
             pool[size++] = socket;
             return true;
         }
         // Remove a socket from the pool
         bool FastBerkeleyPool::forgetSocket(BaseSocket * _socket)
         {
-            if (!_socket && _socket->getTypeID() != 1) return false;
+            if (!_socket || _socket->getTypeID() != 1) return false;
             BerkeleySocket * socket = (BerkeleySocket*)(_socket);
-            // Need to find out the socket in the pool
-            for (uint32 i = 0; i < size; i++)
-            {
-                if (pool[i] == socket)
-                {   // Found
-                    triggerCount = 0; // If removed while iterating for events, let's redo selecting
-                    // Swap the value with the last on in the list
-                    pool[i] = pool[size - 1];
-                    size--;
-                    pool[size] = 0;
+            uint32 i = indexOf(socket);
+            if (i == size) return false;
 
-                    // Remove from the monitored element (we destruct the polling array to have good indexes)
-                    struct epoll_event ev;
-                    ev.events = 0;
-                    ev.data.ptr = socket;
-                    epoll_ctl(rd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-                    epoll_ctl(wd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-                    epoll_ctl(bd, EPOLL_CTL_DEL, socket->descriptor, &ev);
-
-                    events = (struct epoll_event *)Platform::safeRealloc(events, size * sizeof(struct epoll_event));
-                    if (size && events == NULL) return false;
-
-                    // We don't realloc smaller anyway
-                    return true;
-                }
+            triggerCount = 0; // If removed while iterating for events, let's redo selecting
+            // Move the last socket in the removed slot
+            if (socket->descriptor >= 0 && (uint32)socket->descriptor < slotsSize && slots[socket->descriptor] == i) slots[socket->descriptor] = (uint32)-1;
+            size--;
+            if (i != size)
+            {
+                pool[i] = pool[size];
+                if (pool[i]->descriptor >= 0 && (uint32)pool[i]->descriptor < slotsSize) slots[pool[i]->descriptor] = i;
             }
-            return false;
+            pool[size] = 0;
+
+            struct epoll_event ev = {0};
+            ev.data.ptr = socket;
+            if (rd >= 0) epoll_ctl(rd, EPOLL_CTL_DEL, socket->descriptor, &ev);
+            if (wd >= 0) epoll_ctl(wd, EPOLL_CTL_DEL, socket->descriptor, &ev);
+            if (bd >= 0) epoll_ctl(bd, EPOLL_CTL_DEL, socket->descriptor, &ev);
+            return true;
         }
         // Remove a socket from the pool
         bool FastBerkeleyPool::removeSocket(BaseSocket * _socket)
@@ -545,8 +603,8 @@ namespace Network
             if (timeout < 0) return false; // Already timed out previously
 
             // wait for something to do...
-            int fd = reading ? (writing ? bd : rd) : (writing ? wd : -1);
-            if (fd < 0)
+            int fd = reading || writing ? getSet((reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0)) : -1;
+            if (fd < 0 || !events)
             {
                 if (timeout <= 0) return timeout == 0;
                 struct timespec ts;
@@ -558,7 +616,7 @@ namespace Network
             }
 
             // Ok, now poll the pool
-            triggerCount = epoll_wait(fd, (struct epoll_event*)events, size, (int)timeout < 0 ? -1 : (int)timeout);
+            triggerCount = epoll_wait(fd, (struct epoll_event*)events, MaxEvents, (int)timeout < 0 ? -1 : (int)timeout);
             timeout.filterError(triggerCount);
             return triggerCount > 0;
         }
@@ -570,22 +628,31 @@ namespace Network
             if ((!size && !_other->getSize()) || _other->getTypeID() != getTypeID()) return 0; // Can not mix different pool (this should never happen in reality)
             // Under linux, we can have a epoll FD waiting in another epoll FD
             FastBerkeleyPool * other = (FastBerkeleyPool*)_other;
-            Platform::FileIndexWrapper cd(epoll_create(2));
-            if (cd < 0) return 0;
-            struct epoll_event ev = {0}, _events[2] = {0};
-            ev.events = EPOLLIN;
-            ev.data.fd = rd;
-            if (rd >= 0 && epoll_ctl(cd, EPOLL_CTL_ADD, rd, &ev) != 0) return 0;
-            ev.events = EPOLLIN; // We are interested in "ready" event for the "write" descriptor
-            ev.data.fd = other->wd;
-            if (other->wd >= 0 && epoll_ctl(cd, EPOLL_CTL_ADD, other->wd, &ev) != 0) return 0; // There's no point in checking empty set
-
-            int triggered = epoll_wait(cd, _events, 2, (int)timeout < 0 ? -1 : (int)timeout);
-            timeout.filterError(triggerCount);
-            if (triggered == 0) return 0;
+            int reading = getSet(EPOLLIN), writing = other->getSet(EPOLLOUT);
+            if (reading < 0 || writing < 0) return 0;
+            // The combined set is kept as long as both sets are the same
+            if (md >= 0 && (mdOther != other || mdGeneration != generation || mdOtherGeneration != other->generation)) { close(md); md = -1; }
+            if (md < 0)
+            {
+                md = epoll_create1(EPOLL_CLOEXEC);
+                if (md < 0) return 0;
+                struct epoll_event ev = {0};
+                ev.events = EPOLLIN;
+                ev.data.fd = reading;
+                bool added = epoll_ctl(md, EPOLL_CTL_ADD, reading, &ev) == 0;
+                ev.events = EPOLLIN; // We are interested in "ready" event for the "write" descriptor
+                ev.data.fd = writing;
+                if (!added || epoll_ctl(md, EPOLL_CTL_ADD, writing, &ev) != 0) { close(md); md = -1; return 0; }
+                mdOther = other; mdGeneration = generation; mdOtherGeneration = other->generation;
+            }
+            struct epoll_event _events[2] = {{0},{0}};
+
+            int triggered = epoll_wait(md, _events, 2, (int)timeout < 0 ? -1 : (int)timeout);
+            timeout.filterError(triggered);
+            if (triggered <= 0) return 0;
             int ret = 0;
-            if (triggered != 1 || _events[0].data.fd == rd) { select(true, false, timeout); ret = 1; }
-            if (triggered != 1 || _events[0].data.fd == other->wd) { other->select(false, true, timeout); ret |= 2; }
+            if (triggered != 1 || _events[0].data.fd == reading) { select(true, false, timeout); ret = 1; }
+            if (triggered != 1 || _events[0].data.fd == writing) { other->select(false, true, timeout); ret |= 2; }
             return ret;
         }
 
@@ -794,6 +861,352 @@ namespace Network
 #endif
 #endif
 
+#ifdef _LINUX
+        // Our own system calls wrappers (the C library does not provide them)
+        static int uringSetup(const uint32 entries, struct io_uring_params * params) { return (int)syscall(__NR_io_uring_setup, entries, params); }
+        static int uringEnter(const int ring, const uint32 toSubmit, const uint32 minComplete, const uint32 flags, const void * arg, const size_t argSize) { return (int)syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, arg, argSize); }
+
+        // Build a pool with its ring
+        URingPool::URingPool(const bool own)
+            : pool(0), size(0), capacity(0), slots(0), slotsSize(0), queued(0), queuedCount(0), readyList(0), triggerCount(0), interest(0), lastToken(0),
+              ring(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED), sqRingSize(0), cqRingSize(0), sqesSize(0),
+              sqHead(0), sqTail(0), sqArray(0), sqMask(0), cqHead(0), cqTail(0), cqMask(0), cqes(0), pending(0), watched(0), watchToken(0), own(own)
+        {
+            struct io_uring_params params = {0};
+            int fd = uringSetup(RingSize, &params);
+            if (fd < 0) return;
+            // The timeout is given to the kernel when waiting, and the completions must never be dropped
+            if ((params.features & (IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP)) != (IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP)) { close(fd); return; }
+
+            sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32);
+            cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+            sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+            sqRing = mmap(0, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            cqRing = mmap(0, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            sqes = mmap(0, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) { close(fd); return; }
+
+            sqHead = (uint32*)((uint8*)sqRing + params.sq_off.head);
+            sqTail = (uint32*)((uint8*)sqRing + params.sq_off.tail);
+            sqArray = (uint32*)((uint8*)sqRing + params.sq_off.array);
+            sqMask = *(uint32*)((uint8*)sqRing + params.sq_off.ring_mask);
+            cqHead = (uint32*)((uint8*)cqRing + params.cq_off.head);
+            cqTail = (uint32*)((uint8*)cqRing + params.cq_off.tail);
+            cqMask = *(uint32*)((uint8*)cqRing + params.cq_off.ring_mask);
+            cqes = (uint8*)cqRing + params.cq_off.cqes;
+            ring = fd;
+        }
+
+        URingPool::~URingPool()
+        {
+            clearPool();
+            // Closing the ring cancels all the requests still in flight
+            if (sqRing != MAP_FAILED) munmap(sqRing, sqRingSize);
+            if (cqRing != MAP_FAILED) munmap(cqRing, cqRingSize);
+            if (sqes != MAP_FAILED) munmap(sqes, sqesSize);
+            if (ring >= 0) close(ring);
+        }
+
+        // Make sure the arrays can hold the given number of sockets and descriptors (they grow geometrically)
+        bool URingPool::reserve(const uint32 count, const uint32 descriptors)
+        {
+            if (count > capacity)
+            {
+                uint32 newCapacity = max(capacity * 2, (uint32)16);
+                Entry * newPool = (Entry *)Platform::realloc(pool, newCapacity * sizeof(*pool));
+                if (!newPool) return false;
+                pool = newPool;
+                uint32 * newReady = (uint32 *)Platform::realloc(readyList, newCapacity * sizeof(*readyList));
+                if (!newReady) return false;
+                readyList = newReady; capacity = newCapacity;
+            }
+            if (descriptors > slotsSize)
+            {
+                uint32 newSize = max(max(slotsSize * 2, descriptors), (uint32)64);
+                uint32 * newQueued = (uint32 *)Platform::realloc(queued, newSize * sizeof(*queued));
+                if (!newQueued) return false;
+                queued = newQueued;
+                uint32 * newSlots = (uint32 *)Platform::realloc(slots, newSize * sizeof(*slots));
+                if (!newSlots) return false;
+                // An unused slot points past the pool
+                for (uint32 i = slotsSize; i < newSize; i++) newSlots[i] = SlotMask;
+                slots = newSlots; slotsSize = newSize;
+            }
+            return true;
+        }
+
+        // Queue the given descriptor for a new request in the next select (a descriptor is only queued once)
+        void URingPool::requeue(const int descriptor) const
+        {
+            if (descriptor < 0 || (uint32)descriptor >= slotsSize || (slots[descriptor] & Queued)) return;
+            slots[descriptor] |= Queued;
+            queued[queuedCount++] = (uint32)descriptor;
+        }
+
+        // Queue a request
+        bool URingPool::queue(const uint8 opcode, const int fd, const uint32 events, const uint64 address, const uint64 userData) const
+        {
+            uint32 tail = *sqTail;
+            if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > sqMask)
+            {   // The submission queue is full, so submit what's queued to make room
+                if (enter(-1) < 0) return false;
+                if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) > sqMask) return false;
+            }
+            uint32 index = tail & sqMask;
+            struct io_uring_sqe * sqe = (struct io_uring_sqe *)sqes + index;
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = opcode;
+            sqe->fd = fd;
+            sqe->poll32_events = events;
+            sqe->addr = address;
+            sqe->user_data = userData;
+            sqArray[index] = index;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            pending++;
+            return true;
+        }
+
+        // Queue a poll request for each queued descriptor
+        void URingPool::arm(const uint32 events) const
+        {
+            if (events != interest)
+            {   // The requests for the previous events are removed (their completion is ignored since the token changed)
+                for (uint32 i = 0; i < size; i++)
+                {
+                    Entry & entry = pool[i];
+                    if (!entry.armed) continue;
+                    queue(IORING_OP_POLL_REMOVE, -1, 0, ((uint64)entry.token << 32) | (uint32)entry.socket->descriptor, 0);
+                    entry.armed = 0; entry.token = 0;
+                    requeue(entry.socket->descriptor);
+                }
+                interest = events;
+            }
+            for (uint32 i = 0; i < queuedCount; i++)
+            {
+                int descriptor = (int)queued[i];
+                slots[descriptor] &= SlotMask;
+                uint32 slot = slotOf(descriptor);
+                if (slot == size || pool[slot].armed) continue;
+                Entry & entry = pool[slot];
+                entry.token = nextToken();
+                if (queue(IORING_OP_POLL_ADD, descriptor, events, 0, ((uint64)entry.token << 32) | (uint32)descriptor)) entry.armed = events;
+            }
+            queuedCount = 0;
+        }
+
+        // Submit the queued requests and wait for a completion if asked to
+        int URingPool::enter(const int wait) const
+        {
+            struct __kernel_timespec ts = { wait / 1000, (wait % 1000) * 1000000 };
+            struct io_uring_getevents_arg arg = {0};
+            arg.ts = (uint64)(size_t)&ts;
+            int ret = uringEnter(ring, pending, wait >= 0 ? 1 : 0, wait >= 0 ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0, wait >= 0 ? &arg : 0, wait >= 0 ? sizeof(arg) : 0);
+            if (ret < 0) return errno == ETIME || errno == EINTR || errno == EBUSY ? 0 : -1;
+            pending -= min((uint32)ret, pending);
+            return ret;
+        }
+
+        // Check if there are some unread completions
+        bool URingPool::hasCompletions() const
+        {
+            return ring >= 0 && *cqHead != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        }
+
+        // Read the completions
+        void URingPool::harvest() const
+        {
+            uint32 head = *cqHead, tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++)
+            {
+                const struct io_uring_cqe & cqe = ((const struct io_uring_cqe *)cqes)[head & cqMask];
+                // The removal requests have no user data
+                if (!cqe.user_data) continue;
+                int descriptor = (int)(uint32)cqe.user_data;
+                uint32 token = (uint32)(cqe.user_data >> 32);
+                if (descriptor == -1)
+                {   // The other ring we are watching has completions
+                    if (token == watchToken) watchToken = 0;
+                    continue;
+                }
+                uint32 slot = slotOf(descriptor);
+                if (slot == size || pool[slot].token != token) continue; // Removed since
+                Entry & entry = pool[slot];
+                entry.armed = 0;
+                requeue(descriptor);
+                if (cqe.res == -ECANCELED) continue;
+                // An error is reported as an error on the socket, the next operation on it will tell
+                entry.ready = cqe.res < 0 ? (uint32)POLLERR : (uint32)cqe.res;
+                readyList[triggerCount++] = (uint32)descriptor;
+            }
+            __atomic_store_n(cqHead, tail, __ATOMIC_RELEASE);
+        }
+
+        // Submit the requests and wait for a socket to be ready
+        int URingPool::wait(const URingPool * other, const Time::TimeOut & timeout) const
+        {
+            if (watchToken && watched != other)
+            {   // Stop watching the previous pool's ring
+                queue(IORING_OP_POLL_REMOVE, -1, 0, ((uint64)watchToken << 32) | 0xFFFFFFFF, 0);
+                watchToken = 0;
+            }
+            while (true)
+            {
+                if (other && !watchToken)
+                {   // The other ring is readable when it has completions
+                    watched = other;
+                    watchToken = nextToken();
+                    queue(IORING_OP_POLL_ADD, other->ring, POLLIN, 0, ((uint64)watchToken << 32) | 0xFFFFFFFF);
+                }
+                // The submitted requests for sockets already ready complete immediately, so waiting is only done when nothing completed
+                int ret = enter(-1);
+                if (ret >= 0 && !hasCompletions() && (!other || !other->hasCompletions())) ret = enter(max((int)timeout, 0));
+                if (ret < 0) { timeout.filterError(-1); return 0; }
+
+                int ready = 0;
+                if (other && other->hasCompletions()) { other->harvest(); if (other->triggerCount) ready |= 2; }
+                if (hasCompletions()) { harvest(); if (triggerCount) ready |= 1; }
+                if (ready) { timeout.success(); return ready; }
+                // Only requests that were removed completed, so wait again for the remaining time
+                if (timeout.timedOut()) { timeout.filterError(0); return 0; }
+            }
+        }
+
+        // Append a socket to this pool
+        bool URingPool::appendSocket(BaseSocket * _socket)
+        {
+            if (!_socket || _socket->getTypeID() != 1 || ring < 0) return false;
+            BerkeleySocket * socket = (BerkeleySocket*)(_socket);
+            if (size >= MaxQueueLen || socket->descriptor < 0) return false;
+            if (!reserve(size + 1, (uint32)socket->descriptor + 1)) return false;
+            // A descriptor can only be monitored once
+            if (slotOf(socket->descriptor) != size) return false;
+
+            Entry & entry = pool[size];
+            entry.socket = socket; entry.armed = 0; entry.ready = 0; entry.token = 0;
+            slots[socket->descriptor] = (slots[socket->descriptor] & Queued) | size;
+            size++;
+            // The request is submitted with the next select
+            requeue(socket->descriptor);
+            return true;
+        }
+        // Forget a socket from the pool
+        bool URingPool::forgetSocket(BaseSocket * _socket)
+        {
+            if (!_socket || _socket->getTypeID() != 1) return false;
+            BerkeleySocket * socket = (BerkeleySocket*)(_socket);
+            uint32 i = indexOf(socket);
+            if (i == size) return false;
+
+            triggerCount = 0; // If removed while iterating for events, let's redo selecting
+            Entry removed = pool[i];
+            if (removed.socket->descriptor >= 0 && (uint32)removed.socket->descriptor < slotsSize && (slots[removed.socket->descriptor] & SlotMask) == i)
+                slots[removed.socket->descriptor] = (slots[removed.socket->descriptor] & Queued) | SlotMask;
+            // Move the last socket in the removed slot
+            size--;
+            if (i != size)
+            {
+                pool[i] = pool[size];
+                int descriptor = pool[i].socket->descriptor;
+                if (descriptor >= 0 && (uint32)descriptor < slotsSize) slots[descriptor] = (slots[descriptor] & Queued) | i;
+            }
+            // The request holds a reference on the socket, so it's removed now for the socket to be closed when asked to
+            if (removed.armed && queue(IORING_OP_POLL_REMOVE, -1, 0, ((uint64)removed.token << 32) | (uint32)removed.socket->descriptor, 0)) enter(-1);
+            return true;
+        }
+        // Remove a socket from the pool
+        bool URingPool::removeSocket(BaseSocket * _socket)
+        {
+            if (!forgetSocket(_socket)) return false;
+            if (own) delete (BerkeleySocket*)_socket;
+            return true;
+        }
+        // Get the index of the given socket in the pool
+        uint32 URingPool::indexOf(BaseSocket * socket) const
+        {
+            // The position is found from the descriptor (unless the socket was closed while in the pool)
+            int descriptor = socket && socket->getTypeID() == 1 ? ((BerkeleySocket*)socket)->descriptor : -1;
+            uint32 slot = slotOf(descriptor);
+            if (slot < size && pool[slot].socket == socket) return slot;
+            for (uint32 i = 0; i < size; i++)
+                if (pool[i].socket == socket) return i;
+            return size;
+        }
+        // Clear the pool from all its sockets
+        void URingPool::clearPool()
+        {
+            for (uint32 i = 0; i < size; i++)
+            {
+                if (pool[i].armed) queue(IORING_OP_POLL_REMOVE, -1, 0, ((uint64)pool[i].token << 32) | (uint32)pool[i].socket->descriptor, 0);
+                if (own) delete pool[i].socket;
+            }
+            if (pending) enter(-1);
+            size = 0;
+            Platform::safeRealloc(pool, 0);
+            Platform::safeRealloc(readyList, 0);
+            Platform::safeRealloc(slots, 0);
+            Platform::safeRealloc(queued, 0);
+            pool = 0;
+            readyList = 0;
+            slots = 0;
+            queued = 0;
+            capacity = slotsSize = queuedCount = 0;
+            triggerCount = 0;
+        }
+        // Check if a socket is connected.
+        bool URingPool::isConnected(const Time::TimeOut & timeout)
+        {
+            for (uint32 i = 0; i < size; i++) pool[i].socket->setOption(BaseSocket::Blocking, 0);
+            bool ret = isReadPossible(timeout);
+            for (uint32 j = 0; j < size; j++) pool[j].socket->setOption(BaseSocket::Blocking, 1);
+            return ret;
+        }
+
+        // Select the pool for at least an element that is ready
+        bool URingPool::select(const bool reading, const bool writing, const Time::TimeOut & timeout) const
+        {
+            if (timeout < 0) return false; // Already timed out previously
+
+            triggerCount = 0;
+            if ((!reading && !writing) || ring < 0)
+            {
+                if (timeout <= 0) return timeout == 0;
+                struct timespec ts;
+                ts.tv_sec = timeout / 1000;
+                ts.tv_nsec = (timeout % 1000) * 1000000;
+
+                while (nanosleep(&ts, &ts) == -1);
+                return true;
+            }
+            arm((reading ? POLLIN : 0) | (writing ? POLLOUT : 0));
+            return wait(0, timeout) != 0;
+        }
+        // Select our pool for reading, and the other pool for writing.
+        int URingPool::selectMultiple(MonitoringPool * _other, const Time::TimeOut & timeout) const
+        {
+            if (!_other) return select(true, false, timeout) == 1;
+            if (timeout <= 0) return 0; // Already timed out previously
+            if ((!size && !_other->getSize()) || _other->getTypeID() != getTypeID()) return 0; // Can not mix different pool (this should never happen in reality)
+            URingPool * other = (URingPool*)_other;
+            if (ring < 0 || other->ring < 0) return 0;
+            // The other pool's requests are submitted first, so the sockets already writable have completed when we check its ring
+            triggerCount = 0; other->triggerCount = 0;
+            other->arm(POLLOUT);
+            if (other->pending && other->enter(-1) < 0) return 0;
+            arm(POLLIN);
+            return wait(other, timeout);
+        }
+
+        // Get the ready socket at the given position
+        BaseSocket * URingPool::getReadyAt(const int index, bool * writing)
+        {
+            if ((uint32)index >= (uint32)triggerCount) return 0;
+            uint32 slot = slotOf((int)readyList[index]);
+            if (slot == size) return 0;
+            if (writing) *writing = (pool[slot].ready & POLLOUT) > 0;
+            return pool[slot].socket;
+        }
+#endif
+
 
 
 
@@ -943,6 +1356,15 @@ namespace Network
             sock_t desc = ::accept(descriptor, (struct sockaddr*)&bigaddr, &socklen);
             if (desc == SocketError) Return((BaseSocket*)0);
 
+#if _LINUX == 1
+            if (((struct sockaddr*)&bigaddr)->sa_family == AF_UNIX)
+            {   // Unix domain socket, the client is usually not bound (and its path would not fit in the buffer anyway)
+                delete address;
+                address = new Network::Address::Unix();
+                Return(new BerkeleySocket(desc, type, Connected));
+            }
+#endif
+
             if (socklen != sizeof(bigaddr))
             {   // IPv4
                 struct sockaddr_in * addr = (struct sockaddr_in*)&bigaddr;
@@ -990,6 +1412,22 @@ namespace Network
             // Ensure we are using the low level stuff now
             const Address & address = _address.getBindableAddress();
             const Network::Address::IPV6 * ipv6 = address.getTypeID() == 2 ? (const Network::Address::IPV6 *)(&address) : 0;
+#if _LINUX == 1
+            if (address.getTypeID() == 6)
+            {   // Unix domain socket, bound on a path
+                if (descriptor == SocketError)
+                {
+                    descriptor = ::socket(PF_UNIX, type == Datagram ? SOCK_DGRAM : SOCK_STREAM, 0);
+                    if (descriptor == SocketError) Return(OtherError);
+                    state = Opened;
+                }
+                struct sockaddr_un addr;
+                memset(&addr, 0, sizeof(addr));
+                addr.sun_family = AF_UNIX;
+                memcpy(addr.sun_path, address.getLowLevelObject(), min((size_t)address.getLowLevelObjectSize(), sizeof(addr.sun_path) - 1));
+                Return(setError(::bind(descriptor, (struct sockaddr*)&addr, sizeof(addr))) == 0 ? setState(Bound) : getLastError());
+            }
+#endif
             if (ipv6)
             {
                 // If not open yet, open now
@@ -1160,20 +1598,53 @@ namespace Network
             Return(ret == 0 ? sent : ret);
 #elif defined(_POSIX)
             typedef struct iovec iovec;
-            iovec * vectors = new iovec[buffersCount];
+            // Avoid allocating for the usual small counts
+            iovec local[8];
+            iovec * vectors = buffersCount <= (int)ArrSz(local) ? local : new iovec[buffersCount];
             for (int i = 0; i < buffersCount; i++)
             {
                 vectors[i].iov_base = (void*)buffers[i];
                 vectors[i].iov_len = buffersSize[i];
             }
-            int ret = setError(::writev(descriptor, vectors, buffersCount));
-            delete[] vectors;
+            // Use sendmsg instead of writev so the flags are honored
+            struct msghdr msg = {0};
+            msg.msg_iov = vectors;
+            msg.msg_iovlen = buffersCount;
+            int sendFlags = flags;
+  #ifdef _LINUX
+            sendFlags |= sendOptions;
+  #endif
+            int ret = setError(::sendmsg(descriptor, &msg, sendFlags));
+            if (vectors != local) delete[] vectors;
             Return(ret);
 #else
             return BaseSocket::sendBuffers(buffers, buffersSize, buffersCount, flags);
 #endif
         }
 
+        // Fetch a zero copy send completion
+        bool BerkeleySocket::getZeroCopyCompletion(uint32 & first, uint32 & last) const
+        {
+#if defined(_LINUX) && defined(SO_EE_ORIGIN_ZEROCOPY)
+            if (descriptor == SocketError) return false;
+            char control[128];
+            struct msghdr msg = {0};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (::recvmsg(descriptor, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) return false;
+            for (struct cmsghdr * cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+            {
+                if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) || (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))) continue;
+                const struct sock_extended_err * err = (const struct sock_extended_err *)CMSG_DATA(cm);
+                if (err->ee_errno || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+                first = err->ee_info;
+                last = err->ee_data;
+                return true;
+            }
+#endif
+            return false;
+        }
+
         // Send data from multiple buffer to an host.
         int BerkeleySocket::sendBuffersTo(const char ** buffers, const int * buffersSize, const int buffersCount, const Address & to) const
         {
@@ -1959,6 +2430,12 @@ namespace Network
                 ReturnI(setsockopt(descriptor, SOL_SOCKET, SO_SNDBUF, (const char*)&value, sizeof(value)) == 0, SendBufferSize, value);
             case ReuseAddress:
                 ReturnI(setsockopt(descriptor, SOL_SOCKET, SO_REUSEADDR, (const char*)&value, sizeof(value)) == 0, ReuseAddress, value);
+            case ReusePort:
+#ifdef SO_REUSEPORT
+                ReturnI(setsockopt(descriptor, SOL_SOCKET, SO_REUSEPORT, (const char*)&value, sizeof(value)) == 0, ReusePort, value);
+#else
+                Return(false);
+#endif
             case LingerOnClose:
                 {
                     struct linger ling = {0};
@@ -1989,6 +2466,18 @@ namespace Network
                 ReturnI(setsockopt(descriptor, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&value, sizeof(value)) == 0, NoSigPipe, value);
 #else
                 Return(false);
+#endif
+            case ZeroCopy:
+#if defined(_LINUX) && defined(SO_ZEROCOPY)
+                ReturnI(setsockopt(descriptor, SOL_SOCKET, SO_ZEROCOPY, (const char*)&value, sizeof(value)) == 0, ZeroCopy, value);
+#else
+                Return(false);
+#endif
+            case NotSentLowAt:
+#if defined(_LINUX) && defined(TCP_NOTSENT_LOWAT)
+                ReturnI(setsockopt(descriptor, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (const char*)&value, sizeof(value)) == 0, NotSentLowAt, value);
+#else
+                Return(false);
 #endif
             // Update the descriptor directly
             case Descriptor:
@@ -2034,6 +2523,14 @@ namespace Network
                 ReturnI(getsockopt(descriptor, IPPROTO_TCP, TCP_CORK,     &value, &len) == 0, Cork, value);
 #elif defined(_MAC)
                 ReturnI(getsockopt(descriptor, IPPROTO_TCP, TCP_NOPUSH,   &value, &len) == 0, Cork, value);
+#endif
+#if defined(_LINUX) && defined(TCP_NOTSENT_LOWAT)
+            case NotSentLowAt:
+                ReturnI(getsockopt(descriptor, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char*)&value, &len) == 0, NotSentLowAt, value);
+#endif
+#if defined(_LINUX) && defined(SIOCOUTQNSD)
+            case UnsentSize:
+                ReturnI(ioctl(descriptor, SIOCOUTQNSD, &value) == 0, UnsentSize, value);
 #endif
             // Might not work on some platform
             case Descriptor: value = (int)descriptor; Return(true);
@@ -2093,10 +2590,21 @@ namespace Network
         // Get the peer name for a connected socket
         Address * BerkeleySocket::getPeerName() const
         {
+#if _LINUX == 1
+            char buffer[sizeof(struct sockaddr_un)];
+#else
             char buffer[sizeof(struct sockaddr_in6)];
+#endif
             socklen_t socklen = sizeof(buffer);
             if (getpeername(descriptor, (struct sockaddr*)buffer, &socklen) == 0)
             {
+#if _LINUX == 1
+                if (((struct sockaddr*)buffer)->sa_family == AF_UNIX)
+                {   // Unix domain socket, the path might be empty for an unbound socket
+                    size_t offset = offsetof(struct sockaddr_un, sun_path);
+                    return new Network::Address::Unix(((struct sockaddr_un *)buffer)->sun_path, socklen > offset ? (int)(socklen - offset) : 0);
+                }
+#endif
                 if (socklen == sizeof(struct sockaddr_in))
                 {   // IPv4
                     struct sockaddr_in * addr = (struct sockaddr_in *)buffer;
@@ -2112,10 +2620,21 @@ namespace Network
         // Get the bound address for a connected socket
         Address * BerkeleySocket::getBoundAddress() const
         {
+#if _LINUX == 1
+            char buffer[sizeof(struct sockaddr_un)];
+#else
             char buffer[sizeof(struct sockaddr_in6)];
+#endif
             socklen_t socklen = sizeof(buffer);
             if (getsockname(descriptor, (struct sockaddr*)buffer, &socklen) == 0)
             {
+#if _LINUX == 1
+                if (((struct sockaddr*)buffer)->sa_family == AF_UNIX)
+                {   // Unix domain socket, the path might be empty for an unbound socket
+                    size_t offset = offsetof(struct sockaddr_un, sun_path);
+                    return new Network::Address::Unix(((struct sockaddr_un *)buffer)->sun_path, socklen > offset ? (int)(socklen - offset) : 0);
+                }
+#endif
                 if (socklen == sizeof(struct sockaddr_in))
                 {   // IPv4
                     struct sockaddr_in * addr = (struct sockaddr_in *)buffer;
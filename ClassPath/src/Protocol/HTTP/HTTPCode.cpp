@@ -79,6 +79,8 @@ namespace Protocol
                 return "Requested Range Not Satisfiable";
             case ExpectationFail:
                 return "Expectation Failed";
+            case TooManyRequests:
+                return "Too Many Requests";
                 // --------------------SERVER ERROR CODES-----------------//
             case InternalServerError:
                 return "Internal Server Error";
@@ -751,15 +751,15 @@ bool Thread::setCurrentThreadOnProcessorMask(const uint64 mask)
     cpu_set_t Mask;
     CPU_ZERO (&Mask);
 
-    for (size_t i = 0; i < sizeof(mask); ++i)
-        if ((mask & (1 << i))) CPU_SET (i, &Mask);
+    for (size_t i = 0; i < sizeof(mask) * 8; ++i)
+        if ((mask & ((uint64)1 << i))) CPU_SET (i, &Mask);
 
     // If this doesn't compile, you need to update your glibc library
     // Quote from man page:
     // "The CPU affinity system calls were introduced in Linux kernel 2.5.8. The library interfaces were introduced in glibc 2.3.
     // Initially, the glibc interfaces included a cpusetsize argument. In glibc 2.3.2, the cpusetsize argument was removed,
     // but this argument was restored in glibc 2.3.4. "
-    sched_setaffinity (0, sizeof(Mask), &Mask);
+    if (sched_setaffinity (0, sizeof(Mask), &Mask) != 0) return false;
     sched_yield();
     return true;
 #else
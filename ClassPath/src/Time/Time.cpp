@@ -697,4 +697,8 @@ namespace Time
     
 }
 
+#if (WantTimedProfiling==1)
+// No probe is timed until the application sets its sink
+Time::ScopedProbe::Sink Time::ScopedProbe::sink = 0;
+#endif
 
@@ -58,18 +58,25 @@ namespace Utils
     uint32 MemoryBlock::lookFor(const uint8 * pattern, const uint32 patternLen, const uint32 startPos) const
     {
         if (!pattern || (patternLen + startPos) > size) return (uint32)-1;
-        
-        uint32 pos = startPos;
-        while (pos < size)
+        if (!patternLen) return startPos;
+
+        // The (vectorized) memchr on the first byte is the fastest while its false matches are rare, but it's quadratic with many partial matches.
+        // So once the comparisons cost more than the scanned bytes (with some slack for a false match at the start), the rest is searched with the C library's linear search (two-way in glibc)
+        uint32 pos = startPos, work = 0;
+        const uint32 last = size - patternLen;
+        while (pos <= last)
         {
-            void * foundBuff = memchr(&buffer[pos], pattern[0], (size - pos));
-            if (foundBuff && (uint32)((uint8*)foundBuff - buffer) + patternLen <= size)
+            const uint8 * found = (const uint8*)memchr(&buffer[pos], pattern[0], last - pos + 1);
+            if (!found) return (uint32)-1;
+            pos = (uint32)(found - buffer);
+            if (memcmp(found, pattern, patternLen) == 0) return pos;
+            pos++;
+            work += patternLen + 16;
+            if (work > pos - startPos + 256)
             {
-                if (memcmp(foundBuff, pattern, patternLen) == 0)
-                    return (uint32)((uint8*)foundBuff - buffer);
-                pos = (uint32)((uint8*)foundBuff - buffer) + 1;
-            } 
-            else return (uint32)-1;
+                const void * match = memmem(&buffer[pos], size - pos, pattern, patternLen);
+                return match ? (uint32)((const uint8*)match - buffer) : (uint32)-1;
+            }
         }
         return (uint32)-1;
     }
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need Utils::MemoryBlock here
+#include "Utils/MemoryBlock.hpp"
+// We need containers too
+#include "Container/Container.hpp"
+
+/** A MJPEG AVI file layout, for wrapping JPEG pictures in an AVI container without copying them.
+    The file is a RIFF AVI 1.0 file: the headers, the pictures chunks (in a movi list) and the legacy index (idx1).
+    Since all the pictures sizes are known first, the file size is known before any picture is sent, and the file can be sent in order:
+    getHeader(), then getChunkHeader() and the picture (and a padding byte if its size is odd) for each picture, then getIndex() */
+struct AVIMuxer
+{
+    /** Some limits */
+    enum Constants {
+        /** The RIFF sizes are 32 bits, and many players don't read AVI 1.0 files larger than 2GB */
+        MaxFileSize     = 0x7FFFFFFF,
+        /** The RIFF header, the hdrl list and the movi list header */
+        HeaderSize      = 12 + 200 + 12,
+        ChunkHeaderSize = 8,
+        IndexEntrySize  = 16,
+    };
+
+    /** Set the pictures to wrap
+        @param width    The pictures width in pixels
+        @param height   The pictures height in pixels
+        @param fps      The playback rate in frames per second
+        @param sizes    The size of each picture, in bytes */
+    void setPictures(const int width, const int height, const unsigned fps, const Container::PlainOldData<uint32>::Array & sizes);
+    /** Check if a picture of the given size can be added without exceeding the maximum file size
+        @param current  The size of the pictures already added, as returned by getPictureSpace */
+    static bool canAdd(const uint64 current, const uint32 size, const size_t count) { return HeaderSize + current + getPictureSpace(size) + (count + 1) * IndexEntrySize + 8 <= MaxFileSize; }
+    /** Get the space used by a picture in the file, with its chunk header and padding */
+    static inline uint64 getPictureSpace(const uint32 size) { return ChunkHeaderSize + size + (size & 1); }
+
+    /** Get the file size in bytes */
+    uint64 getFileSize() const { return fileSize; }
+    /** Get the file header, up to the first picture chunk */
+    const Utils::MemoryBlock & getHeader() const { return header; }
+    /** Get the header of a picture chunk */
+    static void getChunkHeader(const uint32 size, uint8 (&chunk)[ChunkHeaderSize]);
+    /** Get the index chunk, at the end of the file */
+    const Utils::MemoryBlock & getIndex() const { return index; }
+
+    AVIMuxer() : fileSize(0) {}
+
+    // Members
+private:
+    Utils::MemoryBlock  header, index;
+    uint64              fileSize;
+};
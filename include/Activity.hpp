@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need the DC coefficients decoder
+#include "Downscaler.hpp"
+// We need threading code here
+#include "Threading/Threads.hpp"
+
+/** A cheap change detector, telling whether something moves in front of the camera.
+    Only the DC coefficients of the pictures are decoded (the mean of each 8x8 luma block), and compared to a slowly adapting baseline.
+    The score is the percentage of blocks that differ from the baseline, once the mean brightness change of the whole picture is removed (so
+    the camera's exposure adjustments are not seen as activity). The camera is active while the score is above the threshold, and for some
+    time after it.
+    The pictures are analyzed at a limited rate (the decoding is a large part of a full decoding), so the cost does not depend on the frame rate */
+struct ActivityDetector
+{
+    /** Some parameters */
+    enum Constants {
+        /** The difference from the baseline, in gray levels, for a block to be changed */
+        BlockThreshold  = 12,
+        /** The baseline adapts by 1/(2^BaselineShift) of the difference for each analyzed picture */
+        BaselineShift   = 3,
+        /** The baseline is stored with this number of fractional bits */
+        BaselineBits    = 4,
+    };
+
+    /** Set the detector's parameters
+        @param threshold    The percentage of changed blocks for the camera to be active, 0 to disable the detector
+        @param holdSec      The time the camera stays active after the last change, in seconds
+        @param intervalMs   The minimum interval between two analyzed pictures, in milliseconds */
+    void setParameters(const unsigned threshold, const unsigned holdSec, const unsigned intervalMs);
+    /** Check if the detector is enabled */
+    inline bool isEnabled() const { return threshold != 0; }
+    /** Analyze the given picture, if it's time to analyze one (called by the capture thread only)
+        @param now      The current time in seconds
+        @return false if the picture could not be decoded */
+    bool pictureReceived(const uint8 * data, const size_t size, const double now);
+    /** Get the last score, the percentage of changed blocks */
+    double getScore() const { Threading::ScopedLock scope(lock); return score; }
+    /** Check if the camera is active at the given time (it's active until a picture is analyzed) */
+    bool isActive(const double now) const { Threading::ScopedLock scope(lock); return !isEnabled() || !lastChange || now - lastChange < hold; }
+
+    /** The number of analyzed pictures */
+    Threading::Atomic<uint64>   framesAnalyzed;
+
+    ActivityDetector() : threshold(0), hold(0), interval(0), nextTime(0), blocks(0), score(0), lastChange(0) {}
+
+    // Members
+private:
+    /** The parameters: the threshold in percent, the hold time and analysis interval in seconds */
+    unsigned        threshold;
+    double          hold, interval;
+    /** The time the next picture is analyzed */
+    double          nextTime;
+    /** The decoder, and the baseline for each block (in fixed point) */
+    JPEGDownscaler  decoder;
+    Utils::MemoryBlock baseline;
+    size_t          blocks;
+    /** The lock protecting the results */
+    mutable Threading::FastLock lock;
+    /** The last score and the time of the last change */
+    double          score, lastChange;
+};
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need Utils::MemoryBlock here
+#include "Utils/MemoryBlock.hpp"
+// We need strings too
+#include "Strings/Strings.hpp"
+
+typedef Strings::FastString String;
+
+/** A region of a picture, in pixels */
+struct JPEGRegion
+{
+    /** The largest coordinate of a JPEG picture */
+    enum { MaxRegionCoordinate = 65535 };
+
+    int x, y, width, height;
+
+    /** Check if the region is set (an empty region is the whole picture) */
+    inline bool isSet() const { return width > 0 && height > 0; }
+    inline bool operator == (const JPEGRegion & other) const { return x == other.x && y == other.y && width == other.width && height == other.height; }
+    /** Parse a region given as "x,y,width,height"
+        @return false if the text is not a valid region */
+    static bool parse(const String & text, JPEGRegion & region);
+
+    JPEGRegion(const int x = 0, const int y = 0, const int width = 0, const int height = 0) : x(x), y(y), width(width), height(height) {}
+};
+
+/** A JPEG picture downscaler, for building a preview from a larger picture without a full decoding.
+    The picture is decoded in the DCT domain: only the low frequency coefficients of each 8x8 block are transformed back, with a reduced
+    inverse DCT (4x4 for the half scale, 2x2 for the quarter scale, and only the DC coefficient for the eighth scale).
+    The preview is then encoded as a baseline JPEG picture with the same chroma subsampling.
+    Only the baseline Huffman pictures (what the MJPEG cameras produce) are supported.
+    The buffers are kept between the calls, so there is no allocation once the first picture is downscaled.
+    It also crops the pictures without any loss, in the DCT domain too (like jpegtran's crop) */
+struct JPEGDownscaler
+{
+    /** Some limits */
+    enum Constants {
+        MaxComponents   = 3,
+        MaxDimension    = 16384,
+        DefaultQuality  = 80,
+    };
+
+    /** Downscale the given picture
+        @param data     The JPEG picture
+        @param size     The picture size in bytes
+        @param scale    The scale divisor: 2, 4 or 8
+        @param out      On output, contains the preview JPEG picture
+        @return An empty string on success, or the error message */
+    String downscale(const uint8 * data, const size_t size, const unsigned scale, Utils::MemoryBlock & out);
+    /** Decode only the DC coefficients of the given picture (the AC coefficients are skipped, there is no inverse DCT and no encoding).
+        This gives the mean of each 8x8 block, so a 1/8 scale thumbnail of each component
+        @return An empty string on success, or the error message */
+    String decodeDC(const uint8 * data, const size_t size);
+    /** Crop the given picture, without decoding it: the blocks of the region are entropy decoded, and coded again in the cropped picture.
+        The region's top left corner is moved to the previous MCU boundary (8 or 16 pixels), so the blocks are kept as they are
+        @param region   The region to keep, it's clipped to the picture
+        @param out      On output, contains the cropped JPEG picture (with the standard Huffman tables)
+        @param actual   If not 0, on output, the region actually kept
+        @return An empty string on success, or the error message */
+    String crop(const uint8 * data, const size_t size, const JPEGRegion & region, Utils::MemoryBlock & out, JPEGRegion * actual = 0);
+    /** Copy the last picture decoded by decodeDC in 4:4:4 planes (the chroma planes are upsampled, a grayscale picture has neutral ones)
+        @param planes       The Y, Cb and Cr planes, pointing to the thumbnail's top left pixel
+        @param stride       The planes row size in bytes
+        @param maxWidth     The largest width to copy (the thumbnail is getWidth() wide)
+        @param maxHeight    The largest height to copy
+        @return false if the last picture was not decoded by decodeDC */
+    bool getThumbnail(uint8 * const planes[MaxComponents], const int stride, const int maxWidth, const int maxHeight) const;
+    /** Encode 4:4:4 planes as a JPEG picture, with the preview quality
+        @param planes       The Y, Cb and Cr planes
+        @param stride       The planes row size in bytes
+        @param out          On output, contains the JPEG picture
+        @return An empty string on success, or the error message */
+    String encodePlanes(const uint8 * const planes[MaxComponents], const int stride, const int width, const int height, Utils::MemoryBlock & out);
+    /** Get the luma plane of the last decoded picture (a byte for each block)
+        @param planeWidth   On output, the plane width in blocks (it's a whole number of MCU)
+        @param planeHeight  On output, the plane height in blocks */
+    const uint8 * getLuma(int & planeWidth, int & planeHeight) const { planeWidth = components[0].planeWidth; planeHeight = components[0].planeHeight; return components[0].plane.getConstBuffer(); }
+    /** Set the preview quality (1 to 100) */
+    void setQuality(const unsigned quality);
+    /** Get the last preview (or thumbnail) size in pixels */
+    inline int getWidth() const { return outWidth; }
+    inline int getHeight() const { return outHeight; }
+
+    JPEGDownscaler();
+
+    /** A Huffman table, for decoding (canonical codes) and encoding */
+    struct HuffmanTable
+    {
+        /** The number of codes for each length and the symbols */
+        uint8   bits[17], values[256];
+        /** The fast lookup for the codes up to FastBits: the symbol and the code length (0 if longer) */
+        enum { FastBits = 9 };
+        uint8   fastValue[1 << FastBits], fastLength[1 << FastBits];
+        /** The largest code of each length (-1 if none) and the index of the first symbol of each length */
+        int32   maxCode[18], valueOffset[17];
+        /** The code and code length of each symbol, for encoding */
+        uint16  code[256];
+        uint8   length[256];
+
+        /** Build the table from a DHT segment content (after the class and identifier byte)
+            @return The number of bytes used, or 0 if the content is invalid */
+        size_t build(const uint8 * data, const size_t size);
+    };
+
+    // Helpers
+private:
+    /** A picture component (for both the decoding and the encoding) */
+    struct Component
+    {
+        uint8   id, h, v, quantTable, dcTable, acTable;
+        /** The last DC value (the DC coefficients are coded as differences) */
+        int     dcPredictor;
+        /** The component plane, at the downscaled size, and its size in pixels */
+        Utils::MemoryBlock plane;
+        int     planeWidth, planeHeight;
+    };
+
+    /** Parse the picture header and the tables
+        @return The offset of the entropy coded data, or 0 on error (error is set) */
+    size_t parseHeader(const uint8 * data, const size_t size);
+    /** Decode the entropy coded data, in the component planes */
+    bool decodeScan(const uint8 * data, const size_t size, const unsigned blockSize);
+    /** Encode the component planes as the preview picture */
+    bool encode(Utils::MemoryBlock & out);
+    /** Decode the entropy coded data, and code the blocks of the given MCU range again in the cropped picture */
+    bool cropScan(const uint8 * data, const size_t size, const int mcuX, const int mcuY, const int mcusX, const int mcusY, Utils::MemoryBlock & out);
+    /** Fail with the given error */
+    bool fail(const String & message) { error = message; return false; }
+
+    // Members
+private:
+    /** The decoding tables: quantization (in zigzag order), DC and AC Huffman tables */
+    uint16          quant[4][64];
+    HuffmanTable    dc[4], ac[4];
+    /** Set if the last picture had its own Huffman tables (so the standard ones must be restored) */
+    bool            customTables;
+    /** The encoding tables: quantization (in zigzag order), and the standard Huffman tables */
+    uint8           encQuant[2][64];
+    HuffmanTable    encDC[2], encAC[2];
+    /** The picture components */
+    Component       components[MaxComponents];
+    int             componentCount;
+    /** The picture size in pixels, the maximum sampling factors and the restart interval in MCU */
+    int             width, height, maxH, maxV, restartInterval;
+    /** The downscaled block size (8 / scale) and the preview size in pixels */
+    unsigned        blockSize;
+    int             outWidth, outHeight;
+    /** The last error */
+    String          error;
+};
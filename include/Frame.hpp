@@ -0,0 +1,208 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need threading code here
+#include "Threading/Threads.hpp"
+// We need Utils::MemoryBlock here
+#include "Utils/MemoryBlock.hpp"
+// We need containers too
+#include "Container/Container.hpp"
+// We need the Huffman tables insertion
+#include "JPEG.hpp"
+
+struct FramePool;
+
+/** A captured JPEG frame.
+    The frame is shared by all the consumers that need it (the frame is reference counted).
+    When the last reference is released, it goes back to its pool, so its buffer is reused for a later frame */
+struct Frame
+{
+    /** The JPEG picture */
+    Utils::MemoryBlock          data;
+    /** The frame sequence number (incremented for each published frame) */
+    uint32                      sequence;
+    /** The time the frame was published, in seconds */
+    double                      time;
+    /** The time elapsed between the driver's capture and the publishing, in seconds (0 if unknown) */
+    double                      captureAge;
+    /** The multipart header to send before the picture in a stream (boundary, type, length and timestamp) */
+    char                        header[128];
+    /** The header size in bytes */
+    uint32                      headerSize;
+    /** The offset the standard Huffman tables are inserted at when sending the picture, 0 if the picture is sent as is */
+    uint32                      tablesOffset;
+    /** Set if the frame can be decoded alone (all the JPEG pictures, only the IDR access units of a H.264 stream) */
+    bool                        keyFrame;
+    /** Set if the frame repeats the previous picture (while the device is switched to the full resolution), it's told in its multipart header */
+    bool                        repeated;
+    /** Set if the picture is identical to the previous frame's (see JPEGInfo::fingerprint) */
+    bool                        duplicate;
+    /** The sequence number and the time of the first frame with this picture (the frame's own ones, unless it's a duplicate or repeated frame),
+        so a client polling the same picture is told it did not change */
+    uint32                      origin;
+    double                      originTime;
+
+    /** Format the multipart header for the current picture, this must be called once the picture and the time are set */
+    void prepareHeader();
+    /** Get the multipart header */
+    inline const char * getHeader() const { return header; }
+    /** Get the multipart header size in bytes */
+    inline size_t getHeaderSize() const { return headerSize; }
+
+    /** Get the picture data */
+    inline const uint8 * getData() const { return data.getConstBuffer(); }
+    /** Get the picture size in bytes, as sent (with the inserted Huffman tables, if any) */
+    inline size_t getSize() const { return data.getSize() + (tablesOffset ? (size_t)JPEGInfo::StandardHuffmanTablesSize : 0); }
+    /** Gather the buffers to send the remaining part of the picture (see JPEGInfo::gather)
+        @return The number of buffers filled (up to 3) */
+    inline int getBuffers(const size_t from, const char ** buffers, int * sizes) const { return JPEGInfo::gather(data.getConstBuffer(), data.getSize(), tablesOffset, from, buffers, sizes); }
+
+    /** Take a reference on this frame */
+    inline void acquire() { ++refCount; }
+    /** Release a reference on this frame, the frame is recycled when it's not used anymore */
+    void release();
+
+    // Members
+private:
+    /** The pool this frame belongs to */
+    FramePool &                 pool;
+    /** The number of references on this frame */
+    Threading::Atomic<uint32>   refCount;
+    /** The buffer size accounted by the pool, in bytes (the buffer might have grown since) */
+    uint32                      pooledSize;
+
+    friend struct FramePool;
+    Frame(FramePool & pool) : sequence(0), time(0), captureAge(0), headerSize(0), tablesOffset(0), keyFrame(true), repeated(false), duplicate(false), origin(0), originTime(0), pool(pool), refCount(0), pooledSize(0) { header[0] = 0; }
+};
+
+/** A reference on a frame.
+    This behaves like a smart pointer, the frame is released when the reference is destructed */
+struct FrameRef
+{
+    /** Set the referenced frame */
+    FrameRef & operator = (const FrameRef & other) { if (other.frame) other.frame->acquire(); if (frame) frame->release(); frame = other.frame; return *this; }
+    /** Release the referenced frame */
+    void reset() { if (frame) frame->release(); frame = 0; }
+
+    inline Frame * operator ->() const { return frame; }
+    inline Frame & operator *() const { return *frame; }
+    inline operator bool() const { return frame != 0; }
+    inline bool operator == (const FrameRef & other) const { return frame == other.frame; }
+
+    FrameRef(Frame * frame = 0) : frame(frame) { if (frame) frame->acquire(); }
+    FrameRef(const FrameRef & other) : frame(other.frame) { if (frame) frame->acquire(); }
+    ~FrameRef() { reset(); }
+
+private:
+    Frame * frame;
+};
+
+/** The pool of frames.
+    Frames are allocated on demand, and recycled once released so, after the first frames, there is no allocation for a new frame.
+    The buffers are allocated by size classes (a quarter of a power of 2), so a recycled frame rarely has to grow for a larger picture,
+    and the pool can be limited, so the frames kept by the slow clients and the history can't exhaust the memory.
+    The pool must outlive all the frames references */
+struct FramePool
+{
+    /** Get a free frame.
+        @param size     The expected picture size in bytes, the frame's buffer is allocated for it (but its size is not set)
+        @return A reference on an unused frame (with its previous content) or an empty reference if the pool reached its limit or on allocation failure */
+    FrameRef get(const size_t size = 0);
+    /** Set the memory limit of the frames buffers, 0 for no limit (the pool never shrinks, only new buffers are refused) */
+    void setLimit(const size_t bytes) { Threading::ScopedLock scope(lock); limit = bytes; }
+    /** Allocate the given number of frames with a buffer for the given picture size, so the first frames don't allocate
+        @return false if the frames can't be allocated (or exceed the limit) */
+    bool reserve(const size_t count, const size_t size);
+    /** Check if the pool is near its limit (it's using more than 7/8 of it), so the history should stop growing */
+    bool isNearLimit() const { Threading::ScopedLock scope(lock); return limit && bytes > limit - limit / 8; }
+    /** Get the size of the frames buffers, their high water mark, and the number of refused frames */
+    size_t getBytes() const { Threading::ScopedLock scope(lock); return bytes; }
+    size_t getPeakBytes() const { Threading::ScopedLock scope(lock); return peakBytes; }
+    uint32 getRejected() const { return rejected.read(); }
+    /** Get the number of frames allocated, and the number of them in use (referenced by the clients, the history or the outputs) */
+    void getCounts(size_t & allocated, size_t & used) const { Threading::ScopedLock scope(lock); allocated = frames.getSize(); used = allocated - freeFrames.getSize(); }
+
+    /** Get the buffer size class for the given size (a quarter of a power of 2, 16kB at least), so it wastes less than 25% */
+    static size_t getSizeClass(const size_t size);
+
+    FramePool() : bytes(0), peakBytes(0), limit(0), rejected(0) {}
+    ~FramePool();
+
+    // Helpers
+private:
+    /** Called by a frame when it's not referenced anymore */
+    void recycle(Frame * frame);
+    /** Account the frame's buffer growth since it was last accounted (the lock must be taken) */
+    void account(Frame * frame);
+    /** Grow the frame's buffer to the given size class if it's allowed (the lock must be taken) */
+    bool grow(Frame * frame, const size_t size);
+    friend struct Frame;
+
+    // Members
+private:
+    /** The lock protecting the lists and the sizes below */
+    mutable Threading::FastLock                         lock;
+    /** The size of the frames buffers, and its high water mark, in bytes */
+    size_t                                              bytes, peakBytes;
+    /** The memory limit of the frames buffers, 0 for no limit */
+    size_t                                              limit;
+    /** The number of frames refused because of the limit */
+    Threading::Atomic<uint32>                           rejected;
+    /** All the frames ever allocated (owned) */
+    Container::NotConstructible<Frame>::IndexList       frames;
+    /** The frames that are currently unused */
+    Container::PlainOldData<Frame *>::Array             freeFrames;
+};
+
+/** The recent frames history, for the pre-event bursts.
+    The frames are kept by reference, so the history does not copy them (they are only recycled later).
+    The oldest frames are released once the history spans more than its duration or uses more than its size */
+struct FrameHistory
+{
+    /** Set the history limits
+        @param seconds  The maximum time between the oldest and the newest frames, 0 to disable the history
+        @param bytes    The maximum size of the pictures in the history, in bytes */
+    void setLimits(const double seconds, const size_t bytes) { Threading::ScopedLock scope(lock); duration = seconds; maxBytes = bytes; trim(); }
+    /** Check if the history is enabled */
+    bool isEnabled() const { return duration > 0; }
+    /** Add a frame to the history
+        @param noGrowth  If true, the oldest frame is released for this one, so the history does not grow (when the frames pool is near its limit) */
+    void append(const FrameRef & frame, const bool noGrowth = false);
+    /** Release the oldest frame (the newest is always kept)
+        @return true if a frame was released */
+    bool dropOldest() { Threading::ScopedLock scope(lock); if (count < 2) return false; release(); return true; }
+    /** Get the frames in the history, from the oldest to the newest
+        @param frames   On output, filled with the frames references (allocated with new[], the caller must delete[] it)
+        @return The number of frames */
+    size_t getFrames(FrameRef *& frames) const;
+    /** Get the number of frames in the history, and their pictures size in bytes (they are in the frames pool) */
+    void getUsage(size_t & frames, size_t & size) const { Threading::ScopedLock scope(lock); frames = count; size = bytes; }
+
+    FrameHistory() : ring(0), capacity(0), head(0), count(0), bytes(0), duration(0), maxBytes(0) {}
+    ~FrameHistory() { delete[] ring; }
+
+    // Helpers
+private:
+    /** Release the oldest frames until the history is within its limits (the lock must be taken) */
+    void trim();
+    /** Release the oldest frame (the lock must be taken) */
+    void release();
+    /** Get the frame at the given position from the oldest one */
+    inline FrameRef & at(const size_t pos) const { return ring[(head + pos) % capacity]; }
+
+    // Members
+private:
+    /** The lock protecting the ring, since the frames are added by the capture thread */
+    mutable Threading::FastLock lock;
+    /** The frames ring (it grows when it's full), the oldest frame position and the number of frames */
+    FrameRef *  ring;
+    size_t      capacity, head, count;
+    /** The pictures size in bytes */
+    size_t      bytes;
+    /** The limits */
+    double      duration;
+    size_t      maxBytes;
+};
@@ -0,0 +1,41 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need basic types here
+#include "Types.hpp"
+
+/** The H.264 access units helpers.
+    The devices with an onboard encoder give an access unit per buffer, as an Annex B byte stream: each NAL unit is prefixed with a start code
+    (00 00 01 or 00 00 00 01). Only the NAL units headers are read here, the slices are never parsed */
+struct H264Info
+{
+    /** The NAL unit types used here */
+    enum NALType {
+        Slice   = 1,
+        IDR     = 5,
+        SEI     = 6,
+        SPS     = 7,
+        PPS     = 8,
+        AUD     = 9,
+    };
+
+    /** Get a NAL unit's type from its header byte */
+    static inline uint8 getType(const uint8 * nal) { return nal[0] & 0x1F; }
+    /** Check if the access unit starts with a start code (a truncated or stale buffer usually does not) */
+    static inline bool hasStartCode(const uint8 * data, const size_t size) { return size > 4 && !data[0] && !data[1] && (data[2] == 1 || (!data[2] && data[3] == 1)); }
+    /** Find the next NAL unit of an access unit
+        @param pos      On input, the offset to search from, on output the offset after the NAL unit
+        @param nal      On output, points to the NAL unit (after its start code)
+        @param nalSize  On output, the NAL unit size in bytes (without the trailing zero bytes)
+        @return false if there is no more NAL unit */
+    static bool nextNAL(const uint8 * data, const size_t size, size_t & pos, const uint8 * & nal, size_t & nalSize);
+    /** Check if the access unit is a key frame (it has an IDR slice, so it can be decoded without the previous ones) */
+    static bool isKeyFrame(const uint8 * data, const size_t size);
+    /** Get the picture size from a sequence parameter set (the cropped size, as displayed)
+        @param nal      The SPS NAL unit (with its header)
+        @return false if the SPS can't be parsed */
+    static bool parseSPS(const uint8 * nal, const size_t size, int & width, int & height);
+};
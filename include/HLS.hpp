@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need the fragmented MP4 layout
+#include "MP4.hpp"
+// We need strings too
+#include "Strings/Strings.hpp"
+// We need threading code here
+#include "Threading/Threads.hpp"
+
+typedef Strings::FastString String;
+
+/** An HTTP Live Streaming segmenter, cutting the stream in short fragmented MP4 segments kept in memory.
+    The segments and their playlist are plain files for an HTTP cache: a segment never changes once listed (its name is unique, even
+    across restarts), so a CDN can serve all the remote viewers from a single fetch per segment.
+
+    A segment starts on a key frame (any JPEG picture, or an H.264 IDR access unit) and is cut on the first key frame after the target
+    duration. The H.264 access units are passed through (as length prefixed NAL units, the parameter sets move to the init segment), the JPEG
+    pictures are stored as is (with the standard Huffman tables inserted, if they have none).
+    When the pictures size or the parameter sets change, a new init segment is made and the window is restarted with a discontinuity.
+    The window keeps a few more segments than the playlist lists, for the viewers (or caches) that fetch the playlist just before it's updated */
+struct HLSSegmenter
+{
+    /** Some constants */
+    enum Constants {
+        /** The segments kept after they are removed from the playlist */
+        ExtraSegments   = 2,
+        /** The longest frame duration in Timescale units, a longer pause in the capture is not in the timeline */
+        MaxFrameTicks   = FMP4Muxer::Timescale,
+    };
+
+    /** Start segmenting
+        @param h264         Set if the pictures are H.264 access units, else they are JPEG pictures
+        @param segmentMs    The target segment duration in milliseconds
+        @param segments     The number of segments in the playlist */
+    void open(const bool h264, const unsigned segmentMs, const unsigned segments);
+    /** Stop segmenting and free the segments */
+    void close();
+    /** Check if the segmenter is opened */
+    inline bool isOpened() const { return target != 0; }
+    /** Add a picture (called by the capture thread only)
+        @param time         The capture time in seconds
+        @param keyFrame     Set if the picture can be decoded alone
+        @return false if the picture could not be added */
+    bool pictureReceived(const uint8 * data, const size_t size, const double time, const bool keyFrame);
+    /** Get the playlist
+        @param query        Appended to the segments URI (like "?token=secret"), or empty
+        @return false if there is no segment yet */
+    bool getPlaylist(String & playlist, const String & query) const;
+    /** Get the playlist's target duration in seconds (the longest segment, rounded) */
+    unsigned getTargetDuration() const { Threading::ScopedLock scope(lock); return targetDuration; }
+    /** Get a copy of the init segment or a media segment, from its name in the playlist
+        @param size     On output, the file size in bytes
+        @return A buffer allocated with new[] (for a Stream::MemoryBlockStream to own), or 0 if there is no such file (anymore) */
+    uint8 * getFile(const String & name, size_t & size) const;
+    /** Get the memory used by the window of segments and the init segment, in bytes (the pending segment is not counted)
+        @param segments     On output, the number of segments in the window */
+    size_t getBytes(unsigned & segments) const;
+
+    HLSSegmenter() : h264(false), target(0), segments(0), capacity(0), run(0), ring(0), first(0), count(0), sequence(0), generation(0), discontinuities(0), targetDuration(0),
+                     startTime(0), lastTick(0), decodeTime(0), width(0), height(0), pendingDuration(0), discontinuity(false) {}
+    ~HLSSegmenter() { close(); }
+
+    // Helpers
+private:
+    /** Store the pending samples as the next segment of the window */
+    void finishSegment();
+    /** Check the picture's format, a new init segment is made if it changed
+        @return false if the picture can't be used (not parsable, or an H.264 access unit without the parameter sets yet) */
+    bool checkFormat(const uint8 * data, const size_t size, const bool keyFrame);
+    /** Append the picture to the pending sample data */
+    void appendSample(const uint8 * data, const size_t size, const bool keyFrame);
+
+    // Members
+private:
+    /** A segment of the window */
+    struct Segment
+    {
+        /** The complete file (the fragment header, then the samples) */
+        Utils::MemoryBlock  data;
+        /** The media sequence number, the init segment generation and the duration in Timescale units */
+        uint32              sequence, generation, duration;
+        /** Set if the segment starts after a discontinuity (a format change), and the number of discontinuities up to this segment */
+        bool                discontinuity;
+        uint32              discontinuitySequence;
+
+        Segment() : sequence(0), generation(0), duration(0), discontinuity(false), discontinuitySequence(0) {}
+    };
+
+    /** The parameters: the codec, the target duration in Timescale units, the playlist length, and the window size */
+    bool                h264;
+    uint32              target;
+    unsigned            segments, capacity;
+    /** The run identifier (the start time), in the files names so they are unique */
+    uint32              run;
+    /** The lock protecting the window and the init segment */
+    mutable Threading::FastLock lock;
+    /** The window of segments, in a ring, with the oldest one's index and the number of segments */
+    Segment *           ring;
+    unsigned            first, count;
+    /** The last media sequence number, the current init segment generation and the number of discontinuities */
+    uint32              sequence, generation, discontinuities;
+    /** The current target duration of the playlist in seconds */
+    unsigned            targetDuration;
+    /** The init segment */
+    Utils::MemoryBlock  init;
+
+    // The capture thread's state
+    /** The first picture time, the last picture tick (in Timescale units from the first picture) and the pending segment's decode time */
+    double              startTime;
+    uint64              lastTick, decodeTime;
+    /** The current format: the pictures size, and the H.264 parameter sets */
+    int                 width, height;
+    Utils::MemoryBlock  sps, pps;
+    /** The pending segment's samples and their data */
+    Container::PlainOldData<FMP4Muxer::Sample>::Array samples;
+    Utils::MemoryBlock  pending, header;
+    uint32              pendingDuration;
+    /** Set if the pending segment starts after a format change */
+    bool                discontinuity;
+};
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need basic types here
+#include "Types.hpp"
+
+/** The information found in a JPEG picture's header.
+    Only the markers segments up to the start of scan are walked (using their length), the entropy coded data is not read */
+struct JPEGInfo
+{
+    /** The JPEG markers used here */
+    enum Marker {
+        SOF0    = 0xC0,
+        DHT     = 0xC4,
+        JPG     = 0xC8,
+        DAC     = 0xCC,
+        RST0    = 0xD0,
+        RST7    = 0xD7,
+        SOI     = 0xD8,
+        EOI     = 0xD9,
+        SOS     = 0xDA,
+        DQT     = 0xDB,
+        DRI     = 0xDD,
+        TEM     = 0x01,
+    };
+    /** The size of the picture's end searched for the end of image marker (some devices pad the pictures) */
+    enum { EndOfImageWindow = 64 };
+    /** The size of the standard Huffman tables segment, in bytes (with its marker) */
+    enum { StandardHuffmanTablesSize = 420 };
+    /** The number of runs of bytes hashed for a picture's fingerprint, and their size */
+    enum { FingerprintRuns = 64, FingerprintRunSize = 16 };
+    /** The DHT segment with the standard Huffman tables (ITU T.81 annex K.3), that MJPEG pictures without tables are decoded with */
+    static const uint8 standardHuffmanTables[StandardHuffmanTablesSize];
+
+    /** The picture size in pixels */
+    int     width, height;
+    /** Set if the picture contains Huffman tables (a DHT segment), most MJPEG cameras omit them and rely on the standard ones */
+    bool    hasHuffmanTables;
+    /** The offset of the start of scan marker in the picture */
+    size_t  scanOffset;
+
+    /** Parse the header of the given picture
+        @return false if it's not a JPEG picture or if its header is truncated */
+    bool parse(const uint8 * data, const size_t size);
+
+    /** Check if the picture starts with the start of image marker */
+    static inline bool hasStartOfImage(const uint8 * data, const size_t size) { return size >= 2 && data[0] == 0xFF && data[1] == SOI; }
+    /** Check if the picture ends with the end of image marker (a truncated picture does not), in the last EndOfImageWindow bytes (after the zero padding, if any) */
+    static inline bool hasEndOfImage(const uint8 * data, const size_t size) { return findEndOfImage(data, size) != size; }
+    /** Find the end of image marker in the last EndOfImageWindow bytes (after the zero padding, if any)
+        @return The offset of the marker's 0xFF byte, or size if there is none */
+    static size_t findEndOfImage(const uint8 * data, const size_t size);
+    /** Check if the picture is complete, that's starting and ending with the expected markers (the picture content is not checked) */
+    static inline bool isComplete(const uint8 * data, const size_t size) { return hasStartOfImage(data, size) && hasEndOfImage(data, size); }
+    /** Find the next marker from the given offset (the 0xFF bytes followed by 0x00, in the entropy coded data, are not markers).
+        The 0xFF bytes are searched with memchr, that the C library vectorizes (SSE2/AVX2, NEON)
+        @return The offset of the marker's 0xFF byte, or size if there is none */
+    static size_t findMarker(const uint8 * data, const size_t size, size_t from);
+    /** Get the offset to insert the standard Huffman tables at, if the picture has no tables
+        @return The start of scan offset, or 0 if the tables must not be inserted (the picture has some or is not parsable) */
+    static size_t getHuffmanTablesOffset(const uint8 * data, const size_t size);
+    /** Get a cheap fingerprint of the picture, to find the pictures identical to the previous one: its size (without the padding) and a hash
+        of FingerprintRuns runs of bytes spread over the picture. A change in the scene changes the entropy coded data from there to its end
+        (the codes are not aligned anymore), so it's very unlikely to be missed, while only a few hundred bytes are read */
+    static uint64 fingerprint(const uint8 * data, const size_t size);
+    /** Gather the buffers to send a picture with the standard Huffman tables inserted, without copying it.
+        @param tablesOffset The offset to insert the tables at, or 0 to send the picture as is
+        @param from         The number of bytes already sent
+        @param buffers      On output, filled with the remaining buffers to send (up to 3: the prefix, the tables and the rest)
+        @param sizes        On output, filled with the buffers sizes in bytes
+        @return The number of buffers filled */
+    static int gather(const uint8 * data, const size_t size, const size_t tablesOffset, const size_t from, const char ** buffers, int * sizes);
+
+    JPEGInfo() : width(0), height(0), hasHuffmanTables(false), scanOffset(0) {}
+};
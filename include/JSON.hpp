@@ -8,8 +8,9 @@
 
 #include "Strings/Strings.hpp"
 
+// The configuration files are parsed at once, so they are not limited to 32kB like with the 16 bits default
 #ifndef IndexType
-  #define IndexType int16
+  #define IndexType int32
 #endif
 
 #pragma pack(push, 1)
@@ -59,11 +60,10 @@
     remembering the container's ID. Try to accumulate as much data as possible before calling partialParsing,
     since this rewriting is computation expensive, so avoid to do that for each byte received.
  
-    The default implementation limits input JSON size to signed 16 bits (32768 bytes), and less than 4095 embedded
-    objects/arrays.
-    If you intend to parse more than that, you'll need to define IndexType to a larger **signed** type.
-    The Token's size is, by default, 8 bytes long. Using signed 32 bits int for the IndexType will double it's size.
-    The parser memory size is 10 bytes by default. It requires less than a hundred bytes of stack space.
+    A 16 bits IndexType limits input JSON size to signed 16 bits (32768 bytes), and less than 4095 embedded
+    objects/arrays, so this server defines it to a signed 32 bits type by default.
+    The Token's size is 8 bytes long with a 16 bits IndexType. Using signed 32 bits int for the IndexType doubles it's size.
+    The parser memory size is 10 bytes with a 16 bits IndexType. It requires less than a hundred bytes of stack space.
  
     Because I got the question, you can not write a JSON stream with any parser and even more with this one.
     Writing small JSON is trivial, but it's not the subject of this class.
@@ -3,6 +3,8 @@
 
 #pragma once
 
+#include <stddef.h>
+
 /** The log level for message output */
 enum LogLevel
 {
@@ -24,3 +26,13 @@ int log(LogLevel level, const char * format, ...)
 __attribute__ ((format (printf, 2, 3)))
 #endif
 ;
+
+/** Write the log messages from a background thread.
+    The messages are then formatted in a lock-free ring and written later, so logging never blocks the calling thread (they are dropped if the ring is full).
+    Call this once the process is daemonized, since the thread would not survive the fork
+    @return false if the thread can't be started (the messages are still written synchronously) */
+bool startAsyncLog();
+/** Write the pending messages, stop the background thread and go back to synchronous logging */
+void stopAsyncLog();
+/** Get the memory used by the logging (the messages ring and the rate limiter, they are allocated once), in bytes */
+size_t getLogMemory();
@@ -16,7 +16,35 @@
 
 // We need V4L2 code here 
 #include "V4L2Source.hpp"
+// We need shared frames too
+#include "Frame.hpp"
+// We need latency statistics too
+#include "Stats.hpp"
+// We need the timelapse recorder too
+#include "Recorder.hpp"
+// We need the shared memory output
+#include "SharedOutput.hpp"
+// We need the RTSP server
+#include "RTSP.hpp"
+// We need the H.264 key frames detection
+#include "H264.hpp"
+// We need the HLS segmenter
+#include "HLS.hpp"
+// We need the AVI container for the timelapse files
+#include "AVI.hpp"
+// We need WebSocket framing too
+#include "WebSocket.hpp"
+// We need TLS termination
+#include "TLS.hpp"
 
+#include <sys/inotify.h>
+#include <poll.h>
+
+
+#ifndef MSG_ZEROCOPY
+  // Older C library headers don't declare it, but the kernel might support it
+  #define MSG_ZEROCOPY 0x4000000
+#endif
 
 // Let's inject the string class we are using
 typedef Strings::FastString String;
@@ -36,16 +64,286 @@ struct Configuration
     unsigned int    stabPicCount;
     unsigned int    maxFPS;
     unsigned int    closeDevTimeoutSec;
+    unsigned int    standbyTimeoutSec;
+    /** The time without any captured frame while the capture is needed before the watchdog restarts it, in seconds (0 to disable) */
+    unsigned int    watchdogTimeoutSec;
+    unsigned int    firstFrameMaxAgeSec;
     String          securityToken;           
+    unsigned int    bufferCount;
+    unsigned int    highResBufferCount;
+    unsigned int    zeroCopyMinSize;
+    unsigned int    fullResCacheMs;
+    String          highResDevice;
+    bool            fastSwitch;
+    unsigned int    switchTimeoutMs;
+    bool            repeatOnSwitch;
+    unsigned int    minSwitchIntervalMs;
+    unsigned int    httpClientsPerThread;
+    /** The number of HTTP server loops, each one in its own thread with its own listening socket (global only) */
+    unsigned int    httpReactors;
+    String          fakeSource;
+    /** A capture trace replayed by the fake source: the recorded frames intervals and drops, and the full resolution captures durations */
+    String          fakeTrace;
+    /** The file recording the device's capture trace (the frames timings and status, and the full resolution captures durations) */
+    String          captureTrace;
+    String          remoteSource;
+    String          remoteFullRes;
+    bool            insertHuffmanTables;
+    unsigned int    previewScale;
+    /** The stream's codec, "mjpeg" or "h264" (from the device's encoder, only served over RTSP and HLS, the full resolution pictures are still JPEG) */
+    String          streamCodec;
+    String          recordDir;
+    unsigned int    recordIntervalSec;
+    bool            recordFullRes;
+    unsigned int    recordSegmentMB;
+    unsigned int    recordSegments;
+    unsigned int    preEventSeconds;
+    unsigned int    preEventBytes;
+    bool            preEventFullRes;
+    unsigned int    frameMemoryMB;
+    String          sharedMemory;
+    unsigned int    sharedMemorySlots;
+    String          multicastGroup;
+    unsigned int    multicastTTL;
+    /** The HLS segments target duration in milliseconds (0 to disable the segmenter) and the number of segments in the playlist */
+    unsigned int    hlsSegmentMs;
+    unsigned int    hlsSegments;
+    unsigned int    activityThreshold;
+    unsigned int    activityHoldSec;
+    unsigned int    activityIntervalMs;
+    unsigned int    idleFPS;
+    /** The interval the stream clients still get a frame identical to the previous one at, in seconds (0 to send all the frames) */
+    unsigned int    duplicateKeepAliveSec;
+    bool            adaptiveFPS;
+    unsigned int    lowResQuality;
+    unsigned int    highResQuality;
+    bool            adaptiveQuality;
+    String          controls;
+    String          stillControls;
+    /** The file caching the enumerated device formats (global only) */
+    String          formatsCacheFile;
+    /** The TLS certificate chain and private key files (global only) */
+    String          tlsCertificate;
+    String          tlsKey;
+    /** The maximum number of streams and the bandwidth in kbit/s for each client address (global only) */
+    unsigned int    maxStreamsPerAddress;
+    unsigned int    maxKbpsPerAddress;
+    /** The uplink bandwidth shared by all the picture streams in kbit/s, and the streams classes weights, like "operator=8&dashboard=2" (global only) */
+    unsigned int    uplinkKbps;
+    String          streamClasses;
+    /** The send buffer size and the maximum unsent size of the stream sockets in bytes, 0 for the kernel's default */
+    unsigned int    streamSendBuffer;
+    unsigned int    streamNotSentLowAt;
+    /** The sockets readiness backend of the HTTP server and fan-out threads, "epoll" or "io_uring" (global only) */
+    String          eventLoop;
+    /** The number of threads sending the frames to the stream clients, each one serving a share of the clients */
+    unsigned int    senderThreads;
+    /** The capture thread scheduling, "fifo:priority" or "rr:priority" for a real time policy, and the CPUs it runs on, like "2" or "0-1,3" */
+    String          captureScheduling;
+    String          captureCPUs;
+    /** The same for the threads sending the pictures (the fan-out threads, and the HTTP server threads for the global configuration) */
+    String          senderScheduling;
+    String          senderCPUs;
+    /** Lock the process memory, so the frames are never paged out (global only) */
+    bool            lockMemory;
+    String          unixSocket;
+    /** The RTSP server port, 0 to disable it (global only) */
+    unsigned int    rtspPort;
+    /** The minimum time between two mosaic pictures, in seconds (global only) */
+    unsigned int    mosaicIntervalSec;
+    /** Time the hot paths with the profiling probes, for the /debug/profile route (global only, this needs the WantTimedProfiling build option) */
+    bool            profiling;
+    /** Log a summary of the memory use every given seconds, 0 to disable it (global only) */
+    unsigned int    memoryReportSec;
+    /** The camera name, used in its routes (only for the cameras declared in the "cameras" array) */
+    String          name;
+    /** The keys set by the configuration file, as "key=value" lines, to find the changed keys when it's reloaded */
+    String          setKeys;
+
+    /** The cameras declared in the configuration */
+    typedef Container::NotConstructible<Configuration>::IndexList Cameras;
       
-    Configuration() : port(8080), device("/dev/video0"), daemonize(false), monitorDev(false), lowResWidth(640), lowResHeight(480), highResWidth(0), highResHeight(0), stabPicCount(0), maxFPS(0), closeDevTimeoutSec(0), securityToken("") {}
+    Configuration() : port(8080), device("/dev/video0"), daemonize(false), monitorDev(false), lowResWidth(640), lowResHeight(480), highResWidth(0), highResHeight(0), stabPicCount(0), maxFPS(0), closeDevTimeoutSec(0), standbyTimeoutSec(0), watchdogTimeoutSec(0), firstFrameMaxAgeSec(0), securityToken(""), bufferCount(V4L2Thread::DefaultBuffersCount), highResBufferCount(0), zeroCopyMinSize(0), fullResCacheMs(0), highResDevice(""), fastSwitch(false), switchTimeoutMs(V4L2Thread::DefaultSwitchTimeoutMs), repeatOnSwitch(true), minSwitchIntervalMs(0), httpClientsPerThread(0), httpReactors(1), fakeSource(""), fakeTrace(""), captureTrace(""), remoteSource(""), remoteFullRes(""), insertHuffmanTables(false), previewScale(0), streamCodec("mjpeg"), recordDir(""), recordIntervalSec(60), recordFullRes(false), recordSegmentMB(64), recordSegments(16), preEventSeconds(0), preEventBytes(16 * 1024 * 1024), preEventFullRes(false), frameMemoryMB(0), sharedMemory(""), sharedMemorySlots(4), multicastGroup(""), multicastTTL(1), hlsSegmentMs(0), hlsSegments(6), activityThreshold(0), activityHoldSec(30), activityIntervalMs(500), idleFPS(0), duplicateKeepAliveSec(0), adaptiveFPS(false), lowResQuality(0), highResQuality(0), adaptiveQuality(false), controls(""), stillControls(""), formatsCacheFile(""), tlsCertificate(""), tlsKey(""), maxStreamsPerAddress(0), maxKbpsPerAddress(0), uplinkKbps(0), streamClasses(""), streamSendBuffer(0), streamNotSentLowAt(0), eventLoop("epoll"), senderThreads(1), captureScheduling(""), captureCPUs(""), senderScheduling(""), senderCPUs(""), lockMemory(false), unixSocket(""), rtspPort(0), mosaicIntervalSec(5), profiling(false), memoryReportSec(0), name(""), setKeys("") {}
 
-    String fromJSON(const String & path);
+    /** Load the configuration file.
+        @param path     The path to the JSON configuration file
+        @param cameras  On output, contains the cameras declared in the "cameras" array, each one starting from the global configuration
+        @return An empty string on success, or the error message */
+    String fromJSON(const String & path, Cameras & cameras);
+    /** Get the keys whose value differs in the other configuration (a key that's set in only one of them is changed too)
+        @return A comma separated list of the changed keys, empty if none */
+    String getChangedKeys(const Configuration & other) const;
 };
 
 extern Configuration config;
 
-struct MJPGServer : public V4L2Thread::PictureSink
+/** Create an empty sockets pool using the eventLoop backend (an epoll pool if io_uring is not supported by the kernel) */
+Network::Socket::MonitoringPool * createSocketPool(const bool own = false);
+/** Set the calling thread's scheduling policy (like "fifo:50", empty or "other" to keep it) and the CPUs it runs on (like "0-1,3", empty for any)
+    @return An error message, or an empty string on success */
+String setThreadScheduling(const String & scheduling, const String & cpus);
+/** Apply the global sender scheduling to the calling HTTP server thread */
+void senderThreadStarted();
+/** Make the entity tag of a picture from its sequence number (with the server's start time, so a tag from a previous run never matches)
+    @param kind     Tells the kinds of pictures apart, like "f" for the full resolution pictures */
+String makeETag(const uint32 sequence, const char * kind = "");
+/** Format a time in seconds since the epoch as an HTTP date, like "Sun, 06 Nov 1994 08:49:37 GMT" */
+String formatHTTPDate(const double time);
+/** Get the validators and the caching headers of a picture answer (each header ends with a line break)
+    @param maxAge   The time the answer can be cached for in seconds, or 0 if it must be validated each time */
+String getCacheHeaders(const String & etag, const double modified, const int maxAge);
+/** Check if the client already has the picture with the given entity tag (from its If-None-Match header).
+    If it does, the answer is set to 304 Not Modified, with the same headers as getCacheHeaders, so it's sent without any body */
+bool isNotModified(Network::Server::URLRouting::Comm & comm, const String & etag, const double modified, const int maxAge);
+
+/** The streams limits of each client address, shared by all the cameras.
+    A new stream from an address already having maxStreamsPerAddress streams is refused, and the maxKbpsPerAddress bandwidth is shared
+    equally by the address' picture streams (each one is decimated to its share, like with its own maxKbps parameter) */
+struct AddressLimits
+{
+    /** The streams of an address */
+    struct Usage
+    {
+        /** The number of streams, and the number of them sending pictures (the events streams don't use any bandwidth) */
+        Threading::Atomic<uint32> streams, pictureStreams;
+    };
+    typedef Container::HashTable<Usage, String, Container::HashKey<String>, Container::DeletionWithDelete<Usage> > UsageMap;
+
+    /** Count a new stream from the given address
+        @param pictures Set if the stream sends pictures (it shares the address' bandwidth)
+        @return The address' usage (to give back to release), or 0 if the address has too many streams already */
+    Usage * acquire(const String & address, const bool pictures)
+    {
+        Threading::ScopedLock scope(lock);
+        Usage * usage = usages.getValue(address);
+        if (usage && config.maxStreamsPerAddress && usage->streams.read() >= config.maxStreamsPerAddress) return 0;
+        if (!usage && !usages.storeValue(address, usage = new Usage)) return 0;
+        ++usage->streams;
+        if (pictures) ++usage->pictureStreams;
+        return usage;
+    }
+    /** Forget a stream from the given address (the usage is deleted with the last one) */
+    void release(const String & address, Usage * usage, const bool pictures)
+    {
+        Threading::ScopedLock scope(lock);
+        if (pictures) --usage->pictureStreams;
+        if (!--usage->streams) usages.removeValue(address);
+    }
+    /** Get the bandwidth share of a picture stream from the given address' usage, in kbit/s (0 for unlimited) */
+    static uint32 getShareKbps(const Usage * usage)
+    {
+        if (!usage || !config.maxKbpsPerAddress) return 0;
+        return max(config.maxKbpsPerAddress / max(usage->pictureStreams.read(), (uint32)1), (uint32)1);
+    }
+
+    // Members
+private:
+    Threading::FastLock lock;
+    UsageMap            usages;
+};
+extern AddressLimits addressLimits;
+
+/** The sharing of the uplink bandwidth (uplinkKbps) between the picture streams of all the cameras, by weight.
+    Each stream reports the bandwidth it would use (its demand), and the uplink is shared by weighted max-min fairness: the streams needing less
+    than their weighted share get what they need, and the rest is shared by the other streams, in proportion of their weights.
+    Each stream is then decimated to its share, so the lower weight streams drop frames first when the uplink is saturated */
+struct UplinkScheduler
+{
+    /** A picture stream */
+    struct Stream
+    {
+        /** The stream's weight (from its class) */
+        uint32  weight;
+        /** The bandwidth the stream would use without the uplink limit, in kbit/s */
+        double  demand;
+        /** The stream's share of the uplink in kbit/s, updated when the shares are computed */
+        Threading::Atomic<uint32> share;
+
+        Stream(const uint32 weight = 1) : weight(weight), demand(0), share(0) {}
+    };
+
+    /** The minimum interval between two computations of the shares, in seconds */
+    enum { ShareIntervalMs = 500 };
+
+    /** Add a stream to share the uplink with
+        @return The stream to give back to remove, or 0 if the uplink is not limited */
+    Stream * add(const uint32 weight)
+    {
+        if (!config.uplinkKbps) return 0;
+        Stream * stream = new Stream(max(weight, (uint32)1));
+        // Until the shares are computed, assume the stream gets an equal part
+        Threading::ScopedLock scope(lock);
+        streams.Append(stream);
+        stream->share = max(config.uplinkKbps / (uint32)streams.getSize(), (uint32)1);
+        return stream;
+    }
+    /** Remove a stream, and delete it */
+    void remove(Stream * stream)
+    {
+        Threading::ScopedLock scope(lock);
+        for (size_t i = 0; i < streams.getSize(); i++) if (streams[i] == stream) { streams.Remove(i); break; }
+        delete stream;
+        lastTime = 0;
+        if (!streams.getSize()) loadPercent.save(0);
+    }
+    /** Report the bandwidth a stream would use, the shares are computed again if they are old enough */
+    void report(Stream * stream, const double demand, const double now)
+    {
+        Threading::ScopedLock scope(lock);
+        stream->demand = demand;
+        if (now - lastTime < ShareIntervalMs / 1000.0) return;
+        lastTime = now;
+        computeShares();
+    }
+    /** Get the given stream's share in kbit/s (0 for unlimited) */
+    static uint32 getShareKbps(const Stream * stream) { return stream ? stream->share.read() : 0; }
+    /** Get the streams total demand in percent of the uplink, when the shares were last computed (above 100 when it's congested, 0 if not limited) */
+    uint32 getLoadPercent() const { return loadPercent.read(); }
+
+    UplinkScheduler() : lastTime(0), loadPercent(0) {}
+
+    // Helpers
+private:
+    /** Share the uplink, by serving the streams from the lowest demand per weight unit (the lock must be taken) */
+    void computeShares()
+    {
+        size_t count = streams.getSize();
+        Container::PlainOldData<size_t>::Array order;
+        double weights = 0;
+        for (size_t i = 0; i < count; i++) { order.Append(i); weights += streams[i]->weight; }
+        // There are only a few streams, so a insertion sort is enough
+        for (size_t i = 1; i < count; i++)
+            for (size_t j = i; j && streams[order[j]]->demand * streams[order[j - 1]]->weight < streams[order[j - 1]]->demand * streams[order[j]]->weight; j--)
+            { size_t t = order[j]; order[j] = order[j - 1]; order[j - 1] = t; }
+
+        double left = config.uplinkKbps, demand = 0;
+        for (size_t i = 0; i < count; i++) demand += streams[i]->demand;
+        loadPercent.save((uint32)min(demand * 100 / config.uplinkKbps, 100000.0));
+        for (size_t i = 0; i < count; i++)
+        {
+            Stream * stream = streams[order[i]];
+            // A stream needing less than its part gets its whole part (so it's not limited if its demand grows a bit), but only uses its demand
+            double part = left * stream->weight / weights;
+            stream->share = max((uint32)part, (uint32)1);
+            left -= min(part, stream->demand);
+            weights -= stream->weight;
+        }
+    }
+
+    // Members
+private:
+    Threading::FastLock lock;
+    Container::PlainOldData<Stream*>::Array streams;
+    /** The last time the shares were computed */
+    double              lastTime;
+    /** The demand in percent of the uplink, when the shares were last computed */
+    Threading::Atomic<uint32> loadPercent;
+};
+extern UplinkScheduler uplinkScheduler;
+
+/** A camera served by the server.
+    Each camera has its own capture, fan-out and full resolution threads, and its own configuration */
+struct Camera : public V4L2Thread::PictureSink, public RTSPSource
 {
     typedef Network::Socket::BaseSocket Socket;
 
@@ -53,233 +351,3130 @@ struct MJPGServer : public V4L2Thread::PictureSink
     {
         Socket * clientSocket;
         String  address;
-        int     throttle;
-
-        void throttleClient() 
-        {
-            const int SkipPictureCount = 2;
-            if (throttle < 0) log(Info, "Throttling client %s", (const char*)address);
-            throttle = SkipPictureCount;
-        }
-
-        bool pictureReceived(const uint8 * data, const size_t length) {
-            if (!clientSocket) return false;
-            // If the socket is not able to keep up with the bandwidth, just skip the picture.
-            if (throttle > 0) {
-                // Is the socket ready to receive more data ?
-                throttle--; // Let's skip the immediate next picture anyway to let network buffer's recover the stream
-                if (!throttle) throttle = !clientSocket->select(false, true, 0);
-            }
-            if (throttle > 0) return true;
-
-            // Need to send a multipart boundary here
-            String boundary = String::Print("\r\n--boundary\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n", length);
-            
-            int sent = clientSocket->send((const char*)boundary, boundary.getLength(), 0);
-            if (sent != boundary.getLength()) { 
-                if (sent <= 0) { 
-                    // Client disconnected
-                    log(Info, "Client %s disconnected (boundary): %d", (const char*)address, sent);
-                    delete0(clientSocket);
-                    return false;
+        /** The frame being sent to this client (shared with the other clients) */
+        FrameRef frame;
+        /** The newest frame received while the current frame was in flight, it's sent next (any older pending frame is dropped) */
+        FrameRef pending;
+        /** The number of bytes of the frame's header and picture already sent */
+        size_t  sent;
+        /** Set while the client is dropping pictures (used to avoid flooding the logs) */
+        bool    throttled;
+        /** Set while the socket is in the fan-out writability pool */
+        bool    monitored;
+        /** The minimum interval between two frames sent to this client in seconds (from the fps parameter), 0 for all frames */
+        double  minInterval;
+        /** The maximum bandwidth for this client in kbit/s (from the maxKbps parameter), 0 for unlimited */
+        uint32  maxKbps;
+        /** The region of the pictures sent to this client (from the crop parameter), not set for the whole pictures */
+        JPEGRegion region;
+        /** The time the next frame should be sent to this client, when decimating */
+        double  nextTime;
+        /** The sequence number of the last frame given to this client, and its time */
+        uint32  lastSequence;
+        double  lastTime;
+        /** Set if this client only wants a single picture (the socket is closed once it's sent) */
+        bool    snapshot;
+        /** Set while sending the first frame to a stream client (it's not a live frame) */
+        bool    cached;
+        /** The HTTP header of the snapshot answer (a stream client uses the frame's multipart header instead) */
+        String  header;
+        /** The camera's latency statistics, recorded when sending to a stream client (not owned) */
+        FrameLatency * latency;
+        /** The client identifier in its camera (to tell apart the clients from the same address) */
+        uint32  id;
+        /** The number of bytes sent to this client, and the number of frames it did not get because it was backed up */
+        uint64  bytesSent, framesDropped;
+        /** Set if this client gets the pictures as WebSocket binary messages (instead of a multipart stream) */
+        bool    webSocket;
+        /** Set once a WebSocket client closed the connection or broke the protocol */
+        bool    ended;
+        /** The WebSocket frame header of the current frame (and the camera index, when multiplexed) */
+        uint8   wsHeader[WebSocket::MaxHeaderSize + 1];
+        size_t  wsHeaderSize;
+        /** The number of pictures a WebSocket client can get before acknowledging them (from the window parameter), and the number left */
+        uint32  window, credits;
+        /** The WebSocket client's messages */
+        WebSocket::Reader reader;
+        /** A camera multiplexed on a WebSocket client's connection */
+        struct Channel
+        {
+            Camera * camera;
+            /** The sequence number of the last frame sent from this camera, and the number of its pictures the client can get before acknowledging them */
+            uint32   lastSequence, credits;
+
+            Channel(Camera * camera = 0, const uint32 credits = 0) : camera(camera), lastSequence(0), credits(credits) {}
+        };
+        /** The cameras multiplexed on this WebSocket client, each picture is sent after its camera's index (empty for a single camera client) */
+        Container::PlainOldData<Channel>::Array channels;
+        /** The channel of the current frame, and the next one to check (the cameras are served in turn) */
+        uint32  channel, nextChannel;
+        /** Set if this client only gets the frames metadata, as Server-Sent Events (no picture is sent) */
+        bool    eventStream;
+        /** The events not sent yet, from the given offset */
+        String  events;
+        size_t  eventsSent;
+        /** The capture time of the last full resolution picture this client was told about */
+        double  fullResTime;
+        /** The streams of this client's address (0 for a snapshot, or if the address has too many streams) */
+        AddressLimits::Usage * usage;
+        /** The weight of this client when sharing the uplink, and its part of the uplink (0 if it's not limited) */
+        uint32  weight;
+        UplinkScheduler::Stream * uplink;
+        /** The last time this client reported its bandwidth demand to the uplink scheduler */
+        double  reportTime;
+
+        /** The maximum age of a frame to be sent as a snapshot, in seconds */
+        enum { MaxSnapshotAge = 1 };
+        /** Check if the given frame should be sent to this client
+            @param idleInterval The minimum interval between two frames while the camera is idle, in seconds (0 if it's active)
+            @param maxFirstAge  The maximum age of the first frame sent to a stream client, in seconds (0 for any age)
+            @param keepAlive    The interval a stream client gets a duplicate frame at, in seconds (0 to send them all) */
+        inline bool wants(const FrameRef & next, const double now, const double idleInterval = 0, const double maxFirstAge = 0, const double keepAlive = 0) const
+        {
+            if (next->sequence == lastSequence || !isDue(now, idleInterval) || (snapshot && frame) || (webSocket && !credits)) return false;
+            // The client already has this picture
+            if (next->duplicate && lastSequence && keepAlive && next->time - lastTime < keepAlive) return false;
+            // Don't answer a snapshot with an old picture from a previous capture session
+            if (snapshot) return now - next->time < MaxSnapshotAge;
+            // A new stream client gets the last frame right away, unless it's too old
+            return lastSequence || !maxFirstAge || now - next->time <= maxFirstAge;
+        }
+
+        /** Get the minimum interval between two frames for this client (the snapshots are never decimated) */
+        inline double getInterval(const double idleInterval) const { return snapshot ? minInterval : max(minInterval, idleInterval); }
+        /** Check if this client wants a new frame now (it's decimated to its own frame rate and bandwidth) */
+        inline bool isDue(const double now, const double idleInterval = 0) const { return !nextTime || now + getInterval(idleInterval) / 4 >= nextTime; }
+        /** Compute the time the next frame can be sent, after accepting a frame of the given size */
+        void scheduleNext(const double now, const size_t size, const double idleInterval = 0)
+        {
+            double minimum = getInterval(idleInterval);
+            uint32 kbps = getMaxKbps();
+            if (!minimum && !kbps) return;
+            // Allow some jitter with the frame rate (like the capture), else a frame arriving slightly early would halve the frame rate
+            double interval = max(minimum, kbps ? (size * 8.0) / (kbps * 1000.0) : 0.0);
+            nextTime = !nextTime || now - nextTime > interval ? now + interval : nextTime + interval;
+        }
+
+        /** Get the bandwidth limit of this client in kbit/s, its own one or its share of its address' one (0 for unlimited) */
+        inline uint32 getMaxKbps() const
+        {
+            uint32 share = eventStream ? 0 : AddressLimits::getShareKbps(usage), uplinkShare = UplinkScheduler::getShareKbps(uplink);
+            if (uplinkShare && (!share || uplinkShare < share)) share = uplinkShare;
+            return !share ? maxKbps : !maxKbps ? share : min(maxKbps, share);
+        }
+        /** Tell the uplink scheduler the bandwidth this client would use without the uplink limit
+            @param streamKbps   The camera's stream bandwidth in kbit/s
+            @param frameSize    The size of the offered frame in bytes */
+        void reportDemand(const double now, const double streamKbps, const size_t frameSize, const double idleInterval)
+        {
+            if (!uplink || now - reportTime < UplinkScheduler::ShareIntervalMs / 1000.0) return;
+            reportTime = now;
+            double demand = streamKbps, interval = getInterval(idleInterval);
+            if (interval) demand = min(demand, frameSize * 8.0 / 1000.0 / interval);
+            uint32 share = AddressLimits::getShareKbps(usage);
+            if (maxKbps) demand = min(demand, (double)maxKbps);
+            if (share) demand = min(demand, (double)share);
+            uplinkScheduler.report(uplink, demand, now);
+        }
+        /** Check if this client was refused because its address has too many streams */
+        inline bool isRefused() const { return !snapshot && !usage; }
+
+        /** Check if the current frame (or the events) is not completely sent yet */
+        inline bool isBackedUp() const { return eventStream ? eventsSent < (size_t)events.getLength() : (bool)frame; }
+
+        /** The maximum size of the events waiting to be sent to a client, the next events are dropped until they are sent */
+        enum { MaxEventBacklog = 16384 };
+        /** Queue an event and send as much as possible without blocking
+            @return false if the client disconnected */
+        bool queueEvent(const String & event)
+        {
+            if (!clientSocket || ended) return false;
+            if (events.getLength() - eventsSent > MaxEventBacklog)
+            {
+                if (!throttled) log(Info, "Dropping events for client %s", (const char*)address);
+                throttled = true;
+                framesDropped++;
+                return flush();
+            }
+            throttled = false;
+            if (eventsSent) { events = events.midString((int)eventsSent, events.getLength()); eventsSent = 0; }
+            events += event;
+            return flush();
+        }
+        /** Tell an event client about a new frame */
+        bool eventReceived(const FrameRef & next, const String & event)
+        {
+            lastSequence = next->sequence;
+            lastTime = next->time;
+            return queueEvent(event);
+        }
+
+        /** The maximum number of frames waiting for a zero copy completion */
+        enum { MaxZeroCopyInFlight = 8 };
+        /** Set if the socket accepted the zero copy option */
+        bool     zeroCopy;
+        /** The frames that were sent with zero copy, and the last send call using them (the kernel still reads them) */
+        FrameRef zeroCopyFrames[MaxZeroCopyInFlight];
+        uint32   zeroCopyCalls[MaxZeroCopyInFlight];
+        /** The first used entry and the number of used entries in the arrays above */
+        uint32   zeroCopyHead, zeroCopyCount;
+        /** The number of the next zero copy send call */
+        uint32   zeroCopyNextCall;
+
+        /** Release the frames the kernel is done with */
+        void reapZeroCopy()
+        {
+            uint32 first = 0, last = 0;
+            while (zeroCopyCount && clientSocket->getZeroCopyCompletion(first, last))
+            {   // Completions are reported in order for a stream socket
+                while (zeroCopyCount && (int32)(zeroCopyCalls[zeroCopyHead] - last) <= 0)
+                {
+                    zeroCopyFrames[zeroCopyHead].reset();
+                    zeroCopyHead = (zeroCopyHead + 1) % MaxZeroCopyInFlight;
+                    zeroCopyCount--;
                 }
-                throttleClient();
-                // Retry, while waiting here
-                sent = clientSocket->sendReliably((const char*)boundary + sent, boundary.getLength() - sent);
-                if (sent <= 0) {
-                    // Client disconnected or can't accept more data, let's drop it
-                    log(Info, "Client %s disconnected (boundary): %d", (const char*)address, sent);
-                    delete0(clientSocket);
+            }
+        }
+        /** Remember the current frame is used by the last zero copy send call */
+        void holdForZeroCopy()
+        {
+            uint32 call = zeroCopyNextCall++;
+            uint32 tail = (zeroCopyHead + zeroCopyCount + MaxZeroCopyInFlight - 1) % MaxZeroCopyInFlight;
+            if (zeroCopyCount && zeroCopyFrames[tail] == frame) { zeroCopyCalls[tail] = call; return; }
+            tail = (zeroCopyHead + zeroCopyCount) % MaxZeroCopyInFlight;
+            zeroCopyFrames[tail] = frame;
+            zeroCopyCalls[tail] = call;
+            zeroCopyCount++;
+        }
+
+        /** Send as much of the current frame as the socket accepts, without blocking.
+            The multipart header and the picture are sent in a single gathered write.
+            @return false if the client disconnected */
+        bool flush()
+        {
+            if (!clientSocket || ended) return false;
+            if (eventStream) return flushEvents();
+            if (zeroCopy) reapZeroCopy();
+            while (frame)
+            {
+                const char * head = snapshot ? (const char*)header : webSocket ? (const char*)wsHeader : frame->getHeader();
+                size_t headerSize = snapshot ? (size_t)header.getLength() : webSocket ? wsHeaderSize : frame->getHeaderSize();
+                const char * buffers[4]; int sizes[4]; int count = 0;
+                if (sent < headerSize) { buffers[count] = head + sent; sizes[count++] = (int)(headerSize - sent); }
+                size_t dataSent = sent < headerSize ? 0 : sent - headerSize;
+                // The picture might be split to insert the Huffman tables
+                count += frame->getBuffers(dataSent, buffers + count, sizes + count);
+
+                // The header belongs to the frame, so it stays valid as long as the frame is referenced
+                bool useZeroCopy = zeroCopy && (headerSize + frame->getSize() - sent) >= config.zeroCopyMinSize && zeroCopyCount < MaxZeroCopyInFlight;
+                int ret = clientSocket->sendBuffers(buffers, sizes, count, useZeroCopy ? MSG_ZEROCOPY : 0);
+                if (ret <= 0)
+                {
+                    if (ret < 0 && clientSocket->getLastError() == Socket::InProgress) return true; // Would block, retry later
+                    // The socket is deleted with this object, once it's removed from the monitoring pool
+                    log(Info, "Client %s disconnected: %d", (const char*)address, ret);
                     return false;
                 }
+                if (useZeroCopy) holdForZeroCopy();
+                // A snapshot or a stream's first frame might be sent with an older picture, so only the live frames are measured
+                double now = latency && !snapshot && !cached ? Time::getPreciseTime() : 0;
+                if (now && !sent) latency->firstByte.record(now - frame->time);
+                sent += (size_t)ret;
+                bytesSent += (uint64)ret;
+                if (sent == headerSize + frame->getSize())
+                {   // A snapshot is done once its picture is sent, so close the socket now
+                    if (snapshot) { frame.reset(); return false; }
+                    if (now)
+                    {
+                        latency->lastByte.record(now - frame->time);
+                        log(Debug, "Frame %u sent to client %s: captured %.2fms before publishing, last byte sent %.2fms after", frame->sequence, (const char*)address, frame->captureAge * 1000, (now - frame->time) * 1000);
+                    }
+                    // Done with this frame, release it so it can be recycled, and start with the newest one if any
+                    frame = pending;
+                    pending.reset();
+                    sent = 0;
+                    cached = false;
+                    startFrame();
+                }
             }
+            return true;
+        }
 
-            // Then send the picture itself
-            sent = clientSocket->sendReliably((const char*)data, length);
-            if (sent != length) {
-                // Bad luck here, the socket is struck
-                if (sent >= 0 || clientSocket->getLastError() == Socket::InProgress) throttleClient(); // Timeout, let's skip the next picture again
-                else {
-                    // Client disconnected or can't accept more data, let's drop it
-                    log(Info, "Client %s disconnected (data): %d", (const char*)address, sent);
-                    delete0(clientSocket);
+        /** Send as much of the queued events as the socket accepts, without blocking
+            @return false if the client disconnected */
+        bool flushEvents()
+        {
+            while (eventsSent < (size_t)events.getLength())
+            {
+                const char * buffer = (const char*)events + eventsSent; int size = (int)(events.getLength() - eventsSent);
+                int ret = clientSocket->sendBuffers(&buffer, &size, 1, 0);
+                if (ret <= 0)
+                {
+                    if (ret < 0 && clientSocket->getLastError() == Socket::InProgress) return true;
+                    log(Info, "Client %s disconnected: %d", (const char*)address, ret);
                     return false;
                 }
+                eventsSent += (size_t)ret;
+                bytesSent += (uint64)ret;
             }
+            events = ""; eventsSent = 0;
             return true;
         }
 
-        ClientSocket(Socket * socket) : clientSocket(socket), address(socket->getPeerName() ? (const char*)socket->getPeerName()->asText(): ""), throttle(-1) {}
-        ~ClientSocket() { delete0(clientSocket); }
-    };
+        bool pictureReceived(const FrameRef & next) {
+            if (!clientSocket || ended) return false;
+            // The first frame is the last published one, it might be from before the client came
+            bool first = !lastSequence;
+            lastSequence = next->sequence;
+            lastTime = next->time;
+            if (frame) {
+                // The socket is not able to keep up with the bandwidth, so only keep the newest frame for when the current one is sent
+                if (pending) {
+                    if (!throttled) log(Info, "Dropping frames for client %s", (const char*)address);
+                    throttled = true;
+                    framesDropped++;
+                }
+                pending = next;
+                return flush();
+            }
+            throttled = false;
 
-    V4L2Thread v4l2Thread;
-    
+            // The frame's multipart header is sent first, then the picture itself
+            frame = next;
+            sent = 0;
+            cached = first;
+            startFrame();
+            if (snapshot) header = String::Print("HTTP/1.1 200 OK\r\n%sContent-Type: image/jpeg\r\nContent-Length: %u\r\nConnection: close\r\n\r\n",
+                                                 (const char*)getCacheHeaders(makeETag(frame->origin), frame->originTime, MaxSnapshotAge), (uint32)frame->getSize());
+            return flush();
+        }
 
-    // The lock protecting the client list
-    Threading::FastLock         lock;
-    // The list of clients to send JPEG stream to
-    Container::NotConstructible<ClientSocket>::IndexList clients;
+        /** Prepare sending the new current frame (a WebSocket client uses a credit for it) */
+        void startFrame()
+        {
+            if (!webSocket || !frame) return;
+            bool multiplexed = channels.getSize() > 0;
+            wsHeaderSize = WebSocket::makeHeader(wsHeader, WebSocket::Binary, frame->getSize() + (multiplexed ? 1 : 0));
+            if (!multiplexed) { if (credits) credits--; return; }
+            wsHeader[wsHeaderSize++] = (uint8)channel;
+            if (channels[channel].credits) channels[channel].credits--;
+        }
 
-    bool FilterAccess(Network::Server::URLRouting::Comm & comm, bool needSource = true)
-    {
-        if (comm.method != "GET") return comm.sendError("Bad method", Protocol::HTTP::BadMethod) != 0;
-        if (config.securityToken) 
+        /** Acknowledge a picture from a WebSocket client's data message.
+            A multiplexing client acknowledges a camera's picture with the camera's index, in text */
+        void acknowledge(const uint8 * payload, const size_t length)
         {
-            String * token = comm.headers.getValue("token");
-            if (!token || *token != config.securityToken) return comm.sendError("Unauthorized", Protocol::HTTP::Unauthorized) != 0;
+            if (!channels.getSize()) { if (credits < window) credits++; return; }
+            uint32 index = 0; size_t i = 0;
+            for (; i < length && i < 3 && payload[i] >= '0' && payload[i] <= '9'; i++) index = index * 10 + (payload[i] - '0');
+            if (i && index < channels.getSize() && channels[index].credits < window) channels[index].credits++;
         }
 
-        if (needSource && config.closeDevTimeoutSec > 0 && !v4l2Thread.isOpened()) 
+        /** Read the messages sent by a WebSocket client, without blocking.
+            Any data message acknowledges a picture, a ping is answered and a close request ends the connection.
+            The control answers are only sent between two pictures, since they can't be inserted in a picture's message
+            @return false if the client disconnected or must be disconnected */
+        bool receiveMessages()
         {
-            log(Info, "Starting V4L2 device");
-            String ret = startV4L2Device();
-            if (ret) 
-            { 
-                log(Error, (const char*)ret); 
-                return comm.sendError("Internal server error", Protocol::HTTP::InternalServerError) != 0; 
+            if (!clientSocket || ended) return false;
+            while (true)
+            {
+                size_t space = 0;
+                uint8 * buffer = reader.getFreeSpace(space);
+                int ret = space ? clientSocket->receive((char*)buffer, (int)space, MSG_DONTWAIT) : 0;
+                if (ret < 0 && clientSocket->getLastError() == Socket::InProgress) return true;
+                if (ret > 0) reader.received((size_t)ret);
+
+                WebSocket::Opcode opcode; const uint8 * payload = 0; size_t length = 0;
+                int got = 0;
+                while ((got = reader.next(opcode, payload, length)) == 1)
+                {
+                    if (opcode == WebSocket::Close)
+                    {
+                        static const char closeFrame[2] = { (char)0x88, 0 };
+                        if (!frame) clientSocket->send(closeFrame, sizeof(closeFrame), MSG_DONTWAIT);
+                        log(Info, "WebSocket client %s closed the connection", (const char*)address);
+                        ended = true;
+                        return false;
+                    }
+                    if (opcode == WebSocket::Ping && !frame)
+                    {
+                        uint8 head[WebSocket::MaxHeaderSize];
+                        const char * buffers[2] = { (const char*)head, (const char*)payload }; int sizes[2] = { (int)WebSocket::makeHeader(head, WebSocket::Pong, length), (int)length };
+                        clientSocket->sendBuffers(buffers, sizes, length ? 2 : 1, MSG_DONTWAIT);
+                    }
+                    else if (opcode < WebSocket::Close) acknowledge(payload, length);
+                }
+                if (got < 0) { log(Info, "WebSocket protocol error from client %s", (const char*)address); ended = true; return false; }
+                // The peer closed the socket (a full buffer can't happen since the complete messages are consumed)
+                if (ret <= 0) { ended = true; return false; }
             }
-            return heartbeat();
         }
-        return true;
-    }
 
+        ClientSocket(Socket * socket, const double fps = 0, const uint32 maxKbps = 0, const bool snapshot = false, const uint32 window = 0, const bool eventStream = false) : clientSocket(socket), address(socket->getPeerName() ? (const char*)socket->getPeerName()->asText(): ""), sent(0), throttled(false), monitored(false),
+            minInterval(fps > 0 ? 1.0 / fps : 0), maxKbps(maxKbps), nextTime(0), lastSequence(0), lastTime(0), snapshot(snapshot), cached(false), latency(0), id(0), bytesSent(0), framesDropped(0),
+            webSocket(window > 0), ended(false), wsHeaderSize(0), window(window), credits(window), channel(0), nextChannel(0), eventStream(eventStream), eventsSent(0), fullResTime(0),
+            usage(snapshot ? 0 : addressLimits.acquire(address, !eventStream)), weight(1), uplink(0), reportTime(0),
+            // The snapshot socket is closed as soon as it's sent, so don't let the kernel read the buffers after that
+            // The WebSocket header is not in the frame but in this object, and it's rewritten for the next frame
+            zeroCopy(!snapshot && !window && !eventStream && config.zeroCopyMinSize && socket->setOption(Socket::ZeroCopy, 1)), zeroCopyHead(0), zeroCopyCount(0), zeroCopyNextCall(0)
+        {
+            // The end of a picture must not wait for the previous segments to be acknowledged
+            socket->setOption(Socket::NoDelay, 1);
+            if (config.streamSendBuffer) socket->setOption(Socket::SendBufferSize, (int)config.streamSendBuffer);
+            // The socket is only writable again once the kernel has little left to send, so the next picture is picked as late as possible
+            if (config.streamNotSentLowAt && !socket->setOption(Socket::NotSentLowAt, (int)config.streamNotSentLowAt)) log(Warning, "Can't limit the unsent data for client %s", (const char*)address);
+        }
+        /** Get the number of bytes queued in the kernel for this client and not sent yet (0 if unknown) */
+        uint32 getUnsentSize() const { int size = 0; return clientSocket && clientSocket->getOption(Socket::UnsentSize, size) ? (uint32)size : 0; }
+        ~ClientSocket() { if (uplink) uplinkScheduler.remove(uplink); if (usage) addressLimits.release(address, usage, !eventStream); delete0(clientSocket); }
+    };
 
-    Stream::InputStream * App(Network::Server::URLRouting::Comm & comm)
+    /** The fan-out stage.
+        The V4L2 thread only publishes the last frame, and this thread sends it to all clients without blocking,
+        so the capture rate does not depend on the slowest client anymore.
+        The thread waits on a socket pair (to be woken up when a frame is published) and on the writability of the backed up clients.
+        With senderThreads, each thread owns a share of the camera's clients, and sends the same published frame in parallel with the others */
+    struct FanOut : public Threading::Thread
     {
-        if (!FilterAccess(comm, false)) return 0;
-        String tokenURL = config.securityToken ? "?token=" + config.securityToken : String();
-        String baseURL = routing.getBaseURL();
+        /** A socket built from an existing descriptor */
+        struct PairSocket : public Network::Socket::BerkeleySocket
+        {
+            PairSocket(const int fd) : Network::Socket::BerkeleySocket(fd, Stream, Opened) {}
+        };
 
-        comm.returnText = String::Print("<!doctype html>"
-        "<html><body>"
-        "<h1>MJPEG Streamer</h1>"
-        "<div>URL list for this server:</div>"
-        "<ul><li><strong>Small resolution (%dx%d) mjpeg stream: </strong>%s/mjpg%s</li>"
-        "<li><strong>Full resolution (%dx%d) picture: </strong>%s/full_res%s</li></ul>"
-        "<h2>Demo below</h2>"
-        "<div><img src='/mjpg%s'></div>"
-        "<div><button id='capt'>Full resolution</button></div>"
-        "<div><img id='fr'></div>"
-        "<script>var button = document.querySelector('#capt'), pic = document.querySelector('#fr');"
-        "button.addEventListener('click', function(e) { e.preventDefault(); pic.src = '/full_res?time='+(new Date()).getTime()+'&%s'; });</script>"
-        "</body></html>", 
-            v4l2Thread.getLowResWidth(), v4l2Thread.getLowResHeight(), (const char*)baseURL, (const char*)tokenURL, 
-            v4l2Thread.getHighResWidth(), v4l2Thread.getHighResHeight(), (const char*)baseURL, (const char*)tokenURL, 
-            (const char*)tokenURL, (const char*)tokenURL + 1);
+        Camera & camera;
+        /** The wake up socket pair: the capture thread writes to the second one, this thread reads from the first one */
+        PairSocket * wakeUp[2];
+        /** The pool containing the read side of the wake up socket pair */
+        Network::Socket::MonitoringPool * wakeUpPool;
+        /** The pool of the backed up clients sockets, waiting for writability (not owned) */
+        Network::Socket::MonitoringPool * backedUpPool;
+        /** The clients added by the HTTP threads or handed over by another fan-out thread, waiting for this thread to take them (the queue is lock-free) */
+        Threading::MultipleProducerSingleConsumerQueue<ClientSocket> newClients;
+        /** The clients this thread sends to (only modified by this thread, the other readers take the camera's clients lock) */
+        Container::NotConstructible<ClientSocket>::IndexList clients;
+        /** The number of clients given to this thread, including the queued ones */
+        Threading::Atomic<uint32> load;
+        /** The average time spent serving the clients after a frame is published, in microseconds */
+        Threading::Atomic<uint32> passTime;
+        /** The thread index in the camera (the first one runs the frame rate governor) */
+        uint32 index;
+        /** The cropper for the clients asking for a region, and the last cropped frame and its region (shared by the clients cropping the same region) */
+        JPEGDownscaler cropper;
+        FrameRef cropped;
+        JPEGRegion croppedRegion;
 
-        return 0;
-    }
+        /** Wake up the thread, this is called from any thread */
+        void wake() { if (wakeUp[1]) wakeUp[1]->send("", 1, 0); }
+        /** Consume all pending wake up */
+        void drain() { char buf[64]; while (wakeUp[0]->receive(buf, sizeof(buf), 0) > 0) {} }
 
+        /** Create the socket pair (if not done yet) */
+        bool init()
+        {
+            if (wakeUp[0]) return true;
+            int fds[2];
+            if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds) != 0) return false;
+            wakeUp[0] = new PairSocket(fds[0]); wakeUp[1] = new PairSocket(fds[1]);
+            return wakeUpPool->appendSocket(wakeUp[0]);
+        }
 
+        uint32 runThread() { return camera.fanOutLoop(*this); }
+        FanOut(Camera & camera, const uint32 index) : Threading::Thread("FanOut"), camera(camera), wakeUpPool(createSocketPool()), backedUpPool(wakeUpPool->createEmpty()), load(0), passTime(0), index(index) { wakeUp[0] = wakeUp[1] = 0; init(); }
+        ~FanOut() { destroyThread(); wakeUpPool->forgetSocket(wakeUp[0]); delete0(wakeUp[0]); delete0(wakeUp[1]); delete0(backedUpPool); delete0(wakeUpPool); }
+    };
 
-    Stream::InputStream * FullResJPEG(Network::Server::URLRouting::Comm & comm)
+    /** The full resolution picture sender.
+        Capturing a full resolution picture takes seconds, so it's done in this thread instead of the HTTP server loop.
+        The requesting sockets are captured, and all requests waiting at the same time are answered with the same capture */
+    struct StillSender : public Threading::Thread
     {
-        if (!FilterAccess(comm)) return 0;
+        Camera & camera;
+        /** Set when a new socket is waiting for a picture */
+        Threading::Event requested;
 
-        // Fetch full resolution image here
-        Utils::MemoryBlock pic;
-        String ret = v4l2Thread.captureFullResPicture(pic);
-        if (ret) return comm.sendError(ret, Protocol::HTTP::InternalServerError);
-
-        heartbeat();
-        comm.addAnswerHeader("Content-Type", "image/jpeg");
-        uint64 bufSize = pic.getSize();
-        return new Stream::MemoryBlockStream(pic.Forget(), bufSize, true); 
-    }
+        uint32 runThread() { return camera.stillLoop(*this); }
+        StillSender(Camera & camera) : Threading::Thread("StillSender"), camera(camera), requested("StillRequested", Threading::Event::AutoReset) {}
+        ~StillSender() { destroyThread(); }
+    };
 
-    Stream::InputStream * MotionJPEG(Network::Server::URLRouting::Comm & comm)
+    /** The timelapse recorder thread, it captures the full resolution pictures to record, or starts the capture for the stream's ones */
+    struct RecordThread : public Threading::Thread
     {
-        if (!FilterAccess(comm)) return 0;
-        // Capture the socket to return the MJPEG stream
-        Socket * clientSocket = const_cast<Socket*>(comm.context.client);
-        if (!clientSocket) return comm.sendError("Bad state", Protocol::HTTP::InternalServerError);
+        Camera & camera;
+        /** Set when a picture is requested on the record route */
+        Threading::Event requested;
 
-        // Need to prepare the multipart stream first before going further
-        String firstData = "HTTP/1.0 200 OK\r\nCache-Control: no-cache\r\nCache-Control: private\r\nContent-Type: multipart/x-mixed-replace;boundary=--boundary\r\n";
-        int sent = clientSocket->sendReliably(firstData, firstData.getLength());
-        if (sent != firstData.getLength()) return comm.sendError("Can't write", Protocol::HTTP::InternalServerError);
+        uint32 runThread() { return camera.recordLoop(*this); }
+        RecordThread(Camera & camera) : Threading::Thread("Recorder"), camera(camera), requested("RecordRequested", Threading::Event::AutoReset) {}
+        ~RecordThread() { destroyThread(); }
+    };
 
-        Threading::ScopedLock scope(lock);
-        size_t clientSize = clients.getSize();
-        clients.Append(new ClientSocket(clientSocket));
-        // If no client previously, let's create the thread to handle them
-        if (!v4l2Thread.isRunning()) v4l2Thread.createThread();
-        comm.statusCode = Protocol::HTTP::CapturedSocket; 
-        return 0;
-    }
+    /** The device watcher, starting the device again as soon as it's plugged back (when monitoring the device).
+        It waits with inotify for the device node to appear in its directory, so the device path is not polled */
+    struct DeviceWatcher : public Threading::Thread
+    {
+        /** The delay before retrying to start a device that's present */
+        enum { RetryMs = 2000 };
 
-    typedef Network::Server::URLRouting URLRouting;
-    URLRouting routing;
-    uint32     lastSeenTime;
+        Camera & camera;
+        /** The inotify descriptor (watching the device's directory) and the descriptor waking up the thread */
+        int inotifyFd, wakeFd;
+        /** The device node name in its directory */
+        String name;
+        /** Set while the directory is watched (it's not anymore if the directory is removed, like /dev/v4l/by-id when the last camera is unplugged) */
+        Threading::Atomic<uint32> watching;
+
+        /** Start watching the given device path, return false if it can't be watched (the device path is then polled) */
+        bool watch(const String & path)
+        {
+            if (inotifyFd != -1) return true;
+            String dir = path.upToLast("/", true);
+            name = path.fromLast("/");
+            if (dir == path) { dir = "."; name = path; }
+            inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (inotifyFd == -1) return false;
+            // The node's permissions might be set after it's created, so it's checked again when its attributes change
+            if (inotify_add_watch(inotifyFd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO) == -1) { log(Warning, "Can't watch %s, polling the device instead", (const char*)dir); close(); return false; }
+            watching.save(1);
+            if (createThread()) return true;
+            close();
+            return false;
+        }
+        /** Check if the device is watched */
+        bool isWatching() const { return watching.read() != 0; }
+        /** Wake up the thread, so it checks the device now (called from any thread) */
+        void wake() { if (wakeFd != -1) eventfd_write(wakeFd, 1); }
+        /** Wait for the device node to appear, or a wake up
+            @return true if the device should be checked */
+        bool wait(const int timeoutMs)
+        {
+            struct pollfd fds[2] = { { inotifyFd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+            if (::poll(fds, 2, timeoutMs) <= 0) return timeoutMs >= 0;
+            bool check = false;
+            if (fds[1].revents & POLLIN) { eventfd_t value; eventfd_read(wakeFd, &value); check = true; }
+            char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t len = 0;
+            while ((len = ::read(inotifyFd, buffer, sizeof(buffer))) > 0)
+            {
+                for (char * ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len)
+                {
+                    const struct inotify_event * event = (const struct inotify_event*)ptr;
+                    if (event->len && name == event->name) check = true;
+                    if (event->mask & IN_IGNORED) watching.save(0);
+                }
+            }
+            return check;
+        }
+        /** Stop the thread and the watch */
+        void stop() { signalShouldStop(); wake(); destroyThread(); close(); }
+        void close() { if (inotifyFd != -1) ::close(inotifyFd); inotifyFd = -1; watching.save(0); }
 
+        uint32 runThread() { return camera.watchLoop(*this); }
+        DeviceWatcher(Camera & camera) : Threading::Thread("DeviceWatcher"), camera(camera), inotifyFd(-1), wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), watching(0) {}
+        ~DeviceWatcher() { stop(); if (wakeFd != -1) ::close(wakeFd); }
+    };
 
-    String startServer()
+    /** The device starter, opening the device and starting the background capture at startup while the server already accepts the clients.
+        Enumerating the formats and allocating the buffers takes seconds with some USB cameras, so the requests needing the device wait for it
+        instead of the server listening only once all the cameras are set up */
+    struct DeviceStarter : public Threading::Thread
     {
-        uint16 port = (uint16)min(config.port, 65535U);
-        if (!routing.registerRoute("full_res",  MakeDel(URLRouting::URLTrigger, MJPGServer, FullResJPEG, *this))) return "Can't register route: full_res";
-        if (!routing.registerRoute("mjpg",      MakeDel(URLRouting::URLTrigger, MJPGServer, MotionJPEG, *this))) return "Can't register route: mjpg";
-        routing.registerDefaultRoute(MakeDel(URLRouting::URLTrigger, MJPGServer, App, *this));
+        /** The longest time a request waits for the device to be started */
+        enum { WaitMs = 30000 };
 
-        if (!routing.startServer(port)) return String::Print("Failed to start server on port: %u", port);
-        String url = routing.getBaseURL();
-        if (config.securityToken) url += "?token=" + config.securityToken;
-        heartbeat();
-        fprintf(stdout, "Server started on: %s\n", (const char*)url);
-        return "";
-    }
-    bool loop() 
+        Camera & camera;
+        /** Set once the device is started (or failed to), it's set while not starting */
+        Threading::Event started;
+        /** The error starting the device, and the error starting the background capture */
+        String deviceError, captureError;
+
+        uint32 runThread() { return camera.startLoop(*this); }
+        DeviceStarter(Camera & camera) : Threading::Thread("DeviceStarter"), camera(camera), started("DeviceStarted", Threading::Event::ManualReset, Threading::Event::InitiallySet) {}
+        ~DeviceStarter() { destroyThread(); }
+    };
+
+    /** A client replaying the recorded pictures */
+    struct ReplayClient
     {
-        time_t currentTime = {};
-        if (config.closeDevTimeoutSec && v4l2Thread.isOpened()) {
-            currentTime = time(NULL);
-            if ((uint32)currentTime > (lastSeenTime + config.closeDevTimeoutSec)) {
-                log(Info, "Closing the device after %us of inactivity", config.closeDevTimeoutSec);
-                String ret = v4l2Thread.stopV4L2Device();
-                if (ret) log(Error, (const char*)ret);
+        /** The replay formats */
+        enum Format {
+            Multipart   = 0,    //!< A MJPEG stream, paced to the replay rate
+            AVIFile     = 1,    //!< A MJPEG AVI file, downloaded as fast as possible
+            Burst       = 2,    //!< A MJPEG stream of the frames history, sent as fast as possible
+        };
+
+        Socket *    socket;
+        Format      format;
+        /** The reading position in the recorder's store */
+        SegmentStore::Cursor cursor;
+        /** The replayed time range, in microseconds since the epoch */
+        uint64      from, to;
+        /** The interval between two pictures sent to this client in seconds (from the fps parameter), and the time the next one is due */
+        double      interval, nextTime;
+        /** Set once the cursor is positioned */
+        bool        started;
+
+        /** The AVI file layout, and the capture time and size of its pictures (found when starting) */
+        AVIMuxer    muxer;
+        unsigned    fps;
+        Container::PlainOldData<uint64>::Array times;
+        Container::PlainOldData<uint32>::Array sizes;
+        /** The burst frames (allocated with new[]) and their number */
+        FrameRef *  frames;
+        size_t      frameCount;
+        /** The number of AVI or burst pictures sent, and the current picture of the cursor, if it's not sent yet */
+        size_t      sentPictures;
+        bool        hasCurrent;
+        uint32      currentSize;
+        uint64      currentTime;
+
+        /** The replay frame rate if not given, and the AVI file's playback rate */
+        enum { DefaultFPS = 10, DefaultFileFPS = 25 };
+
+        /** Send the next picture, from the store's files
+            @return false once the replay is done, or if the client disconnected */
+        bool sendNext(const SegmentStore & store)
+        {
+            if (format == AVIFile) return sendNextAVI(store);
+            if (format == Burst) return sendNextFrame();
+            if (!started)
+            {
+                started = true;
+                if (!cursor.seek(store, from)) return false;
             }
+            uint32 size = 0; uint64 timestamp = 0; int fd = -1;
+            if (!cursor.next(size, timestamp) || timestamp > to || !socket->getOption(Socket::Descriptor, fd)) return false;
+            String header = String::Print("\r\n--boundary\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %.6f\r\n\r\n", size, timestamp / 1000000.0);
+            // The header and the picture are sent in the same packets
+            socket->setOption(Socket::Cork, 1);
+            bool sent = socket->sendReliably(header, header.getLength()) == header.getLength() && cursor.sendTo(fd);
+            socket->setOption(Socket::Cork, 0);
+            return sent;
         }
-        if (!v4l2Thread.isDevicePresent()) {
-            static time_t lastCheckedTime = 0;
-            if (!currentTime) currentTime = time(NULL);
-            if (config.monitorDev && currentTime > (lastCheckedTime + 2) && File::Info(config.device).doesExist()) {
-                log(Info, "Device seems to be present, let's start again");
-                String ret = v4l2Thread.startV4L2Device(config.device, config.lowResWidth, config.lowResHeight, config.highResWidth, config.highResHeight, config.stabPicCount);
-                if (ret) log(Error, (const char*)ret);
+
+        /** End the replay (the client might be gone already) */
+        void finish()
+        {
+            static const char end[] = "\r\n--boundary--\r\n";
+            if (format != AVIFile) socket->sendReliably(end, sizeof(end) - 1);
+            else if (sizes.getSize() && sentPictures == sizes.getSize())
+                socket->sendReliably((const char*)muxer.getIndex().getConstBuffer(), (int)muxer.getIndex().getSize());
+        }
+
+        /** Compute the AVI file layout from the recorded pictures, and send the answer header and the file header */
+        bool startAVI(const SegmentStore & store)
+        {
+            SegmentStore::Cursor scan;
+            JPEGInfo info;
+            uint32 size = 0; uint64 timestamp = 0, space = 0;
+            if (scan.seek(store, from))
+                while (scan.next(size, timestamp) && timestamp <= to && AVIMuxer::canAdd(space, size, sizes.getSize()))
+                {   // The first picture gives the video size, the pictures are not decoded
+                    if (!sizes.getSize()) info.parse(scan.getPicture(), size);
+                    sizes.Append(size);
+                    times.Append(timestamp);
+                    space += AVIMuxer::getPictureSpace(size);
+                }
+            if (!sizes.getSize())
+            {
+                static const char notFound[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 23\r\nConnection: close\r\n\r\nNo picture in the range";
+                socket->sendReliably(notFound, sizeof(notFound) - 1);
+                return false;
             }
-            lastCheckedTime = currentTime;
+            muxer.setPictures(info.width, info.height, fps, sizes);
+            String header = String::Print("HTTP/1.1 200 OK\r\nContent-Type: video/x-msvideo\r\nContent-Length: " PF_LLU "\r\nContent-Disposition: attachment; filename=\"timelapse.avi\"\r\nConnection: close\r\n\r\n", muxer.getFileSize());
+            // If the recording is gone already, the pictures are sent as blank chunks
+            cursor.seek(store, from);
+            return socket->sendReliably(header, header.getLength()) == header.getLength()
+                && socket->sendReliably((const char*)muxer.getHeader().getConstBuffer(), (int)muxer.getHeader().getSize()) == (int)muxer.getHeader().getSize();
+        }
+
+        /** Send the next AVI picture chunk
+            @return false once all the pictures are sent, or if the client disconnected */
+        bool sendNextAVI(const SegmentStore & store)
+        {
+            if (!started) { started = true; return startAVI(store); }
+            if (sentPictures == sizes.getSize()) return false;
+            uint32 size = sizes[sentPictures]; uint64 timestamp = times[sentPictures];
+            // Find the picture again, it might have been recycled since the layout was computed
+            bool found = false;
+            while (hasCurrent || (hasCurrent = cursor.next(currentSize, currentTime)))
+            {
+                if (currentTime < timestamp) { hasCurrent = false; continue; }
+                found = currentTime == timestamp && currentSize == size;
+                break;
+            }
+            if (found) hasCurrent = false;
+
+            int fd = -1;
+            if (!socket->getOption(Socket::Descriptor, fd)) return false;
+            uint8 chunk[AVIMuxer::ChunkHeaderSize];
+            AVIMuxer::getChunkHeader(size, chunk);
+            socket->setOption(Socket::Cork, 1);
+            bool sent = socket->sendReliably((const char*)chunk, sizeof(chunk)) == (int)sizeof(chunk);
+            if (sent && found) sent = cursor.sendTo(fd);
+            // A missing picture is replaced by zeros, since the file size is already sent
+            static const char zeros[4096] = {};
+            for (uint32 left = found ? 0 : size; sent && left; left -= min(left, (uint32)sizeof(zeros))) 
+                sent = socket->sendReliably(zeros, (int)min(left, (uint32)sizeof(zeros))) == (int)min(left, (uint32)sizeof(zeros));
+            if (sent && (size & 1)) sent = socket->sendReliably(zeros, 1) == 1;
+            socket->setOption(Socket::Cork, 0);
+            if (sent) sentPictures++;
+            return sent;
+        }
+
+        /** Send the next burst frame, with its multipart header
+            @return false once all the frames are sent, or if the client disconnected */
+        bool sendNextFrame()
+        {
+            if (sentPictures == frameCount) return false;
+            const Frame & frame = *frames[sentPictures];
+            const char * buffers[4] = { frame.getHeader() }; int sizes[4] = { (int)frame.getHeaderSize() };
+            int count = 1 + frame.getBuffers(0, buffers + 1, sizes + 1);
+            socket->setOption(Socket::Cork, 1);
+            bool sent = true;
+            for (int i = 0; i < count && sent; i++) sent = socket->sendReliably(buffers[i], sizes[i]) == sizes[i];
+            socket->setOption(Socket::Cork, 0);
+            // Release the frame as soon as it's sent
+            frames[sentPictures++].reset();
+            return sent;
         }
-        return routing.loop(); 
+
+        ReplayClient(Socket * socket, const Format format, const uint64 from, const uint64 to, const double fps) 
+            : socket(socket), format(format), from(from), to(to), interval(format == Multipart && fps > 0 ? 1.0 / fps : 0), nextTime(0), started(false), 
+              fps(fps >= 1 ? (unsigned)fps : 1), frames(0), frameCount(0), sentPictures(0), hasCurrent(false), currentSize(0), currentTime(0) {}
+        /** A burst client, sending the given frames (owned) */
+        ReplayClient(Socket * socket, FrameRef * frames, const size_t frameCount) 
+            : socket(socket), format(Burst), from(0), to(0), interval(0), nextTime(0), started(true), 
+              fps(1), frames(frames), frameCount(frameCount), sentPictures(0), hasCurrent(false), currentSize(0), currentTime(0) {}
+        ~ReplayClient() { delete[] frames; delete socket; }
+    };
+
+    /** The replay thread, sending the recorded pictures to the replay clients at their own pace */
+    struct ReplaySender : public Threading::Thread
+    {
+        Camera & camera;
+        /** Set when a new replay client is waiting */
+        Threading::Event requested;
+
+        uint32 runThread() { return camera.replayLoop(*this); }
+        ReplaySender(Camera & camera) : Threading::Thread("ReplaySender"), camera(camera), requested("ReplayRequested", Threading::Event::AutoReset) {}
+        ~ReplaySender() { destroyThread(); }
+    };
+
+    /** A socket captured by a route.
+        The HTTP server still uses the socket when the route returns, so it's only given to the sending threads once the server forgot it */
+    struct PendingSocket
+    {
+        /** The captured socket */
+        Socket *        socket;
+        /** The stream or snapshot client to add to the fan-out list, or 0 for a full resolution picture request */
+        ClientSocket *  client;
+        /** Set if the socket is given back to the server once answered (for the full resolution picture requests on a persistent connection) */
+        bool            keepAlive;
+        /** The replay client to give to the replay thread, if it's a replay request */
+        ReplayClient *  replay;
+        /** Set for a full resolution picture request that must not wait for the minimum switch interval (like a timelapse capture) */
+        bool            highPriority;
+        /** The region of the full resolution picture to answer with, not set for the whole picture */
+        JPEGRegion      region;
+
+        PendingSocket(Socket * socket = 0, ClientSocket * client = 0, const bool keepAlive = false, ReplayClient * replay = 0, const bool highPriority = false, const JPEGRegion & region = JPEGRegion())
+            : socket(socket), client(client), keepAlive(keepAlive), replay(replay), highPriority(highPriority), region(region) {}
+    };
+
+    /** This camera configuration */
+    Configuration               cfg;
+
+    V4L2Thread v4l2Thread;
+    
+    // The pool of frames shared by the clients (must be declared before any frame reference)
+    FramePool                   framePool;
+
+    // The lock protecting the fan-out threads client lists for the other readers (the fan-out threads only take it to add or remove clients, not while sending)
+    Threading::FastLock         clientsLock;
+    // The number of clients, including the queued ones
+    Threading::Atomic<uint32>   clientCount;
+    // The identifier of the next client
+    Threading::Atomic<uint32>   nextClientId;
+    // The bytes sent and the frames dropped for the clients that are gone (protected by the clients lock)
+    uint64                      pastBytesSent, pastFramesDropped;
+    // The stream's bandwidth in kbit/s, its average frame interval in seconds, and the last frame they were measured with (protected by the frame lock)
+    double                      streamKbps, streamInterval, streamTime;
+    uint32                      streamSequence;
+    // The lock serializing the threads creation
+    Threading::FastLock         startLock;
+
+    // The lock protecting the published frame
+    Threading::FastLock         frameLock;
+    // The last frame published by the capture thread
+    FrameRef                    latest;
+    // The sequence number of the last published frame (protected by the frame lock)
+    uint32                      sequence;
+    // The frames repeated while the device was switched to the full resolution
+    Threading::Atomic<uint64>   framesRepeated;
+    // The fingerprint of the last captured picture (only used by the capture thread), and the pictures identical to the previous one
+    uint64                      lastFingerprint;
+    Threading::Atomic<uint64>   framesDuplicate;
+    // The recovery steps taken by the capture watchdog, the stalls it recovered, their total duration and the last one's, in milliseconds
+    Threading::Atomic<uint64>   recoverySteps, recoveries, recoveryMs, lastRecoveryMs;
+    // The quality governor's stream quality (0 until it changes it), and since when the uplink is congested or not (only used by the first fan-out thread)
+    unsigned                    streamQuality;
+    double                      congestedSince, relaxedSince;
+    // The fan-out threads, each one sending the frames to its share of the clients
+    Container::NotConstructible<FanOut>::IndexList fanOuts;
+    // The lock protecting the listeners below
+    Threading::FastLock         listenersLock;
+    // The fan-out threads of the other cameras multiplexing this camera's frames, they are woken up when a frame is published
+    Container::PlainOldData<FanOut*>::Array listeners;
+    // The frames latency statistics
+    FrameLatency                latency;
+    // The recent frames, for the pre-event bursts
+    FrameHistory                history;
+    // The activity detector
+    ActivityDetector            activity;
+
+    // The lock protecting the still waiting list
+    Threading::FastLock         stillLock;
+    // The sockets waiting for a full resolution picture (owned)
+    Container::PlainOldData<PendingSocket>::Array stillClients;
+    // The answered sockets to give back to the server (owned)
+    Container::PlainOldData<Socket *>::Array returnedSockets;
+    // The number of sockets that'll be given back to the server
+    Threading::Atomic<uint32>   stillInFlight;
+    // The full resolution picture sender thread
+    StillSender                 stillSender;
+    // The cropper for the full resolution requests asking for a region, and the last cropped picture (only used by the still sender thread)
+    JPEGDownscaler              stillCropper;
+    Utils::MemoryBlock          croppedStill;
+
+    // The timelapse recorder, and its thread
+    Recorder                    recorder;
+    RecordThread                recordThread;
+    // The shared memory output for the local consumers, if enabled
+    SharedFrameRing             sharedOutput;
+    // The multicast output on the LAN, if enabled (sent by the first fan-out thread), the last frame sent, and the frames sent
+    MulticastSender             multicastOutput;
+    uint32                      multicastSequence;
+    Threading::Atomic<uint64>   framesMulticast;
+    // The HLS segments of the stream, if enabled (filled by the capture thread)
+    HLSSegmenter                hls;
+    // The device watcher thread (when monitoring the device)
+    DeviceWatcher               deviceWatcher;
+    // The device starter thread (at startup)
+    DeviceStarter               deviceStarter;
+
+    // The lock protecting the new replay clients list
+    Threading::FastLock         replayLock;
+    // The replay clients waiting for the replay thread to take them (owned)
+    Container::PlainOldData<ReplayClient *>::Array newReplays;
+    // The replay thread
+    ReplaySender                replaySender;
+
+    /** Compare the given token with the expected one, in a time that does not depend on where they differ (so it can't be guessed byte by byte) */
+    static bool isSameToken(const String & token, const String & expected)
+    {
+        if (token.getLength() != expected.getLength()) return false;
+        const uint8 * a = (const uint8*)(const char*)token, * b = (const uint8*)(const char*)expected;
+        uint8 diff = 0;
+        for (int i = 0; i < expected.getLength(); i++) diff |= a[i] ^ b[i];
+        return !diff;
     }
 
-    bool stopServer() { return routing.stopServer(); }
+    // The lock protecting the security token, since it can be changed when the configuration is reloaded
+    mutable Threading::FastLock tokenLock;
 
+    /** Check the request's token, from the token URL parameter or an "Authorization: Bearer" header */
+    bool isAuthorized(Network::Server::URLRouting::Comm & comm) const
+    {
+        String expected;
+        {
+            Threading::ScopedLock scope(tokenLock);
+            expected = cfg.securityToken;
+        }
+        if (!expected) return true;
+        String * token = comm.headers.getValue("token");
+        if (token) return isSameToken(*token, expected);
+        String * authorization = comm.headers.getValue("Authorization");
+        if (!authorization || authorization->getLength() < 7 || authorization->midString(0, 7).asLowercase() != "bearer ") return false;
+        return isSameToken(authorization->midString(7, authorization->getLength()).Trimmed(), expected);
+    }
 
-    String startV4L2Device() { 
-        return v4l2Thread.startV4L2Device(config.device, 
-                                            config.lowResWidth, config.lowResHeight, 
-                                            config.highResWidth, config.highResHeight, 
-                                            config.stabPicCount, config.maxFPS); 
+    bool FilterAccess(Network::Server::URLRouting::Comm & comm, bool needSource = true, bool allowPost = false)
+    {
+        if (comm.method != "GET" && (!allowPost || comm.method != "POST")) return comm.sendError("Bad method", Protocol::HTTP::BadMethod) != 0;
+        if (!isAuthorized(comm))
+        {
+            comm.addAnswerHeader("WWW-Authenticate", "Bearer");
+            return comm.sendError("Unauthorized", Protocol::HTTP::Unauthorized) != 0;
+        }
+
+        if (needSource && !wakeDevice()) return comm.sendError("Internal server error", Protocol::HTTP::InternalServerError) != 0; 
+        return true;
     }
 
-    // PictureSink interface
-private:
-    bool pictureReceived(const uint8 * data, const size_t len) 
-    {   // Called by the V4L2 thread, so protect it now
-        Threading::ScopedLock scope(lock);
-        for (size_t i = clients.getSize(); i != 0; i--) {
-            if (!clients.getElementAtUncheckedPosition(i - 1)->pictureReceived(data, len))
-                clients.Remove(i - 1); // Iterating from last to first allows to remove cleanly
+    /** Start the device again if it was closed after some inactivity
+        @return false if it can't be started */
+    bool wakeDevice()
+    {
+        if (!waitStarted()) return false;
+        if (!cfg.closeDevTimeoutSec || v4l2Thread.isOpened()) return true;
+        Threading::ScopedLock scope(deviceLock);
+        // Another request might have started it while we were waiting
+        if (v4l2Thread.isOpened()) return heartbeat();
+        log(Info, "Starting V4L2 device");
+        String ret = startV4L2Device();
+        if (ret) 
+        { 
+            log(Error, (const char*)ret); 
+            return false;
         }
-        if (clients.getSize()) return heartbeat();
+        return heartbeat();
+    }
+
+
+    /** Get the region asked for with the crop parameter, like "crop=320,180,640,360"
+        @return false if the parameter is invalid (the request was answered) */
+    static bool getCropRegion(Network::Server::URLRouting::Comm & comm, JPEGRegion & region)
+    {
+        String * crop = comm.headers.getValue("crop");
+        if (!crop || JPEGRegion::parse(*crop, region)) return true;
+        comm.sendError("Invalid crop region, expecting x,y,width,height", Protocol::HTTP::BadRequest);
         return false;
     }
 
-    bool heartbeat() { lastSeenTime = (uint32)time(NULL); return true; }
+    Stream::InputStream * FullResJPEG(Network::Server::URLRouting::Comm & comm)
+    {
+        JPEGRegion region;
+        if (!FilterAccess(comm) || !getCropRegion(comm, region)) return 0;
+        // The cached picture is not sent again to a client that already has it
+        FrameRef cached;
+        if (cfg.fullResCacheMs && v4l2Thread.getCachedFullResFrame(cached, cfg.fullResCacheMs)
+            && isNotModified(comm, makeETag(cached->sequence, "f"), cached->time, getFullResMaxAge(*cached))) return 0;
+        // Capture the socket, the answer is sent by the still sender thread once the picture is captured
+        Socket * clientSocket = const_cast<Socket*>(comm.context.client);
+        if (!clientSocket) return comm.sendError("Bad state", Protocol::HTTP::InternalServerError);
 
-    // Construction and destruction
-public:
-    MJPGServer() : v4l2Thread(*this) {}
-};
-        
-        
+        {
+            Threading::ScopedLock scope(stillLock);
+            if (!stillSender.isRunning() && !stillSender.createThread()) return comm.sendError("Can't capture", Protocol::HTTP::InternalServerError);
+        }
+        // On a persistent connection, the socket is given back to the server once answered, so the next captures don't need a new connection
+        String * priority = comm.headers.getValue("priority");
+        captureSocket(clientSocket, 0, comm.canReuseCapturedSocket(), 0, priority && *priority == "high", region);
+        comm.statusCode = Protocol::HTTP::CapturedSocket; 
+        return 0;
+    }
+
+    /** Get the weight of a stream class, from the class parameter and the streamClasses key (1 for an unknown class or no class) */
+    static uint32 getClassWeight(const String * name)
+    {
+        if (!name || !config.streamClasses) return 1;
+        String classes = config.streamClasses, wanted = name->Trimmed();
+        while (classes)
+        {
+            String weight = classes.splitUpTo("&"), key = weight.splitUpTo("=").Trimmed();
+            if (key == wanted) return (uint32)max(weight.Trimmed().parseInt(10), (int64)1);
+        }
+        return 1;
+    }
+
+    /** Answer a stream client whose address has too many streams already (the socket is not captured, so it's kept by the server) */
+    Stream::InputStream * refuseClient(Network::Server::URLRouting::Comm & comm, ClientSocket * client)
+    {
+        log(Info, "Refusing a new stream from %s: too many streams", (const char*)client->address);
+        client->clientSocket = 0;
+        delete client;
+        comm.addAnswerHeader("Retry-After", "10");
+        return comm.sendError("Too many streams", Protocol::HTTP::TooManyRequests);
+    }
+
+    /** Refuse a JPEG stream or snapshot request when the stream is in H.264
+        @return true if the request was answered */
+    bool refuseH264(Network::Server::URLRouting::Comm & comm)
+    {
+        if (!isH264()) return false;
+        comm.sendError("The stream is in H.264, it's only served over RTSP and HLS", Protocol::HTTP::NotAcceptable);
+        return true;
+    }
+
+    Stream::InputStream * MotionJPEG(Network::Server::URLRouting::Comm & comm)
+    {
+        JPEGRegion region;
+        if (refuseH264(comm) || !FilterAccess(comm) || !getCropRegion(comm, region)) return 0;
+        // Capture the socket to return the MJPEG stream
+        Socket * clientSocket = const_cast<Socket*>(comm.context.client);
+        if (!clientSocket) return comm.sendError("Bad state", Protocol::HTTP::InternalServerError);
+
+        // Per client decimation, if asked for
+        String * fps = comm.headers.getValue("fps"), * maxKbps = comm.headers.getValue("maxKbps");
+        ClientSocket * client = new ClientSocket(clientSocket, fps ? max(fps->parseDouble(), 0.0) : 0, maxKbps ? (uint32)max(maxKbps->parseInt(10), (int64)0) : 0);
+        if (client->isRefused()) return refuseClient(comm, client);
+        client->weight = getClassWeight(comm.headers.getValue("class"));
+        client->region = region;
+
+        // Need to prepare the multipart stream first before going further
+        if (!startMultipart(clientSocket)) { client->clientSocket = 0; delete client; return comm.sendError("Can't write", Protocol::HTTP::InternalServerError); }
+        if (!startThreads()) { client->clientSocket = 0; delete client; return comm.sendError("Can't start streaming", Protocol::HTTP::InternalServerError); }
+        captureSocket(clientSocket, client);
+        comm.statusCode = Protocol::HTTP::CapturedSocket; 
+        return 0;
+    }
+
+    /** Stream the pictures as WebSocket binary messages, one picture per message.
+        The client acknowledges each picture with a message (any content), and only gets a new picture when the number of pictures not
+        acknowledged yet is below its window (the window parameter, 1 by default), so a slow client always gets the newest picture
+        @param sources  If provided, the cameras to multiplex on this connection (this camera's fan-out thread sends all their pictures) */
+    Stream::InputStream * WebSocketStream(Network::Server::URLRouting::Comm & comm, const Container::PlainOldData<Camera*>::Array * sources = 0)
+    {
+        if (refuseH264(comm) || !FilterAccess(comm)) return 0;
+        for (size_t i = 0; sources && i < sources->getSize(); i++)
+            if ((*sources)[i] != this && ((*sources)[i]->refuseH264(comm) || !(*sources)[i]->FilterAccess(comm))) return 0;
+        Socket * clientSocket = const_cast<Socket*>(comm.context.client);
+        if (!clientSocket) return comm.sendError("Bad state", Protocol::HTTP::InternalServerError);
+
+        // The headers names are stored in the Xxxx-Xxxx case by the server
+        String * upgrade = comm.headers.getValue("Upgrade"), * key = comm.headers.getValue("Sec-Websocket-Key"), * version = comm.headers.getValue("Sec-Websocket-Version");
+        if (!upgrade || upgrade->Trimmed().asLowercase() != "websocket" || !key || !key->Trimmed()) return comm.sendError("Expecting a WebSocket upgrade", Protocol::HTTP::BadRequest);
+        if (!version || version->Trimmed() != "13") return comm.sendError("Unsupported WebSocket version", Protocol::HTTP::BadRequest);
+
+        String * fps = comm.headers.getValue("fps"), * maxKbps = comm.headers.getValue("maxKbps"), * window = comm.headers.getValue("window");
+        uint32 credits = window ? (uint32)max(window->parseInt(10), (int64)1) : 1;
+        if (!startThreads()) return comm.sendError("Can't start streaming", Protocol::HTTP::InternalServerError);
+        // The other cameras count this client too, so they keep capturing
+        ClientSocket * client = new ClientSocket(clientSocket, fps ? max(fps->parseDouble(), 0.0) : 0, maxKbps ? (uint32)max(maxKbps->parseInt(10), (int64)0) : 0, false, min(credits, (uint32)64));
+        if (client->isRefused()) return refuseClient(comm, client);
+        client->weight = getClassWeight(comm.headers.getValue("class"));
+        for (size_t i = 0; sources && i < sources->getSize(); i++)
+        {
+            Camera * source = (*sources)[i];
+            client->channels.Append(ClientSocket::Channel(source, client->window));
+            if (source == this) continue;
+            ++source->clientCount;
+            if (!source->startThreads()) { client->clientSocket = 0; detachChannels(*client, 0); delete client; return comm.sendError("Can't start streaming", Protocol::HTTP::InternalServerError); }
+        }
+
+        String answer = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: " + WebSocket::getAcceptKey(*key) + "\r\n\r\n";
+        if (clientSocket->sendReliably(answer, answer.getLength()) != answer.getLength())
+        {
+            client->clientSocket = 0; detachChannels(*client, 0); delete client;
+            return comm.sendError("Can't write", Protocol::HTTP::InternalServerError);
+        }
+        captureSocket(clientSocket, client);
+        comm.statusCode = Protocol::HTTP::CapturedSocket;
+        return 0;
+    }
+
+    /** Stream the frames metadata as Server-Sent Events, so a dashboard only fetches a picture when something changed.
+        A "frame" event is sent for each new frame (decimated like a stream with the fps parameter) with its sequence number, time, size and
+        activity score, and a "full_res" event when a full resolution picture was captured */
+    Stream::InputStream * Events(Network::Server::URLRouting::Comm & comm)
+    {
+        if (!FilterAccess(comm)) return 0;
+        Socket * clientSocket = const_cast<Socket*>(comm.context.client);
+        if (!clientSocket) return comm.sendError("Bad state", Protocol::HTTP::InternalServerError);
+
+        String * fps = comm.headers.getValue("fps");
+        ClientSocket * client = new ClientSocket(clientSocket, fps ? max(fps->parseDouble(), 0.0) : 0, 0, false, 0, true);
+        if (client->isRefused()) return refuseClient(comm, client);
+        if (!startThreads()) { client->clientSocket = 0; delete client; return comm.sendError("Can't start streaming", Protocol::HTTP::InternalServerError); }
+        static const char header[] = "HTTP/1.1 200 OK\r\nCache-Control: no-cache\r\nConnection: close\r\nContent-Type: text/event-stream\r\n\r\nretry: 2000\n\n";
+        if (clientSocket->sendReliably(header, sizeof(header) - 1) != (int)sizeof(header) - 1) { client->clientSocket = 0; delete client; return comm.sendError("Can't write", Protocol::HTTP::InternalServerError); }
+        captureSocket(clientSocket, client);
+        comm.statusCode = Protocol::HTTP::CapturedSocket;
+        return 0;
+    }
+
+    Stream::InputStream * Snapshot(Network::Server::URLRouting::Comm & comm)
+    {
+        if (refuseH264(comm) || !FilterAccess(comm)) return 0;
+        // A client polling a picture that did not change (the scene is static, or it polls faster than the capture) is only told so
+        FrameRef last = getLatestFrame();
+        if (last && Time::getPreciseTime() - last->time < ClientSocket::MaxSnapshotAge && isNotModified(comm, makeETag(last->origin), last->originTime, ClientSocket::MaxSnapshotAge))
+            return 0;
+        // Capture the socket, the fan-out thread answers with the last low resolution frame (or the first one if the capture is idle)
+        Socket * clientSocket = const_cast<Socket*>(comm.context.client);
+        if (!clientSocket) return comm.sendError("Bad state", Protocol::HTTP::InternalServerError);
+
+        if (!startThreads()) return comm.sendError("Can't capture", Protocol::HTTP::InternalServerError);
+        captureSocket(clientSocket, new ClientSocket(clientSocket, 0, 0, true));
+        comm.statusCode = Protocol::HTTP::CapturedSocket; 
+        return 0;
+    }
+
+    Stream::InputStream * Record(Network::Server::URLRouting::Comm & comm)
+    {
+        if (!FilterAccess(comm, false)) return 0;
+        if (!recorder.isOpened()) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        // The picture is recorded by the recorder thread (or the capture thread), so don't wait for it here
+        recorder.trigger();
+        recordThread.requested.Set();
+        comm.addAnswerHeader("Content-Type", "text/plain");
+        comm.addAnswerHeader("Cache-Control", "no-cache");
+        comm.returnText = "Recording the next picture\n";
+        return 0;
+    }
+
+    /** Send the answer header of a multipart stream.
+        The stream's end is not known, so the connection can't be reused */
+    static bool startMultipart(Socket * socket)
+    {
+        static const char header[] = "HTTP/1.1 200 OK\r\nCache-Control: no-cache\r\nCache-Control: private\r\nConnection: close\r\nContent-Type: multipart/x-mixed-replace;boundary=--boundary\r\n";
+        return socket->sendReliably(header, sizeof(header) - 1) == (int)sizeof(header) - 1;
+    }
+
+    /** List the device controls (GET), or set some of them (POST, with the controls in the body like "brightness=128&exposure_time_absolute=300") */
+    Stream::InputStream * Control(Network::Server::URLRouting::Comm & comm)
+    {
+        if (!FilterAccess(comm, true, true)) return 0;
+        if (comm.method == "POST")
+        {
+            Utils::ScopePtr<Stream::InputStream> body(comm.getCompleteRequest());
+            String assignments;
+            Stream::OutputStringStream out(assignments);
+            if (!body || !Stream::copyStream(*body, out)) return comm.sendError("Can't read the request", Protocol::HTTP::BadRequest);
+            String ret = v4l2Thread.setControls(assignments.Trimmed());
+            if (ret) return comm.sendError(ret, Protocol::HTTP::BadRequest);
+        }
+        comm.addAnswerHeader("Content-Type", "application/json");
+        comm.addAnswerHeader("Cache-Control", "no-cache");
+        comm.returnText = "{\"controls\":" + v4l2Thread.getControls() + "}";
+        return 0;
+    }
+
+    /** Apply a changed key of the reloaded configuration, while the camera is running.
+        The device keys are read while the device is started or checked, so they are changed with the device lock taken. The other keys are single
+        values read by the fan-out threads for each frame
+        @return false if the key can't be changed without a restart */
+    bool applyKey(const String & key, const Configuration & next)
+    {
+        if (key == "maxFPS")                        { cfg.maxFPS = next.maxFPS; v4l2Thread.setMaxFPS(next.maxFPS); }
+        else if (key == "lowResWidth" || key == "lowResHeight")
+        {
+            if (cfg.fakeSource || cfg.remoteSource || cfg.previewScale > 1) return false;
+            Threading::ScopedLock scope(deviceLock);
+            cfg.lowResWidth = next.lowResWidth; cfg.lowResHeight = next.lowResHeight;
+            v4l2Thread.setLowRes(next.lowResWidth, next.lowResHeight);
+        }
+        else if (key == "idleFPS")                  cfg.idleFPS = next.idleFPS;
+        else if (key == "duplicateKeepAliveSec")    cfg.duplicateKeepAliveSec = next.duplicateKeepAliveSec;
+        else if (key == "adaptiveFPS")
+        {
+            cfg.adaptiveFPS = next.adaptiveFPS;
+            // The governor is not run anymore, so remove its limit
+            if (!next.adaptiveFPS) v4l2Thread.setFrameRateLimit(0);
+        }
+        else if (key == "firstFrameMaxAgeSec")      cfg.firstFrameMaxAgeSec = next.firstFrameMaxAgeSec;
+        else if (key == "closeDeviceTimeoutSec")    { Threading::ScopedLock scope(deviceLock); cfg.closeDevTimeoutSec = next.closeDevTimeoutSec; }
+        else if (key == "standbyTimeoutSec")        { Threading::ScopedLock scope(deviceLock); cfg.standbyTimeoutSec = next.standbyTimeoutSec; }
+        else if (key == "watchdogTimeoutSec")       { Threading::ScopedLock scope(deviceLock); cfg.watchdogTimeoutSec = next.watchdogTimeoutSec; }
+        else if (key == "securityToken")            { Threading::ScopedLock scope(tokenLock); cfg.securityToken = next.securityToken; }
+        else if (key == "controls")
+        {
+            Threading::ScopedLock scope(deviceLock);
+            cfg.controls = next.controls;
+            String ret = next.controls ? v4l2Thread.setControls(next.controls) : String();
+            if (ret) log(Warning, "Camera %s: can't set the controls: %s", (const char*)cfg.name, (const char*)ret);
+        }
+        else if (key == "stillControls")            { Threading::ScopedLock scope(deviceLock); cfg.stillControls = next.stillControls; v4l2Thread.setStillControls(next.stillControls); }
+        // The log level is applied while the file is parsed
+        else if (key != "logLevel") return false;
+        return true;
+    }
+
+    /** Apply the reloaded configuration of this camera, the streams are kept.
+        The pacing, resolution, controls and timeouts keys are applied, the other changed keys need a restart.
+        @param next     The camera's reloaded configuration
+        @param applied  On output, the changed keys that were applied, comma separated
+        @return The changed keys that were not applied, comma separated */
+    String reload(const Configuration & next, String & applied)
+    {
+        String changed = cfg.getChangedKeys(next), pending;
+        applied = "";
+        while (changed)
+        {
+            String key = changed.splitUpTo(",");
+            String & list = applyKey(key, next) ? applied : pending;
+            list += list ? "," + key : key;
+        }
+        // The pending keys are only reported once, the running values are used until the restart
+        cfg.setKeys = next.setKeys;
+        return pending;
+    }
+
+    Stream::InputStream * Burst(Network::Server::URLRouting::Comm & comm)
+    {
+        if (!FilterAccess(comm, false)) return 0;
+        if (!history.isEnabled()) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        bool toRecorder = comm.headers.getValue("record") != 0;
+        if (toRecorder && !recorder.isOpened()) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+
+        // The frames are only referenced, the last full resolution picture is the only copy (if it's recent enough)
+        FrameRef * frames = 0;
+        size_t count = history.getFrames(frames);
+        FrameRef fullRes = cfg.preEventFullRes ? framePool.get() : FrameRef();
+        double captured = 0, oldest = count ? frames[0]->time : Time::getPreciseTime() - cfg.preEventSeconds;
+        if (fullRes && v4l2Thread.getLastFullResPicture(fullRes->data, captured) && captured >= oldest)
+        {
+            fullRes->sequence = 0;
+            fullRes->time = captured;
+            fullRes->captureAge = 0;
+            fullRes->tablesOffset = cfg.insertHuffmanTables ? (uint32)JPEGInfo::getHuffmanTablesOffset(fullRes->getData(), fullRes->data.getSize()) : 0;
+            fullRes->prepareHeader();
+            FrameRef * all = new FrameRef[count + 1];
+            for (size_t i = 0; i < count; i++) all[i] = frames[i];
+            all[count++] = fullRes;
+            delete[] frames;
+            frames = all;
+        }
+
+        if (toRecorder)
+        {   // Recorded now, in one go
+            size_t recorded = 0;
+            for (size_t i = 0; i < count; i++)
+            {
+                const Frame & frame = *frames[i];
+                if (recorder.record(frame.getData(), frame.data.getSize(), (uint64)((frame.time - frame.captureAge) * 1000000))) recorded++;
+            }
+            delete[] frames;
+            comm.addAnswerHeader("Content-Type", "text/plain");
+            comm.addAnswerHeader("Cache-Control", "no-cache");
+            comm.returnText = String::Print("Recorded %u pictures\n", (unsigned)recorded);
+            return 0;
+        }
+
+        Socket * clientSocket = const_cast<Socket*>(comm.context.client);
+        if (!clientSocket) { delete[] frames; return comm.sendError("Bad state", Protocol::HTTP::InternalServerError); }
+        {
+            Threading::ScopedLock scope(replayLock);
+            if (!replaySender.isRunning() && !replaySender.createThread()) { delete[] frames; return comm.sendError("Can't replay", Protocol::HTTP::InternalServerError); }
+        }
+        if (!startMultipart(clientSocket)) { delete[] frames; return comm.sendError("Can't write", Protocol::HTTP::InternalServerError); }
+        // Sent by the replay thread, so a large history does not block the server
+        captureSocket(clientSocket, 0, false, new ReplayClient(clientSocket, frames, count));
+        comm.statusCode = Protocol::HTTP::CapturedSocket; 
+        return 0;
+    }
+
+    Stream::InputStream * Replay(Network::Server::URLRouting::Comm & comm) { return startReplay(comm, ReplayClient::Multipart); }
+    Stream::InputStream * Timelapse(Network::Server::URLRouting::Comm & comm) { return startReplay(comm, ReplayClient::AVIFile); }
+
+    /** Serve the HLS playlist ("index.m3u8"), the init segment or a media segment, from the segmenter's memory.
+        The segments never change, so they are cached for long, while the playlist is cached for half a segment (so a CDN fetches it
+        about once per segment, whatever the number of viewers) */
+    Stream::InputStream * HLS(Network::Server::URLRouting::Comm & comm)
+    {
+        if (!FilterAccess(comm, false)) return 0;
+        if (!hls.isOpened() || !comm.captures.getSize()) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        const String & name = comm.captures[comm.captures.getSize() - 1];
+        if (name == "index.m3u8")
+        {   // The segments are requested with the same token
+            String * token = comm.headers.getValue("token"), playlist;
+            if (!hls.getPlaylist(playlist, token ? "?token=" + *token : String()))
+            {
+                comm.addAnswerHeader("Retry-After", "1");
+                comm.addAnswerHeader("Cache-Control", "no-cache");
+                return comm.sendError("No segment yet", Protocol::HTTP::Unavailable);
+            }
+            comm.addAnswerHeader("Content-Type", "application/vnd.apple.mpegurl");
+            comm.addAnswerHeader("Cache-Control", String::Print("public, max-age=%u", max(hls.getTargetDuration() / 2, 1U)));
+            comm.returnText = playlist;
+            return 0;
+        }
+        size_t size = 0;
+        uint8 * file = hls.getFile(name, size);
+        if (!file)
+        {   // A segment that's gone is gone for good, but the name might be reused by a future segment (a camera restarting in the same second)
+            comm.addAnswerHeader("Cache-Control", "no-cache");
+            return comm.sendError("Not found", Protocol::HTTP::NotFound, false);
+        }
+        comm.addAnswerHeader("Content-Type", name.fromLast(".") == "mp4" ? "video/mp4" : "video/iso.segment");
+        comm.addAnswerHeader("Cache-Control", "public, max-age=31536000, immutable");
+        return new Stream::MemoryBlockStream(file, size, true);
+    }
+
+    /** Give a replay request to the replay thread */
+    Stream::InputStream * startReplay(Network::Server::URLRouting::Comm & comm, const ReplayClient::Format format)
+    {
+        if (!FilterAccess(comm, false)) return 0;
+        if (!recorder.isOpened()) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        Socket * clientSocket = const_cast<Socket*>(comm.context.client);
+        if (!clientSocket) return comm.sendError("Bad state", Protocol::HTTP::InternalServerError);
+
+        // The time range is in seconds since the epoch, the whole recording by default
+        String * from = comm.headers.getValue("from"), * to = comm.headers.getValue("to"), * fps = comm.headers.getValue("fps");
+        double start = from ? max(from->parseDouble(), 0.0) : 0, end = to ? to->parseDouble() : 0;
+        {
+            Threading::ScopedLock scope(replayLock);
+            if (!replaySender.isRunning() && !replaySender.createThread()) return comm.sendError("Can't replay", Protocol::HTTP::InternalServerError);
+        }
+        // The AVI file answer is sent by the replay thread, once the file size is known
+        if (format == ReplayClient::Multipart && !startMultipart(clientSocket)) return comm.sendError("Can't write", Protocol::HTTP::InternalServerError);
+        double rate = fps ? fps->parseDouble() : (double)(format == ReplayClient::Multipart ? ReplayClient::DefaultFPS : ReplayClient::DefaultFileFPS);
+        captureSocket(clientSocket, 0, false, new ReplayClient(clientSocket, format, (uint64)(start * 1000000), end > 0 ? (uint64)(end * 1000000) : (uint64)-1, rate));
+        comm.statusCode = Protocol::HTTP::CapturedSocket; 
+        return 0;
+    }
+
+    /** Start the threads feeding the clients, if required */
+    bool startThreads()
+    {
+        if (fanOuts.getElementAtUncheckedPosition(fanOuts.getSize() - 1)->isRunning() && v4l2Thread.isRunning()) return true;
+        Threading::ScopedLock scope(startLock);
+        for (size_t i = 0; i < fanOuts.getSize(); i++)
+        {
+            FanOut & fanOut = *fanOuts.getElementAtUncheckedPosition(i);
+            if (!fanOut.isRunning() && (!fanOut.init() || !fanOut.createThread())) return false;
+        }
+        if (!v4l2Thread.isRunning()) v4l2Thread.createThread();
+        return true;
+    }
+
+    // The lock protecting the captured sockets list
+    Threading::FastLock         capturedLock;
+    // The sockets captured by the routes, waiting for the server to forget them
+    Container::PlainOldData<PendingSocket>::Array captured;
+
+    /** Remember a socket captured by a route, until the server forgets it */
+    void captureSocket(Socket * socket, ClientSocket * client, const bool keepAlive = false, ReplayClient * replay = 0, const bool highPriority = false, const JPEGRegion & region = JPEGRegion())
+    {
+        // Count the client now, so the capture thread does not stop before it's added
+        if (client) ++clientCount;
+        // Same for the sockets to give back, so the server loop checks for them until then
+        if (keepAlive) ++stillInFlight;
+        Threading::ScopedLock scope(capturedLock);
+        captured.Append(PendingSocket(socket, client, keepAlive, replay, highPriority, region));
+    }
+
+    /** Give a captured socket to its thread, now that the server forgot it.
+        This never waits for the fan-out thread, a client is queued and taken by the fan-out thread when it's woken up
+        @return false if the socket was not captured by this camera */
+    bool socketForgotten(Socket & socket)
+    {
+        PendingSocket capture;
+        {
+            Threading::ScopedLock scope(capturedLock);
+            for (size_t i = 0; i < captured.getSize() && !capture.socket; i++)
+                if (captured[i].socket == &socket) { capture = captured[i]; captured.Remove(i); }
+        }
+        if (!capture.socket) return false;
+        if (capture.replay)
+        {   // A replay request
+            Threading::ScopedLock scope(replayLock);
+            newReplays.Append(capture.replay);
+            replaySender.requested.Set();
+            return true;
+        }
+        if (!capture.client)
+        {   // A full resolution picture request
+            Threading::ScopedLock scope(stillLock);
+            stillClients.Append(capture);
+            stillSender.requested.Set();
+            return true;
+        }
+        ClientSocket * client = capture.client;
+        client->latency = &latency;
+        client->id = ++nextClientId - 1;
+        FanOut & fanOut = leastLoaded();
+        ++fanOut.load;
+        fanOut.newClients.enqueue(client);
+        // Give it the current frame (if any) without waiting for the next one
+        fanOut.wake();
+        return true;
+    }
+
+    /** Get the fan-out thread with the fewest clients */
+    FanOut & leastLoaded() const
+    {
+        FanOut * best = fanOuts.getElementAtUncheckedPosition(0);
+        for (size_t i = 1; i < fanOuts.getSize(); i++)
+            if (fanOuts.getElementAtUncheckedPosition(i)->load.read() < best->load.read()) best = fanOuts.getElementAtUncheckedPosition(i);
+        return *best;
+    }
+    /** Wake up all the fan-out threads, this is called from any thread */
+    void wakeFanOuts() { for (size_t i = 0; i < fanOuts.getSize(); i++) fanOuts.getElementAtUncheckedPosition(i)->wake(); }
+    /** Stop the fan-out threads (they are all told to stop first, so they don't wait for their timeout in turn) */
+    void stopFanOuts()
+    {
+        for (size_t i = 0; i < fanOuts.getSize(); i++) { fanOuts.getElementAtUncheckedPosition(i)->signalShouldStop(); fanOuts.getElementAtUncheckedPosition(i)->wake(); }
+        for (size_t i = 0; i < fanOuts.getSize(); i++) fanOuts.getElementAtUncheckedPosition(i)->destroyThread();
+    }
+
+    uint32     lastSeenTime;
+    // The lock serializing the device opening and closing (the requests might be processed by a thread pool)
+    Threading::FastLock         deviceLock;
+
+    /** Close the device if it's unused, or restart it if it's back */
+    void checkDevice()
+    {
+        // The starter thread owns the device until it's started
+        if (isStarting()) return;
+        Threading::ScopedLock scope(deviceLock);
+        time_t currentTime = {};
+        if (cfg.closeDevTimeoutSec && v4l2Thread.isOpened()) {
+            currentTime = time(NULL);
+            if ((uint32)currentTime > (lastSeenTime + cfg.closeDevTimeoutSec)) {
+                log(Info, "Closing the device %s after %us of inactivity", (const char*)cfg.device, cfg.closeDevTimeoutSec);
+                String ret = v4l2Thread.stopV4L2Device();
+                if (ret) log(Error, (const char*)ret);
+            }
+        }
+        if (cfg.standbyTimeoutSec && v4l2Thread.isStreaming() && !v4l2Thread.isRunning()) {
+            if (!currentTime) currentTime = time(NULL);
+            if ((uint32)currentTime > (lastSeenTime + cfg.standbyTimeoutSec)) {
+                // A client might be starting the capture now
+                Threading::ScopedLock start(startLock);
+                if (!v4l2Thread.isRunning()) {
+                    log(Info, "Stopping the device %s stream after %us of inactivity", (const char*)cfg.device, cfg.standbyTimeoutSec);
+                    v4l2Thread.enterStandby();
+                }
+            }
+        }
+        bool present = v4l2Thread.isDevicePresent();
+        if (!present && deviceWatcher.isWatching()) {
+            // The device node might already be back (like when the disconnection is only seen when using the device), so check it once
+            if (wasPresent) deviceWatcher.wake();
+        }
+        else if (!present) {
+            if (!currentTime) currentTime = time(NULL);
+            if (cfg.monitorDev && currentTime > (lastCheckedTime + 2) && File::Info(cfg.device).doesExist()) restartDevice();
+            lastCheckedTime = currentTime;
+        }
+        wasPresent = present;
+        watchCapture();
+    }
+
+    /** Check the capture progresses while it's needed, and recover it when no frame was captured for watchdogTimeoutSec (the device lock must be taken).
+        Each step is tried for watchdogTimeoutSec before the next one: restart the device's stream, then open the device again, then reset its USB
+        port (the device node comes back a moment later, so it's opened again by the next step). The steps then cycle between the last two */
+    void watchCapture()
+    {
+        double now = Time::getPreciseTime();
+        uint64 frames = v4l2Thread.getCounters().framesCaptured.read();
+        if (frames != watchdogFrames && stallTime)
+        {
+            uint64 ms = (uint64)((now - stallTime) * 1000);
+            ++recoveries; recoveryMs += ms; lastRecoveryMs.save(ms);
+            log(Info, "Camera %s: the capture recovered after %.1fs", (const char*)cfg.name, now - stallTime);
+        }
+        // A disconnected device is started again when it's back, and a full resolution capture is limited by its own timeout
+        if (frames != watchdogFrames || !cfg.watchdogTimeoutSec || (!clientCount.read() && !capturesAlways()) || !v4l2Thread.isDevicePresent() || v4l2Thread.isSwitching())
+        {
+            watchdogFrames = frames; progressTime = now; stallTime = 0; recoveryStep = 0;
+            return;
+        }
+        if (now - progressTime < cfg.watchdogTimeoutSec) return;
+
+        if (!stallTime) stallTime = progressTime;
+        ++recoverySteps;
+        String ret;
+        if (!recoveryStep)
+        {
+            log(Warning, "Camera %s: no frame captured for %us, restarting the stream", (const char*)cfg.name, cfg.watchdogTimeoutSec);
+            v4l2Thread.stopThread();
+            v4l2Thread.enterStandby();
+        }
+        else
+        {
+            bool reset = recoveryStep > 1;
+            log(Warning, "Camera %s: no frame captured for %.0fs, %s", (const char*)cfg.name, now - stallTime, reset ? "resetting the device" : "opening the device again");
+            ret = v4l2Thread.stopV4L2Device();
+            if (ret) log(Warning, "Camera %s: %s", (const char*)cfg.name, (const char*)ret);
+            if (reset && (ret = V4L2Thread::resetUSBDevice(cfg.device))) log(Error, "Camera %s: can't reset the device: %s", (const char*)cfg.name, (const char*)ret);
+            if ((ret = startV4L2Device())) log(Error, "Camera %s: %s", (const char*)cfg.name, (const char*)ret);
+        }
+        if (!ret && !startThreads()) log(Error, "Camera %s: can't start the capture", (const char*)cfg.name);
+        // Only a device can be reset
+        unsigned lastStep = cfg.fakeSource || cfg.remoteSource ? 1 : 2;
+        recoveryStep = recoveryStep < lastStep ? recoveryStep + 1 : 1;
+        progressTime = now;
+    }
+
+    /** Start the device again, now that it's back (the device lock must be taken)
+        @return false if it can't be started */
+    bool restartDevice()
+    {
+        log(Info, "Device %s seems to be present, let's start again", (const char*)cfg.device);
+        String ret = startV4L2Device();
+        if (ret) { log(Error, (const char*)ret); return false; }
+        // The pre-event frames are captured all the time
+        if (capturesAlways() && !startThreads()) log(Error, "Can't start the background capture");
+        return true;
+    }
+
+    /** Open the device and start the background capture in the starter thread, the requests needing the device wait for it.
+        The device nodes are opened here, before the privileges are dropped, only their setup is done in the starter thread
+        @return false if the thread can't be started */
+    bool startDeviceAsync()
+    {
+        // A node that can't be opened now is opened again (and its error reported) by the starter thread
+        if (!cfg.fakeSource && !cfg.remoteSource)
+        {
+            v4l2Thread.openV4L2Device(cfg.device);
+            if (cfg.highResDevice) v4l2Thread.openStillDevice(cfg.highResDevice);
+        }
+        deviceStarter.started.Reset();
+        if (deviceStarter.createThread()) return true;
+        deviceStarter.started.Set();
+        return false;
+    }
+    /** Check if the device is still being started */
+    inline bool isStarting() { return !deviceStarter.started.Wait(Threading::InstantCheck); }
+    /** Wait for the device to be started
+        @return false if it's still starting after DeviceStarter::WaitMs */
+    bool waitStarted()
+    {
+        if (deviceStarter.started.Wait(Threading::InstantCheck)) return true;
+        if (deviceStarter.started.Wait(DeviceStarter::WaitMs)) return true;
+        log(Error, "Camera %s: the device is still starting after %us", (const char*)cfg.name, DeviceStarter::WaitMs / 1000);
+        return false;
+    }
+    /** Get the errors of the startup, once it's done */
+    const String & getStartDeviceError() const { return deviceStarter.deviceError; }
+    const String & getStartCaptureError() const { return deviceStarter.captureError; }
+
+    /** Start watching the device node, if the device is monitored */
+    void startDeviceWatcher()
+    {
+        if (!cfg.monitorDev || cfg.fakeSource || cfg.remoteSource) return;
+        if (!deviceWatcher.watch(cfg.device)) log(Warning, "Can't watch the device %s, polling it instead", (const char*)cfg.device);
+    }
+
+    /** Stop the threads sending to the clients, and the recorder */
+    void stop() { deviceStarter.destroyThread(); deviceWatcher.stop(); stopFanOuts(); detachClients(); stillSender.destroyThread(); replaySender.destroyThread(); recordThread.destroyThread(); recorder.close(); sharedOutput.close(); multicastOutput.close(); hls.close(); }
+
+    /** Check if the capture runs even without any client (for the pre-event frames history, the activity detector, the shared memory consumers, the multicast receivers or the HLS segments) */
+    inline bool capturesAlways() const { return history.isEnabled() || activity.isEnabled() || sharedOutput.isOpened() || multicastOutput.isOpened() || hls.isOpened(); }
+    /** Check if the stream is in H.264 (the device's encoder pictures are only served over RTSP) */
+    inline bool isH264() const { return cfg.streamCodec == "h264"; }
+    /** Start the pre-event frames history and the activity detector, if enabled (the capture then runs even without any client) */
+    String startBackgroundCapture()
+    {
+        if (cfg.streamCodec != "mjpeg" && !isH264()) log(Warning, "Camera %s: unknown streamCodec %s, using mjpeg instead", (const char*)cfg.name, (const char*)cfg.streamCodec);
+        if (cfg.preEventSeconds) history.setLimits(cfg.preEventSeconds, cfg.preEventBytes);
+        if (cfg.frameMemoryMB)
+        {   // Preallocate a few frames for the expected picture size (about 3 bits per pixel), the pool then rarely allocates
+            framePool.setLimit((size_t)cfg.frameMemoryMB * 1024 * 1024);
+            if (!framePool.reserve(4, (size_t)cfg.lowResWidth * cfg.lowResHeight * 3 / 8)) log(Warning, "Camera %s: can't preallocate the frames", (const char*)cfg.name);
+        }
+        // The segments are made from either codec
+        if (cfg.hlsSegmentMs) hls.open(isH264(), cfg.hlsSegmentMs, cfg.hlsSegments);
+        if (isH264())
+        {   // All these need the JPEG pictures
+            if (cfg.preEventSeconds || cfg.activityThreshold || cfg.sharedMemory || cfg.multicastGroup)
+                log(Warning, "Camera %s: the pre-event frames, the activity detector, the shared memory and the multicast outputs need a MJPEG stream, they are disabled", (const char*)cfg.name);
+            return !capturesAlways() || startThreads() ? "" : "Can't start the background capture";
+        }
+        if (cfg.activityThreshold)
+        {
+            activity.setParameters(cfg.activityThreshold, cfg.activityHoldSec, cfg.activityIntervalMs);
+            recorder.setActivity(&activity);
+        }
+        if (cfg.sharedMemory)
+        {   // A slot fits a picture of 4 bits per pixel, more than any JPEG of a camera
+            String ret = sharedOutput.open(cfg.sharedMemory, cfg.sharedMemorySlots, cfg.lowResWidth * cfg.lowResHeight / 2);
+            if (ret) return "Can't open the shared memory output: " + ret;
+        }
+        if (cfg.multicastGroup)
+        {
+            String ret = multicastOutput.open(cfg.multicastGroup, cfg.multicastTTL);
+            if (ret) return "Can't open the multicast output: " + ret;
+        }
+        if (!capturesAlways()) return "";
+        return startThreads() ? "" : "Can't start the background capture";
+    }
+
+    /** Start the timelapse recorder, if enabled */
+    String startRecorder()
+    {
+        if (!cfg.recordDir) return "";
+        if (isH264() && !cfg.recordFullRes)
+        {
+            log(Warning, "Camera %s: the H.264 stream can't be recorded, only the full resolution pictures are (with recordFullRes)", (const char*)cfg.name);
+            return "";
+        }
+        // The segment files of the named cameras are told apart by their name
+        String ret = recorder.open(cfg.recordDir, (cfg.name ? cfg.name : String("segment")) + "-", min(cfg.recordSegmentMB, 4095U) * 1024 * 1024, cfg.recordSegments, cfg.recordIntervalSec);
+        if (ret) return "Can't open the recorder: " + ret;
+        return recordThread.createThread() ? "" : "Can't start the recorder thread";
+    }
+
+    String startV4L2Device() { 
+        if (isH264() && (cfg.fakeSource || cfg.remoteSource)) return "The H.264 stream is only captured from a device";
+        if (isH264() && cfg.previewScale > 1) log(Warning, "The H.264 stream can't be downscaled, previewScale is ignored");
+        else if (!v4l2Thread.setPreviewScale(cfg.previewScale)) log(Warning, "Unsupported preview scale %u (only 2, 4 or 8), the pictures are not downscaled", cfg.previewScale);
+        v4l2Thread.setH264Stream(isH264());
+        v4l2Thread.setMinSwitchInterval(cfg.minSwitchIntervalMs);
+        v4l2Thread.setJPEGQuality(streamQuality ? streamQuality : cfg.lowResQuality, cfg.highResQuality);
+        if (cfg.fakeSource) {
+            String ret = v4l2Thread.startFakeSource(cfg.fakeSource, cfg.maxFPS);
+            return ret || !cfg.fakeTrace ? ret : v4l2Thread.setFakeTrace(cfg.fakeTrace);
+        }
+        if (cfg.remoteSource) return v4l2Thread.startRemoteSource(cfg.remoteSource, cfg.maxFPS, cfg.remoteFullRes);
+        unsigned highResBuffers = cfg.highResBufferCount ? cfg.highResBufferCount : cfg.bufferCount;
+        v4l2Thread.setFastSwitch(cfg.fastSwitch);
+        v4l2Thread.setSwitchTimeout(cfg.switchTimeoutMs);
+        String ret = v4l2Thread.startV4L2Device(cfg.device, 
+                                            cfg.lowResWidth, cfg.lowResHeight, 
+                                            cfg.highResWidth, cfg.highResHeight, 
+                                            cfg.stabPicCount, cfg.maxFPS,
+                                            cfg.bufferCount, highResBuffers); 
+        if (ret) return ret;
+        ret = cfg.captureTrace ? v4l2Thread.startCaptureTrace(cfg.captureTrace) : String();
+        if (ret) log(Warning, "Can't record the capture trace: %s", (const char*)ret);
+        // The configured controls are set each time the device is opened
+        v4l2Thread.setStillControls(cfg.stillControls);
+        ret = cfg.controls ? v4l2Thread.setControls(cfg.controls) : String();
+        if (ret) log(Warning, "Can't set the device controls: %s", (const char*)ret);
+        if (!cfg.highResDevice || v4l2Thread.hasStillDevice()) return "";
+        ret = v4l2Thread.startStillDevice(cfg.highResDevice, cfg.highResWidth, cfg.highResHeight, cfg.stabPicCount, highResBuffers);
+        // Not fatal, the main device is used for full resolution pictures instead
+        if (ret) log(Warning, "Can't open the full resolution device %s: %s", (const char*)cfg.highResDevice, (const char*)ret);
+        return "";
+    }
+
+    // RTSPSource interface
+private:
+    Codec getCodec() const { return isH264() ? RTSPSource::H264 : RTSPSource::JPEG; }
+    void requestKeyFrame() { if (!v4l2Thread.requestKeyFrame()) log(Debug, "Camera %s: can't ask the device for a key frame", (const char*)cfg.name); }
+    bool isAuthorized(const String & token) const
+    {
+        Threading::ScopedLock scope(tokenLock);
+        return !cfg.securityToken || isSameToken(token, cfg.securityToken);
+    }
+    bool startViewer()
+    {   // Counted as a client, so the capture runs while it plays
+        ++clientCount; ++rtspViewers;
+        if (wakeDevice() && startThreads()) return true;
+        --rtspViewers; --clientCount;
+        return false;
+    }
+    void stopViewer() { --rtspViewers; --clientCount; }
+    FrameRef getLatestFrame() { Threading::ScopedLock scope(frameLock); return latest; }
+
+    // PictureSink interface
+private:
+    void captureStarted()
+    {
+        String error = setThreadScheduling(cfg.captureScheduling, cfg.captureCPUs);
+        if (error) log(Warning, "Capture thread: %s", (const char*)error);
+    }
+    bool pictureReceived(const uint8 * data, const size_t len, const double age) 
+    {   // Called by the V4L2 thread, so only publish the frame here, the fan-out thread will send it
+        PROBE(Profiler::PictureReceived);
+        // The activity is analyzed first, so the recorder knows if this picture is worth recording
+        double now = Time::getPreciseTime();
+        if (activity.isEnabled() && !activity.pictureReceived(data, len, now)) log(Debug, "Can't analyze the picture's activity");
+        // The stream's pictures are recorded here, unless the full resolution ones are recorded instead
+        if (!cfg.recordFullRes && recorder.isDue(now)) recorder.pictureReceived(data, len, age);
+        // The capture continues without any client, if the frames are kept for the pre-event bursts or analyzed
+        if (!clientCount.read() && !capturesAlways()) return false;
+        // Copy the picture once, so the V4L2 buffer can be returned to the driver immediately
+        FrameRef frame = framePool.get(len);
+        // When the pool is full, the oldest frame of the history is given back to it
+        while (!frame && history.dropOldest()) frame = framePool.get(len);
+        if (!frame || !frame->data.setSize((uint32)len)) return false;
+        memcpy(frame->data.getBuffer(), data, len);
+        frame->time = Time::getPreciseTime();
+        frame->captureAge = age;
+        if (age) latency.capture.record(age);
+        // The tables are inserted while sending the picture, so it's not moved here
+        frame->tablesOffset = cfg.insertHuffmanTables && !isH264() ? (uint32)JPEGInfo::getHuffmanTablesOffset(data, len) : 0;
+        frame->keyFrame = !isH264() || H264Info::isKeyFrame(data, len);
+        frame->repeated = false;
+        // The identical pictures are only sent to the stream clients from time to time (a H.264 picture is never the same)
+        frame->duplicate = false;
+        if (!isH264())
+        {
+            uint64 fingerprint = JPEGInfo::fingerprint(data, len);
+            frame->duplicate = fingerprint == lastFingerprint;
+            lastFingerprint = fingerprint;
+            if (frame->duplicate) ++framesDuplicate;
+        }
+        frame->prepareHeader();
+        {   // The fan-out thread numbers the repeated frames too
+            Threading::ScopedLock scope(frameLock);
+            frame->sequence = ++sequence;
+            frame->origin = frame->duplicate && latest ? latest->origin : frame->sequence;
+            frame->originTime = frame->duplicate && latest ? latest->originTime : frame->time;
+            latest = frame;
+        }
+        if (history.isEnabled()) history.append(frame, framePool.isNearLimit());
+        if (sharedOutput.isOpened()) sharedOutput.publish(frame->getData(), len, frame->sequence, (uint64)((frame->time - age) * 1000000));
+        wakeFanOuts();
+        if (rtspViewers.read()) rtsp->wake();
+        {   // The other cameras multiplexing this camera's frames
+            Threading::ScopedLock scope(listenersLock);
+            for (size_t i = 0; i < listeners.getSize(); i++) listeners[i]->wake();
+        }
+        // The segment is made once the clients are woken up, so it does not delay them
+        if (hls.isOpened() && !hls.pictureReceived(data, len, frame->time, frame->keyFrame)) log(Debug, "Camera %s: can't segment the picture", (const char*)cfg.name);
+        return heartbeat();
+    }
+
+    // Fan-out
+private:
+    /** Get the interval to repeat the last frame at, the stream's usual one (clamped, in case it was not measured yet) */
+    double getRepeatInterval()
+    {
+        Threading::ScopedLock scope(frameLock);
+        return min(max(streamInterval ? streamInterval : 0.1, 1.0 / 60), 1.0);
+    }
+    /** Publish the last frame again, if the device did not capture any for a frame interval (called by the first fan-out thread while the device
+        is switched to the full resolution, so the streams don't stall during the gap) */
+    void repeatLastFrame()
+    {
+        double interval = getRepeatInterval(), now = Time::getPreciseTime();
+        FrameRef last = getLatestFrame();
+        // A captured frame is given a bit more time, in case the switch just ended
+        if (!last || now - last->time < (last->repeated ? interval : interval * 1.5)) return;
+        FrameRef frame = framePool.get(last->data.getSize());
+        if (!frame || !frame->data.setSize(last->data.getSize())) return;
+        memcpy(frame->data.getBuffer(), last->data.getConstBuffer(), last->data.getSize());
+        frame->time = now;
+        frame->captureAge = 0;
+        frame->tablesOffset = last->tablesOffset;
+        frame->keyFrame = true;
+        frame->repeated = true;
+        frame->duplicate = false;
+        frame->prepareHeader();
+        {   // Unless the capture thread published a new frame meanwhile
+            Threading::ScopedLock scope(frameLock);
+            if (!(latest == last)) return;
+            frame->sequence = ++sequence;
+            frame->origin = last->origin;
+            frame->originTime = last->originTime;
+            latest = frame;
+        }
+        ++framesRepeated;
+        wakeFanOuts();
+        if (rtspViewers.read()) rtsp->wake();
+    }
+
+    uint32 fanOutLoop(FanOut & thread)
+    {
+        Container::NotConstructible<ClientSocket>::IndexList & clients = thread.clients;
+        String error = setThreadScheduling(cfg.senderScheduling, cfg.senderCPUs);
+        if (error) log(Warning, "Fan-out thread: %s", (const char*)error);
+        while (thread.isRunning())
+        {
+            // Wait for the next frame or for a backed up client to accept more data
+            // While the device is switched to the full resolution, the first thread wakes up at the stream's pace to repeat the last frame
+            bool repeating = !thread.index && cfg.repeatOnSwitch && !isH264() && v4l2Thread.isSwitching();
+            int ready = thread.wakeUpPool->selectMultiple(thread.backedUpPool, repeating ? (int)(getRepeatInterval() * 1000) : 500);
+            if (repeating) repeatLastFrame();
+            if (!ready) continue;
+            FrameRef frame;
+            double fullResTime = 0, kbps = 0, start = Time::getPreciseTime();
+            if (ready & 1)
+            {
+                thread.drain();
+                // The full resolution captures wake this thread up too, for the event clients
+                fullResTime = v4l2Thread.getLastFullResTime();
+                // The WebSocket clients sockets are in the same pool, their acknowledgements might allow sending the current frame
+                for (size_t i = 0; i < clients.getSize(); i++)
+                {
+                    ClientSocket * client = clients.getElementAtUncheckedPosition(i);
+                    if (client->webSocket) client->receiveMessages();
+                }
+                Threading::ScopedLock scope(frameLock);
+                frame = latest;
+                // The stream's bandwidth is the clients' demand on the uplink (averaged, since the pictures size changes), measured once per frame by the first thread taking it
+                if (frame && frame->sequence != streamSequence)
+                {
+                    if (streamTime && frame->time > streamTime)
+                    {
+                        double kbps = (frame->getHeaderSize() + frame->getSize()) * 8.0 * (frame->sequence - streamSequence) / 1000.0 / (frame->time - streamTime);
+                        streamKbps = streamKbps ? streamKbps * 0.9 + kbps * 0.1 : kbps;
+                        double interval = (frame->time - streamTime) / (frame->sequence - streamSequence);
+                        streamInterval = streamInterval ? streamInterval * 0.9 + interval * 0.1 : interval;
+                    }
+                    streamSequence = frame->sequence;
+                    streamTime = frame->time;
+                }
+                kbps = streamKbps;
+            }
+            // The first thread sends each new frame to the multicast group, once for all the receivers (the receivers repeat the frames themselves)
+            if (frame && !frame->repeated && !thread.index && multicastOutput.isOpened() && frame->sequence != multicastSequence)
+            {
+                multicastSequence = frame->sequence;
+                if (multicastOutput.send(frame->getData(), frame->data.getSize(), frame->sequence)) ++framesMulticast;
+            }
+            // New clients are also given the current frame when woken up
+            double now = frame ? Time::getPreciseTime() : 0;
+            // The stream clients get fewer frames while nothing moves
+            double idleInterval = frame && cfg.idleFPS && !activity.isActive(now) ? 1.0 / cfg.idleFPS : 0;
+
+            // Take the new clients
+            if (!thread.newClients.isPossiblyEmpty())
+            {
+                Threading::ScopedLock scope(clientsLock);
+                while (ClientSocket * client = thread.newClients.dequeue())
+                {   // Watch the WebSocket clients for their messages
+                    if (client->webSocket && !thread.wakeUpPool->appendSocket(client->clientSocket)) client->ended = true;
+                    // And be woken up by the other cameras a client multiplexes
+                    for (size_t j = 0; j < client->channels.getSize(); j++)
+                        if (client->channels[j].camera != this) client->channels[j].camera->addListener(thread);
+                    // The multiplexing clients are paced by their acknowledgements only (a client handed over by another thread is already registered)
+                    if (!client->snapshot && !client->eventStream && !client->channels.getSize() && !client->uplink) client->uplink = uplinkScheduler.add(client->weight);
+                    // A client handed over in the middle of a picture is watched right away
+                    if (client->isBackedUp()) client->monitored = thread.backedUpPool->appendSocket(client->clientSocket);
+                    clients.Append(client);
+                }
+            }
+
+            // The events are only formatted once for all the event clients
+            String frameEvent, fullResEvent;
+            for (size_t i = clients.getSize(); i != 0; i--) {
+                ClientSocket * client = clients.getElementAtUncheckedPosition(i - 1);
+                bool alive = true;
+                if (client->channels.getSize())
+                {   // A multiplexing client picks the frames from its cameras itself, when any of them woke this thread up
+                    if (!(ready & 1) && !client->monitored && !client->ended) continue;
+                    alive = serveChannels(*client);
+                } else
+                {
+                    if (frame) client->reportDemand(now, kbps, frame->getHeaderSize() + frame->getSize(), idleInterval);
+                    // Clients with a lower frame rate or bandwidth only get some of the frames
+                    bool deliver = frame && client->wants(frame, now, idleInterval, cfg.firstFrameMaxAgeSec, cfg.duplicateKeepAliveSec);
+                    bool notify = client->eventStream && fullResTime > client->fullResTime;
+                    if (!deliver && !notify && !client->monitored && !client->ended) continue; // Nothing to do for this client
+                    if (deliver) client->scheduleNext(now, frame->getHeaderSize() + frame->getSize(), idleInterval);
+                    if (notify)
+                    {
+                        if (!fullResEvent) fullResEvent = String::Print("event: full_res\ndata: {\"time\":%.3f}\n\n", fullResTime);
+                        client->fullResTime = fullResTime;
+                        alive = client->queueEvent(fullResEvent);
+                    }
+                    if (alive && deliver && client->eventStream)
+                    {
+                        if (!frameEvent) frameEvent = String::Print("event: frame\ndata: {\"sequence\":%u,\"time\":%.3f,\"size\":%u,\"activity\":%.1f,\"active\":%s}\n\n", frame->sequence, frame->time,
+                                                                   (uint32)frame->getSize(), activity.isEnabled() ? activity.getScore() : 0.0, activity.isActive(now) ? "true" : "false");
+                        alive = client->eventReceived(frame, frameEvent);
+                    }
+                    else if (alive) alive = deliver ? client->pictureReceived(client->region.isSet() ? cropFrame(thread, frame, client->region) : frame) : client->flush();
+                }
+                // Only monitor the sockets that have pending data
+                bool monitor = alive && client->isBackedUp();
+                if (monitor != client->monitored)
+                {
+                    if (monitor) monitor = thread.backedUpPool->appendSocket(client->clientSocket);
+                    else thread.backedUpPool->forgetSocket(client->clientSocket);
+                    client->monitored = monitor;
+                }
+                if (!alive)
+                {   // Keep its counters for the camera's totals
+                    Threading::ScopedLock scope(clientsLock);
+                    pastBytesSent += client->bytesSent;
+                    pastFramesDropped += client->framesDropped;
+                    if (client->webSocket) thread.wakeUpPool->forgetSocket(client->clientSocket);
+                    detachChannels(*client, &thread);
+                    clients.Remove(i - 1); // Iterating from last to first allows to remove cleanly
+                    --thread.load;
+                    --clientCount;
+                }
+            }
+            if (frame && fanOuts.getSize() > 1) balance(thread, Time::getPreciseTime() - start);
+            if (cfg.adaptiveFPS && !thread.index) v4l2Thread.setFrameRateLimit(getWantedFPS(now ? now : Time::getPreciseTime()));
+            if (cfg.adaptiveQuality && !thread.index) governQuality(now ? now : Time::getPreciseTime());
+        }
+        return 0;
+    }
+
+    /** Get a region of a frame, cropped without decoding it (only called by the fan-out threads)
+        @return The cropped frame (shared by the thread's clients cropping the same region), or the whole frame if it can't be cropped */
+    FrameRef cropFrame(FanOut & thread, const FrameRef & frame, const JPEGRegion & region)
+    {
+        if (thread.cropped && thread.cropped->sequence == frame->sequence && thread.croppedRegion == region) return thread.cropped;
+        FrameRef cropped = framePool.get(frame->data.getSize());
+        if (!cropped) return frame;
+        String error = thread.cropper.crop(frame->getData(), frame->data.getSize(), region, cropped->data);
+        if (error) { log(Debug, "Camera %s: can't crop the frame: %s", (const char*)cfg.name, (const char*)error); return frame; }
+        cropped->sequence = frame->sequence;
+        cropped->time = frame->time;
+        cropped->captureAge = frame->captureAge;
+        // The cropped picture has the standard Huffman tables
+        cropped->tablesOffset = 0;
+        cropped->keyFrame = true;
+        cropped->repeated = frame->repeated;
+        cropped->duplicate = frame->duplicate;
+        cropped->origin = frame->origin;
+        cropped->originTime = frame->originTime;
+        cropped->prepareHeader();
+        thread.cropped = cropped;
+        thread.croppedRegion = region;
+        return cropped;
+    }
+
+    /** The quality governor's parameters: its quality range, its step, and how long the uplink must be congested (or not) before each step */
+    enum { DefaultAdaptiveQuality = 80, MinAdaptiveQuality = 30, QualityStep = 10, QualityStepDownSec = 3, QualityStepUpSec = 10 };
+    /** Lower the stream's JPEG quality while the uplink is congested, and raise it back once it's not (only called by the first fan-out thread).
+        The congestion must last for a few seconds before each step, so a short burst of clients does not change the pictures */
+    void governQuality(const double now)
+    {
+        uint32 load = uplinkScheduler.getLoadPercent();
+        unsigned ceiling = cfg.lowResQuality ? cfg.lowResQuality : (unsigned)DefaultAdaptiveQuality, quality = streamQuality ? streamQuality : ceiling;
+        bool congested = load > 100 && quality > MinAdaptiveQuality, relaxed = load < 80 && quality < ceiling;
+        if (!congested) congestedSince = 0;
+        if (!relaxed) relaxedSince = 0;
+        if (congested && !congestedSince) congestedSince = now;
+        if (relaxed && !relaxedSince) relaxedSince = now;
+        // Lowering is quicker than raising, so the quality does not oscillate around the uplink limit
+        if (congested && now - congestedSince >= QualityStepDownSec) { quality = max(quality - QualityStep, (unsigned)MinAdaptiveQuality); congestedSince = now; }
+        else if (relaxed && now - relaxedSince >= QualityStepUpSec) { quality = min(quality + QualityStep, ceiling); relaxedSince = now; }
+        else return;
+        streamQuality = quality;
+        log(Info, "Camera %s: the uplink is at %u%%, setting the stream's JPEG quality to %u", (const char*)cfg.name, load, quality);
+        v4l2Thread.setStreamQuality(quality);
+    }
+
+    /** Hand a client over to the least busy fan-out thread, if this thread takes much longer to serve its clients.
+        The clients are never shared, the given client is queued for the other thread like a new client, so each client is only used by one thread at a time
+        @param thread   The calling fan-out thread
+        @param duration The time spent serving its clients for the last frame, in seconds */
+    void balance(FanOut & thread, const double duration)
+    {
+        // The pass time is averaged, since a single frame can be slowed down by the scheduler
+        uint32 passTime = (uint32)(thread.passTime.read() * 0.8 + duration * 1000000 * 0.2);
+        thread.passTime.save(passTime);
+        FanOut * idle = 0;
+        for (size_t i = 0; i < fanOuts.getSize(); i++)
+        {
+            FanOut * other = fanOuts.getElementAtUncheckedPosition(i);
+            if (other != &thread && (!idle || other->passTime.read() < idle->passTime.read())) idle = other;
+        }
+        // Only steal when the imbalance is worth the move (twice the other thread's time, and at least a millisecond)
+        if (!idle || thread.clients.getSize() < 2 || passTime < 2 * idle->passTime.read() + 1000) return;
+        // The last client is taken (it's the cheapest to remove)
+        size_t last = thread.clients.getSize() - 1;
+        ClientSocket * client = thread.clients.getElementAtUncheckedPosition(last);
+        if (client->ended) return;
+        // Stop watching its socket here, the other thread watches it once it takes it
+        if (client->monitored) thread.backedUpPool->forgetSocket(client->clientSocket);
+        client->monitored = false;
+        if (client->webSocket) thread.wakeUpPool->forgetSocket(client->clientSocket);
+        for (size_t j = 0; j < client->channels.getSize(); j++)
+            if (client->channels[j].camera != this) client->channels[j].camera->removeListener(thread);
+        {
+            Threading::ScopedLock scope(clientsLock);
+            thread.clients.Forget(last);
+        }
+        --thread.load;
+        ++idle->load;
+        // Assume the load moves with the client, so the next frame does not move another one before the times are measured again
+        thread.passTime.save(passTime - passTime / (uint32)(last + 1));
+        idle->newClients.enqueue(client);
+        idle->wake();
+    }
+
+    /** Send the next pictures to a client multiplexing several cameras, the cameras with a new frame and credits are served in turn
+        @return false if the client disconnected */
+    bool serveChannels(ClientSocket & client)
+    {
+        if (!client.flush()) return false;
+        uint32 count = (uint32)client.channels.getSize();
+        while (!client.frame)
+        {
+            FrameRef next;
+            for (uint32 i = 0; i < count && !next; i++)
+            {
+                uint32 index = (client.nextChannel + i) % count;
+                ClientSocket::Channel & channel = client.channels[index];
+                if (!channel.credits) continue;
+                Camera & source = *channel.camera;
+                Threading::ScopedLock scope(source.frameLock);
+                if (!source.latest || source.latest->sequence == channel.lastSequence) continue;
+                next = source.latest;
+                channel.lastSequence = next->sequence;
+                client.channel = index;
+            }
+            if (!next) return true;
+            client.nextChannel = (client.channel + 1) % count;
+            // The other cameras frames are not measured in this camera's latency statistics
+            client.frame = next; client.sent = 0; client.cached = true;
+            client.startFrame();
+            if (!client.flush()) return false;
+        }
+        return true;
+    }
+
+    /** Stop multiplexing the other cameras on a client
+        @param thread   The fan-out thread the client was given to, if any */
+    void detachChannels(ClientSocket & client, FanOut * thread)
+    {
+        for (size_t i = 0; i < client.channels.getSize(); i++)
+        {
+            Camera * source = client.channels[i].camera;
+            if (source == this) continue;
+            if (thread) source->removeListener(*thread);
+            --source->clientCount;
+        }
+        client.channels.Clear();
+    }
+    /** Wake up the given fan-out thread when a frame is published */
+    void addListener(FanOut & thread) { Threading::ScopedLock scope(listenersLock); listeners.Append(&thread); }
+    /** Stop waking up the given fan-out thread (once, it's added for each multiplexing client) */
+    void removeListener(FanOut & thread)
+    {
+        Threading::ScopedLock scope(listenersLock);
+        for (size_t i = 0; i < listeners.getSize(); i++) if (listeners[i] == &thread) { listeners.Remove(i); return; }
+    }
+    /** Stop multiplexing the other cameras, once the fan-out thread is stopped */
+    void detachClients()
+    {
+        for (size_t t = 0; t < fanOuts.getSize(); t++)
+        {
+            FanOut & fanOut = *fanOuts.getElementAtUncheckedPosition(t);
+            for (size_t i = 0; i < fanOut.clients.getSize(); i++) detachChannels(*fanOut.clients.getElementAtUncheckedPosition(i), &fanOut);
+            while (ClientSocket * client = fanOut.newClients.dequeue()) { detachChannels(*client, 0); fanOut.clients.Append(client); }
+        }
+    }
+
+    /** Get the capture frame rate the clients and the scene need, for the rate governor (only called by the first fan-out thread)
+        @return The frame rate of the fastest stream client (limited to idleFPS while the camera is idle), 0 for the device's maximum */
+    unsigned getWantedFPS(const double now)
+    {
+        // A stream client without a frame rate wants all the frames
+        double interval = -1;
+        {   // The other fan-out threads might be adding or removing clients
+            Threading::ScopedLock scope(clientsLock);
+            for (size_t t = 0; t < fanOuts.getSize(); t++)
+            {
+                const FanOut & fanOut = *fanOuts.getElementAtUncheckedPosition(t);
+                for (size_t i = 0; i < fanOut.clients.getSize(); i++)
+                {
+                    const ClientSocket & client = *fanOut.clients.getElementAtUncheckedPosition(i);
+                    if (!client.snapshot) interval = interval < 0 ? client.minInterval : min(interval, client.minInterval);
+                }
+            }
+        }
+        // Without a stream client, the capture runs for the recorder, the pre-event frames or the activity detector, so it's not limited
+        unsigned wanted = interval > 0 ? (unsigned)(1.0 / interval + 0.99) : 0;
+        if (cfg.idleFPS && !activity.isActive(now) && (!wanted || wanted > cfg.idleFPS)) wanted = cfg.idleFPS;
+        return wanted;
+    }
+
+    // Full resolution picture sending
+private:
+    /** Get the time a full resolution picture can be cached for by the clients, in seconds (while it's served from the cache) */
+    int getFullResMaxAge(const Frame & picture) const
+    {
+        return cfg.fullResCacheMs ? (int)((picture.time + cfg.fullResCacheMs / 1000.0 - Time::getPreciseTime())) : 0;
+    }
+    /** Check if a high priority full resolution picture request is waiting */
+    bool hasHighPriorityStill()
+    {
+        Threading::ScopedLock scope(stillLock);
+        for (size_t i = 0; i < stillClients.getSize(); i++)
+            if (stillClients[i].highPriority) return true;
+        return false;
+    }
+    uint32 stillLoop(StillSender & thread)
+    {
+        while (thread.isRunning())
+        {
+            if (!thread.requested.Wait(500)) continue;
+            // The requests wait for the minimum interval between the switches, so the ones queued meanwhile share the same capture, unless a high
+            // priority request is queued
+            while (uint32 delay = v4l2Thread.getSwitchDelayMs(cfg.fullResCacheMs))
+            {
+                if (hasHighPriorityStill() || !thread.isRunning()) break;
+                thread.requested.Wait(delay);
+            }
+            // Take all the waiting sockets, they'll get the same picture
+            Container::PlainOldData<PendingSocket>::Array waiting;
+            {
+                Threading::ScopedLock scope(stillLock);
+                waiting = stillClients;
+                stillClients.Clear();
+            }
+            if (!waiting.getSize()) continue;
+
+            // Fetch full resolution image here, it's shared with the cache so it's sent without any copy
+            FrameRef pic;
+            String ret = v4l2Thread.captureFullResFrame(pic, cfg.fullResCacheMs);
+            heartbeat();
+            // Tell the event clients
+            if (!ret) wakeFanOuts();
+
+            // The picture is sent in pieces when the Huffman tables are inserted, so it's not copied either, the first buffer is the header
+            size_t tablesOffset = !ret && cfg.insertHuffmanTables ? JPEGInfo::getHuffmanTablesOffset(pic->getData(), pic->data.getSize()) : 0;
+            const char * buffers[4]; int sizes[4];
+            int count = ret ? 0 : JPEGInfo::gather(pic->getData(), pic->data.getSize(), tablesOffset, 0, buffers + 1, sizes + 1);
+            size_t size = ret ? 0 : pic->data.getSize() + (tablesOffset ? (size_t)JPEGInfo::StandardHuffmanTablesSize : 0);
+            String cacheHeaders = ret ? String() : getCacheHeaders(makeETag(pic->sequence, "f"), pic->time, getFullResMaxAge(*pic));
+            String header = ret ? String::Print("HTTP/1.1 500 Internal Server Error\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", ret.getLength()) + ret
+                                : String::Print("HTTP/1.1 200 OK\r\n%sContent-Type: image/jpeg\r\nContent-Length: %u\r\nConnection: %%s\r\n\r\n", (const char*)cacheHeaders, (uint32)size);
+            if (ret) log(Error, "%s", (const char*)ret);
+            for (size_t i = 0; i < waiting.getSize(); i++)
+            {
+                const PendingSocket & pending = waiting.getElementAtUncheckedPosition(i);
+                // The sockets are closed here, unless they are on a persistent connection
+                bool keepAlive = pending.keepAlive && !ret;
+                String answer = ret ? header : String::Print(header, keepAlive ? "keep-alive" : "close");
+                // The header and the picture are sent together, in as few gathered writes as the socket accepts
+                const char ** body = buffers; int * bodySizes = sizes, bodyCount = count + 1; size_t bodySize = size;
+                const char * cropBuffers[2]; int cropSizes[2];
+                if (!ret && pending.region.isSet())
+                {   // The region is cropped from the shared picture for each request, it's quick compared to the capture
+                    JPEGRegion actual;
+                    String error = stillCropper.crop(pic->getData(), pic->data.getSize(), pending.region, croppedStill, &actual);
+                    if (error) { keepAlive = false; answer = String::Print("HTTP/1.1 400 Bad Request\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", error.getLength()) + error; }
+                    // The region actually cropped starts on the previous MCU boundary
+                    else answer = String::Print("HTTP/1.1 200 OK\r\n%sContent-Type: image/jpeg\r\nContent-Length: %u\r\nX-Crop: %d,%d,%d,%d\r\nConnection: %s\r\n\r\n", (const char*)cacheHeaders, croppedStill.getSize(),
+                                                actual.x, actual.y, actual.width, actual.height, keepAlive ? "keep-alive" : "close");
+                    cropBuffers[1] = (const char*)croppedStill.getConstBuffer(); cropSizes[1] = (int)croppedStill.getSize();
+                    body = cropBuffers; bodySizes = cropSizes; bodyCount = error ? 1 : 2; bodySize = error ? 0 : croppedStill.getSize();
+                }
+                body[0] = answer; bodySizes[0] = answer.getLength();
+                if (pending.socket->sendBuffersReliably(body, bodySizes, bodyCount) != (int)(answer.getLength() + bodySize)) keepAlive = false;
+
+                if (keepAlive) { giveBackSocket(pending.socket); continue; }
+                delete pending.socket;
+                if (pending.keepAlive) --stillInFlight;
+            }
+        }
+        return 0;
+    }
+
+    // Timelapse recording
+private:
+    uint32 recordLoop(RecordThread & thread)
+    {
+        while (thread.isRunning())
+        {
+            // Check the schedule twice a second, or as soon as a picture is requested
+            thread.requested.Wait(500);
+            double now = Time::getPreciseTime();
+            if (!recorder.isDue(now)) continue;
+            if (!wakeDevice()) { recorder.skip(now); continue; }
+            if (!cfg.recordFullRes)
+            {   // The capture thread records the next picture, it stops again once it's done if there is no client
+                if (!startThreads()) { log(Error, "Can't start the capture to record a picture"); recorder.skip(now); }
+                continue;
+            }
+            FrameRef pic;
+            String ret = v4l2Thread.captureFullResFrame(pic, cfg.fullResCacheMs);
+            heartbeat();
+            if (ret) { log(Error, "Can't capture the picture to record: %s", (const char*)ret); recorder.skip(now); continue; }
+            wakeFanOuts();
+            recorder.pictureReceived(pic->getData(), pic->data.getSize(), 0);
+        }
+        return 0;
+    }
+
+    // Device monitoring
+private:
+    uint32 startLoop(DeviceStarter & thread)
+    {
+        {
+            Threading::ScopedLock scope(deviceLock);
+            thread.deviceError = startV4L2Device();
+        }
+        startDeviceWatcher();
+        // Like before the server was started, the background capture is started even if the device failed (it's started again when it's back)
+        thread.captureError = startBackgroundCapture();
+        thread.started.Set();
+        return 0;
+    }
+
+    uint32 watchLoop(DeviceWatcher & thread)
+    {
+        // The device is checked when its node appears, and retried while it's there but can't be started (like when udev did not set its permissions yet)
+        int timeoutMs = 0;
+        while (thread.isRunning())
+        {
+            if (!thread.wait(timeoutMs)) {
+                if (thread.isWatching()) continue;
+                log(Warning, "The device %s directory was removed, polling the device instead", (const char*)cfg.device);
+                break;
+            }
+            timeoutMs = -1;
+            if (!thread.isRunning()) break;
+            Threading::ScopedLock scope(deviceLock);
+            if (v4l2Thread.isDevicePresent() || !File::Info(cfg.device).doesExist()) continue;
+            if (!restartDevice()) timeoutMs = DeviceWatcher::RetryMs;
+        }
+        return 0;
+    }
+
+    // Recorded pictures replay
+private:
+    uint32 replayLoop(ReplaySender & thread)
+    {
+        // The replay clients (only used by this thread)
+        Container::NotConstructible<ReplayClient>::IndexList replays;
+        while (thread.isRunning())
+        {
+            {
+                Threading::ScopedLock scope(replayLock);
+                for (size_t i = 0; i < newReplays.getSize(); i++) replays.Append(newReplays[i]);
+                newReplays.Clear();
+            }
+            // Send to the client whose next picture is due first, the others wait for their turn
+            double now = Time::getPreciseTime(), due = 0;
+            size_t next = replays.getSize();
+            for (size_t i = 0; i < replays.getSize(); i++)
+            {
+                const ReplayClient & client = *replays.getElementAtUncheckedPosition(i);
+                if (next == replays.getSize() || client.nextTime < due) { next = i; due = client.nextTime; }
+            }
+            if (next == replays.getSize() || due > now)
+            {
+                thread.requested.Wait(next == replays.getSize() ? 500 : (uint32)min((due - now) * 1000 + 1, 500.0));
+                continue;
+            }
+            ReplayClient * client = replays.getElementAtUncheckedPosition(next);
+            if (!client->sendNext(recorder.getStore()))
+            {
+                client->finish();
+                replays.Remove(next);
+                continue;
+            }
+            client->nextTime = !client->nextTime || now - client->nextTime > client->interval ? now + client->interval : client->nextTime + client->interval;
+        }
+        return 0;
+    }
+
+    // The last time the device was checked (when monitoring it)
+    time_t lastCheckedTime;
+    // Set if the device was present at the last check
+    bool wasPresent;
+    // The capture watchdog's state (only used by the server loop): the frames captured at the last check, the last time they changed (or a recovery
+    // step was taken), the time the capture stalled (0 if it's not stalled), and the next recovery step
+    uint64   watchdogFrames;
+    double   progressTime, stallTime;
+    unsigned recoveryStep;
+
+    /** Give back an answered socket to the server, or queue it if it must be done from the server loop thread */
+    void giveBackSocket(Socket * socket)
+    {
+        if (!routing || !routing->canAdoptFromAnyThread())
+        {
+            Threading::ScopedLock scope(stillLock);
+            returnedSockets.Append(socket);
+            return;
+        }
+        if (!routing->adoptSocket(socket)) delete socket;
+        --stillInFlight;
+    }
+
+public:
+    /** The HTTP server the answered sockets are given back to */
+    Network::Server::URLRouting * routing;
+    /** The RTSP server woken up for each frame while it has viewers, if enabled (not owned) */
+    RTSPServer * rtsp;
+    /** The number of RTSP sessions playing this camera */
+    Threading::Atomic<uint32> rtspViewers;
+
+    /** Check if some sockets will be given back to the server soon */
+    inline bool hasSocketsInFlight() const { return stillInFlight.read() > 0; }
+    /** Give back the queued answered sockets to the server, this must be called from the server loop thread */
+    void giveBackSockets()
+    {
+        Container::PlainOldData<Socket *>::Array sockets;
+        {
+            Threading::ScopedLock scope(stillLock);
+            sockets = returnedSockets;
+            returnedSockets.Clear();
+        }
+        for (size_t i = 0; i < sockets.getSize(); i++)
+        {
+            Socket * socket = sockets.getElementAtUncheckedPosition(i);
+            if (!routing || !routing->adoptSocket(socket)) delete socket;
+            --stillInFlight;
+        }
+    }
+
+    // Construction and destruction
+public:
+    bool heartbeat() { lastSeenTime = (uint32)time(NULL); return true; }
+
+    Camera(const Configuration & cfg) : cfg(cfg), v4l2Thread(*this), nextClientId(0), pastBytesSent(0), pastFramesDropped(0), streamKbps(0), streamInterval(0), streamTime(0), streamSequence(0), sequence(0), framesRepeated(0), lastFingerprint(0), framesDuplicate(0), recoverySteps(0), recoveries(0), recoveryMs(0), lastRecoveryMs(0), streamQuality(0), congestedSince(0), relaxedSince(0), stillInFlight(0), stillSender(*this), recordThread(*this), multicastSequence(0), framesMulticast(0), deviceWatcher(*this), deviceStarter(*this), replaySender(*this), lastSeenTime(0), lastCheckedTime(0), wasPresent(false), watchdogFrames(0), progressTime(0), stallTime(0), recoveryStep(0), routing(0), rtsp(0), rtspViewers(0)
+    {
+        // Bounded, since more threads than cores only add context switches
+        uint32 senders = min(max(cfg.senderThreads, 1U), 16U);
+        for (uint32 i = 0; i < senders; i++) fanOuts.Append(new FanOut(*this, i));
+    }
+    ~Camera()
+    {
+        deviceWatcher.stop(); v4l2Thread.stopThread(); stopFanOuts(); detachClients(); stillSender.destroyThread(); replaySender.destroyThread(); recordThread.destroyThread();
+        for (size_t i = 0; i < newReplays.getSize(); i++) delete newReplays.getElementAtUncheckedPosition(i);
+        for (size_t i = 0; i < stillClients.getSize(); i++) delete stillClients.getElementAtUncheckedPosition(i).socket;
+        for (size_t i = 0; i < returnedSockets.getSize(); i++) delete returnedSockets.getElementAtUncheckedPosition(i);
+    }
+};
+        
+        
+
+/** The HTTP server, serving all the cameras.
+    The first camera is served on the root routes (like /mjpg), and each named camera is also served on /cam/<name>/ routes */
+struct MJPGServer
+{
+    typedef Network::Server::URLRouting URLRouting;
+    URLRouting routing;
+    // The cameras (owned)
+    Container::NotConstructible<Camera>::IndexList cameras;
+    // The RTSP server, if enabled
+    RTSPServer rtsp;
+
+    /** The configuration file, read again when the configuration is reloaded */
+    String configFile;
+    /** The lock serializing the configuration reloads */
+    Threading::FastLock reloadLock;
+
+    MJPGServer() : handshaker(*this), mosaicTime(0) {}
+
+    /** Add a camera to serve, this must be done before starting the server */
+    void addCamera(const Configuration & cfg) { cameras.Append(new Camera(cfg)); }
+
+    /** Find the camera for the given request, from the captured name or the first camera for the root routes */
+    Camera * getCamera(URLRouting::Comm & comm)
+    {
+        if (!comm.captures.getSize()) return cameras.getSize() ? cameras.getElementAtUncheckedPosition(0) : 0;
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            if (camera->cfg.name == comm.captures[0]) return camera;
+        }
+        return 0;
+    }
+
+    /** The index page, it's only rendered again when a camera's resolution changes */
+    URLRouting::PrerenderedAnswer indexPage;
+    /** The cameras' resolutions the index page was rendered for */
+    Container::PlainOldData<int>::Array indexResolutions;
+    /** The lock protecting the index page, since the routes can be called from multiple threads */
+    Threading::FastLock indexLock;
+
+    /** Get the current resolutions of all the cameras (low resolution width and height, then high resolution's ones) */
+    Container::PlainOldData<int>::Array getResolutions()
+    {
+        Container::PlainOldData<int>::Array resolutions;
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            const V4L2Thread & v4l2Thread = cameras.getElementAtUncheckedPosition(i)->v4l2Thread;
+            resolutions.Append(v4l2Thread.getLowResWidth());
+            resolutions.Append(v4l2Thread.getLowResHeight());
+            resolutions.Append(v4l2Thread.getHighResWidth());
+            resolutions.Append(v4l2Thread.getHighResHeight());
+        }
+        return resolutions;
+    }
+
+    /** Render the index page if it's not rendered yet, or if a resolution changed since it was rendered. The index lock must be taken */
+    void renderIndexPage()
+    {
+        Container::PlainOldData<int>::Array resolutions = getResolutions();
+        if (indexPage && resolutions == indexResolutions) return;
+        indexResolutions = resolutions;
+
+        String tokenURL = config.securityToken ? "?token=" + config.securityToken : String();
+        String baseURL = routing.getBaseURL();
+
+        String list;
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            String url = i ? baseURL + "/cam/" + camera->cfg.name : baseURL;
+            String title = camera->cfg.name ? "[" + camera->cfg.name + "] " : String();
+            list += String::Print(
+                "<li><strong>%sSmall resolution (%dx%d) mjpeg stream: </strong>%s/mjpg%s</li>"
+                "<li><strong>%sSmall resolution (%dx%d) picture: </strong>%s/snapshot%s</li>"
+                "<li><strong>%sFull resolution (%dx%d) picture: </strong>%s/full_res%s</li>",
+                (const char*)title, camera->v4l2Thread.getLowResWidth(), camera->v4l2Thread.getLowResHeight(), (const char*)url, (const char*)tokenURL, 
+                (const char*)title, camera->v4l2Thread.getLowResWidth(), camera->v4l2Thread.getLowResHeight(), (const char*)url, (const char*)tokenURL, 
+                (const char*)title, camera->v4l2Thread.getHighResWidth(), camera->v4l2Thread.getHighResHeight(), (const char*)url, (const char*)tokenURL);
+        }
+
+        indexPage.render(Network::Server::EventHTTP::getStatusLine(Protocol::HTTP::Ok), "text/html", String::Print("<!doctype html>"
+        "<html><body>"
+        "<h1>MJPEG Streamer</h1>"
+        "<div>URL list for this server:</div>"
+        "<ul>%s</ul>"
+        "<h2>Demo below</h2>"
+        "<div><img src='/mjpg%s'></div>"
+        "<div><button id='capt'>Full resolution</button></div>"
+        "<div><img id='fr'></div>"
+        "<script>var button = document.querySelector('#capt'), pic = document.querySelector('#fr');"
+        "button.addEventListener('click', function(e) { e.preventDefault(); pic.src = '/full_res?time='+(new Date()).getTime()+'&%s'; });</script>"
+        "</body></html>", 
+            (const char*)list, (const char*)tokenURL, tokenURL ? (const char*)tokenURL + 1 : ""));
+    }
+
+    /** Read the configuration file again and apply the changed keys to the running cameras, without closing their streams
+        @param applied  On output, the applied keys, comma separated and prefixed by the camera's name for the named cameras
+        @param pending  On output, the changed keys that need a restart, in the same format
+        @return An empty string on success, or the error message */
+    String reload(String & applied, String & pending)
+    {
+        if (!configFile) return "No configuration file";
+        Threading::ScopedLock scope(reloadLock);
+        Configuration next;
+        Configuration::Cameras nextCameras;
+        String error = next.fromJSON(configFile, nextCameras);
+        if (error) return error;
+
+        applied = pending = "";
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            // Without a "cameras" array, the global configuration is the only camera
+            const Configuration * cfg = nextCameras.getSize() ? 0 : &next;
+            for (size_t j = 0; !cfg && j < nextCameras.getSize(); j++)
+                if (nextCameras.getElementAtUncheckedPosition(j)->name == camera->cfg.name) cfg = nextCameras.getElementAtUncheckedPosition(j);
+            if (!cfg) { log(Warning, "Camera %s is not in the configuration anymore, a restart is required to remove it", (const char*)camera->cfg.name); continue; }
+
+            String prefix = camera->cfg.name ? camera->cfg.name + "." : String(), done, keys = camera->reload(*cfg, done);
+            while (done) applied += (applied ? "," : "") + prefix + done.splitUpTo(",");
+            while (keys) pending += (pending ? "," : "") + prefix + keys.splitUpTo(",");
+        }
+        if (nextCameras.getSize() > cameras.getSize()) log(Warning, "A restart is required to add the new cameras");
+
+        // The index page shows the global token in its links
+        if (next.securityToken != config.securityToken)
+        {
+            Threading::ScopedLock scope(indexLock);
+            config.securityToken = next.securityToken;
+            indexResolutions.Clear();
+        }
+        log(Info, "Configuration reloaded, applied: %s", applied ? (const char*)applied : "none");
+        if (pending) log(Warning, "Configuration keys requiring a restart: %s", (const char*)pending);
+        return "";
+    }
+
+    /** Reload the configuration file on a POST request */
+    Stream::InputStream * Config(URLRouting::Comm & comm)
+    {
+        Camera * first = getCamera(comm);
+        if (!first) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        if (comm.method != "POST") return comm.sendError("Bad method", Protocol::HTTP::BadMethod);
+        if (!first->FilterAccess(comm, false, true)) return 0;
+        String applied, pending, error = reload(applied, pending);
+        if (error) return comm.sendError(error, Protocol::HTTP::InternalServerError);
+        comm.addAnswerHeader("Content-Type", "application/json");
+        comm.addAnswerHeader("Cache-Control", "no-cache");
+        comm.returnText = String::Print("{\"applied\":\"%s\",\"restartRequired\":\"%s\"}", (const char*)applied, (const char*)pending);
+        return 0;
+    }
+
+    Stream::InputStream * App(URLRouting::Comm & comm)
+    {
+        Camera * first = getCamera(comm);
+        if (!first) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        if (!first->FilterAccess(comm, false)) return 0;
+        Threading::ScopedLock scope(indexLock);
+        renderIndexPage();
+        return comm.sendPrerendered(indexPage);
+    }
+
+    /** Get the name of the camera at the given index (its index if it's not named) */
+    String getCameraName(const size_t index)
+    {
+        const String & name = cameras.getElementAtUncheckedPosition(index)->cfg.name;
+        return name ? name : String::Print("%u", (unsigned)index);
+    }
+
+    /** The TLS termination, if enabled */
+    TLSServer tls;
+
+    /** The TLS handshakes thread. The accepted connections are captured from the HTTP server while their handshake runs, so a slow client
+        does not delay the other connections, and they are given back to the server once the kernel has their record layer */
+    struct TLSHandshaker : public Threading::Thread
+    {
+        /** A handshake in progress */
+        struct Handshake
+        {
+            Camera::Socket *    socket;
+            /** The TLS session */
+            void *              session;
+            /** The time the client is closed if the handshake is not done */
+            double              deadline;
+            /** The events the handshake waits for, and set if they happened */
+            short               events;
+            bool                ready;
+        };
+
+        MJPGServer & server;
+        /** The descriptor waking up the thread */
+        int wakeFd;
+        /** The lock protecting the socket arrays below */
+        Threading::FastLock lock;
+        /** The accepted sockets, until the server forgot them */
+        Container::PlainOldData<Camera::Socket *>::Array accepted;
+        /** The sockets forgotten by the server, waiting for this thread to take them */
+        Container::PlainOldData<Camera::Socket *>::Array queued;
+        /** The sockets whose handshake is done, waiting for the server loop to take them back (when it can't be done from any thread) */
+        Container::PlainOldData<Camera::Socket *>::Array done;
+        /** The number of sockets captured and not given back yet */
+        Threading::Atomic<uint32> inFlight;
+
+        /** Wake up the thread, this is called from any thread */
+        void wake() { if (wakeFd != -1) eventfd_write(wakeFd, 1); }
+        /** Capture an accepted socket, this is called from the accepting thread */
+        void capture(Camera::Socket & socket)
+        {
+            Threading::ScopedLock scope(lock);
+            accepted.Append(&socket);
+            ++inFlight;
+        }
+        /** Start the handshake on a socket once the server forgot it
+            @return false if the socket was not captured on accept */
+        bool start(Camera::Socket & socket)
+        {
+            {
+                Threading::ScopedLock scope(lock);
+                if (!accepted.removeItem(&socket)) return false;
+                queued.Append(&socket);
+            }
+            wake();
+            return true;
+        }
+        /** Give back a socket whose handshake is done to the server, or queue it if it must be done from the server loop thread */
+        void giveBack(Camera::Socket * socket)
+        {
+            if (!server.routing.canAdoptFromAnyThread())
+            {
+                Threading::ScopedLock scope(lock);
+                done.Append(socket);
+                return;
+            }
+            if (!server.routing.adoptSocket(socket)) delete socket;
+            --inFlight;
+        }
+        /** Give back the queued sockets to the server, this must be called from the server loop thread */
+        void giveBackSockets()
+        {
+            Container::PlainOldData<Camera::Socket *>::Array sockets;
+            {
+                Threading::ScopedLock scope(lock);
+                sockets = done;
+                done.Clear();
+            }
+            for (size_t i = 0; i < sockets.getSize(); i++)
+            {
+                if (!server.routing.adoptSocket(sockets[i])) delete sockets[i];
+                --inFlight;
+            }
+        }
+        /** Check if some sockets will be given back to the server soon */
+        bool hasSocketsInFlight() const { return inFlight.read() > 0; }
+        /** Stop the thread */
+        void stop() { signalShouldStop(); wake(); destroyThread(); }
+
+        uint32 runThread() { return server.handshakeLoop(*this); }
+        TLSHandshaker(MJPGServer & server) : Threading::Thread("TLSHandshaker"), server(server), wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), inFlight(0) {}
+        ~TLSHandshaker()
+        {
+            stop();
+            for (size_t i = 0; i < queued.getSize(); i++) delete queued[i];
+            for (size_t i = 0; i < done.getSize(); i++) delete done[i];
+            if (wakeFd != -1) ::close(wakeFd);
+        }
+    };
+    /** The TLS handshakes thread, running if the TLS termination is enabled */
+    TLSHandshaker handshaker;
+
+    /** Capture an accepted connection for its TLS handshake (this is called from the accepting thread) */
+    URLRouting::AcceptAction clientAccepted(Camera::Socket & socket)
+    {
+        if (socket.getTypeID() != 1) return Network::Server::EventHTTP::RefuseClient;
+        handshaker.capture(socket);
+        return Network::Server::EventHTTP::CaptureClient;
+    }
+
+    /** Run the TLS handshakes, each one progresses when its socket is ready, so none waits for another */
+    uint32 handshakeLoop(TLSHandshaker & thread)
+    {
+        // The handshakes in progress, and the descriptors polled for them after the wake up one (only used by this thread)
+        Container::WithCopyConstructor<TLSHandshaker::Handshake>::Array handshakes;
+        Container::WithCopyConstructor<struct pollfd>::Array fds;
+        while (thread.isRunning())
+        {
+            double now = Time::getPreciseTime();
+            {
+                Threading::ScopedLock scope(thread.lock);
+                for (size_t i = 0; i < thread.queued.getSize(); i++)
+                {
+                    // The client usually sent its hello already, so the handshake is started without waiting
+                    TLSHandshaker::Handshake handshake = { thread.queued[i], 0, now + TLSServer::HandshakeTimeoutMs / 1000.0, 0, true };
+                    handshakes.Append(handshake);
+                }
+                thread.queued.Clear();
+            }
+            for (size_t i = handshakes.getSize(); i > 0; i--)
+            {
+                TLSHandshaker::Handshake & handshake = handshakes[i - 1];
+                String error;
+                TLSServer::Progress progress = TLSServer::Failed;
+                if (now >= handshake.deadline) { tls.abortHandshake(handshake.session); error = "TLS handshake timed out"; }
+                else if (handshake.ready) progress = tls.handshake(handshake.session, ((Network::Socket::BerkeleySocket*)handshake.socket)->getDescriptor(), error);
+                else continue;
+                handshake.ready = false;
+                if (progress == TLSServer::WantRead || progress == TLSServer::WantWrite)
+                {
+                    handshake.events = progress == TLSServer::WantRead ? POLLIN : POLLOUT;
+                    continue;
+                }
+                Camera::Socket * socket = handshake.socket;
+                handshakes.Remove(i - 1);
+                if (progress == TLSServer::Done) { thread.giveBack(socket); continue; }
+                Network::Address::BaseAddress * address = socket->getPeerName();
+                log(Info, "TLS connection from %s refused: %s", address ? (const char*)address->asText() : "?", (const char*)error);
+                delete address;
+                delete socket;
+                --thread.inFlight;
+            }
+
+            // Wait for the sockets to be ready, or the next deadline
+            int timeoutMs = -1;
+            struct pollfd wake = { thread.wakeFd, POLLIN, 0 };
+            fds.Clear();
+            fds.Append(wake);
+            for (size_t i = 0; i < handshakes.getSize(); i++)
+            {
+                const TLSHandshaker::Handshake & handshake = handshakes[i];
+                struct pollfd ready = { ((Network::Socket::BerkeleySocket*)handshake.socket)->getDescriptor(), handshake.events, 0 };
+                fds.Append(ready);
+                int left = (int)((handshake.deadline - now) * 1000) + 1;
+                if (timeoutMs < 0 || left < timeoutMs) timeoutMs = left;
+            }
+            if (::poll(&fds[0], (nfds_t)fds.getSize(), timeoutMs) <= 0) continue;
+            if (fds[0].revents & POLLIN) { eventfd_t value; eventfd_read(thread.wakeFd, &value); }
+            for (size_t i = 0; i < handshakes.getSize(); i++) handshakes[i].ready = fds[i + 1].revents != 0;
+        }
+        // The server is stopping, so the clients still in their handshake are closed
+        for (size_t i = 0; i < handshakes.getSize(); i++)
+        {
+            tls.abortHandshake(handshakes[i].session);
+            delete handshakes[i].socket;
+            --thread.inFlight;
+        }
+        return 0;
+    }
+
+    /** Called by the HTTP server once it forgot a socket captured by a route, or on accept */
+    void socketForgotten(Camera::Socket & socket)
+    {
+        if (handshaker.start(socket)) return;
+        for (size_t i = 0; i < cameras.getSize(); i++)
+            if (cameras.getElementAtUncheckedPosition(i)->socketForgotten(socket)) return;
+    }
+
+    /** Report the frames latency of each camera, as JSON */
+    Stream::InputStream * Stats(URLRouting::Comm & comm)
+    {
+        Camera * first = getCamera(comm);
+        if (!first) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        if (!first->FilterAccess(comm, false)) return 0;
+        String list;
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            String fpsLimit = camera->cfg.adaptiveFPS ? String::Print(",\"fpsLimit\":%u", camera->v4l2Thread.getFrameRateLimit()) : String();
+            if (camera->cfg.adaptiveQuality) fpsLimit += String::Print(",\"quality\":%u", camera->streamQuality);
+            String activity = camera->activity.isEnabled() ? String::Print(",\"activity\":{\"active\":%s,\"score\":%.1f}", camera->activity.isActive(Time::getPreciseTime()) ? "true" : "false", camera->activity.getScore()) : String();
+            list += String::Print("%s\"%s\":{\"clients\":%u,\"frames\":%u,\"latency\":%s%s%s}", i ? "," : "", (const char*)getCameraName(i), 
+                                  camera->clientCount.read(), camera->sequence, (const char*)camera->latency.toJSON(), (const char*)activity, (const char*)fpsLimit);
+        }
+        comm.addAnswerHeader("Content-Type", "application/json");
+        comm.addAnswerHeader("Cache-Control", "no-cache");
+        comm.returnText = "{\"cameras\":{" + list + "}}";
+        return 0;
+    }
+
+    /** Report the counters of each camera, in Prometheus text format */
+    Stream::InputStream * Metrics(URLRouting::Comm & comm)
+    {
+        Camera * first = getCamera(comm);
+        if (!first) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        if (!first->FilterAccess(comm, false)) return 0;
+
+        // The counters families, each camera adds its series to each family
+        enum { FramesCaptured, FramesErrored, FramesTruncated, FramesNotScaled, FramesThrottled, FramesStale, FramesPublished, FramesRecorded, RecordErrors, FramesAnalyzed, FramesDropped, BytesSent, IOCTLRetries, IOCTLFailures, Clients, FramePoolBytes, FramePoolPeakBytes, FramesRejected, SharedFramesSkipped, FramesMulticast, RTSPSessions, FramesRepeated, FramesDuplicate, RecoverySteps, Recoveries, CounterCount };
+        static const char * families[CounterCount][3] = {
+            { "frames_captured_total",  "counter",  "Frames fetched from the device" },
+            { "frames_errored_total",   "counter",  "Frames dropped because the driver flagged them as corrupt" },
+            { "frames_truncated_total", "counter",  "Frames dropped because they are truncated or not a JPEG picture" },
+            { "frames_not_scaled_total", "counter", "Frames dropped because they could not be downscaled for the preview" },
+            { "frames_throttled_total", "counter",  "Frames dropped to respect the maximum frame rate" },
+            { "frames_stale_total",     "counter",  "Frames dropped after a resolution switch because they are stale or in the wrong format" },
+            { "frames_published_total", "counter",  "Frames published to the clients" },
+            { "frames_recorded_total",  "counter",  "Pictures saved by the timelapse recorder" },
+            { "record_errors_total",    "counter",  "Pictures the timelapse recorder could not capture or save" },
+            { "frames_analyzed_total",  "counter",  "Frames analyzed by the activity detector" },
+            { "frames_dropped_total",   "counter",  "Frames not sent to a client because it was backed up" },
+            { "bytes_sent_total",       "counter",  "Bytes sent to the stream and snapshot clients" },
+            { "ioctl_retries_total",    "counter",  "Device ioctl calls retried after a recoverable error" },
+            { "ioctl_failures_total",   "counter",  "Device ioctl calls that failed" },
+            { "clients",                "gauge",    "Current number of stream and snapshot clients" },
+            { "frame_pool_bytes",       "gauge",    "Memory used by the frames buffers" },
+            { "frame_pool_peak_bytes",  "gauge",    "Highest memory used by the frames buffers" },
+            { "frames_rejected_total",  "counter",  "Frames dropped because the frame pool reached its memory limit" },
+            { "shared_frames_skipped_total", "counter", "Frames not published in the shared memory because all the slots were read" },
+            { "frames_multicast_total", "counter",  "Frames sent to the multicast group" },
+            { "rtsp_sessions",          "gauge",    "RTSP sessions playing the stream" },
+            { "frames_repeated_total",  "counter",  "Frames repeated while the device was switched to the full resolution" },
+            { "frames_duplicate_total", "counter",  "Frames identical to the previous one" },
+            { "capture_recovery_steps_total", "counter", "Recovery steps taken by the capture watchdog" },
+            { "capture_recoveries_total", "counter", "Capture stalls recovered by the watchdog" },
+        };
+        String series[CounterCount], clientSeries, unsentSeries, activitySeries, recoveryTime, lastRecovery, fullRes, switchTime, frameLatency;
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            const V4L2Thread::Counters & counters = camera->v4l2Thread.getCounters();
+            String labels = "camera=\"" + getCameraName(i) + "\"";
+            uint64 values[CounterCount] = { counters.framesCaptured.read(), counters.framesErrored.read(), counters.framesTruncated.read(), counters.framesNotScaled.read(),
+                                            counters.framesThrottled.read(), counters.framesStale.read(), camera->sequence - camera->framesRepeated.read(), 
+                                            camera->recorder.framesRecorded.read(), camera->recorder.recordErrors.read(), camera->activity.framesAnalyzed.read(), 0, 0, counters.ioctlRetries.read(), counters.ioctlFailures.read(), 0,
+                                            camera->framePool.getBytes(), camera->framePool.getPeakBytes(), camera->framePool.getRejected(), camera->sharedOutput.getSkipped(), camera->framesMulticast.read(), camera->rtspViewers.read(), camera->framesRepeated.read(), camera->framesDuplicate.read(),
+                                            camera->recoverySteps.read(), camera->recoveries.read() };
+            {
+                Threading::ScopedLock scope(camera->clientsLock);
+                values[FramesDropped] = camera->pastFramesDropped;
+                values[BytesSent] = camera->pastBytesSent;
+                for (size_t t = 0; t < camera->fanOuts.getSize(); t++)
+                {
+                    const Camera::FanOut & fanOut = *camera->fanOuts.getElementAtUncheckedPosition(t);
+                    values[Clients] += fanOut.clients.getSize();
+                    for (size_t j = 0; j < fanOut.clients.getSize(); j++)
+                    {
+                        const Camera::ClientSocket & client = *fanOut.clients.getElementAtUncheckedPosition(j);
+                        values[FramesDropped] += client.framesDropped;
+                        values[BytesSent] += client.bytesSent;
+                        clientSeries += String::Print("mjpgserver_client_bytes_sent_total{%s,client=\"%s\",id=\"%u\"} " PF_LLU "\n", (const char*)labels, (const char*)client.address, client.id, client.bytesSent);
+                        unsentSeries += String::Print("mjpgserver_client_unsent_bytes{%s,client=\"%s\",id=\"%u\"} %u\n", (const char*)labels, (const char*)client.address, client.id, client.getUnsentSize());
+                    }
+                }
+            }
+            for (size_t m = 0; m < CounterCount; m++) series[m] += String::Print("mjpgserver_%s{%s} " PF_LLU "\n", families[m][0], (const char*)labels, values[m]);
+            if (camera->activity.isEnabled()) activitySeries += String::Print("mjpgserver_activity_score{%s} %.1f\n", (const char*)labels, camera->activity.getScore());
+            recoveryTime += String::Print("mjpgserver_capture_recovery_seconds_total{%s} %.3f\n", (const char*)labels, camera->recoveryMs.read() / 1000.0);
+            lastRecovery += String::Print("mjpgserver_capture_last_recovery_seconds{%s} %.3f\n", (const char*)labels, camera->lastRecoveryMs.read() / 1000.0);
+            fullRes += counters.fullResDuration.toPrometheus("mjpgserver_full_res_duration_seconds", labels);
+            switchTime += counters.switchDuration.toPrometheus("mjpgserver_switch_duration_seconds", labels);
+            frameLatency += camera->latency.capture.toPrometheus("mjpgserver_frame_latency_seconds", labels + ",stage=\"capture\"")
+                          + camera->latency.firstByte.toPrometheus("mjpgserver_frame_latency_seconds", labels + ",stage=\"first_byte\"")
+                          + camera->latency.lastByte.toPrometheus("mjpgserver_frame_latency_seconds", labels + ",stage=\"last_byte\"");
+        }
+
+        String out;
+        for (size_t m = 0; m < CounterCount; m++)
+            out += String::Print("# HELP mjpgserver_%s %s\n# TYPE mjpgserver_%s %s\n", families[m][0], families[m][2], families[m][0], families[m][1]) + series[m];
+        out += "# HELP mjpgserver_client_bytes_sent_total Bytes sent to each current client\n# TYPE mjpgserver_client_bytes_sent_total counter\n" + clientSeries;
+        out += "# HELP mjpgserver_client_unsent_bytes Bytes queued in the kernel for each current client and not sent yet\n# TYPE mjpgserver_client_unsent_bytes gauge\n" + unsentSeries;
+        out += "# HELP mjpgserver_activity_score Percentage of the picture that changed in the last analyzed frame\n# TYPE mjpgserver_activity_score gauge\n" + activitySeries;
+        out += "# HELP mjpgserver_capture_recovery_seconds_total Time the capture was stalled until the watchdog recovered it\n# TYPE mjpgserver_capture_recovery_seconds_total counter\n" + recoveryTime;
+        out += "# HELP mjpgserver_capture_last_recovery_seconds Duration of the last capture stall recovered by the watchdog\n# TYPE mjpgserver_capture_last_recovery_seconds gauge\n" + lastRecovery;
+        out += "# HELP mjpgserver_full_res_duration_seconds Time to capture a full resolution picture\n# TYPE mjpgserver_full_res_duration_seconds histogram\n" + fullRes;
+        out += "# HELP mjpgserver_switch_duration_seconds Time to switch the sensor to full resolution\n# TYPE mjpgserver_switch_duration_seconds histogram\n" + switchTime;
+        out += "# HELP mjpgserver_frame_latency_seconds Frames latency at each stage\n# TYPE mjpgserver_frame_latency_seconds histogram\n" + frameLatency;
+
+        comm.addAnswerHeader("Content-Type", "text/plain; version=0.0.4");
+        comm.addAnswerHeader("Cache-Control", "no-cache");
+        comm.returnText = out;
+        return 0;
+    }
+
+    /** The mosaic of the cameras: the last mosaic picture, the time it was made, and the planes it's made in (protected by the mosaic lock) */
+    Threading::FastLock mosaicLock;
+    Utils::MemoryBlock  mosaic, mosaicPlanes;
+    double              mosaicTime;
+    JPEGDownscaler      mosaicCoder;
+
+    /** Make the mosaic picture from the last frame of each camera, at 1/8 scale (only the DC coefficients are decoded).
+        The cameras are tiled in a grid (as square as possible) of cells as large as the largest thumbnail, a camera without a JPEG frame is a dark cell.
+        The mosaic lock must be taken */
+    String renderMosaic()
+    {
+        size_t count = cameras.getSize();
+        Container::WithCopyConstructor<FrameRef>::Array frames;
+        int cellWidth = 1, cellHeight = 1;
+        for (size_t i = 0; i < count; i++)
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            FrameRef frame;
+            if (!camera->isH264())
+            {
+                Threading::ScopedLock scope(camera->frameLock);
+                frame = camera->latest;
+            }
+            JPEGInfo info;
+            if (frame && !info.parse(frame->data.getConstBuffer(), frame->data.getSize())) frame.reset();
+            if (frame)
+            {
+                cellWidth = max(cellWidth, (info.width + 7) / 8);
+                cellHeight = max(cellHeight, (info.height + 7) / 8);
+            }
+            frames.Append(frame);
+        }
+
+        int columns = 1;
+        while ((size_t)(columns * columns) < count) columns++;
+        const int rows = (int)((count + columns - 1) / columns);
+        const int width = columns * cellWidth, height = rows * cellHeight, planeSize = width * height;
+        if (!mosaicPlanes.ensureSize((uint32)planeSize * JPEGDownscaler::MaxComponents, true)) return "Out of memory";
+        uint8 * buffer = mosaicPlanes.getBuffer();
+        memset(buffer, 16, planeSize);
+        memset(buffer + planeSize, 128, planeSize * 2);
+        for (size_t i = 0; i < count; i++)
+        {
+            const FrameRef & frame = frames[i];
+            if (!frame) continue;
+            String ret = mosaicCoder.decodeDC(frame->data.getConstBuffer(), frame->data.getSize());
+            if (ret) { log(Debug, "Camera %s: can't decode the mosaic thumbnail: %s", (const char*)getCameraName(i), (const char*)ret); continue; }
+            // Centered in its cell
+            int x = (int)(i % columns) * cellWidth + (cellWidth - mosaicCoder.getWidth()) / 2, y = (int)(i / columns) * cellHeight + (cellHeight - mosaicCoder.getHeight()) / 2;
+            uint8 * planes[JPEGDownscaler::MaxComponents];
+            for (int c = 0; c < JPEGDownscaler::MaxComponents; c++) planes[c] = buffer + c * planeSize + y * width + x;
+            mosaicCoder.getThumbnail(planes, width, cellWidth, cellHeight);
+        }
+        const uint8 * planes[JPEGDownscaler::MaxComponents] = { buffer, buffer + planeSize, buffer + planeSize * 2 };
+        return mosaicCoder.encodePlanes(planes, width, width, height, mosaic);
+    }
+
+    /** Report the durations of the profiled hot paths, as JSON (see the profiling option) */
+    Stream::InputStream * Profile(URLRouting::Comm & comm)
+    {
+        Camera * first = getCamera(comm);
+        if (!first) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        if (!first->FilterAccess(comm, false)) return 0;
+        if (!Profiler::isStarted()) return comm.sendError("Profiling is not enabled", Protocol::HTTP::NotFound);
+
+        comm.addAnswerHeader("Content-Type", "application/json");
+        comm.addAnswerHeader("Cache-Control", "no-cache");
+        comm.returnText = Profiler::toJSON();
+        return 0;
+    }
+
+    /** The memory used by a camera, per subsystem, as a JSON object (the frames referenced by the clients, the history and the outputs are in the
+        frames pool, so they are only counted there)
+        @param total    On output, the bytes accounted for this camera */
+    String getMemoryJSON(Camera & camera, uint64 & total)
+    {
+        size_t frames = 0, used = 0, fullResFrames = 0, fullResUsed = 0, historyFrames = 0, historyBytes = 0, clients = 0, clientsBytes = 0;
+        unsigned segments = 0;
+        const FramePool & fullResPool = camera.v4l2Thread.getFullResPool();
+        camera.framePool.getCounts(frames, used);
+        fullResPool.getCounts(fullResFrames, fullResUsed);
+        camera.history.getUsage(historyFrames, historyBytes);
+        size_t hlsBytes = camera.hls.getBytes(segments), deviceBytes = camera.v4l2Thread.getDeviceBuffersBytes();
+        {
+            Threading::ScopedLock scope(camera.clientsLock);
+            for (size_t t = 0; t < camera.fanOuts.getSize(); t++)
+            {
+                const Camera::FanOut & fanOut = *camera.fanOuts.getElementAtUncheckedPosition(t);
+                clients += fanOut.clients.getSize();
+                for (size_t j = 0; j < fanOut.clients.getSize(); j++)
+                {
+                    const Camera::ClientSocket & client = *fanOut.clients.getElementAtUncheckedPosition(j);
+                    clientsBytes += sizeof(client) + client.address.getLength() + client.header.getLength() + client.events.getLength() + client.channels.getSize() * sizeof(Camera::ClientSocket::Channel);
+                }
+            }
+        }
+        total = (uint64)camera.framePool.getBytes() + fullResPool.getBytes() + hlsBytes + deviceBytes + clientsBytes;
+        return String::Print("{\"frames\":{\"bytes\":" PF_LLU ",\"peak\":" PF_LLU ",\"limit\":" PF_LLU ",\"allocated\":%u,\"used\":%u},"
+                             "\"fullRes\":{\"bytes\":" PF_LLU ",\"peak\":" PF_LLU ",\"allocated\":%u,\"used\":%u},"
+                             "\"preEvent\":{\"bytes\":" PF_LLU ",\"frames\":%u},\"hls\":{\"bytes\":" PF_LLU ",\"segments\":%u},"
+                             "\"device\":{\"bytes\":" PF_LLU "},\"clients\":{\"bytes\":" PF_LLU ",\"count\":%u},\"total\":" PF_LLU "}",
+                             (uint64)camera.framePool.getBytes(), (uint64)camera.framePool.getPeakBytes(), (uint64)camera.cfg.frameMemoryMB * 1024 * 1024, (unsigned)frames, (unsigned)used,
+                             (uint64)fullResPool.getBytes(), (uint64)fullResPool.getPeakBytes(), (unsigned)fullResFrames, (unsigned)fullResUsed,
+                             (uint64)historyBytes, (unsigned)historyFrames, (uint64)hlsBytes, segments,
+                             (uint64)deviceBytes, (uint64)clientsBytes, (unsigned)clients, total);
+    }
+
+    /** A one line summary of the memory use, for the memoryReportSec logs */
+    String getMemoryReport()
+    {
+        ProcessMemory process;
+        process.read();
+        String out = String::Print("RSS %.1fMB (peak %.1fMB), heap %.1fMB (peak %.1fMB, %.1fMB free)", process.rss / 1048576.0, process.rssPeak / 1048576.0,
+                                   process.heapUsed / 1048576.0, process.heapPeak / 1048576.0, process.heapFree / 1048576.0);
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            uint64 total = 0;
+            getMemoryJSON(*cameras.getElementAtUncheckedPosition(i), total);
+            out += String::Print(", %s %.1fMB", (const char*)getCameraName(i), total / 1048576.0);
+        }
+        return out;
+    }
+
+    /** Report the memory used by the process and by each camera's subsystems, as JSON */
+    Stream::InputStream * DebugMemory(URLRouting::Comm & comm)
+    {
+        Camera * first = getCamera(comm);
+        if (!first) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        if (!first->FilterAccess(comm, false)) return 0;
+
+        ProcessMemory process;
+        process.read();
+        String out = "{\"process\":" + process.toJSON() + String::Print(",\"logging\":{\"bytes\":%u},\"cameras\":{", (unsigned)getLogMemory());
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            uint64 total = 0;
+            out += String::Print("%s\"%s\":", i ? "," : "", (const char*)getCameraName(i)) + getMemoryJSON(*cameras.getElementAtUncheckedPosition(i), total);
+        }
+        comm.addAnswerHeader("Content-Type", "application/json");
+        comm.addAnswerHeader("Cache-Control", "no-cache");
+        comm.returnText = out + "}}";
+        return 0;
+    }
+
+    /** A single picture with the thumbnails of all the cameras, for an overview page. It's made again at most every mosaicIntervalSec, so any
+        number of viewers costs a decoding of the cameras' DC coefficients and an encoding per interval */
+    Stream::InputStream * Mosaic(URLRouting::Comm & comm)
+    {
+        Camera * first = getCamera(comm);
+        if (!first) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        if (!first->FilterAccess(comm, false)) return 0;
+
+        double now = Time::getPreciseTime(), interval = max(config.mosaicIntervalSec, 1U);
+        Threading::ScopedLock scope(mosaicLock);
+        if (!mosaic.getSize() || now - mosaicTime >= interval)
+        {
+            String ret = renderMosaic();
+            if (ret) return comm.sendError(ret, Protocol::HTTP::InternalServerError);
+            mosaicTime = now;
+        }
+        uint8 * copy = new uint8[mosaic.getSize()];
+        memcpy(copy, mosaic.getConstBuffer(), mosaic.getSize());
+        comm.addAnswerHeader("Content-Type", "image/jpeg");
+        comm.addAnswerHeader("Cache-Control", String::Print("private, max-age=%u", (unsigned)max(mosaicTime + interval - now, 1.0)));
+        return new Stream::MemoryBlockStream(copy, mosaic.getSize(), true);
+    }
+
+    Stream::InputStream * FullResJPEG(URLRouting::Comm & comm)
+    {
+        Camera * camera = getCamera(comm);
+        return camera ? camera->FullResJPEG(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+    }
+    Stream::InputStream * MotionJPEG(URLRouting::Comm & comm)
+    {
+        Camera * camera = getCamera(comm);
+        return camera ? camera->MotionJPEG(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+    }
+    Stream::InputStream * WebSocketStream(URLRouting::Comm & comm)
+    {
+        String * cams = comm.headers.getValue("cams");
+        if (!cams)
+        {
+            Camera * camera = getCamera(comm);
+            return camera ? camera->WebSocketStream(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+        }
+        // Several cameras on a single connection (like "cams=front,back"), they are sent by the camera listed first
+        Container::PlainOldData<Camera*>::Array sources;
+        String list = *cams;
+        while (list)
+        {
+            String name = list.splitUpTo(",").Trimmed();
+            Camera * camera = 0;
+            for (size_t i = 0; i < cameras.getSize() && !camera; i++)
+                if (cameras.getElementAtUncheckedPosition(i)->cfg.name == name) camera = cameras.getElementAtUncheckedPosition(i);
+            if (!camera || sources.getSize() >= 255) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+            sources.Append(camera);
+        }
+        if (!sources.getSize()) return comm.sendError("Not found", Protocol::HTTP::NotFound);
+        return sources[0]->WebSocketStream(comm, &sources);
+    }
+    Stream::InputStream * Events(URLRouting::Comm & comm)
+    {
+        Camera * camera = getCamera(comm);
+        return camera ? camera->Events(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+    }
+    Stream::InputStream * Snapshot(URLRouting::Comm & comm)
+    {
+        Camera * camera = getCamera(comm);
+        return camera ? camera->Snapshot(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+    }
+    Stream::InputStream * HLS(URLRouting::Comm & comm)
+    {   // The file name is captured too
+        Camera * camera = comm.captures.getSize() > 1 ? getCamera(comm) : (cameras.getSize() ? cameras.getElementAtUncheckedPosition(0) : 0);
+        return camera ? camera->HLS(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+    }
+    Stream::InputStream * Record(URLRouting::Comm & comm)
+    {
+        Camera * camera = getCamera(comm);
+        return camera ? camera->Record(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+    }
+    Stream::InputStream * Replay(URLRouting::Comm & comm)
+    {
+        Camera * camera = getCamera(comm);
+        return camera ? camera->Replay(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+    }
+    Stream::InputStream * Control(URLRouting::Comm & comm)
+    {
+        Camera * camera = getCamera(comm);
+        return camera ? camera->Control(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+    }
+    Stream::InputStream * Burst(URLRouting::Comm & comm)
+    {
+        Camera * camera = getCamera(comm);
+        return camera ? camera->Burst(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+    }
+    Stream::InputStream * Timelapse(URLRouting::Comm & comm)
+    {
+        Camera * camera = getCamera(comm);
+        return camera ? camera->Timelapse(comm) : comm.sendError("Not found", Protocol::HTTP::NotFound);
+    }
+
+    String startServer()
+    {
+        uint16 port = (uint16)min(config.port, 65535U);
+        if (!routing.registerRoute("full_res",  MakeDel(URLRouting::URLTrigger, MJPGServer, FullResJPEG, *this))) return "Can't register route: full_res";
+        if (!routing.registerRoute("mjpg",      MakeDel(URLRouting::URLTrigger, MJPGServer, MotionJPEG, *this))) return "Can't register route: mjpg";
+        if (!routing.registerRoute("ws",        MakeDel(URLRouting::URLTrigger, MJPGServer, WebSocketStream, *this))) return "Can't register route: ws";
+        if (!routing.registerRoute("events",    MakeDel(URLRouting::URLTrigger, MJPGServer, Events, *this))) return "Can't register route: events";
+        if (!routing.registerRoute("snapshot",  MakeDel(URLRouting::URLTrigger, MJPGServer, Snapshot, *this))) return "Can't register route: snapshot";
+        if (!routing.registerRoute("stats",     MakeDel(URLRouting::URLTrigger, MJPGServer, Stats, *this))) return "Can't register route: stats";
+        if (!routing.registerRoute("metrics",   MakeDel(URLRouting::URLTrigger, MJPGServer, Metrics, *this))) return "Can't register route: metrics";
+        if (!routing.registerRoute("record",    MakeDel(URLRouting::URLTrigger, MJPGServer, Record, *this))) return "Can't register route: record";
+        if (!routing.registerRoute("replay",    MakeDel(URLRouting::URLTrigger, MJPGServer, Replay, *this))) return "Can't register route: replay";
+        if (!routing.registerRoute("timelapse.avi", MakeDel(URLRouting::URLTrigger, MJPGServer, Timelapse, *this))) return "Can't register route: timelapse.avi";
+        if (!routing.registerRoute("burst",     MakeDel(URLRouting::URLTrigger, MJPGServer, Burst, *this))) return "Can't register route: burst";
+        if (!routing.registerRoute("control",   MakeDel(URLRouting::URLTrigger, MJPGServer, Control, *this))) return "Can't register route: control";
+        if (!routing.registerRoute("config",    MakeDel(URLRouting::URLTrigger, MJPGServer, Config, *this))) return "Can't register route: config";
+        if (!routing.registerRoute("hls/\"",    MakeDel(URLRouting::URLTrigger, MJPGServer, HLS, *this))) return "Can't register route: hls";
+        if (!routing.registerRoute("mosaic",    MakeDel(URLRouting::URLTrigger, MJPGServer, Mosaic, *this))) return "Can't register route: mosaic";
+        if (!routing.registerRoute("debug/profile", MakeDel(URLRouting::URLTrigger, MJPGServer, Profile, *this))) return "Can't register route: debug/profile";
+        if (!routing.registerRoute("debug/memory", MakeDel(URLRouting::URLTrigger, MJPGServer, DebugMemory, *this))) return "Can't register route: debug/memory";
+        // The named cameras routes, the camera name is captured
+        if (cameras.getSize() > 1 || (cameras.getSize() && cameras.getElementAtUncheckedPosition(0)->cfg.name))
+        {
+            if (!routing.registerRoute("cam/\"/full_res", MakeDel(URLRouting::URLTrigger, MJPGServer, FullResJPEG, *this))) return "Can't register route: cam/full_res";
+            if (!routing.registerRoute("cam/\"/mjpg",     MakeDel(URLRouting::URLTrigger, MJPGServer, MotionJPEG, *this))) return "Can't register route: cam/mjpg";
+            if (!routing.registerRoute("cam/\"/ws",       MakeDel(URLRouting::URLTrigger, MJPGServer, WebSocketStream, *this))) return "Can't register route: cam/ws";
+            if (!routing.registerRoute("cam/\"/events",   MakeDel(URLRouting::URLTrigger, MJPGServer, Events, *this))) return "Can't register route: cam/events";
+            if (!routing.registerRoute("cam/\"/snapshot", MakeDel(URLRouting::URLTrigger, MJPGServer, Snapshot, *this))) return "Can't register route: cam/snapshot";
+            if (!routing.registerRoute("cam/\"/record",   MakeDel(URLRouting::URLTrigger, MJPGServer, Record, *this))) return "Can't register route: cam/record";
+            if (!routing.registerRoute("cam/\"/replay",   MakeDel(URLRouting::URLTrigger, MJPGServer, Replay, *this))) return "Can't register route: cam/replay";
+            if (!routing.registerRoute("cam/\"/timelapse.avi", MakeDel(URLRouting::URLTrigger, MJPGServer, Timelapse, *this))) return "Can't register route: cam/timelapse.avi";
+            if (!routing.registerRoute("cam/\"/burst",    MakeDel(URLRouting::URLTrigger, MJPGServer, Burst, *this))) return "Can't register route: cam/burst";
+            if (!routing.registerRoute("cam/\"/control",  MakeDel(URLRouting::URLTrigger, MJPGServer, Control, *this))) return "Can't register route: cam/control";
+            if (!routing.registerRoute("cam/\"/hls/\"",    MakeDel(URLRouting::URLTrigger, MJPGServer, HLS, *this))) return "Can't register route: cam/hls";
+        }
+        routing.registerDefaultRoute(MakeDel(URLRouting::URLTrigger, MJPGServer, App, *this));
+        routing.registerCapturedHandler(MakeDel(URLRouting::CaptureTrigger, MJPGServer, socketForgotten, *this));
+        if (config.tlsCertificate)
+        {
+            String ret = tls.init(config.tlsCertificate, config.tlsKey ? config.tlsKey : config.tlsCertificate);
+            if (ret) return ret;
+            // The kernel can't send the pages as is on a TLS socket, it encrypts them in its own buffers
+            if (config.zeroCopyMinSize) log(Warning, "Zero copy is not used with TLS");
+            config.zeroCopyMinSize = 0;
+            if (!handshaker.createThread()) return "Can't start the TLS handshakes thread";
+            routing.registerAcceptHandler(MakeDel(URLRouting::AcceptTrigger, MJPGServer, clientAccepted, *this));
+        }
+
+        if (config.httpClientsPerThread && config.httpReactors > 1) log(Warning, "httpReactors is ignored with httpClientsPerThread");
+        // The other HTTP server loops set their own scheduling, the main one is set up by the caller
+        routing.setReactorStarted(senderThreadStarted);
+        if (!routing.startServer(port, config.httpClientsPerThread, createSocketPool(true), max(config.httpReactors, 1U), config.unixSocket))
+            return config.unixSocket ? String::Print("Failed to start server on port: %u and socket: %s", port, (const char*)config.unixSocket) : String::Print("Failed to start server on port: %u", port);
+        String url = routing.getBaseURL();
+        if (tls.isEnabled()) url = "https://" + url.fromFirst("://");
+        if (config.securityToken) url += "?token=" + config.securityToken;
+        for (size_t i = 0; i < cameras.getSize(); i++) 
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            camera->heartbeat();
+            camera->routing = &routing;
+            camera->rtsp = &rtsp;
+        }
+        if (config.rtspPort)
+        {   // The same paths as the HTTP routes: the first camera on the root, and the named cameras on /cam/<name>
+            for (size_t i = 0; i < cameras.getSize(); i++)
+            {
+                Camera * camera = cameras.getElementAtUncheckedPosition(i);
+                if (!i) rtsp.addStream("/", *camera);
+                if (camera->cfg.name) rtsp.addStream("/cam/" + camera->cfg.name, *camera);
+            }
+            String ret = rtsp.start((uint16)min(config.rtspPort, 65535U));
+            if (ret) return ret;
+            fprintf(stdout, "RTSP server started on port: %u\n", config.rtspPort);
+        }
+        {
+            Threading::ScopedLock scope(indexLock);
+            renderIndexPage();
+        }
+        fprintf(stdout, "Server started on: %s\n", (const char*)url);
+        return "";
+    }
+
+    /** Start all the cameras devices, and their pre-event frames histories and activity detectors if enabled.
+        The devices are started in parallel, in each camera's starter thread, while the server is started (see getStartError)
+        @return An empty string on success, or the first error message */
+    String startV4L2Devices()
+    {
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            if (!camera->startDeviceAsync()) return camera->cfg.name ? camera->cfg.name + ": Can't start the device starter thread" : String("Can't start the device starter thread");
+        }
+        return "";
+    }
+
+    /** Check if any camera's device is still being started */
+    bool isStarting()
+    {
+        for (size_t i = 0; i < cameras.getSize(); i++)
+            if (cameras.getElementAtUncheckedPosition(i)->isStarting()) return true;
+        return false;
+    }
+
+    /** Get the first error of the cameras startup, once they are all started
+        @param deviceError  On output, the first device error (it's not fatal when the devices are monitored)
+        @return The first background capture error */
+    String getStartError(String & deviceError)
+    {
+        deviceError = "";
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            const String & device = camera->getStartDeviceError(), & capture = camera->getStartCaptureError();
+            if (device && !deviceError) deviceError = camera->cfg.name ? camera->cfg.name + ": " + device : device;
+            if (capture) return camera->cfg.name ? camera->cfg.name + ": " + capture : capture;
+        }
+        return "";
+    }
+
+    /** Start the cameras timelapse recorders, if enabled.
+        @return An empty string on success, or the first error message */
+    String startRecorders()
+    {
+        for (size_t i = 0; i < cameras.getSize(); i++)
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            String ret = camera->startRecorder();
+            if (ret) return camera->cfg.name ? camera->cfg.name + ": " + ret : ret;
+        }
+        return "";
+    }
+
+    bool loop() 
+    {
+        bool inFlight = false;
+        for (size_t i = 0; i < cameras.getSize(); i++) 
+        {
+            Camera * camera = cameras.getElementAtUncheckedPosition(i);
+            camera->checkDevice();
+            camera->giveBackSockets();
+            inFlight = inFlight || camera->hasSocketsInFlight() || camera->isStarting();
+        }
+        handshaker.giveBackSockets();
+        inFlight = inFlight || handshaker.hasSocketsInFlight();
+        // The server doesn't wake up for a given back socket (or a started device), so don't wait too long while some are expected
+        return routing.loop(inFlight ? 20 : (int)Network::DefaultTimeOut); 
+    }
+
+    bool stopServer() 
+    { 
+        // The RTSP sessions are ended first, they stop the cameras delivery
+        rtsp.stop();
+        handshaker.stop();
+        for (size_t i = 0; i < cameras.getSize(); i++) cameras.getElementAtUncheckedPosition(i)->stop();
+        return routing.stopServer(); 
+    }
+};
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need Utils::MemoryBlock here
+#include "Utils/MemoryBlock.hpp"
+// We need containers too
+#include "Container/Container.hpp"
+
+/** A fragmented MP4 (ISO BMFF) layout with a single video track, for the HLS segments.
+    The init segment (ftyp and moov) describes the track, then each media segment is a fragment (moof and mdat) with its samples.
+    The H.264 samples are length prefixed NAL units (avc1, the parameter sets are only in the init segment), the JPEG pictures are stored as is
+    (mp4v with the JPEG object type, like the MJPEG in MP4 files) */
+struct FMP4Muxer
+{
+    /** Some constants */
+    enum Constants {
+        /** The media time scale (like RTP, so the times are the same) */
+        Timescale       = 90000,
+        /** The mdat box header */
+        MDATHeaderSize  = 8,
+    };
+
+    /** A sample of a fragment */
+    struct Sample
+    {
+        uint32  size;
+        /** The sample's duration in Timescale units */
+        uint32  duration;
+        bool    keyFrame;
+
+        Sample(const uint32 size = 0, const uint32 duration = 0, const bool keyFrame = false) : size(size), duration(duration), keyFrame(keyFrame) {}
+    };
+
+    /** Build the init segment
+        @param width    The pictures width in pixels
+        @param height   The pictures height in pixels
+        @param sps      The H.264 sequence parameter set, or empty for the JPEG pictures
+        @param pps      The H.264 picture parameter set, or empty for the JPEG pictures */
+    static void makeInit(Utils::MemoryBlock & out, const int width, const int height, const Utils::MemoryBlock & sps, const Utils::MemoryBlock & pps);
+    /** Build a media segment's header (the moof box and the mdat box header), the samples data must follow it
+        @param sequence     The fragment's sequence number (starting from 1)
+        @param decodeTime   The first sample's decode time in Timescale units
+        @param samples      The fragment's samples, in order (their data is stored in the same order) */
+    static void makeFragmentHeader(Utils::MemoryBlock & out, const uint32 sequence, const uint64 decodeTime, const Container::PlainOldData<Sample>::Array & samples);
+};
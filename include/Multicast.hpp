@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need Utils::MemoryBlock here
+#include "Utils/MemoryBlock.hpp"
+// We need strings too
+#include "Strings/Strings.hpp"
+
+typedef Strings::FastString String;
+
+/** The multicast distribution of a stream on the LAN.
+    Each JPEG picture is split in fragments, each one sent in its own UDP datagram to the multicast group, with a small header:
+    @verbatim
+       0: "MJPM"            The magic
+       4: sequence          The frame sequence number (32 bits, big endian, like all the fields)
+       8: frame size        The picture size in bytes
+      12: offset            The fragment's offset in the picture
+      16: index             The fragment index (16 bits)
+      18: count             The number of fragments of this picture (16 bits)
+      20: payload           Up to FragmentSize bytes of the picture
+    @endverbatim
+    A datagram fits an Ethernet frame (1500 bytes MTU), so the network never fragments it. A picture is only used once all its fragments are
+    received: there is no retransmission, a picture missing a fragment is dropped (the next one replaces it anyway) */
+struct Multicast
+{
+    /** Some constants */
+    enum Constants {
+        HeaderSize      = 20,
+        /** The largest payload in a 1500 bytes MTU (minus the IPv4 and UDP headers) */
+        DatagramSize    = 1472,
+        FragmentSize    = DatagramSize - HeaderSize,
+        /** The number of datagrams sent or received in a single system call */
+        BatchSize       = 64,
+        MaxFrameSize    = 16 * 1024 * 1024,
+        /** A picture older than the last one by fewer frames than this is late, else the sender restarted */
+        MaxReorder      = 64,
+    };
+
+    /** Parse a group address and port, like "239.255.42.1:5004"
+        @return An empty string on success, or the error message */
+    static String parseGroup(const char * text, struct sockaddr_in & address);
+};
+
+/** Send the pictures to a multicast group */
+struct MulticastSender
+{
+    /** Open the sending socket
+        @param group    The group and port, like "239.255.42.1:5004"
+        @param ttl      The datagrams time to live (1 to stay on the local network)
+        @return An empty string on success, or the error message */
+    String open(const char * group, const unsigned ttl);
+    /** Send a picture, in as many datagrams as required (in batches, with sendmmsg)
+        @return false if the picture could not be sent completely */
+    bool send(const uint8 * data, const size_t size, const uint32 sequence);
+    /** Close the socket */
+    void close();
+    /** Check if the sender is opened */
+    bool isOpened() const { return fd != -1; }
+
+    MulticastSender() : fd(-1) {}
+    ~MulticastSender() { close(); }
+
+    // Members
+private:
+    /** The socket descriptor */
+    int                 fd;
+    /** The fragments headers (reused for each picture) */
+    Utils::MemoryBlock  headers;
+};
+
+/** Receive the pictures from a multicast group, and reassemble them */
+struct MulticastReceiver
+{
+    /** The receive result flags (like RemoteSource::ReceiveResult) */
+    enum ReceiveResult {
+        DataReceived    = 1,
+        WokenUp         = 2,
+    };
+
+    /** Join the group
+        @param group    The group and port, like "239.255.42.1:5004"
+        @return An empty string on success, or the error message */
+    String open(const char * group);
+    /** Receive the available datagrams, waiting at most the given time
+        @param wakeFd     If not -1, an event descriptor interrupting the waiting when it's readable (it's read then)
+        @param timeoutMs  The maximum waiting time in milliseconds
+        @return A combination of ReceiveResult, 0 on timeout or -1 on error */
+    int receive(const int wakeFd, const int timeoutMs);
+    /** Get the last complete picture, if it was not returned yet
+        @param data     On output, points to the picture, it's valid until the next call to receive
+        @param size     On output, the picture size in bytes
+        @return true if a picture is returned */
+    bool nextFrame(const uint8 * & data, size_t & size);
+    /** Get the number of pictures dropped since the last call, because some of their fragments were lost */
+    uint32 takeIncomplete() { uint32 ret = incomplete; incomplete = 0; return ret; }
+    /** Leave the group */
+    void close();
+
+    MulticastReceiver() : fd(-1), sequence(0), fragments(0), received(0), synced(false), ready(false), incomplete(0) {}
+    ~MulticastReceiver() { close(); }
+
+    // Helpers
+private:
+    /** Handle a received datagram */
+    void handle(const uint8 * datagram, const size_t size);
+
+    // Members
+private:
+    /** The socket descriptor */
+    int                 fd;
+    /** The picture being reassembled, its sequence number, its number of fragments and the number received so far */
+    Utils::MemoryBlock  assembling;
+    uint32              sequence, fragments, received;
+    /** Whether a picture was seen (so the sequence is known) */
+    bool                synced;
+    /** Whether each fragment is received (a byte per fragment) */
+    Utils::MemoryBlock  receivedMap;
+    /** The last complete picture, and whether it was returned */
+    Utils::MemoryBlock  complete;
+    bool                ready;
+    /** The number of incomplete pictures */
+    uint32              incomplete;
+    /** The datagrams buffers */
+    Utils::MemoryBlock  datagrams;
+};
@@ -0,0 +1,287 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need shared frames here
+#include "Frame.hpp"
+// We need threading code too
+#include "Threading/Threads.hpp"
+// We need containers too
+#include "Container/Container.hpp"
+// We need strings too
+#include "Strings/Strings.hpp"
+
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+
+typedef Strings::FastString String;
+
+/** The RTP packetizers base: a picture is split once in packets, that are sent to all the sessions of a stream.
+    Each packet's payload is made of some headers (built in the headers buffer) and a part of the picture (not copied) */
+struct RTPPacketizer
+{
+    /** Some constants */
+    enum Constants {
+        ClockRate       = 90000,
+        RTPHeaderSize   = 12,
+        /** The largest RTP packet, so it fits an Ethernet frame with the IP, UDP (or TCP and interleaving) headers */
+        MaxPacketSize   = 1400,
+    };
+
+    /** A packet's payload: its headers (in the headers buffer), and its part of the picture */
+    struct Packet
+    {
+        uint32  headerOffset, headerSize;
+        uint32  dataOffset, dataSize;
+
+        Packet(const uint32 headerOffset = 0, const uint32 headerSize = 0, const uint32 dataOffset = 0, const uint32 dataSize = 0) : headerOffset(headerOffset), headerSize(headerSize), dataOffset(dataOffset), dataSize(dataSize) {}
+    };
+
+    /** Split a picture in packets (the picture must stay valid while the packets are sent)
+        @return An empty string on success, or why the picture can't be sent */
+    virtual String prepare(const uint8 * data, const size_t size) = 0;
+    /** Get the media attributes of the session description (after the media line), with their line endings */
+    virtual String getMediaAttributes() const = 0;
+    /** Get the number of packets of the prepared picture */
+    inline size_t getPacketCount() const { return packets.getSize(); }
+    /** Get the payload of a packet, in 2 buffers (the headers and the data) */
+    inline void getPayload(const size_t index, struct iovec * vectors) const
+    {
+        const Packet & packet = packets[index];
+        vectors[0].iov_base = (void*)(headers.getConstBuffer() + packet.headerOffset); vectors[0].iov_len = packet.headerSize;
+        vectors[1].iov_base = (void*)(payload + packet.dataOffset); vectors[1].iov_len = packet.dataSize;
+    }
+    /** Get a payload's size in bytes */
+    inline uint32 getPayloadSize(const size_t index) const { return packets[index].headerSize + packets[index].dataSize; }
+    /** Get the RTP payload type */
+    inline uint8 getPayloadType() const { return payloadType; }
+    /** Write a RTP header
+        @param marker   Set for the last packet of a picture */
+    void writeHeader(uint8 * header, const bool marker, const uint16 sequence, const uint32 timestamp, const uint32 ssrc) const;
+
+    RTPPacketizer(const uint8 payloadType) : payloadType(payloadType), payload(0) {}
+    virtual ~RTPPacketizer() {}
+
+    // Members
+protected:
+    /** The RTP payload type */
+    const uint8         payloadType;
+    /** The packets of the prepared picture */
+    Container::PlainOldData<Packet>::Array packets;
+    /** The headers of all the packets */
+    Utils::MemoryBlock  headers;
+    /** The part of the picture the packets data offsets are relative to */
+    const uint8 *       payload;
+};
+
+/** The RTP/JPEG packetizer (RFC 2435).
+    The MJPEG pictures are sent as is: the header segments are removed, the quantization tables are sent in the first packet of each picture
+    (Q = 255), and the entropy coded data is split in packets. The receivers use the standard Huffman tables, like for the MJPEG pictures
+    without tables. Only the baseline pictures with 3 components in 4:2:2 or 4:2:0 (what the cameras send), up to 2040x2040, can be sent */
+struct RTPJPEG : public RTPPacketizer
+{
+    /** Some constants */
+    enum Constants {
+        PayloadType     = 26,
+        /** The JPEG header, the restart marker header, the quantization table header and the 2 tables */
+        MaxHeaderSize   = 8 + 4 + 4 + 2 * 64,
+    };
+
+    String prepare(const uint8 * data, const size_t size);
+    /** The payload type is static, so there is no attribute */
+    String getMediaAttributes() const { return ""; }
+
+    RTPJPEG() : RTPPacketizer(PayloadType) {}
+};
+
+/** The RTP/H.264 packetizer (RFC 6184, in non interleaved mode).
+    The access units captured by the device's encoder are sent as is: each NAL unit fitting a packet is sent in a single NAL unit packet,
+    the larger ones are split in fragmentation units (FU-A). The last parameter sets seen are kept for the session description */
+struct RTPH264 : public RTPPacketizer
+{
+    /** Some constants */
+    enum Constants {
+        /** The dynamic payload type used */
+        PayloadType     = 96,
+        /** The fragmentation unit NAL type */
+        FUA             = 28,
+        /** The largest parameter set kept for the session description */
+        MaxParameterSetSize = 256,
+    };
+
+    String prepare(const uint8 * data, const size_t size);
+    /** The codec and its parameters: the packetization mode, and the profile and the parameter sets if known */
+    String getMediaAttributes() const;
+
+    RTPH264() : RTPPacketizer(PayloadType) {}
+
+    // Members
+private:
+    /** The last sequence and picture parameter sets seen */
+    Utils::MemoryBlock  sps, pps;
+};
+
+/** A stream served by the RTSP server (a camera) */
+struct RTSPSource
+{
+    /** The stream codecs */
+    enum Codec {
+        JPEG,
+        H264,
+    };
+
+    /** Get the stream's codec (it's not changing while the server runs) */
+    virtual Codec getCodec() const = 0;
+    /** Check the token given in the URL (the security token)
+        @return true if the stream can be played with this token */
+    virtual bool isAuthorized(const String & token) const = 0;
+    /** Start delivering the frames, the server is woken up for each new frame
+        @return false if the capture can't start */
+    virtual bool startViewer() = 0;
+    /** Stop delivering the frames for a viewer (when the last one is gone, the capture can stop) */
+    virtual void stopViewer() = 0;
+    /** Get the latest frame */
+    virtual FrameRef getLatestFrame() = 0;
+    /** Ask for a key frame as soon as possible, since a H.264 session can only start on one (this does nothing if the source can't) */
+    virtual void requestKeyFrame() {}
+
+    virtual ~RTSPSource() {}
+};
+
+/** The RTSP server, so the NVRs and the video players can pull the stream without a transcoding relay.
+    It runs in its own thread, with its own listening socket, and supports the OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN and GET_PARAMETER
+    methods. The RTP packets are sent over UDP (unicast, from a single pair of server ports) or interleaved in the RTSP connection (TCP). A RTCP
+    sender report is sent every few seconds, and the receiver reports (or any request) keep the UDP sessions alive.
+    A session lives in its RTSP connection: it's gone when the connection is closed.
+    Each picture is only packetized once for all the sessions of a stream. A TCP session that can't keep up skips the pictures until its
+    connection accepts more data (for a H.264 stream, until the next key frame, since the following pictures depend on the skipped one) */
+struct RTSPServer : public Threading::Thread
+{
+    /** Some constants */
+    enum Constants {
+        MaxConnections      = 64,
+        /** The UDP sessions without any request or receiver report for this time are closed */
+        SessionTimeoutSec   = 60,
+        ReportIntervalSec   = 5,
+        /** The largest request */
+        MaxRequestSize      = 8192,
+        /** The number of packets sent in a single system call */
+        BatchSize           = 64,
+    };
+
+    /** Serve a stream on the given path (like "/" or "/cam/front"), this must be done before starting */
+    void addStream(const String & path, RTSPSource & source);
+    /** Start listening on the given port, and start the thread
+        @return An empty string on success, or the error message */
+    String start(const uint16 port);
+    /** Stop the thread, and close all the sessions */
+    void stop();
+    /** Wake up the thread, because a new frame is published (called from any thread) */
+    inline void wake() { if (wakeFd != -1) eventfd_write(wakeFd, 1); }
+
+    RTSPServer();
+    ~RTSPServer();
+
+    // Helpers
+private:
+    /** A served stream, the picture is packetized once for all its sessions */
+    struct Stream
+    {
+        String          path;
+        RTSPSource *    source;
+        /** The packetizer for the source's codec (owned) */
+        RTPPacketizer * packetizer;
+        /** The last frame packetized (kept while its packets are referenced), and why it can't be sent, if so */
+        FrameRef        frame;
+        String          error;
+        Stream(const String & path, RTSPSource * source) : path(path), source(source), packetizer(source->getCodec() == RTSPSource::H264 ? (RTPPacketizer*)new RTPH264 : (RTPPacketizer*)new RTPJPEG) {}
+        ~Stream() { delete packetizer; }
+    };
+
+    /** A RTSP connection, and its session */
+    struct Connection
+    {
+        int                 fd;
+        struct sockaddr_in  peer;
+        String              address;
+        /** The received bytes not processed yet, and the bytes not sent yet */
+        Utils::MemoryBlock  input, output;
+        size_t              outputSent;
+        /** The stream authorized on this connection (so SETUP and PLAY don't need the token again) */
+        Stream *            authorized;
+
+        // The session
+        /** The session identifier (empty until SETUP), its stream and its track URL */
+        String              session;
+        Stream *            stream;
+        String              trackURL;
+        /** Whether the packets are interleaved in the connection, and the channels */
+        bool                interleaved;
+        uint8               rtpChannel, rtcpChannel;
+        /** The client's RTP and RTCP addresses (UDP sessions) */
+        struct sockaddr_in  rtpAddress, rtcpAddress;
+        bool                playing;
+        /** The RTP state */
+        uint16              rtpSequence;
+        uint32              ssrc, timestampBase, lastTimestamp;
+        uint32              packetsSent, octetsSent;
+        /** The last frame sent, and the pictures skipped because the connection was busy */
+        uint32              lastFrame;
+        uint32              framesSkipped;
+        /** Set while the H.264 pictures are skipped until the next key frame (when starting, or after a skipped picture) */
+        bool                waitKeyFrame;
+        /** The time of the last request or receiver report, and of the last sender report */
+        double              lastSeen, lastReport;
+
+        /** Get the pending bytes to send (TCP) */
+        inline size_t getPending() const { return output.getSize() - outputSent; }
+
+        Connection(const int fd, const struct sockaddr_in & peer);
+        ~Connection();
+    };
+
+    uint32 runThread();
+    /** Accept the pending connections */
+    void acceptConnections();
+    /** Read from a connection, and process its requests
+        @return false if the connection must be closed */
+    bool receive(Connection & connection);
+    /** Process a request
+        @return false if the connection must be closed */
+    bool processRequest(Connection & connection, const String & request);
+    /** Send the pending bytes of a connection
+        @return false if the connection must be closed */
+    bool flush(Connection & connection);
+    /** Queue an answer on the connection */
+    void answer(Connection & connection, const String & cseq, const char * status, const String & headers = "", const String & body = "");
+    /** Send the new frames to the playing sessions */
+    void deliverFrames();
+    /** Send a picture to a session */
+    void sendPicture(Connection & connection, const RTPPacketizer & packetizer, const uint32 timestamp);
+    /** Send a RTCP sender report (and a BYE if the session ends) */
+    void sendReport(Connection & connection, const double now, const bool bye = false);
+    /** Read the RTCP packets from the UDP socket (they only keep the sessions alive) */
+    void receiveReports(const double now);
+    /** Find the stream for an URL
+        @param token    On output, the token in the URL's query
+        @param base     On output, the stream's base URL (for the relative track URL) */
+    Stream * findStream(const String & url, String & token, String & base) const;
+    /** End a session (and stop the source's delivery if it was playing) */
+    void endSession(Connection & connection, const bool bye);
+
+    // Members
+private:
+    /** The served streams (owned) */
+    Container::NotConstructible<Stream>::IndexList      streams;
+    /** The connections (owned, only used by the server thread) */
+    Container::NotConstructible<Connection>::IndexList  connections;
+    /** The listening socket, the RTP and RTCP sockets, and the wake up descriptor */
+    int                 listenFd, rtpFd, rtcpFd, wakeFd;
+    /** The server's RTP port (the RTCP port is the next one) */
+    uint16              rtpPort;
+    /** The next session identifier */
+    uint32              nextSession;
+};
@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need the picture sink interface here
+#include "V4L2Source.hpp"
+// We need the activity detector too
+#include "Activity.hpp"
+
+typedef Strings::FastString String;
+
+/** A ring of preallocated segment files, storing the recorded pictures.
+    Each segment is allocated at its full size the first time it's used and memory mapped, so appending a picture is only a copy in
+    the page cache (the kernel writes it back in large chunks, there is no file creation or fsync per picture).
+    When a segment is full, the next one is used, and the oldest segment is recycled once all of them are used.
+
+    A segment starts with a header page, followed by the frame index (an offset, size and timestamp for each picture), then the
+    pictures. The frame count is updated last, so a reader only sees the pictures that are completely written */
+struct SegmentStore
+{
+    /** Some limits */
+    enum Constants {
+        Version         = 1,
+        HeaderSize      = 4096,
+        /** The expected minimum picture size, used to size the index */
+        MinPictureSize  = 4096,
+        MinSegmentSize  = 1024 * 1024,
+        /** The maximum time waiting for a slow reader to accept a picture */
+        SendTimeoutMs   = 5000,
+    };
+    /** The header at the beginning of each segment file */
+    struct Header
+    {
+        /** "MJPGSEG" and a zero byte */
+        char    magic[8];
+        uint32  version;
+        /** The maximum number of index entries */
+        uint32  indexCapacity;
+        /** The segment's generation, increased each time a segment is started (so the segments can be ordered) */
+        uint64  generation;
+        /** The offset of the pictures area and the segment size in bytes */
+        uint32  dataOffset, segmentSize;
+        /** The number of pictures and the end of the last one */
+        uint32  frameCount, dataUsed;
+    };
+    /** An entry of the frame index */
+    struct IndexEntry
+    {
+        /** The picture offset in the segment and its size in bytes */
+        uint32  offset, size;
+        /** The capture time in microseconds since the epoch */
+        uint64  timestamp;
+    };
+
+    /** Open the store, resuming in the most recent segment if the store already exists
+        @param dir          The directory of the segment files
+        @param prefix       The segment files name prefix
+        @param segmentSize  The size of each segment file in bytes
+        @param segmentCount The number of segment files in the ring
+        @return An empty string on success, or the error message */
+    String open(const char * dir, const char * prefix, const uint32 segmentSize, const unsigned segmentCount);
+    /** Append a picture
+        @param timestamp    The capture time in microseconds since the epoch
+        @return An empty string on success, or the error message */
+    String append(const uint8 * data, const size_t size, const uint64 timestamp);
+    /** Close the store, the mapped segment is written back */
+    void close();
+    /** Check if the store is opened */
+    bool isOpened() const { return count != 0; }
+    /** Get the capture time of the last picture appended (or found when opening the store), in microseconds since the epoch */
+    uint64 getLastTimestamp() const { return lastTimestamp; }
+    /** Get the path of a segment file */
+    String getSegmentPath(const unsigned index) const { return String::Print("%s/%s%03u.seg", (const char*)dir, (const char*)prefix, index); }
+
+    /** A reading position in the store, going through the pictures in time order.
+        The segments might be recycled while they are read: a recycled segment is skipped, and the pictures of the newest segment can be read as
+        they are appended. The index is read from the segment mapping, and the pictures are sent from the segment file without copying them */
+    struct Cursor
+    {
+        /** Find the first picture recorded at or after the given time
+            @param from     The time in microseconds since the epoch
+            @return false if the store is empty */
+        bool seek(const SegmentStore & store, const uint64 from);
+        /** Go to the next picture
+            @param size         On output, the picture size in bytes
+            @param timestamp    On output, the picture capture time in microseconds since the epoch
+            @return false if there are no more pictures */
+        bool next(uint32 & size, uint64 & timestamp);
+        /** Get the current picture, from the segment mapping (this is only valid until the next call) */
+        const uint8 * getPicture() const { return header ? (const uint8*)header + offset : 0; }
+        /** Send the current picture to the given socket, with sendfile (the picture is not read by this process)
+            @return false if the socket is closed, or too slow */
+        bool sendTo(const int socket) const;
+
+        Cursor() : store(0), position(0), fd(-1), header(0), generation(0), index(0), offset(0), size(0) {}
+        ~Cursor() { unmap(); }
+
+        // Helpers
+    private:
+        /** Map the segment at the given position in the list, until one can be mapped
+            @return false if none of the remaining segments can be mapped */
+        bool map(size_t from);
+        void unmap();
+
+        // Members
+    private:
+        /** A segment to read, and its generation and its first picture time when it was listed */
+        struct Segment
+        {
+            unsigned index;
+            uint64   generation, first;
+            Segment(const unsigned index = 0, const uint64 generation = 0, const uint64 first = 0) : index(index), generation(generation), first(first) {}
+        };
+        const SegmentStore * store;
+        /** The segments to read, in generation order, and the current one in this list */
+        Container::PlainOldData<Segment>::Array segments;
+        size_t          position;
+        /** The current segment file descriptor, its mapping and generation */
+        int             fd;
+        const Header *  header;
+        uint64          generation;
+        /** The next picture's index in the segment, and the current picture's position */
+        uint32          index, offset, size;
+    };
+
+    SegmentStore() : fd(-1), header(0), segmentSize(0), count(0), current(0), generation(0), lastTimestamp(0) {}
+    ~SegmentStore() { close(); }
+
+    // Helpers
+private:
+    /** Map the given segment, allocating it if required
+        @param reset    If set, the segment is emptied and starts a new generation */
+    String mapSegment(const unsigned index, const bool reset);
+    /** Unmap the current segment */
+    void unmapSegment();
+    /** Get the frame index of the current segment */
+    inline IndexEntry * getIndex() const { return (IndexEntry*)((uint8*)header + HeaderSize); }
+
+    // Members
+private:
+    /** The current segment file descriptor and its mapping */
+    int         fd;
+    Header *    header;
+    /** The segment files location */
+    String      dir, prefix;
+    /** The segments size in bytes and their number */
+    uint32      segmentSize;
+    unsigned    count;
+    /** The current segment and the last generation used */
+    unsigned    current;
+    uint64      generation;
+    /** The last picture's capture time */
+    uint64      lastTimestamp;
+};
+
+/** The timelapse recorder, saving the pictures it receives on a schedule or when triggered.
+    It's given the pictures by its camera (either the stream's pictures, or the full resolution pictures captured for it) */
+struct Recorder : public V4L2Thread::PictureSink
+{
+    /** Open the recorder
+        @param dir          The directory of the segment files
+        @param prefix       The segment files name prefix
+        @param segmentSize  The size of each segment file in bytes
+        @param segmentCount The number of segment files in the ring
+        @param intervalSec  The interval between two recorded pictures in seconds, or 0 to only record when triggered */
+    String open(const char * dir, const char * prefix, const uint32 segmentSize, const unsigned segmentCount, const unsigned intervalSec);
+    /** Record the next picture received */
+    void trigger() { Threading::ScopedLock scope(lock); triggered = true; }
+    /** Skip the scheduled pictures while the given detector sees no activity (the triggered pictures are always recorded) */
+    void setActivity(const ActivityDetector * detector) { Threading::ScopedLock scope(lock); activity = detector; }
+    /** Check if a picture should be recorded now */
+    bool isDue(const double now) const { Threading::ScopedLock scope(lock); return store.isOpened() && isScheduled(now); }
+    /** Record a picture now, whatever the schedule.
+        The pictures older than the last recorded picture are skipped, so the index stays in time order
+        @param timestamp    The capture time in microseconds since the epoch
+        @return true if the picture is recorded */
+    bool record(const uint8 * data, const size_t len, const uint64 timestamp);
+    /** Skip the due picture, since it could not be captured (it's counted as an error) */
+    void skip(const double now);
+    /** Check if the recorder is opened */
+    bool isOpened() const { Threading::ScopedLock scope(lock); return store.isOpened(); }
+    /** Close the recorder */
+    void close() { Threading::ScopedLock scope(lock); store.close(); }
+    /** Get the store, for reading it (the store location does not change once it's opened, so no lock is needed to read it) */
+    const SegmentStore & getStore() const { return store; }
+
+    /** The number of pictures recorded and the number of pictures that could not be recorded */
+    Threading::Atomic<uint64>   framesRecorded, recordErrors;
+
+    Recorder() : interval(0), nextTime(0), triggered(false), activity(0) {}
+
+    // PictureSink interface
+public:
+    /** Record the picture if it's due (or triggered), this never stops the capture */
+    bool pictureReceived(const uint8 * data, const size_t len, const double age);
+
+    // Helpers
+private:
+    /** Schedule the next picture, after recording or skipping one (the lock must be taken) */
+    void schedule(const double now);
+    /** Check if a picture is triggered or scheduled now (the lock must be taken).
+        An idle camera's scheduled picture is postponed, not skipped, so the first picture is recorded as soon as the camera is active */
+    inline bool isScheduled(const double now) const { return triggered || (interval && now >= nextTime && (!activity || activity->isActive(now))); }
+
+    // Members
+private:
+    /** The lock protecting the store and the schedule (the pictures come from the capture thread or the recorder's thread) */
+    mutable Threading::FastLock lock;
+    SegmentStore    store;
+    /** The interval between two pictures and the time the next one is due, in seconds */
+    double          interval, nextTime;
+    /** Set when the next picture must be recorded */
+    bool            triggered;
+    /** The camera's activity detector, if the idle camera is not recorded (not owned) */
+    const ActivityDetector * activity;
+};
@@ -0,0 +1,183 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need Utils::MemoryBlock here
+#include "Utils/MemoryBlock.hpp"
+// We need strings too
+#include "Strings/Strings.hpp"
+// We need the multicast receiver too
+#include "Multicast.hpp"
+
+typedef Strings::FastString String;
+
+/** A streaming parser for a multipart/x-mixed-replace HTTP answer (a MJPEG stream).
+    The received data is appended to the buffer and each byte is scanned at most once: the content of a part with a Content-Length
+    header is awaited without scanning it, else its end is searched from where the previous search stopped.
+    Only the data following the last returned part is moved to the beginning of the buffer, once it has been returned */
+struct MultipartParser
+{
+    /** Some limits */
+    enum Constants {
+        MaxHeaderSize   = 4096,
+        MaxPartSize     = 32 * 1024 * 1024,
+    };
+
+    /** Get a buffer to receive at least the given amount of bytes into
+        @return A pointer to the free space after the received data, or 0 on allocation failure */
+    uint8 * getReceiveBuffer(const uint32 size);
+    /** Account for the data received in the buffer returned by getReceiveBuffer */
+    void received(const uint32 size) { buffer.stripTo(used += size); }
+    /** Get the next complete part.
+        @param data     On output, points to the part content, it's valid until the next call to any method of this parser
+        @param size     On output, the part content size in bytes
+        @return 1 if a part is returned, 0 if more data is needed, or -1 on error (see getError) */
+    int nextPart(const uint8 * & data, size_t & size);
+    /** Get the content of a plain (not multipart) answer, once it's completely received
+        @param content  On output, contains the answer's content
+        @return An empty string on success, or the error message */
+    String getSingleAnswer(Utils::MemoryBlock & content) const;
+    /** Get the parsing error, if any */
+    const String & getError() const { return error; }
+    /** Start parsing a new answer */
+    void reset() { buffer.stripTo(0); used = start = scanned = partSize = 0; state = AnswerHeader; delimiter = error = ""; }
+
+    MultipartParser() : used(0), start(0), scanned(0), partSize(0), state(AnswerHeader) {}
+
+    // Helpers
+private:
+    /** Find the given pattern in the received data, from where the previous search stopped
+        @return The pattern position in the buffer, or -1 if it's not received yet (the next search will resume from the end of the data) */
+    int64 find(const char * pattern, const uint32 length);
+    /** Parse the answer header, to check the status and find the boundary */
+    bool parseAnswerHeader(const String & header);
+    /** Fail with the given error */
+    int fail(const String & message) { error = message; return -1; }
+
+    // Members
+private:
+    /** The parsing state */
+    enum State { AnswerHeader, PartHeader, PartContent };
+
+    /** The received data */
+    Utils::MemoryBlock  buffer;
+    /** The amount of data in the buffer, where the data not parsed yet starts and where the next search starts */
+    uint32              used, start, scanned;
+    /** The current part content size in bytes, or 0 if it's unknown (the part then ends at the next delimiter) */
+    uint32              partSize;
+    /** The current state */
+    State               state;
+    /** The delimiter ending a part ("\r\n--" followed by the boundary) */
+    String              delimiter;
+    /** The parsing error, if any */
+    String              error;
+};
+
+/** A resource on a remote HTTP server, or a multicast group */
+struct RemoteURL
+{
+    /** The remote server's host and port (or the multicast group's address and port) */
+    String      host;
+    uint16      port;
+    /** The requested path (with the query, if any) */
+    String      path;
+    /** Whether this is a multicast group (an udp://group:port URL) */
+    bool        multicast;
+
+    /** Set the resource from the given URL (only http URLs and udp URLs for a multicast group are supported)
+        @return An empty string on success, or the error message */
+    String parse(const char * url);
+    /** Check if a resource is set */
+    bool isSet() const { return host.getLength() != 0; }
+    /** Forget the resource */
+    void clear() { host = path = ""; port = 0; multicast = false; }
+    /** Get the resource URL */
+    String asText() const { return multicast ? String::Print("udp://%s:%hu", (const char*)host, port) : String::Print("http://%s:%hu%s", (const char*)host, port, (const char*)path); }
+    /** Get the multicast group, like "239.255.42.1:5004" */
+    String getGroup() const { return String::Print("%s:%hu", (const char*)host, port); }
+
+    RemoteURL() : port(0), multicast(false) {}
+};
+
+/** A remote source, pulling a MJPEG stream (multipart/x-mixed-replace) from another HTTP server.
+    This makes the server a relay for a network camera (or another server): the remote server only serves a single stream, whatever the number of clients.
+    With an udp:// URL, the pictures are received from a multicast group instead (see MulticastSender), so any number of relays on the LAN
+    cost a single stream to the camera's server */
+struct RemoteSource
+{
+    /** Some constants */
+    enum Constants {
+        ConnectTimeoutMs    = 3000,
+        RetryDelayMs        = 1000,
+        ReceiveSize         = 65536,
+        FullResTimeoutMs    = 30000,
+    };
+
+    /** The receive result flags */
+    enum ReceiveResult {
+        DataReceived    = 1,
+        WokenUp         = 2,
+    };
+
+    /** The remote stream */
+    RemoteURL   stream;
+    /** The remote full resolution picture, if any (else the stream's pictures are used) */
+    RemoteURL   fullRes;
+    /** The minimum frame duration in seconds (0 to keep all the frames) */
+    double      minFrameDuration;
+    /** The pictures size in pixels (from the last received picture) */
+    int         width, height;
+    /** The full resolution pictures size in pixels (from the last fetched picture) */
+    int         fullResWidth, fullResHeight;
+
+    /** A connection to the remote server */
+    struct Connection
+    {
+        /** The socket descriptor, -1 if not connected */
+        int             fd;
+        /** The answer parser */
+        MultipartParser parser;
+
+        /** Connect to the remote server and send the request (the answer is parsed while receiving)
+            @param url      The remote resource to request
+            @return An empty string on success, or the error message */
+        String connect(const RemoteURL & url);
+        /** Receive the available data, waiting at most the given time
+            @param wakeFd     If not -1, an event descriptor interrupting the waiting when it's readable (it's read then)
+            @param timeoutMs  The maximum waiting time in milliseconds
+            @return A combination of ReceiveResult, 0 on timeout or -1 on error or disconnection */
+        int receive(const int wakeFd, const int timeoutMs);
+        /** Close the connection */
+        void close();
+
+        Connection() : fd(-1) {}
+        ~Connection() { close(); }
+    };
+
+    /** Set the remote stream to pull
+        @param url          The stream URL, like http://camera:8080/mjpg, or a multicast group like udp://239.255.42.1:5004
+        @param fps          The maximum frame rate (0 to keep all the frames)
+        @param fullResURL   If not empty, the full resolution pictures URL, like http://camera:8080/full_res
+        @return An empty string on success, or the error message */
+    String open(const char * url, const unsigned fps, const char * fullResURL = "");
+    /** Check if a remote stream is set */
+    bool isOpened() const { return stream.isSet(); }
+    /** Forget the remote stream */
+    void close() { stream.clear(); fullRes.clear(); width = height = fullResWidth = fullResHeight = 0; }
+    /** Get the URL of the remote stream */
+    String getURL() const { return stream.asText(); }
+
+    /** Fetch a single picture from the remote stream (on a dedicated connection)
+        @param pic          On output, contains the JPEG picture
+        @param timeoutMs    The maximum time to get the picture in milliseconds
+        @return An empty string on success, or the error message */
+    String fetchPicture(Utils::MemoryBlock & pic, const unsigned timeoutMs);
+    /** Fetch a full resolution picture from the remote server (the fullRes URL must be set)
+        @param pic          On output, contains the JPEG picture
+        @return An empty string on success, or the error message */
+    String fetchFullResPicture(Utils::MemoryBlock & pic);
+
+    RemoteSource() : minFrameDuration(0), width(0), height(0), fullResWidth(0), fullResHeight(0) {}
+};
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need the shared memory layout, shared with the consumers
+#include "mjpgsrv_shm.h"
+// We need strings
+#include "Strings/Strings.hpp"
+// We need threading code here
+#include "Threading/Threads.hpp"
+
+typedef Strings::FastString String;
+
+/** The shared memory output of a camera's frames, for the local consumers (like a detection model or ffmpeg on the same host).
+    The frames are copied once in a slot of a POSIX shared memory object, and the consumers read them in place, without any socket or HTTP
+    parsing. The consumers count themselves in the slot they read, and the writer only uses a slot no one reads (and never the latest one),
+    so a slow or stuck consumer can't stall the capture: the frame is skipped if all the slots are read.
+    The consumers are woken with a futex in the shared header (only if some are waiting). See mjpgsrv_shm.h for the layout and the client */
+struct SharedFrameRing
+{
+    /** Some limits */
+    enum Constants {
+        MinSlots        = 2,
+        MaxSlots        = MJPGSRV_SHM_MAX_SLOTS,
+        MinSlotSize     = 64 * 1024,
+    };
+
+    /** Create the shared memory object (replacing any existing one with this name)
+        @param name     The object name, without the leading slash
+        @param slots    The number of frame slots
+        @param slotSize The maximum picture size in bytes (rounded up to a page)
+        @return An empty string on success, or the error message */
+    String open(const char * name, const unsigned slots, const uint32 slotSize);
+    /** Publish a picture (called by the capture thread only)
+        @param sequence     The frame sequence number
+        @param timestamp    The capture time in microseconds since the epoch
+        @return false if the picture was skipped */
+    bool publish(const uint8 * data, const size_t size, const uint64 sequence, const uint64 timestamp);
+    /** Close and remove the shared memory object, the consumers see it as dead */
+    void close();
+    /** Check if the ring is opened */
+    bool isOpened() const { return header != 0; }
+    /** Get the number of frames skipped, because all the slots were read or the picture was too large */
+    uint64 getSkipped() const { Threading::ScopedLock scope(lock); return header ? header->skipped : 0; }
+
+    SharedFrameRing() : header(0), next(0) {}
+    ~SharedFrameRing() { close(); }
+
+    // Members
+private:
+    /** The lock protecting the mapping, since the ring is closed by another thread than the capture one */
+    mutable Threading::FastLock lock;
+    /** The mapped shared memory */
+    mjpgsrv_shm_header *        header;
+    /** The object name, with the leading slash */
+    String                      path;
+    /** The next slot to try */
+    uint32                      next;
+};
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need threading code here
+#include "Threading/Threads.hpp"
+// We need strings too
+#include "Strings/Strings.hpp"
+// We need the profiling probes
+#include "Time/Chrono.hpp"
+
+/** A latency histogram.
+    The latencies are counted in buckets growing exponentially, so recording a latency is only an atomic increment.
+    The percentiles are approximated by interpolating in the bucket containing them */
+struct LatencyHistogram
+{
+    /** The number of buckets (the last one counts the latencies above the last bound) */
+    enum { BucketCount = 14 };
+
+    /** Record a latency, in seconds */
+    void record(const double latency);
+
+    /** Get the number of recorded latencies */
+    uint32 getCount() const;
+    /** Get the mean latency, in milliseconds */
+    double getMean() const;
+    /** Get the maximum recorded latency, in milliseconds */
+    double getMax() const { return maxUs.read() / 1000.0; }
+    /** Get the given percentile (in range [0-100]) of the latencies, in milliseconds */
+    double getPercentile(const double percentile) const;
+
+    /** Get the histogram summary as a JSON object */
+    Strings::FastString toJSON() const;
+    /** Get the histogram in Prometheus text format (the buckets, sum and count series, in seconds)
+        @param name     The metric name
+        @param labels   The series labels, without braces (like 'camera="0"'), can be empty */
+    Strings::FastString toPrometheus(const char * name, const Strings::FastString & labels) const;
+
+    // Members
+private:
+    /** The upper bound of each bucket, in milliseconds */
+    static const double bounds[BucketCount - 1];
+    /** The number of latencies in each bucket */
+    Threading::Atomic<uint32>   buckets[BucketCount];
+    /** The sum and the maximum of the latencies, in microseconds */
+    Threading::Atomic<uint64>   totalUs, maxUs;
+};
+
+/** The latencies of the frames at each stage from the driver to the clients */
+struct FrameLatency
+{
+    /** From the driver's timestamp to the frame being published by the capture thread */
+    LatencyHistogram    capture;
+    /** From the frame being published to its first byte sent to a stream client */
+    LatencyHistogram    firstByte;
+    /** From the frame being published to its last byte sent to a stream client */
+    LatencyHistogram    lastByte;
+
+    /** Get the latencies as a JSON object */
+    Strings::FastString toJSON() const;
+};
+
+/** The process memory, as seen by the kernel and by the C library's allocator.
+    It's read on demand (the allocator's statistics walk its arenas), so it costs nothing otherwise */
+struct ProcessMemory
+{
+    /** The resident size, and its high water mark, in bytes */
+    uint64 rss, rssPeak;
+    /** The heap: the bytes allocated (including the large allocations mapped on their own), their highest value read so far, the bytes free in the
+        allocator's arenas (kept for the next allocations, a large value with a small heap means fragmentation) and the bytes mapped on their own */
+    uint64 heapUsed, heapPeak, heapFree, heapMapped;
+
+    /** Read the current values
+        @return false if the process status can't be read */
+    bool read();
+    /** Get the values as a JSON object */
+    Strings::FastString toJSON() const;
+
+    ProcessMemory() : rss(0), rssPeak(0), heapUsed(0), heapPeak(0), heapFree(0), heapMapped(0) {}
+};
+
+/** The profiler of the hot paths, timed by probes (see PROBE, this needs the WantTimedProfiling build option).
+    The probes only measure once the profiler is started, and their durations are aggregated in lock-free histograms shared by all the threads.
+    The durations are recorded in microseconds, so the histograms milliseconds are microseconds here */
+struct Profiler
+{
+    /** The probes, the HTTP server's ones come first */
+    enum Probes {
+        ParseRequest    = 0,
+        SendPendingData = 1,
+        /** Waiting for and dequeuing a frame from the device */
+        FetchFrame      = 2,
+        /** Parsing a JPEG picture's header */
+        ParseJPEG,
+        /** Switching the device's format and buffers */
+        SwitchRes,
+        /** Publishing a captured frame to the clients, the recorder and the outputs */
+        PictureReceived,
+
+        ProbeCount
+    };
+
+    /** Start timing the probes
+        @return false if the profiling was not built */
+    static bool start();
+    /** Check if the profiler is started */
+    static bool isStarted();
+    /** Get each probe's durations (in microseconds) as a JSON object */
+    static Strings::FastString toJSON();
+};
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need strings here
+#include "Strings/Strings.hpp"
+
+typedef Strings::FastString String;
+
+/** The TLS termination of the accepted connections.
+    The handshake is done by OpenSSL, then the record layer is given to the kernel (kTLS), so the socket is used as a plain socket afterwards:
+    the server reads the requests and sends the pictures (with the usual gathered writes) without any copy in user space, the kernel encrypts them.
+    This needs the kernel TLS module (modprobe tls) and a build with TLS=1 (for OpenSSL), else init fails */
+struct TLSServer
+{
+    /** Some limits */
+    enum Constants {
+        /** The maximum duration of a handshake, a stalled client is closed after it */
+        HandshakeTimeoutMs  = 3000,
+    };
+    /** The handshake progress */
+    enum Progress {
+        Failed      = -1,   //!< The handshake failed, the connection must be closed
+        Done        = 0,    //!< The record layer is in the kernel, the socket is used as is
+        WantRead    = 1,    //!< The handshake continues once the socket is readable
+        WantWrite   = 2,    //!< The handshake continues once the socket is writable
+    };
+
+    /** Load the certificate and the private key, and check the kernel can do the record layer
+        @param certificate  The PEM certificate chain file path
+        @param key          The PEM private key file path
+        @return An empty string on success, or the error message */
+    String init(const String & certificate, const String & key);
+    /** Check if the TLS termination is enabled */
+    bool isEnabled() const { return context != 0; }
+    /** Make the handshake progress on an accepted socket without blocking, and give the record layer to the kernel once it's done
+        @param session  The handshake session, it must be 0 for the first call. It's set to 0 once the handshake is over (done or failed)
+        @param fd       The accepted socket descriptor (in non blocking mode)
+        @param error    On output, the error message if the handshake failed
+        @return The handshake progress, call again when the socket is ready as asked */
+    Progress handshake(void *& session, const int fd, String & error);
+    /** Give up a handshake in progress (like when the client is too slow), the socket must be closed
+        @param session  The handshake session, it's set to 0 */
+    void abortHandshake(void *& session);
+
+    TLSServer() : context(0) {}
+    ~TLSServer();
+
+    // Members
+private:
+    /** The OpenSSL context (SSL_CTX) */
+    void * context;
+};
@@ -10,12 +10,24 @@
 #include "Platform/Platform.hpp"
 // We need Utils::MemoryBlock here
 #include "Utils/MemoryBlock.hpp"
+// We need containers too
+#include "Container/Container.hpp"
 
 // We need logs too
 #include "LogLevel.hpp"
+// We need latency statistics too
+#include "Stats.hpp"
+// We need the remote source too
+#include "RemoteSource.hpp"
+// We need the preview downscaler
+#include "Downscaler.hpp"
+// We need shared frames for the full resolution pictures
+#include "Frame.hpp"
 
 #include <linux/types.h>          /* for videodev2.h */
 #include <linux/videodev2.h>
+#include <sys/eventfd.h>
+#include <stdio.h>
 
 typedef Strings::FastString String;
 
@@ -34,26 +46,138 @@ public:
 
     /** Some constants */
     enum Constants {
-        IOCTLRetry      = 4,
-        BuffersCount    = 3,
+        IOCTLRetry          = 4,
+        DefaultBuffersCount = 3,
+        MaxBuffersCount     = 32,
+        DefaultSwitchTimeoutMs = 3000,
     };
 
     /** Exception thrown upon unexpected device disconnection */
     struct DisconnectedError {};
 
+    /** The capture counters.
+        They are updated by the capture thread and can be read from any thread */
+    struct Counters
+    {
+        /** The frames fetched from the device */
+        Threading::Atomic<uint64>   framesCaptured;
+        /** The frames dropped because the driver flagged them as corrupt (like a partial USB transfer) */
+        Threading::Atomic<uint64>   framesErrored;
+        /** The frames dropped because they are truncated (no end of image marker) or not a JPEG picture */
+        Threading::Atomic<uint64>   framesTruncated;
+        /** The frames dropped because they could not be downscaled for the preview */
+        Threading::Atomic<uint64>   framesNotScaled;
+        /** The frames dropped to respect the maximum frame rate */
+        Threading::Atomic<uint64>   framesThrottled;
+        /** The frames dropped after a resolution switch, because they are stale or not in the expected format */
+        Threading::Atomic<uint64>   framesStale;
+        /** The ioctl calls retried after a recoverable error, and the ioctl calls that failed */
+        Threading::Atomic<uint64>   ioctlRetries, ioctlFailures;
+        /** The time taken by the full resolution captures (from the request to the picture) */
+        LatencyHistogram            fullResDuration;
+        /** The time taken to switch the sensor to full resolution (until the first valid frame) */
+        LatencyHistogram            switchDuration;
+    };
+
+    /** A device control (like the exposure or the focus), as reported by the driver.
+        The controls are listed when the device is opened and their values are cached, so listing them does not query the device */
+    struct Control
+    {
+        /** The control identifier, type (V4L2_CTRL_TYPE_xxx) and flags (V4L2_CTRL_FLAG_xxx) */
+        uint32  id, type, flags;
+        /** The control name, in lower case with underscores (like "exposure_time_absolute") */
+        String  name;
+        /** The control's range, step and default value */
+        int64   minimum, maximum, step, defaultValue;
+        /** The cached current value */
+        int64   value;
+        /** The menu items as a JSON object (like {"0":"Disabled","1":"50 Hz"}), for the menu controls */
+        String  menu;
+
+        /** Get the control as a JSON object */
+        String toJSON() const;
+
+        Control() : id(0), type(0), flags(0), minimum(0), maximum(0), step(0), defaultValue(0), value(0) {}
+    };
+    /** The controls to set, and their values */
+    struct ControlValues
+    {
+        Container::PlainOldData<uint32>::Array  ids;
+        Container::PlainOldData<int64>::Array   values;
+    };
+
+    /** The formats enumerated for a device: its JPEG pixel format and its frame sizes */
+    struct DeviceFormats
+    {
+        /** A frame size (the maximum size for a stepwise range) */
+        struct Size
+        {
+            uint32 width, height;
+            Size(const uint32 width = 0, const uint32 height = 0) : width(width), height(height) {}
+        };
+        /** The device identifier (its driver, card and bus) */
+        String  key;
+        /** The pixel format (V4L2_PIX_FMT_MJPEG or V4L2_PIX_FMT_JPEG) */
+        uint32  pixelFormat;
+        Container::PlainOldData<Size>::Array sizes;
+
+        DeviceFormats() : pixelFormat(0) {}
+    };
+    /** The cache of the enumerated formats, shared by all the devices.
+        Enumerating the formats and frame sizes takes more than a second with some cameras, and it's done each time a device is opened (so after each
+        idle close and reconnection). The devices are identified by their driver, card and bus, so the cache is still valid for another device path.
+        The cache can be saved in a file, so it survives a restart */
+    struct FormatCache
+    {
+        /** Load the cache from the given file, and save it there when a device is enumerated (an empty path only keeps the cache in memory) */
+        static String load(const char * path);
+        /** Find the formats of the given device, return false if it's not in the cache */
+        static bool find(const String & key, DeviceFormats & formats);
+        /** Store the formats of a device (and save the cache file, if any) */
+        static void store(const DeviceFormats & formats);
+        /** Remove a device from the cache, when its cached formats are not accepted anymore */
+        static void remove(const String & key);
+        /** Get the cache key of a device */
+        static String getKey(const struct v4l2_capability & caps);
+    };
+
     /** The V4L2 context object */
     struct Context
     {
         /** The file descriptor to the object */
         Platform::FileIndexWrapper fd;
+        /** Set when the device node is opened but the device is not set up yet (see openNode) */
+        bool    nodeOpened;
 
         // V4L2 specific stuff here
         struct v4l2_capability      caps;
+        /** The formats, a multi-planar format starts with the same fields (the size, pixel format and field), so fmt.pix is used for both */
         struct v4l2_format          format;
         struct v4l2_format          highres;
         struct v4l2_buffer          buffer;
         struct v4l2_requestbuffers  requestBuffers;
-        void *                      mem[BuffersCount];
+        void *                      mem[MaxBuffersCount];
+        /** The number of buffers currently mapped in mem */
+        unsigned                    mappedCount;
+        /** The buffers type, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE for the multi-planar only devices (like the ISP and libcamera nodes) */
+        uint32                      bufferType;
+        /** The buffer's planes for the multi-planar devices, the compressed pictures are in the first one */
+        struct v4l2_plane           planes[VIDEO_MAX_PLANES];
+        /** The DMABUF descriptors exported for the mapped buffers (-1 if the driver can't export them), for the hardware encoders */
+        int                         dmabuf[MaxBuffersCount];
+        /** The number of buffers to request in low resolution and full resolution mode */
+        unsigned                    lowResBuffers, highResBuffers;
+        /** The buffers memory model (V4L2_MEMORY_MMAP, or V4L2_MEMORY_USERPTR when fast switching) */
+        unsigned                    memory;
+        /** If set, the buffers are allocated once for both resolutions, so switching resolution only changes the format */
+        bool                        fastSwitch;
+        /** If set, the stream is in full resolution (the low resolution pictures are downscaled from it) */
+        bool                        fullResStream;
+        /** If set, the stream is in H.264 (from the device's encoder), the full resolution pictures are still in MJPEG */
+        bool                        h264Stream;
+        /** The number of user allocated buffers in mem and their size in bytes */
+        unsigned                    userCount;
+        size_t                      userBufferSize;
 
         /** Check if the device support streaming API */
         bool supportsStream; 
@@ -61,27 +185,65 @@ public:
         State state;
         /** The number of pictures to drop while switching resolution */
         unsigned framesToDrop;
-        /** The minimum frame duration in milliseconds */
+        /** The minimum frame duration in seconds (it's longer than the configured one while the rate governor slows the capture) */
         double minFrameDuration;
+        /** The configured minimum frame duration in seconds (from the maximum FPS) */
+        double configuredFrameDuration;
+        /** Set when the device itself is limiting the frame rate to the expected FPS */
+        bool driverPaced;
+        /** Set if the device can set its frame interval, and its default interval */
+        bool canSetFrameRate;
+        struct v4l2_fract defaultInterval;
+        /** Set if the device's frame interval was changed from its default */
+        bool intervalChanged;
+        /** The time the stream started (on the monotonic clock), in seconds */
+        double streamStart;
+        /** The maximum time to wait for a valid frame after switching resolution, in milliseconds */
+        unsigned switchTimeoutMs;
+        /** The JPEG quality of the stream's and of the full resolution pictures (1 to 100), 0 to keep the device's */
+        unsigned streamQuality, fullResQuality;
+        /** Set if the device's JPEG quality can be set (with the compression quality control, or the JPEG compression parameters) */
+        bool canSetQuality;
+        /** The event descriptor used to wake up a thread waiting for the device */
+        int wakeFd;
+        /** The counters to update (shared by the contexts of a thread, not owned) */
+        Counters * counters;
+        /** The device controls, with their cached values */
+        Container::WithCopyConstructor<Control>::Array controls;
+
+        /** The waitForDevice result flags */
+        enum WaitResult {
+            FrameReady  = 1,
+            EventReady  = 2,
+            WokenUp     = 4,
+        };
 
         // Interface
     public:
         // Low level IOCTL that's retrying upon recoverable errors
         int ioctl        (int method, void *arg, const bool throwOnDisconnect = true, const bool interruptible = false);
 
- //       int getControl   (int control);
- //       int setControl   (int control, int value, int plugin_number, globals *pglobal);
- //       int upControl    (int control);
- //       int downControl  (int control);
- //       int toggleControl(int control);
- //       int resetControl (int control);
+        // List the device controls and read their values, in the controls cache
+        String  queryControls();
+        // Parse the controls to set, like "brightness=128&exposure_time_absolute=300" (the names or the identifiers in hexadecimal, like 0x00980900)
+        String  parseControls(const String & assignments, ControlValues & out) const;
+        // Set the given controls in a single call, and update the cache (unless it's a temporary change)
+        String  setControls(const ControlValues & values, const bool updateCache = true);
+        // Get the cached values of the given controls
+        void    getCachedControls(ControlValues & values) const;
+        // Get the controls cache as a JSON array
+        String  controlsToJSON() const;
 
+        // Only open the device node, the next openDevice sets up this node instead of opening it (so it's opened with the privileges, and set up later)
+        String  openNode(const char * path);
         // Open the device and extract all useful informations
-        String  openDevice(const char * path, int preferredVideoWidth = 640, int preferredVideoHeight = 480, int picWidth = 0, int picHeight = 0, unsigned stabPicCount = 0, double minFrameDuration = 0);
+        String  openDevice(const char * path, int preferredVideoWidth = 640, int preferredVideoHeight = 480, int picWidth = 0, int picHeight = 0, unsigned stabPicCount = 0, double minFrameDuration = 0, unsigned lowResBufferCount = DefaultBuffersCount, unsigned highResBufferCount = DefaultBuffersCount);
         // Close the device (used to release memory and the file descriptor so device can be unplugged)
         String  closeDevice();
-        // Set file descriptor as blocking/non-blocking 
-        bool    setBlockingState(bool blocking);
+        // Wait for a frame or an event from the device, or a wake up (if wakeable), return a combination of WaitResult, 0 on timeout or -1 on error
+        int     waitForDevice(const int timeoutMs, const bool wakeable);
+        // Wake up the thread waiting for the device
+        void    wakeUp();
         // Start the stream
         bool    startStreaming();
         // Stop the stream
@@ -92,72 +254,373 @@ public:
         bool    fetchFrame(uint8 * & ptr, size_t & size);
         // Return the frame to the queue
         bool    returnFrame();
+        // Get the DMABUF descriptor of the last fetched frame, or -1 if it's not exported (it's only valid until the frame is returned)
+        int     getFrameDMABUF() const { return memory == V4L2_MEMORY_MMAP && buffer.index < mappedCount ? dmabuf[buffer.index] : -1; }
+        // Check if the device is multi-planar
+        bool    isMultiPlanar() const { return bufferType == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE; }
+        // Check if the last fetched frame is a valid frame for the given format
+        bool    isFrameInFormat(const struct v4l2_format & f, uint8 * ptr, size_t size);
+        // Get the capture time of the last fetched frame on the monotonic clock, in seconds
+        double  getFrameTime() const;
+        /** Get the time elapsed since the driver captured the last fetched frame, in seconds (0 if the driver does not timestamp the frames) */
+        double  getFrameAge() const;
+        // Fetch frames until one is valid for the given format (the frame must be returned) or the switch timeout expires
+        bool    fetchFrameInFormat(const struct v4l2_format & f, uint8 * & ptr, size_t & size);
 
 
         // Switch to full resolution picture streaming
         bool    switchToFullRes();
         // Switch to low resolution picture streaming
         bool    switchToLowRes();
+        // Stop the stream, keeping the format and the buffers (queued for the next start), so it starts again quickly
+        bool    enterStandby();
+        // Change the minimum frame duration while streaming (the stream is restarted if the device paces itself, else the frames are dropped)
+        bool    changeFrameRate(const double duration);
+        // Change the low resolution while streaming (the stream is restarted in the new format, or in the previous one if the new one can't be set)
+        // Returns false if the stream can't be restarted at all
+        bool    changeLowRes(const unsigned width, const unsigned height);
+        // Get the size of the buffers mapped or allocated in the process, in bytes
+        size_t  getBuffersBytes() const { return mappedCount * (size_t)getBufferLength() + userCount * userBufferSize; }
+        // Set the device's JPEG quality (does nothing for 0 or if the device can't), return false on error
+        bool    setJPEGQuality(const unsigned quality);
 
         // Helper methods
     private:
+        // Set the device frame rate from minFrameDuration, if supported
+        bool    setFrameRate();
+        // Enumerate the JPEG formats and frame sizes of the device
+        String  enumerateFormats(DeviceFormats & formats);
+        // Read the current value of the given controls (all of them if none given) in the cache
+        String  readControls(const uint32 * ids = 0, const size_t count = 0);
+        // Find a control in the cache, return -1 if not found
+        int     findControl(const uint32 id) const;
         // Switch resolution (internal implementation)
-        String  switchRes(struct v4l2_format * f, bool unmapFirst = true);
+        String  switchRes(struct v4l2_format * f, unsigned count, bool unmapFirst = true);
+        // Queue all the allocated buffers
+        String  queueBuffers();
         // Unmap the buffer
         String  unmapBuffers();
+        // Allocate the user buffers for fast switching (if they are not large enough)
+        String  allocateUserBuffers(unsigned count, size_t size);
+        // Free the user buffers
+        void    freeUserBuffers();
+        // Clear the buffer for the given index, with its planes for the multi-planar devices
+        void    prepareBuffer(const unsigned index);
+        // Get the buffer's size, mapping offset and used size (from its first plane for the multi-planar devices)
+        uint32  getBufferLength() const { return isMultiPlanar() ? planes[0].length : buffer.length; }
+        uint32  getBufferOffset() const { return isMultiPlanar() ? planes[0].m.mem_offset : buffer.m.offset; }
+        // Export the mapped buffers as DMABUF descriptors, if the driver can
+        void    exportBuffers();
+        // Close the exported DMABUF descriptors
+        void    closeExportedBuffers();
+        // Get the maximum picture size of a format
+        size_t  getImageSize(const struct v4l2_format & f) const { return isMultiPlanar() ? f.fmt.pix_mp.plane_fmt[0].sizeimage : f.fmt.pix.sizeimage; }
 
     public:
-        Context() : fd(-1), supportsStream(false), state(Disconnected), framesToDrop(0) {}
+        Context() : fd(-1), nodeOpened(false), mappedCount(0), bufferType(V4L2_BUF_TYPE_VIDEO_CAPTURE), lowResBuffers(DefaultBuffersCount), highResBuffers(DefaultBuffersCount), memory(V4L2_MEMORY_MMAP), fastSwitch(false), fullResStream(false), h264Stream(false), userCount(0), userBufferSize(0), supportsStream(false), state(Disconnected), framesToDrop(0), minFrameDuration(0), configuredFrameDuration(0), driverPaced(false), canSetFrameRate(false), defaultInterval(), intervalChanged(false), streamStart(0), switchTimeoutMs(DefaultSwitchTimeoutMs), streamQuality(0), fullResQuality(0), canSetQuality(false), wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), counters(0) { for (unsigned i = 0; i < MaxBuffersCount; i++) dmabuf[i] = -1; }
+        ~Context() { closeExportedBuffers(); if (wakeFd != -1) ::close(wakeFd); }
+    };
+
+    /** The status of a frame in a capture trace */
+    enum TraceStatus { TraceValid = 0, TraceErrored, TraceTruncated, TraceThrottled, TraceStatusCount };
+
+    /** A synthetic source replaying JPEG pictures at a fixed rate.
+        This is used for measuring the server without a camera */
+    struct FakeSource
+    {
+        /** The pictures to replay (owned) */
+        Container::NotConstructible<Utils::MemoryBlock>::IndexList pictures;
+        /** The duration between two pictures in seconds */
+        double frameDuration;
+        /** The pictures size in pixels (from the first picture) */
+        int width, height;
+        /** The replayed capture trace, if any: each frame's interval (in seconds) and status, and each full resolution capture's duration
+            (in seconds, negative if it failed). They are replayed in a loop, with the next frame and capture indexes */
+        Container::PlainOldData<double>::Array intervals, switches;
+        Container::PlainOldData<uint8>::Array statuses;
+        size_t nextFrame, nextSwitch;
+
+        /** Load the pictures from a directory of JPEG files (in name order) or a MJPEG file (concatenated JPEG pictures)
+            @param path     The directory or file path
+            @param fps      The replay rate in frames per second */
+        String load(const char * path, const unsigned fps);
+        /** Load a capture trace, the pictures are then replayed with the recorded frames intervals and status, and the full resolution
+            captures take the recorded time (see startCaptureTrace) */
+        String loadTrace(const char * path);
+        /** Check if the pictures are loaded */
+        bool isLoaded() const { return pictures.getSize() != 0; }
+        /** Release the pictures */
+        void unload() { pictures.Clear(); width = height = 0; intervals.Clear(); switches.Clear(); statuses.Clear(); nextFrame = nextSwitch = 0; }
+
+        FakeSource() : frameDuration(0), width(0), height(0), nextFrame(0), nextSwitch(0) {}
     };
 
     /** The receiving interface */
     struct PictureSink
     {
-        /** Called upon new picture received, return false to stop the receiving thread */
-        virtual bool pictureReceived(const uint8 * data, const size_t len) = 0;
+        /** Called upon new picture received, return false to stop the receiving thread
+            @param data     The JPEG picture
+            @param len      The picture size in bytes
+            @param age      The time elapsed since the driver captured this picture in seconds, or 0 if unknown */
+        virtual bool pictureReceived(const uint8 * data, const size_t len, const double age) = 0;
+        /** Called by the capture thread when it starts, before capturing any picture (like for setting its scheduling) */
+        virtual void captureStarted() {}
         virtual ~PictureSink() {}
     };
 
     virtual uint32 runThread();
-    bool fetchFullRes();
+    // Capture a full resolution picture with the full resolution controls profile
+    bool fetchFullRes(Context & ctx);
+    // Switch the given context to full resolution and capture a picture
+    bool switchAndFetch(Context & ctx);
+    // The capture loop when replaying a fake source
+    uint32 runFakeSource();
+    // Record a frame fetched from the device in the capture trace, with the driver's timestamp
+    void traceFrame(const double time, const size_t size, const TraceStatus status);
+    // Record a full resolution capture in the capture trace
+    void traceSwitch(const double duration, const bool success);
+    // The capture loop when pulling a remote stream
+    uint32 runRemoteSource();
+    // The capture loop when receiving a multicast stream
+    uint32 runMulticastSource();
+    // Give a captured picture to the sink, downscaled if a preview scale is set, return false to stop the capture loop
+    bool publishPicture(const uint8 * data, const size_t size, const double age);
+    // Answer a pending full resolution picture request with the given picture
+    void answerFullRes(const uint8 * data, const size_t size);
+    // Get the frame duration to use from the configured one and the rate governor's limit
+    inline double getGovernedDuration(const double configured) const { uint32 fps = frameRateLimit.read(); return fps && 1.0 / fps > configured ? 1.0 / fps : configured; }
+    // Apply a configured frame rate change, if one is pending (the sources' configured durations are only used by this thread)
+    void applyMaxFPS();
 
     // Interface
 public:
     V4L2Thread(PictureSink & sink) : 
         Threading::Thread("V4L2Thread"), sink(sink), 
         captureFullRes("FullRes", Threading::Event::AutoReset), 
-        captureDone("FullResDone", Threading::Event::AutoReset), fullResPic(0) { }
+        captureDone("FullResDone", Threading::Event::AutoReset), fullResPic(0), fullResSuccess(false), trace(0), traceTime(0), fullResGeneration(0), fullResTime(0), minSwitchInterval(0), lastSwitchTime(0), stopRequested(false), previewScale(0), fullResRequested(false), frameRateLimit(0), maxFPSRequest(0), lowResRequest(0), qualityRequest(0), switching(0) { context.counters = stillContext.counters = &counters; }
 
     ~V4L2Thread() { 
         // Don't let the thread run here
-        destroyThread();
+        stopThread();
     }
 
-    String startV4L2Device(const char * path, int preferredVideoWidth = 640, int preferredVideoHeight = 480, int picWidth = 0, int picHeight = 0, unsigned stabPicCount = 0, unsigned maxFPS = 0) {
+    /** Stop the capture thread, without waiting for the device to stop blocking */
+    void stopThread() { stopRequested = true; context.wakeUp(); destroyThread(); stopRequested = false; }
+
+    String startV4L2Device(const char * path, int preferredVideoWidth = 640, int preferredVideoHeight = 480, int picWidth = 0, int picHeight = 0, unsigned stabPicCount = 0, unsigned maxFPS = 0, unsigned lowResBufferCount = DefaultBuffersCount, unsigned highResBufferCount = DefaultBuffersCount) {
         double minFrameDuration = maxFPS ? 1.0 / maxFPS : 0.0;
-        return context.openDevice(path, preferredVideoWidth, preferredVideoHeight, picWidth, picHeight, stabPicCount, minFrameDuration);
+        return context.openDevice(path, preferredVideoWidth, preferredVideoHeight, picWidth, picHeight, stabPicCount, minFrameDuration, lowResBufferCount, highResBufferCount);
     }
 
-    String captureFullResPicture(Utils::MemoryBlock & block);
+    /** Only open the device nodes, they are set up by the next startV4L2Device and startStillDevice (which can be called from another thread,
+        after the privileges are dropped, since the format enumeration and the buffers allocation can take seconds) */
+    String openV4L2Device(const char * path) { return context.openNode(path); }
+    String openStillDevice(const char * path) { return stillContext.openNode(path); }
+
+    /** Use pictures from a file or a directory instead of a device (a fake source is used for both resolutions)
+        @param path     The directory of JPEG files or the MJPEG file to replay
+        @param maxFPS   The replay rate (30 if 0) */
+    String startFakeSource(const char * path, unsigned maxFPS = 0) { return fake.load(path, maxFPS ? maxFPS : 30); }
+    /** Replay the frames timings and the full resolution captures of a capture trace with the fake source (this must be called after starting it)
+        @param path     The capture trace, recorded from a device with startCaptureTrace */
+    String setFakeTrace(const char * path) { return fake.loadTrace(path); }
+    /** Get the pool of the full resolution pictures (for its memory usage) */
+    const FramePool & getFullResPool() const { return fullResPool; }
+    /** Get the size of the device's buffers mapped (or allocated, when fast switching) in the process, in bytes */
+    size_t getDeviceBuffersBytes() const { return context.getBuffersBytes() + stillContext.getBuffersBytes(); }
+    /** Record the timings of the device's frames and full resolution captures to a file (this must be called before starting the capture).
+        A line is written for each frame fetched from the device ("frame <interval in ms> <size> <valid|errored|truncated|throttled>") and
+        for each full resolution capture interrupting the stream ("switch <duration in ms> <ok|failed>"), so a camera's behaviour can be
+        replayed without it (see setFakeTrace). The file is closed with the device
+        @param path     The trace file (the lines are appended)
+        @return An empty string on success, or the error message */
+    String startCaptureTrace(const char * path);
+
+    /** Pull the pictures from a remote MJPEG stream instead of a device.
+        The stream is only pulled while the capture thread is running
+        @param url          The remote stream URL, like http://camera:8080/mjpg
+        @param maxFPS       If not 0, the maximum frame rate (the other frames are dropped)
+        @param fullResURL   If not empty, the full resolution pictures are fetched from this URL (else the stream's pictures are used) */
+    String startRemoteSource(const char * url, unsigned maxFPS = 0, const char * fullResURL = "") { return remote.open(url, maxFPS, fullResURL); }
+
+    /** Capture a full resolution picture.
+        Concurrent calls join the capture in progress instead of switching the sensor again.
+        @param block        On output, contains the JPEG picture
+        @param maxAgeMs     If not 0, a previously captured picture that's not older than this is returned instead
+        @return An empty string on success, or the error message */
+    String captureFullResPicture(Utils::MemoryBlock & block, const uint32 maxAgeMs = 0);
+    /** Capture a full resolution picture, without copying it.
+        This is like captureFullResPicture, but the picture is shared with the cache (and the other requests), so it must not be modified
+        @param frame        On output, references the JPEG picture (its time is the capture time)
+        @param maxAgeMs     If not 0, a previously captured picture that's not older than this is returned instead
+        @return An empty string on success, or the error message */
+    String captureFullResFrame(FrameRef & frame, const uint32 maxAgeMs = 0);
+    /** Get the last captured full resolution picture, without capturing a new one
+        @param block        On output, contains the JPEG picture
+        @param time         On output, the time it was captured in seconds
+        @return false if there is none */
+    bool getLastFullResPicture(Utils::MemoryBlock & block, double & time);
+    /** Get the last captured full resolution picture, if it's not older than the given age (it's what captureFullResFrame would return)
+        @return false if there is none */
+    bool getCachedFullResFrame(FrameRef & frame, const uint32 maxAgeMs) const;
+    /** Get the time the last full resolution picture was captured in seconds, 0 if none was */
+    double getLastFullResTime() const { Threading::ScopedLock scope(fullResLock); return fullResTime; }
+    /** Check if the stream is interrupted, because its device is switched to the full resolution */
+    bool isSwitching() const { return switching.read() != 0; }
+    /** Get the time to wait before the stream's device can be switched to the full resolution again (for the minimum switch interval)
+        @param maxAgeMs     If not 0, no wait is needed while the last captured picture is not older than this (it's served instead)
+        @return The time to wait in milliseconds, 0 if a capture can start now (or would not switch the stream) */
+    uint32 getSwitchDelayMs(const uint32 maxAgeMs = 0) const;
+
+    /** Use buffers allocated once for both resolutions (this must be called before starting the device) */
+    void setFastSwitch(const bool enable) { context.fastSwitch = enable; }
+    /** Stream in full resolution and downscale the pictures for the low resolution stream (this must be called before starting the device).
+        This is for the cameras with a single MJPEG resolution, and the full resolution pictures don't need a sensor switch anymore
+        @param scale    The scale divisor: 2, 4 or 8 (0 or 1 to stream the device's low resolution pictures)
+        @return false if the scale is not supported (the pictures are then not downscaled) */
+    bool setPreviewScale(const unsigned scale) { bool valid = scale == 2 || scale == 4 || scale == 8; previewScale = valid ? scale : 0; context.fullResStream = valid; return valid || scale <= 1; }
+    /** Capture the stream in H.264 from the device's encoder instead of MJPEG (this must be called before starting the device).
+        The access units are given to the sink as is, and the frames are never dropped here since the next ones depend on them */
+    void setH264Stream(const bool enable) { context.h264Stream = enable; }
+    /** Ask the device's encoder for a key frame (for a new viewer of the H.264 stream)
+        @return false if the device can't be asked for it (the viewer then waits for the next periodic key frame) */
+    bool requestKeyFrame();
+    /** Limit the capture frame rate below the configured maximum, for the rate governor (the capture thread applies it before its next frame).
+        A device pacing itself is asked for the new rate (its stream is restarted), else the frames are dropped
+        @param fps  The maximum frame rate, 0 for the configured maximum */
+    void setFrameRateLimit(const unsigned fps) { frameRateLimit.save(fps); }
+    /** Get the rate governor's limit, 0 if none */
+    unsigned getFrameRateLimit() const { return frameRateLimit.read(); }
+    /** Change the configured maximum frame rate while capturing (the capture thread applies it before its next frame)
+        @param fps  The maximum frame rate, 0 for the device's maximum */
+    void setMaxFPS(const unsigned fps) { maxFPSRequest.save(fps + 1); context.wakeUp(); }
+    /** Change the low resolution while capturing from a device (the capture thread switches the stream's format before its next frame).
+        The device might pick the closest resolution it supports. This does nothing for a fake or a remote source, and it's kept until the stream is in the low resolution when the preview is downscaled.
+        If the device rejects the resolution, the previous one is kept */
+    void setLowRes(const unsigned width, const unsigned height) { lowResRequest.save((min(width, 65535U) << 16) | min(height, 65535U)); context.wakeUp(); }
+    /** Get the device controls as a JSON array (from the cache, the device is not queried) */
+    String getControls() const { Threading::ScopedLock scope(controlsLock); return context.controlsToJSON(); }
+    /** Set some device controls in a single device call
+        @param assignments  The controls to set, like "brightness=128&exposure_time_absolute=300" (the names or the identifiers in hexadecimal)
+        @return An empty string on success, or the error message */
+    String setControls(const String & assignments);
+    /** Set the controls applied while capturing the full resolution pictures (the stream's values are restored after each capture).
+        @param assignments  The controls to set, with the same syntax as setControls (they are checked on each capture) */
+    void setStillControls(const String & assignments) { Threading::ScopedLock scope(controlsLock); stillControls = assignments; }
+    /** Set the maximum time to wait for a valid frame after a resolution switch */
+    void setSwitchTimeout(const unsigned timeoutMs) { context.switchTimeoutMs = stillContext.switchTimeoutMs = timeoutMs ? timeoutMs : (unsigned)DefaultSwitchTimeoutMs; }
+    /** Set the device's JPEG quality for the stream and for the full resolution pictures (this must be called before starting the device).
+        Many devices can't change it, and the ones that can usually apply it to the next pictures only
+        @param streamQuality    The stream's quality, from 1 to 100 (0 to keep the device's)
+        @param fullResQuality   The full resolution pictures quality, from 1 to 100 (0 to keep the device's) */
+    void setJPEGQuality(const unsigned streamQuality, const unsigned fullResQuality) { context.streamQuality = min(streamQuality, 100U); context.fullResQuality = stillContext.fullResQuality = min(fullResQuality, 100U); }
+    /** Change the stream's JPEG quality while capturing (the capture thread applies it before its next frame), for the quality governor
+        @param quality  The stream's quality, from 1 to 100 */
+    void setStreamQuality(const unsigned quality) { qualityRequest.save(min(quality, 100U)); }
+    /** Set the minimum time between the switches of the stream's device to the full resolution, in milliseconds (0 for none) */
+    void setMinSwitchInterval(const unsigned intervalMs) { minSwitchInterval = intervalMs / 1000.0; }
+
+    /** Open a dedicated device for the full resolution pictures.
+        Some cameras expose a second capture node, using it for full resolution pictures avoids switching the stream's resolution */
+    String startStillDevice(const char * path, int picWidth = 0, int picHeight = 0, unsigned stabPicCount = 0, unsigned bufferCount = DefaultBuffersCount) {
+        // The low resolution mode is not used on this device, so only use a single buffer for it
+        return stillContext.openDevice(path, picWidth ? picWidth : 640, picHeight ? picHeight : 480, picWidth, picHeight, stabPicCount, 0, 1, bufferCount);
+    }
 
     String stopV4L2Device() {
         // First stop the thread
-        destroyThread();
-        return context.closeDevice();
+        stopThread();
+        if (trace) { fclose(trace); trace = 0; }
+        if (fake.isLoaded()) { fake.unload(); return ""; }
+        if (remote.isOpened()) { remote.close(); return ""; }
+        String ret = context.closeDevice();
+        if (stillContext.fd != -1) {
+            Threading::ScopedLock scope(captureLock);
+            String sret = stillContext.closeDevice();
+            if (!ret) ret = sret;
+        }
+        return ret;
     }
  
-    bool isOpened() const { return context.fd != -1; }
-    bool isDevicePresent() const { return context.state != Disconnected; }
+    bool isOpened() const { return context.fd != -1 || fake.isLoaded() || remote.isOpened(); }
+    /** Check if the device is streaming (it's opened but not streaming in standby) */
+    bool isStreaming() const { return context.state == On; }
+    /** Put the device in standby: its stream is stopped, but it's kept opened with its format and buffers, so the next capture starts in a few
+        frames instead of opening the device again. This must be called while the capture thread is not running */
+    bool enterStandby();
+    bool isDevicePresent() const { return context.state != Disconnected || fake.isLoaded() || remote.isOpened(); }
+    /** Reset the USB port of a device, like unplugging it and plugging it back (for a device that stopped sending frames).
+        The device must be closed, its node is removed and comes back (usually with the same name) once the device is enumerated again
+        @param path     The device node, like /dev/video0
+        @return An empty string on success, or the error message */
+    static String resetUSBDevice(const char * path);
+
+    int getLowResWidth()  const { return scaled(fake.isLoaded() ? fake.width : remote.isOpened() ? remote.width : context.format.fmt.pix.width); }
+    int getLowResHeight() const { return scaled(fake.isLoaded() ? fake.height : remote.isOpened() ? remote.height : context.format.fmt.pix.height); }
+    /** Get the preview size from the captured size */
+    inline int scaled(const int size) const { return previewScale ? (size + (int)previewScale - 1) / (int)previewScale : size; }
+    bool hasStillDevice() const { return stillContext.fd != -1 && !stillContext.nodeOpened; }
+
+    /** Get the capture counters */
+    const Counters & getCounters() const { return counters; }
 
-    int getLowResWidth()  const { return context.format.fmt.pix.width; }
-    int getLowResHeight() const { return context.format.fmt.pix.height; }
-    int getHighResWidth() const { return context.highres.fmt.pix.width; }
-    int getHighResHeight() const { return context.highres.fmt.pix.height; }
+    int getHighResWidth() const { if (fake.isLoaded()) return fake.width; if (remote.isOpened()) return remote.fullRes.isSet() ? remote.fullResWidth : remote.width; return (hasStillDevice() ? stillContext : context).highres.fmt.pix.width; }
+    int getHighResHeight() const { if (fake.isLoaded()) return fake.height; if (remote.isOpened()) return remote.fullRes.isSet() ? remote.fullResHeight : remote.height; return (hasStillDevice() ? stillContext : context).highres.fmt.pix.height; }
 
     // Members
 private:
     Context                 context;
+    /** The optional dedicated device context for full resolution pictures */
+    Context                 stillContext;
+    /** The fake source, if used instead of the device */
+    FakeSource              fake;
+    /** The remote source, if used instead of the device */
+    RemoteSource            remote;
     PictureSink       &     sink;
     Threading::Event        captureFullRes, captureDone;
     Utils::MemoryBlock *    fullResPic;
+    /** Set by the capture thread if the last full resolution capture succeeded */
+    bool                    fullResSuccess;
+    /** Serialize the full resolution captures */
+    Threading::FastLock     captureLock;
+    /** The capture trace being recorded, and the last traced frame's time (only used by the capture thread) */
+    FILE *                  trace;
+    double                  traceTime;
+    /** Protect the last captured picture below */
+    mutable Threading::FastLock fullResLock;
+    /** The full resolution pictures, they are recycled once no request sends them anymore */
+    FramePool               fullResPool;
+    /** The last captured full resolution picture and the result of the capture */
+    FrameRef                fullResCache;
+    String                  fullResError;
+    /** Incremented after each full resolution capture */
+    uint32                  fullResGeneration;
+    /** The time of the last successful capture in seconds */
+    double                  fullResTime;
+    /** The minimum time between the switches of the stream's device and the time the last one ended, in seconds */
+    double                  minSwitchInterval, lastSwitchTime;
+    /** Set while stopping the thread (it's checked after being woken up) */
+    volatile bool           stopRequested;
+    /** The capture counters */
+    Counters                counters;
+    /** The preview scale divisor, 0 if the pictures are not downscaled */
+    unsigned                previewScale;
+    /** The preview downscaler and the last preview (only used by the capture thread) */
+    JPEGDownscaler          downscaler;
+    Utils::MemoryBlock      preview;
+    /** Set while a full resolution picture is requested from a full resolution stream, the next valid picture is used */
+    bool                    fullResRequested;
+    /** The rate governor's frame rate limit, 0 if none */
+    Threading::Atomic<uint32> frameRateLimit;
+    /** The configured frame rate to apply + 1, or 0 if none is pending */
+    Threading::Atomic<uint32> maxFPSRequest;
+    /** The low resolution to switch to (width in the upper 16 bits), or 0 if none is pending */
+    Threading::Atomic<uint32> lowResRequest;
+    /** The stream's JPEG quality to apply, or 0 if none is pending */
+    Threading::Atomic<uint32> qualityRequest;
+    /** Set while the capture thread switches the stream's device to the full resolution */
+    Threading::Atomic<uint32> switching;
+    /** Protect the controls cache and the full resolution controls profile (they are used by the capture thread and the server) */
+    mutable Threading::FastLock controlsLock;
+    String                  stillControls;
 };
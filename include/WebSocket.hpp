@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+#pragma once
+
+// We need strings here
+#include "Strings/Strings.hpp"
+
+typedef Strings::FastString String;
+
+/** The WebSocket protocol (RFC 6455) parts used for streaming the pictures.
+    Each picture is sent as a single binary message, and the client acknowledges each picture it displayed with a (small) message, so the
+    server only sends a new picture when the client is ready for it, always the newest one.
+    The server's frames are not masked, so the picture is sent as is after the frame header */
+struct WebSocket
+{
+    /** The frame opcodes */
+    enum Opcode {
+        Continuation    = 0,
+        Text            = 1,
+        Binary          = 2,
+        Close           = 8,
+        Ping            = 9,
+        Pong            = 10,
+    };
+    /** Some limits */
+    enum Constants {
+        /** The largest frame header sent by the server (without a mask) */
+        MaxHeaderSize   = 10,
+        /** The largest message accepted from the client (the control frames can't be larger anyway), a larger one closes the connection */
+        MaxMessageSize  = 125,
+        /** The largest frame header received from the client (for a small message, with its mask) */
+        MaxClientHeader = 6,
+    };
+
+    /** Compute the Sec-WebSocket-Accept answer header from the client's Sec-WebSocket-Key header */
+    static String getAcceptKey(const String & key);
+    /** Build the header of a frame sent by the server
+        @param header   On output, the header (the buffer must be at least MaxHeaderSize bytes)
+        @param opcode   The frame opcode
+        @param length   The payload size in bytes
+        @return The header size in bytes */
+    static size_t makeHeader(uint8 * header, const Opcode opcode, const uint64 length);
+
+    /** The reader of the messages sent by the client (only small messages are accepted) */
+    struct Reader
+    {
+        /** Get the space to receive the client's data into
+            @param size     On output, the available space in bytes */
+        uint8 * getFreeSpace(size_t & size) { size = sizeof(buffer) - used; return buffer + used; }
+        /** Tell the reader some data was received in the space given by getFreeSpace */
+        void received(const size_t size) { used += size; }
+        /** Extract the next complete message, it's unmasked in place
+            @param opcode   On output, the message opcode
+            @param payload  On output, the message payload (it's valid until the next call)
+            @param length   On output, the payload size in bytes
+            @return 1 if a message is extracted, 0 if more data is needed, -1 on a protocol error (like an unmasked or too large message) */
+        int next(Opcode & opcode, const uint8 *& payload, size_t & length);
+
+        Reader() : used(0), consumed(0) {}
+
+        // Members
+    private:
+        uint8   buffer[MaxClientHeader + MaxMessageSize];
+        /** The number of bytes received in the buffer, and the size of the last message extracted */
+        size_t  used, consumed;
+    };
+};
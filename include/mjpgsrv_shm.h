@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+/* The shared memory frame output of MJPGServer, and a tiny client for the local consumers.
+   This header is plain C (C99 or C++), it only needs the POSIX shared memory and the Linux futex.
+
+   The server publishes the stream's frames in a POSIX shared memory object (named by the "sharedMemory" configuration key), made of a
+   header page, then a slot for each frame (the pictures are page aligned). A consumer maps it, waits for a new frame, acquires the latest
+   slot, reads the picture in place (there is no copy) and releases the slot. The server never waits for the consumers: it only writes in a
+   slot that no one reads, and skips the frame if there is none (so keep the frames for a short time, and don't acquire more than one
+   slot per consumer at a time).
+
+   Typical use:
+       struct mjpgsrv_shm_header * ring = mjpgsrv_shm_open("mjpgsrv-front");
+       uint32_t last = 0;
+       while (ring && mjpgsrv_shm_is_alive(ring))
+       {
+           struct mjpgsrv_shm_frame frame;
+           if (!mjpgsrv_shm_wait(ring, last, 1000) || !mjpgsrv_shm_acquire(ring, &frame)) continue;
+           last = (uint32_t)frame.sequence;
+           analyze(frame.data, frame.size);
+           mjpgsrv_shm_release(ring, &frame);
+       }
+       mjpgsrv_shm_close(ring);
+   When the server stops (or restarts), the ring is marked as dead, so the consumer must open it again. */
+#ifndef MJPGSRV_SHM_H
+#define MJPGSRV_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* "MJPR" */
+#define MJPGSRV_SHM_MAGIC       0x524a504d
+#define MJPGSRV_SHM_VERSION     1
+#define MJPGSRV_SHM_MAX_SLOTS   16
+#define MJPGSRV_SHM_HEADER_SIZE 4096
+/* Set in a slot's readers count while the server writes it */
+#define MJPGSRV_SHM_WRITING     0x80000000u
+
+/* A frame slot */
+struct mjpgsrv_shm_slot
+{
+    /* The number of consumers reading this slot, with MJPGSRV_SHM_WRITING while the server writes it */
+    uint32_t readers;
+    /* The picture size in bytes, and its offset from the beginning of the mapping */
+    uint32_t size, offset;
+    uint32_t reserved;
+    /* The frame sequence number, and its capture time in microseconds since the epoch */
+    uint64_t sequence, timestamp;
+};
+
+/* The header at the beginning of the shared memory */
+struct mjpgsrv_shm_header
+{
+    /* MJPGSRV_SHM_MAGIC while the server publishes in this ring, 0 once it's stopped */
+    uint32_t magic, version;
+    /* The number of slots, the size of each slot and the whole mapping size in bytes */
+    uint32_t slot_count, slot_size, map_size;
+    /* The latest written slot (slot_count if none) */
+    uint32_t latest;
+    /* The low 32 bits of the latest frame sequence number, the consumers wait on this futex word */
+    uint32_t futex;
+    /* The number of consumers waiting on the futex (the server only wakes them if there are some) */
+    uint32_t waiters;
+    /* The frames not published because all the slots were read, or the picture was too large for a slot */
+    uint64_t skipped;
+    /* The server's process identifier */
+    uint32_t pid;
+    uint32_t reserved;
+    struct mjpgsrv_shm_slot slots[MJPGSRV_SHM_MAX_SLOTS];
+};
+
+/* A frame acquired by a consumer */
+struct mjpgsrv_shm_frame
+{
+    /* The JPEG picture, in the shared memory (read only, valid until released) */
+    const uint8_t * data;
+    uint32_t size, slot;
+    uint64_t sequence, timestamp;
+};
+
+/* Open the ring with the given name (without the leading slash), or return NULL on error */
+static inline struct mjpgsrv_shm_header * mjpgsrv_shm_open(const char * name)
+{
+    char path[256];
+    struct stat st;
+    struct mjpgsrv_shm_header * header;
+    int fd;
+    snprintf(path, sizeof(path), "/%s", name);
+    fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+    if (fd == -1) return NULL;
+    if (fstat(fd, &st) != 0 || st.st_size < MJPGSRV_SHM_HEADER_SIZE) { close(fd); return NULL; }
+    /* The consumers write the readers counts and the waiters count only */
+    header = (struct mjpgsrv_shm_header *)mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) return NULL;
+    if (header->magic != MJPGSRV_SHM_MAGIC || header->version != MJPGSRV_SHM_VERSION || header->map_size != (uint32_t)st.st_size)
+    {
+        munmap(header, (size_t)st.st_size);
+        return NULL;
+    }
+    return header;
+}
+
+/* Close the ring (the acquired frames must be released first) */
+static inline void mjpgsrv_shm_close(struct mjpgsrv_shm_header * header)
+{
+    if (header) munmap(header, header->map_size);
+}
+
+/* Check if the server still publishes in this ring */
+static inline int mjpgsrv_shm_is_alive(const struct mjpgsrv_shm_header * header)
+{
+    return __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == MJPGSRV_SHM_MAGIC;
+}
+
+/* Wait for a frame newer than the given sequence number (its low 32 bits)
+   Returns 1 if there's a new frame, 0 on timeout (or if the ring is dead) */
+static inline int mjpgsrv_shm_wait(struct mjpgsrv_shm_header * header, const uint32_t last, const int timeout_ms)
+{
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    /* The waiters count is increased before checking the futex word, so the server can't miss this consumer */
+    __atomic_add_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->futex, __ATOMIC_SEQ_CST) == last && mjpgsrv_shm_is_alive(header))
+        syscall(SYS_futex, &header->futex, FUTEX_WAIT, last, timeout_ms < 0 ? NULL : &timeout, NULL, 0);
+    __atomic_sub_fetch(&header->waiters, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&header->futex, __ATOMIC_ACQUIRE) != last && mjpgsrv_shm_is_alive(header);
+}
+
+/* Acquire the latest frame, it's not overwritten until it's released
+   Returns 1 on success, 0 if there is no frame yet */
+static inline int mjpgsrv_shm_acquire(struct mjpgsrv_shm_header * header, struct mjpgsrv_shm_frame * frame)
+{
+    int tries;
+    for (tries = 0; tries < 4; tries++)
+    {
+        uint32_t latest = __atomic_load_n(&header->latest, __ATOMIC_ACQUIRE);
+        struct mjpgsrv_shm_slot * slot;
+        if (latest >= header->slot_count) return 0;
+        slot = &header->slots[latest];
+        /* If the server started writing this slot, it's not the latest anymore, try again */
+        if (__atomic_fetch_add(&slot->readers, 1, __ATOMIC_ACQ_REL) & MJPGSRV_SHM_WRITING)
+        {
+            __atomic_fetch_sub(&slot->readers, 1, __ATOMIC_RELEASE);
+            continue;
+        }
+        frame->data = (const uint8_t *)header + slot->offset;
+        frame->size = slot->size;
+        frame->slot = latest;
+        frame->sequence = slot->sequence;
+        frame->timestamp = slot->timestamp;
+        return 1;
+    }
+    return 0;
+}
+
+/* Release an acquired frame, so the server can reuse its slot */
+static inline void mjpgsrv_shm_release(struct mjpgsrv_shm_header * header, const struct mjpgsrv_shm_frame * frame)
+{
+    __atomic_fetch_sub(&header->slots[frame->slot].readers, 1, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/AVI.hpp"
+
+#include <string.h>
+
+// The AVI values are little endian
+static uint8 * put32(uint8 * out, const uint32 value) { out[0] = (uint8)value; out[1] = (uint8)(value >> 8); out[2] = (uint8)(value >> 16); out[3] = (uint8)(value >> 24); return out + 4; }
+static uint8 * put16(uint8 * out, const uint16 value) { out[0] = (uint8)value; out[1] = (uint8)(value >> 8); return out + 2; }
+static uint8 * putCC(uint8 * out, const char * fourCC) { memcpy(out, fourCC, 4); return out + 4; }
+
+void AVIMuxer::getChunkHeader(const uint32 size, uint8 (&chunk)[ChunkHeaderSize])
+{
+    put32(putCC(chunk, "00dc"), size);
+}
+
+void AVIMuxer::setPictures(const int width, const int height, const unsigned fps, const Container::PlainOldData<uint32>::Array & sizes)
+{
+    const uint32 count = (uint32)sizes.getSize(), rate = fps ? fps : 1;
+    uint64 moviSize = 4;
+    uint32 maxSize = 0;
+    for (uint32 i = 0; i < count; i++) { moviSize += getPictureSpace(sizes[i]); maxSize = max(maxSize, sizes[i]); }
+    uint32 indexSize = count * IndexEntrySize;
+    fileSize = HeaderSize - 4 + moviSize + 8 + indexSize;
+
+    header.ensureSize(HeaderSize, true);
+    uint8 * out = header.getBuffer();
+    out = put32(putCC(out, "RIFF"), (uint32)(fileSize - 8));
+    out = putCC(out, "AVI ");
+    out = put32(putCC(out, "LIST"), 192);
+    out = putCC(out, "hdrl");
+
+    // The main header
+    out = put32(putCC(out, "avih"), 56);
+    out = put32(out, 1000000 / rate);           // Microseconds per frame
+    out = put32(out, maxSize * rate);           // Maximum bytes per second
+    out = put32(out, 0);                        // Padding granularity
+    out = put32(out, 0x10);                     // Flags: has an index
+    out = put32(out, count);                    // Total frames
+    out = put32(out, 0);                        // Initial frames
+    out = put32(out, 1);                        // Streams
+    out = put32(out, maxSize);                  // Suggested buffer size
+    out = put32(out, (uint32)width);
+    out = put32(out, (uint32)height);
+    for (int i = 0; i < 4; i++) out = put32(out, 0);
+
+    // The video stream
+    out = put32(putCC(out, "LIST"), 116);
+    out = putCC(out, "strl");
+    out = put32(putCC(out, "strh"), 56);
+    out = putCC(out, "vids");
+    out = putCC(out, "MJPG");
+    out = put32(out, 0);                        // Flags
+    out = put16(out, 0);                        // Priority
+    out = put16(out, 0);                        // Language
+    out = put32(out, 0);                        // Initial frames
+    out = put32(out, 1);                        // Scale
+    out = put32(out, rate);                     // Rate (the frame rate is rate / scale)
+    out = put32(out, 0);                        // Start
+    out = put32(out, count);                    // Length
+    out = put32(out, maxSize);                  // Suggested buffer size
+    out = put32(out, 0xFFFFFFFF);               // Quality (default)
+    out = put32(out, 0);                        // Sample size (variable)
+    out = put16(out, 0); out = put16(out, 0);   // The frame rectangle
+    out = put16(out, (uint16)width); out = put16(out, (uint16)height);
+    // The stream format, a BITMAPINFOHEADER
+    out = put32(putCC(out, "strf"), 40);
+    out = put32(out, 40);
+    out = put32(out, (uint32)width);
+    out = put32(out, (uint32)height);
+    out = put16(out, 1);                        // Planes
+    out = put16(out, 24);                       // Bit count
+    out = putCC(out, "MJPG");
+    out = put32(out, (uint32)width * (uint32)height * 3);
+    for (int i = 0; i < 4; i++) out = put32(out, 0);
+
+    // The pictures list
+    out = put32(putCC(out, "LIST"), (uint32)moviSize);
+    putCC(out, "movi");
+
+    // The index offsets are from the movi list type
+    index.ensureSize(8 + indexSize, true);
+    out = put32(putCC(index.getBuffer(), "idx1"), indexSize);
+    uint32 offset = 4;
+    for (uint32 i = 0; i < count; i++)
+    {
+        out = put32(putCC(out, "00dc"), 0x10);  // A key frame
+        out = put32(out, offset);
+        out = put32(out, sizes[i]);
+        offset += (uint32)getPictureSpace(sizes[i]);
+    }
+}
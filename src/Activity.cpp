@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/Activity.hpp"
+
+void ActivityDetector::setParameters(const unsigned thresholdPercent, const unsigned holdSec, const unsigned intervalMs)
+{
+    Threading::ScopedLock scope(lock);
+    threshold = thresholdPercent > 100 ? 100 : thresholdPercent;
+    hold = holdSec;
+    interval = intervalMs / 1000.0;
+    nextTime = 0; blocks = 0; score = 0; lastChange = 0;
+}
+
+bool ActivityDetector::pictureReceived(const uint8 * data, const size_t size, const double now)
+{
+    if (!isEnabled() || now < nextTime) return true;
+    nextTime = now + interval;
+    if (decoder.decodeDC(data, size)) return false;
+    ++framesAnalyzed;
+
+    int width = 0, height = 0;
+    const uint8 * luma = decoder.getLuma(width, height);
+    size_t count = (size_t)width * height;
+    if (!count) return false;
+    if (count != blocks)
+    {   // First picture (or a new resolution), it's the baseline
+        if (!baseline.ensureSize((uint32)(count * sizeof(uint16)), true)) return false;
+        uint16 * base = (uint16*)baseline.getBuffer();
+        for (size_t i = 0; i < count; i++) base[i] = (uint16)(luma[i] << BaselineBits);
+        blocks = count;
+        Threading::ScopedLock scope(lock);
+        score = 0; lastChange = now;
+        return true;
+    }
+
+    // The mean difference is the global brightness change, it's not activity
+    uint16 * base = (uint16*)baseline.getBuffer();
+    int64 total = 0;
+    for (size_t i = 0; i < count; i++) total += ((int)luma[i] << BaselineBits) - base[i];
+    int mean = (int)(total / (int64)count);
+
+    size_t changed = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        int diff = ((int)luma[i] << BaselineBits) - base[i];
+        int delta = diff - mean;
+        if (delta > (BlockThreshold << BaselineBits) || delta < -(BlockThreshold << BaselineBits)) changed++;
+        // The baseline follows the slow changes (like the daylight), the moving parts are only in it after a while
+        base[i] = (uint16)(base[i] + (diff >> BaselineShift));
+    }
+
+    Threading::ScopedLock scope(lock);
+    score = changed * 100.0 / count;
+    if (score >= threshold) lastChange = now;
+    return true;
+}
@@ -0,0 +1,231 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+// A benchmark client for MJPGServer.
+// It opens multiple stream clients (some of them reading slowly on purpose) and reports the frame rate and latency for each of them.
+// Use it with a server replaying a fake source (see the fakeSource configuration key), so the results do not depend on a camera.
+
+// We need threading code here
+#include "Threading/Threads.hpp"
+// We need containers too
+#include "Container/Container.hpp"
+// We need arguments parser for the command line interface
+#include "Platform/Arguments.hpp"
+// We need Utils::MemoryBlock here
+#include "Utils/MemoryBlock.hpp"
+// We need time functions too
+#include "Time/Time.hpp"
+// We need logs too
+#include "../include/LogLevel.hpp"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+
+typedef Strings::FastString String;
+
+int logLevel = LogLevel::Info;
+
+/** A stream client, receiving the pictures and measuring the timings */
+struct BenchClient : public Threading::Thread
+{
+    /** The server address */
+    const struct sockaddr_in & address;
+    /** The requested path */
+    String      path;
+    /** If not 0, the maximum reception rate in kbit/s (to simulate a slow client) */
+    unsigned    maxKbps;
+
+    /** The number of pictures received, and the number of bytes received */
+    uint32      frames;
+    uint64      bytes;
+    /** The time the first and last picture were received */
+    double      firstTime, lastTime;
+    /** The latency of each picture (from its publishing on the server to its last byte received), in seconds, sorted */
+    Container::PlainOldData<double>::Array latencies;
+    /** The error, if any */
+    String      error;
+
+    /** Remove the given amount of bytes from the beginning of the buffer and return the remaining size */
+    static size_t consume(Utils::MemoryBlock & buffer, const size_t used, const size_t amount)
+    {
+        memmove(buffer.getBuffer(), buffer.getConstBuffer() + amount, used - amount);
+        buffer.stripTo((uint32)(used - amount));
+        return used - amount;
+    }
+
+    uint32 runThread()
+    {
+        int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) { error = "Can't create socket"; return 0; }
+        if (maxKbps)
+        {   // Keep the receive buffer small, so the server actually sees a slow client
+            int size = 16384;
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        }
+        if (::connect(fd, (const struct sockaddr*)&address, sizeof(address)) != 0) { error = "Can't connect"; ::close(fd); return 0; }
+        String request = String::Print("GET %s HTTP/1.0\r\n\r\n", (const char*)path);
+        if (::send(fd, (const char*)request, request.getLength(), MSG_NOSIGNAL) != request.getLength()) { error = "Can't send request"; ::close(fd); return 0; }
+
+        Utils::MemoryBlock buffer;
+        size_t used = 0, expected = 0;
+        double timestamp = 0;
+        bool gotHTTPHeader = false;
+        char chunk[16384];
+        while (isRunning())
+        {
+            int ret = ::recv(fd, chunk, sizeof(chunk), 0);
+            if (ret <= 0) { if (ret < 0 || !frames) error = "Connection closed"; break; }
+            if (!buffer.ensureSize(used + ret, true)) { error = "Out of memory"; break; }
+            memcpy(buffer.getBuffer() + used, chunk, ret);
+            used += ret;
+            bytes += ret;
+
+            // Parse as many pictures as possible
+            while (true)
+            {
+                const char * data = (const char*)buffer.getConstBuffer();
+                if (!expected)
+                {   // Find the end of the (HTTP or part) header
+                    const char * end = (const char*)memmem(data, used, "\r\n\r\n", 4);
+                    if (!end) break;
+                    size_t headerSize = (size_t)(end - data) + 4;
+                    String header(data, (int)headerSize);
+                    used = consume(buffer, used, headerSize);
+                    if (!gotHTTPHeader) { gotHTTPHeader = true; if (header.Find(" 200 ") == -1) { error = "Bad answer"; break; } continue; }
+                    int len = header.Find("Content-Length:"), ts = header.Find("X-Timestamp:");
+                    if (len == -1) continue; // The boundary itself
+                    expected = (size_t)header.midString(len + 15, header.getLength()).Trimmed().parseInt(10);
+                    timestamp = ts != -1 ? header.midString(ts + 12, header.getLength()).Trimmed().parseDouble() : 0;
+                    if (!expected) continue;
+                }
+                if (used < expected) break;
+
+                // Got a complete picture
+                double now = Time::getPreciseTime();
+                if (!frames) firstTime = now;
+                lastTime = now;
+                frames++;
+                if (timestamp) latencies.insertSorted(now - timestamp);
+                used = consume(buffer, used, expected);
+                expected = 0;
+            }
+            if (error) break;
+
+            // Throttle the reception for slow clients
+            if (maxKbps) interruptibleSleep((uint32)((ret * 8.0) / maxKbps));
+        }
+        ::close(fd);
+        return 0;
+    }
+
+    /** Get the given percentile of the latencies, in milliseconds */
+    double getLatency(const double percentile)
+    {
+        if (!latencies.getSize()) return 0;
+        size_t pos = min((size_t)(percentile * latencies.getSize() / 100), latencies.getSize() - 1);
+        return latencies.getElementAtUncheckedPosition(pos) * 1000;
+    }
+
+    BenchClient(const struct sockaddr_in & address, const String & path, const unsigned maxKbps) : Threading::Thread("BenchClient"), address(address), path(path), maxKbps(maxKbps), frames(0), bytes(0), firstTime(0), lastTime(0) {}
+    ~BenchClient() { destroyThread(); }
+};
+
+/** The server process counters */
+struct ProcessCounters
+{
+    /** The CPU time (user and system) in seconds */
+    double      cpuTime;
+    /** The number of read and write system calls (the send* calls are not counted by the kernel here) */
+    uint64      syscalls;
+
+    /** Read the counters for the given process */
+    bool read(const unsigned pid)
+    {
+        FILE * f = fopen(String::Print("/proc/%u/stat", pid), "r");
+        if (!f) return false;
+        unsigned long utime = 0, stime = 0;
+        // Skip the fields up to utime (the 14th one), the command name might contain spaces so skip up to the closing parenthesis
+        int ret = fscanf(f, "%*[^)]) %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+        fclose(f);
+        if (ret != 2) return false;
+        cpuTime = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+        f = fopen(String::Print("/proc/%u/io", pid), "r");
+        if (!f) return true; // Not all kernels provide this
+        char line[128]; unsigned long long value = 0;
+        syscalls = 0;
+        while (fgets(line, sizeof(line), f))
+            if (sscanf(line, "syscr: %llu", &value) == 1 || sscanf(line, "syscw: %llu", &value) == 1) syscalls += value;
+        fclose(f);
+        return true;
+    }
+    ProcessCounters() : cpuTime(0), syscalls(0) {}
+};
+
+int main(int argc, const char ** argv)
+{
+    String host = "127.0.0.1", path = "/mjpg";
+    unsigned port = 8080, clientsCount = 4, slowCount = 1, slowKbps = 500, duration = 10, pid = 0;
+
+    // Options
+    Arguments::declare(host,            "The server address (default 127.0.0.1)", "host", "a");
+    Arguments::declare(port,            "The server port (default 8080)", "port", "p");
+    Arguments::declare(path,            "The stream path (default /mjpg)", "path", "r");
+    Arguments::declare(clientsCount,    "The number of clients (default 4)", "clients", "n");
+    Arguments::declare(slowCount,       "How many of the clients are slow (default 1)", "slow", "s");
+    Arguments::declare(slowKbps,        "The slow clients bandwidth in kbit/s (default 500)", "slowkbps", "k");
+    Arguments::declare(duration,        "The test duration in seconds (default 10)", "duration", "t");
+    Arguments::declare(pid,             "The server process identifier, to report its CPU usage", "pid", "i");
+
+    String error = Arguments::Core::parse(argc, argv);
+    if (error) return log(Error, "%s", (const char*)error);
+
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16)port);
+    struct hostent * entry = gethostbyname(host);
+    if (!entry || entry->h_addrtype != AF_INET) return log(Error, "Can't resolve: %s", (const char*)host);
+    memcpy(&address.sin_addr, entry->h_addr_list[0], sizeof(address.sin_addr));
+
+    ProcessCounters before, after;
+    if (pid && !before.read(pid)) return log(Error, "Can't read the counters for process %u", pid);
+
+    Container::NotConstructible<BenchClient>::IndexList clients;
+    for (unsigned i = 0; i < clientsCount; i++)
+    {
+        BenchClient * client = new BenchClient(address, path, i < slowCount ? slowKbps : 0);
+        clients.Append(client);
+        if (!client->createThread()) return log(Error, "Can't start client %u", i);
+    }
+
+    double start = Time::getPreciseTime();
+    Threading::Thread::Sleep(duration * 1000);
+    double elapsed = Time::getPreciseTime() - start;
+    for (size_t i = 0; i < clients.getSize(); i++) clients.getElementAtUncheckedPosition(i)->destroyThread();
+    if (pid) after.read(pid);
+
+    // Report now
+    uint32 maxFrames = 0;
+    fprintf(stdout, "Client   Kind   Frames     FPS    kB/s  Lat p50  Lat p90  Lat p99 (ms)\n");
+    for (size_t i = 0; i < clients.getSize(); i++)
+    {
+        BenchClient & client = *clients.getElementAtUncheckedPosition(i);
+        if (client.error) log(Warning, "Client %u: %s", (unsigned)i, (const char*)client.error);
+        double span = client.lastTime > client.firstTime ? client.lastTime - client.firstTime : 0;
+        fprintf(stdout, "%6u   %4s   %6u  %6.2f  %6.1f  %7.2f  %7.2f  %7.2f\n", (unsigned)i, client.maxKbps ? "slow" : "fast", client.frames,
+                span ? (client.frames - 1) / span : 0.0, client.bytes / 1024.0 / elapsed,
+                client.getLatency(50), client.getLatency(90), client.getLatency(99));
+        maxFrames = max(maxFrames, client.frames);
+    }
+    if (pid && maxFrames)
+    {
+        fprintf(stdout, "Server CPU: %.1f%%, CPU time per frame: %.3fms, read/write syscalls per frame: %.2f\n",
+                (after.cpuTime - before.cpuTime) * 100 / elapsed, (after.cpuTime - before.cpuTime) * 1000 / maxFrames,
+                (double)(after.syscalls - before.syscalls) / maxFrames);
+    }
+    return 0;
+}
@@ -0,0 +1,681 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/Downscaler.hpp"
+// We need the JPEG markers and the standard Huffman tables
+#include "../include/JPEG.hpp"
+
+#include <string.h>
+#include <math.h>
+
+// The natural (row major) position of each coefficient in the zigzag order
+static const uint8 zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// The luminance and chrominance quantization tables (ITU T.81 annex K.1) for a 50% quality, in natural order
+static const uint8 standardQuant[2][64] = {
+    {   16,  11,  10,  16,  24,  40,  51,  61,  12,  12,  14,  19,  26,  58,  60,  55,
+        14,  13,  16,  24,  40,  57,  69,  56,  14,  17,  22,  29,  51,  87,  80,  62,
+        18,  22,  37,  56,  68, 109, 103,  77,  24,  35,  55,  64,  81, 104, 113,  92,
+        49,  64,  78,  87, 103, 121, 120, 101,  72,  92,  95,  98, 112, 100, 103,  99 },
+    {   17,  18,  24,  47,  99,  99,  99,  99,  18,  21,  26,  66,  99,  99,  99,  99,
+        24,  26,  56,  99,  99,  99,  99,  99,  47,  66,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,
+        99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99,  99 },
+};
+
+// The reduced inverse DCT factors: the contribution of the frequency u to the pixel x, for a N points transform (N = 1, 2, 4 or 8).
+// The (N / 8) scaling keeping the mean of the block cancels the 2 / N normalization, so the 2D factor is always 1/4
+static float idctTable[4][8][8];
+// The forward DCT factors for 8 points
+static float fdctTable[8][8];
+
+static void initTables()
+{
+    static bool done = false;
+    if (done) return;
+    for (int n = 0, N = 1; n < 4; n++, N *= 2)
+        for (int x = 0; x < N; x++)
+            for (int u = 0; u < N; u++)
+                idctTable[n][x][u] = (u ? 1.0f : (float)M_SQRT1_2) * 0.5f * (float)cos((2 * x + 1) * u * M_PI / (2 * N));
+    for (int u = 0; u < 8; u++)
+        for (int x = 0; x < 8; x++)
+            fdctTable[u][x] = (u ? 1.0f : (float)M_SQRT1_2) * 0.5f * (float)cos((2 * x + 1) * u * M_PI / 16);
+    done = true;
+}
+
+static inline uint8 clampPixel(const float value)
+{
+    int v = (int)(value + 128.5f);
+    return (uint8)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+// Read the entropy coded data, unstuffing the 0xFF00 bytes (zeros are read once a marker is reached)
+struct BitReader
+{
+    const uint8 *   data;
+    size_t          size, pos;
+    // The bits not consumed yet, MSB aligned, and their number
+    uint32          bits;
+    int             count;
+    bool            marker;
+
+    void fill()
+    {
+        while (count <= 24)
+        {
+            uint32 byte = 0;
+            if (!marker && pos < size)
+            {
+                byte = data[pos];
+                if (byte != 0xFF) pos++;
+                else if (pos + 1 < size && data[pos + 1] == 0x00) pos += 2;
+                else { marker = true; byte = 0; }
+            }
+            bits |= byte << (24 - count);
+            count += 8;
+        }
+    }
+    inline void skip(const int n) { bits <<= n; count -= n; }
+    inline int get(const int n)
+    {
+        if (!n) return 0;
+        fill();
+        int value = (int)(bits >> (32 - n));
+        skip(n);
+        return value;
+    }
+    // Get a coefficient of the given category (the negative values are coded as the one's complement)
+    inline int receive(const int s)
+    {
+        int value = get(s);
+        return s && value < (1 << (s - 1)) ? value - (1 << s) + 1 : value;
+    }
+    // Skip to the next restart marker
+    bool restart()
+    {
+        bits = 0; count = 0; marker = false;
+        pos = JPEGInfo::findMarker(data, size, pos);
+        if (pos + 1 >= size || data[pos + 1] < JPEGInfo::RST0 || data[pos + 1] > JPEGInfo::RST7) return false;
+        pos += 2;
+        return true;
+    }
+
+    BitReader(const uint8 * data, const size_t size) : data(data), size(size), pos(0), bits(0), count(0), marker(false) {}
+};
+
+// Write the entropy coded data, stuffing the 0xFF bytes
+struct BitWriter
+{
+    uint8 *     out;
+    uint32      bits;
+    int         count;
+
+    inline void put(const uint32 value, const int n)
+    {
+        bits = (bits << n) | (value & ((1U << n) - 1));
+        count += n;
+        while (count >= 8)
+        {
+            uint8 byte = (uint8)(bits >> (count - 8));
+            *out++ = byte;
+            if (byte == 0xFF) *out++ = 0;
+            count -= 8;
+        }
+    }
+    // Pad the last byte with ones
+    void flush() { if (count) put(0x7F, 8 - count); }
+
+    BitWriter(uint8 * out) : out(out), bits(0), count(0) {}
+};
+
+size_t JPEGDownscaler::HuffmanTable::build(const uint8 * data, const size_t size)
+{
+    if (size < 16) return 0;
+    size_t total = 0;
+    bits[0] = 0;
+    for (int i = 1; i <= 16; i++) total += (bits[i] = data[i - 1]);
+    if (total > 256 || size < 16 + total) return 0;
+    memcpy(values, data + 16, total);
+
+    // Build the canonical codes
+    memset(length, 0, sizeof(length));
+    memset(fastLength, 0, sizeof(fastLength));
+    uint32 current = 0, k = 0;
+    for (int len = 1; len <= 16; len++)
+    {
+        valueOffset[len] = (int32)k - (int32)current;
+        for (int i = 0; i < bits[len]; i++, k++, current++)
+        {
+            code[values[k]] = (uint16)current;
+            length[values[k]] = (uint8)len;
+            if (len <= FastBits)
+            {
+                uint32 first = current << (FastBits - len), last = first + (1U << (FastBits - len));
+                for (uint32 j = first; j < last; j++) { fastValue[j] = values[k]; fastLength[j] = (uint8)len; }
+            }
+        }
+        // A code can't be larger than all ones for its length
+        if (current > (1U << len)) return 0;
+        maxCode[len] = bits[len] ? (int32)current - 1 : -1;
+        current <<= 1;
+    }
+    maxCode[17] = 0x7FFFFFFF;
+    return 16 + total;
+}
+
+static inline int decodeSymbol(BitReader & reader, const JPEGDownscaler::HuffmanTable & table)
+{
+    reader.fill();
+    uint32 index = reader.bits >> (32 - JPEGDownscaler::HuffmanTable::FastBits);
+    if (int len = table.fastLength[index]) { reader.skip(len); return table.fastValue[index]; }
+    for (int len = JPEGDownscaler::HuffmanTable::FastBits + 1; len <= 16; len++)
+    {
+        int32 current = (int32)(reader.bits >> (32 - len));
+        if (current <= table.maxCode[len]) { reader.skip(len); return table.values[current + table.valueOffset[len]]; }
+    }
+    return -1;
+}
+
+JPEGDownscaler::JPEGDownscaler() : customTables(false), componentCount(0), width(0), height(0), maxH(1), maxV(1), restartInterval(0), blockSize(8), outWidth(0), outHeight(0)
+{
+    initTables();
+    memset(quant, 0, sizeof(quant));
+    // The standard tables are used for the pictures without Huffman tables (like most MJPEG cameras send), and for the preview
+    const uint8 * tables = JPEGInfo::standardHuffmanTables + 4;
+    size_t size = JPEGInfo::StandardHuffmanTablesSize - 4;
+    for (int i = 0; i < 4; i++)
+    {
+        uint8 kind = tables[0];
+        HuffmanTable & table = (kind >> 4) ? ac[kind & 1] : dc[kind & 1];
+        size_t used = table.build(tables + 1, size - 1);
+        tables += used + 1; size -= used + 1;
+    }
+    for (int i = 0; i < 2; i++) { encDC[i] = dc[i]; encAC[i] = ac[i]; }
+    setQuality(DefaultQuality);
+}
+
+void JPEGDownscaler::setQuality(const unsigned quality)
+{
+    // Same scaling as the IJG library
+    unsigned q = quality < 1 ? 1 : quality > 100 ? 100 : quality;
+    unsigned factor = q < 50 ? 5000 / q : 200 - q * 2;
+    for (int t = 0; t < 2; t++)
+        for (int k = 0; k < 64; k++)
+        {
+            unsigned value = (standardQuant[t][zigzag[k]] * factor + 50) / 100;
+            encQuant[t][k] = (uint8)(value < 1 ? 1 : value > 255 ? 255 : value);
+        }
+}
+
+size_t JPEGDownscaler::parseHeader(const uint8 * data, const size_t size)
+{
+    if (!JPEGInfo::hasStartOfImage(data, size)) { fail("Not a JPEG picture"); return 0; }
+    componentCount = 0; restartInterval = 0;
+    // The previous picture's tables are not valid for this one
+    if (customTables) for (int i = 0; i < 2; i++) { dc[i] = encDC[i]; ac[i] = encAC[i]; }
+    customTables = false;
+    size_t pos = 2;
+    while (pos + 4 <= size)
+    {
+        if (data[pos] != 0xFF) { pos = JPEGInfo::findMarker(data, size, pos); continue; }
+        uint8 marker = data[pos + 1];
+        if (marker == 0xFF) { pos++; continue; }
+        size_t len = (data[pos + 2] << 8) | data[pos + 3], start = pos + 4, end = pos + 2 + len;
+        if (len < 2 || end > size) { fail("Truncated header"); return 0; }
+        const uint8 * seg = data + start;
+        size_t segSize = end - start;
+        pos = end;
+
+        if (marker == 0xDB)
+        {   // DQT: one or more quantization tables
+            for (size_t i = 0; i < segSize; )
+            {
+                int precision = seg[i] >> 4, id = seg[i] & 3;
+                size_t tableSize = precision ? 128 : 64;
+                if (i + 1 + tableSize > segSize) { fail("Bad quantization table"); return 0; }
+                for (int k = 0; k < 64; k++) quant[id][k] = precision ? (uint16)((seg[i + 1 + k * 2] << 8) | seg[i + 2 + k * 2]) : seg[i + 1 + k];
+                i += 1 + tableSize;
+            }
+        }
+        else if (marker == JPEGInfo::DHT)
+        {   // DHT: one or more Huffman tables
+            for (size_t i = 0; i < segSize; )
+            {
+                uint8 kind = seg[i];
+                HuffmanTable & table = (kind >> 4) ? ac[kind & 3] : dc[kind & 3];
+                size_t used = table.build(seg + i + 1, segSize - i - 1);
+                if (!used) { fail("Bad Huffman table"); return 0; }
+                customTables = true;
+                i += 1 + used;
+            }
+        }
+        else if (marker == 0xDD && segSize >= 2) restartInterval = (seg[0] << 8) | seg[1];
+        else if (marker == 0xC0 || marker == 0xC1)
+        {   // Baseline or extended sequential, Huffman coded
+            if (segSize < 6 || seg[0] != 8) { fail("Only 8 bits pictures are supported"); return 0; }
+            height = (seg[1] << 8) | seg[2];
+            width = (seg[3] << 8) | seg[4];
+            componentCount = seg[5];
+            if ((componentCount != 1 && componentCount != 3) || segSize < 6 + (size_t)componentCount * 3 || !width || !height) { fail("Unsupported picture format"); return 0; }
+            if (width > MaxDimension || height > MaxDimension) { fail("Picture too large"); return 0; }
+            maxH = maxV = 1;
+            for (int c = 0; c < componentCount; c++)
+            {
+                Component & comp = components[c];
+                comp.id = seg[6 + c * 3];
+                comp.h = seg[7 + c * 3] >> 4; comp.v = seg[7 + c * 3] & 15;
+                comp.quantTable = seg[8 + c * 3] & 3;
+                if (!comp.h || !comp.v || comp.h > 2 || comp.v > 2) { fail("Unsupported sampling factors"); return 0; }
+                maxH = max(maxH, (int)comp.h); maxV = max(maxV, (int)comp.v);
+            }
+            // A single component scan is not interleaved, so each block is a MCU
+            if (componentCount == 1) components[0].h = components[0].v = maxH = maxV = 1;
+            // The chroma planes are subsampled, if at all, from the luma plane (this covers 4:4:4, 4:2:2, 4:4:0 and 4:2:0)
+            for (int c = 1; c < componentCount; c++)
+                if (components[c].h != 1 || components[c].v != 1) { fail("Unsupported chroma sampling"); return 0; }
+        }
+        else if (marker >= 0xC2 && marker <= 0xCF && marker != JPEGInfo::DHT && marker != JPEGInfo::JPG && marker != JPEGInfo::DAC) { fail("Only baseline pictures are supported"); return 0; }
+        else if (marker == JPEGInfo::SOS)
+        {
+            if (!componentCount) { fail("No frame header"); return 0; }
+            if (segSize < 1 || seg[0] != componentCount || segSize < 1 + (size_t)componentCount * 2) { fail("Only interleaved scans are supported"); return 0; }
+            for (int c = 0; c < componentCount; c++)
+            {
+                Component & comp = components[c];
+                if (seg[1 + c * 2] != comp.id) { fail("Bad scan component"); return 0; }
+                comp.dcTable = seg[2 + c * 2] >> 4 & 3; comp.acTable = seg[2 + c * 2] & 3;
+            }
+            return end;
+        }
+        else if (marker == JPEGInfo::EOI) break;
+    }
+    fail("No scan found");
+    return 0;
+}
+
+bool JPEGDownscaler::decodeScan(const uint8 * data, const size_t size, const unsigned N)
+{
+    const int level = N == 1 ? 0 : N == 2 ? 1 : N == 4 ? 2 : 3;
+    const int mcusX = (width + 8 * maxH - 1) / (8 * maxH), mcusY = (height + 8 * maxV - 1) / (8 * maxV);
+    // Only the coefficients in the top left N x N corner are kept (the other ones are decoded, but not used)
+    int8 keep[64];
+    for (int k = 0; k < 64; k++) keep[k] = (zigzag[k] >> 3) < (int)N && (zigzag[k] & 7) < (int)N ? (int8)((zigzag[k] >> 3) * N + (zigzag[k] & 7)) : -1;
+
+    for (int c = 0; c < componentCount; c++)
+    {
+        Component & comp = components[c];
+        comp.dcPredictor = 0;
+        comp.planeWidth = mcusX * comp.h * N;
+        comp.planeHeight = mcusY * comp.v * N;
+        if (!comp.plane.ensureSize((uint32)(comp.planeWidth * comp.planeHeight), true)) return fail("Out of memory");
+    }
+
+    BitReader reader(data, size);
+    float coefs[64], tmp[64];
+    int restartsLeft = restartInterval;
+    for (int my = 0; my < mcusY; my++)
+        for (int mx = 0; mx < mcusX; mx++)
+        {
+            if (restartInterval && !restartsLeft--)
+            {
+                if (!reader.restart()) return fail("Missing restart marker");
+                for (int c = 0; c < componentCount; c++) components[c].dcPredictor = 0;
+                restartsLeft = restartInterval - 1;
+            }
+            for (int c = 0; c < componentCount; c++)
+            {
+                Component & comp = components[c];
+                const HuffmanTable & dcTable = dc[comp.dcTable], & acTable = ac[comp.acTable];
+                const uint16 * q = quant[comp.quantTable];
+                for (int by = 0; by < comp.v; by++)
+                    for (int bx = 0; bx < comp.h; bx++)
+                    {
+                        memset(coefs, 0, N * N * sizeof(*coefs));
+                        int s = decodeSymbol(reader, dcTable);
+                        if (s < 0 || s > 11) return fail("Bad DC code");
+                        comp.dcPredictor += reader.receive(s);
+                        coefs[0] = (float)(comp.dcPredictor * q[0]);
+                        for (int k = 1; k < 64; )
+                        {
+                            int rs = decodeSymbol(reader, acTable);
+                            if (rs < 0) return fail("Bad AC code");
+                            int r = rs >> 4; s = rs & 15;
+                            if (!s) { if (r != 15) break; k += 16; continue; }
+                            k += r;
+                            if (k > 63) return fail("Bad AC run");
+                            int value = reader.receive(s);
+                            if (keep[k] >= 0) coefs[keep[k]] = (float)(value * q[k]);
+                            k++;
+                        }
+
+                        // Reduced inverse DCT, rows then columns
+                        uint8 * out = comp.plane.getBuffer() + ((my * comp.v + by) * N) * comp.planeWidth + (mx * comp.h + bx) * N;
+                        if (N == 1) { *out = clampPixel(coefs[0] / 8); continue; }
+                        for (unsigned v = 0; v < N; v++)
+                            for (unsigned x = 0; x < N; x++)
+                            {
+                                float sum = 0;
+                                for (unsigned u = 0; u < N; u++) sum += coefs[v * N + u] * idctTable[level][x][u];
+                                tmp[v * N + x] = sum;
+                            }
+                        for (unsigned y = 0; y < N; y++, out += comp.planeWidth)
+                            for (unsigned x = 0; x < N; x++)
+                            {
+                                float sum = 0;
+                                for (unsigned v = 0; v < N; v++) sum += tmp[v * N + x] * idctTable[level][y][v];
+                                out[x] = clampPixel(sum);
+                            }
+                    }
+            }
+        }
+    return true;
+}
+
+// Write a marker segment header
+static inline uint8 * writeSegment(uint8 * out, const uint8 marker, const size_t length)
+{
+    out[0] = 0xFF; out[1] = marker; out[2] = (uint8)(length >> 8); out[3] = (uint8)length;
+    return out + 4;
+}
+
+// Encode the magnitude of a coefficient: its category (bit count), and the bits to write
+static inline int category(const int value) { int a = value < 0 ? -value : value, bits = 0; while (a) { bits++; a >>= 1; } return bits; }
+
+bool JPEGDownscaler::encode(Utils::MemoryBlock & result)
+{
+    const int mcusX = (outWidth + 8 * maxH - 1) / (8 * maxH), mcusY = (outHeight + 8 * maxV - 1) / (8 * maxV);
+    int blocks = 0;
+    for (int c = 0; c < componentCount; c++) blocks += components[c].h * components[c].v;
+    // The worst case for a block is far below 512 bytes, even with the stuffing
+    size_t maxSize = 1024 + JPEGInfo::StandardHuffmanTablesSize + (size_t)mcusX * mcusY * blocks * 512;
+    if (!result.ensureSize((uint32)maxSize, true)) return fail("Out of memory");
+    uint8 * out = result.getBuffer();
+
+    // The header: the quantization tables, the frame, the standard Huffman tables and the scan
+    *out++ = 0xFF; *out++ = JPEGInfo::SOI;
+    int tables = componentCount > 1 ? 2 : 1;
+    out = writeSegment(out, 0xDB, 2 + tables * 65);
+    for (int t = 0; t < tables; t++) { *out++ = (uint8)t; memcpy(out, encQuant[t], 64); out += 64; }
+    out = writeSegment(out, JPEGInfo::SOF0, 8 + componentCount * 3);
+    *out++ = 8; *out++ = (uint8)(outHeight >> 8); *out++ = (uint8)outHeight; *out++ = (uint8)(outWidth >> 8); *out++ = (uint8)outWidth;
+    *out++ = (uint8)componentCount;
+    for (int c = 0; c < componentCount; c++) { *out++ = (uint8)(c + 1); *out++ = (uint8)(components[c].h << 4 | components[c].v); *out++ = c ? 1 : 0; }
+    memcpy(out, JPEGInfo::standardHuffmanTables, JPEGInfo::StandardHuffmanTablesSize); out += JPEGInfo::StandardHuffmanTablesSize;
+    out = writeSegment(out, JPEGInfo::SOS, 6 + componentCount * 2);
+    *out++ = (uint8)componentCount;
+    for (int c = 0; c < componentCount; c++) { *out++ = (uint8)(c + 1); *out++ = c ? 0x11 : 0x00; }
+    *out++ = 0; *out++ = 63; *out++ = 0;
+
+    BitWriter writer(out);
+    float pixels[64], tmp[64];
+    for (int c = 0; c < componentCount; c++) components[c].dcPredictor = 0;
+    for (int my = 0; my < mcusY; my++)
+        for (int mx = 0; mx < mcusX; mx++)
+            for (int c = 0; c < componentCount; c++)
+            {
+                Component & comp = components[c];
+                const int t = c ? 1 : 0;
+                const HuffmanTable & dcTable = encDC[t], & acTable = encAC[t];
+                // The valid part of the plane (the edges are repeated after it)
+                const int validW = min(comp.planeWidth, (outWidth * comp.h + maxH - 1) / maxH), validH = min(comp.planeHeight, (outHeight * comp.v + maxV - 1) / maxV);
+                for (int by = 0; by < comp.v; by++)
+                    for (int bx = 0; bx < comp.h; bx++)
+                    {
+                        const int x0 = (mx * comp.h + bx) * 8, y0 = (my * comp.v + by) * 8;
+                        for (int y = 0; y < 8; y++)
+                        {
+                            const uint8 * row = comp.plane.getConstBuffer() + min(y0 + y, validH - 1) * comp.planeWidth;
+                            for (int x = 0; x < 8; x++) pixels[y * 8 + x] = (float)row[min(x0 + x, validW - 1)] - 128;
+                        }
+                        // Forward DCT, rows then columns
+                        for (int y = 0; y < 8; y++)
+                            for (int u = 0; u < 8; u++)
+                            {
+                                float sum = 0;
+                                for (int x = 0; x < 8; x++) sum += pixels[y * 8 + x] * fdctTable[u][x];
+                                tmp[y * 8 + u] = sum;
+                            }
+                        int values[64];
+                        for (int k = 0; k < 64; k++)
+                        {
+                            int u = zigzag[k] & 7, v = zigzag[k] >> 3;
+                            float sum = 0;
+                            for (int y = 0; y < 8; y++) sum += tmp[y * 8 + u] * fdctTable[v][y];
+                            float value = sum / encQuant[t][k];
+                            values[k] = (int)(value < 0 ? value - 0.5f : value + 0.5f);
+                        }
+
+                        // Then the Huffman coding
+                        int diff = values[0] - comp.dcPredictor, s = category(diff);
+                        comp.dcPredictor = values[0];
+                        writer.put(dcTable.code[s], dcTable.length[s]);
+                        if (s) writer.put(diff < 0 ? diff - 1 : diff, s);
+                        int run = 0;
+                        for (int k = 1; k < 64; k++)
+                        {
+                            if (!values[k]) { run++; continue; }
+                            while (run > 15) { writer.put(acTable.code[0xF0], acTable.length[0xF0]); run -= 16; }
+                            s = category(values[k]);
+                            int symbol = run << 4 | s;
+                            writer.put(acTable.code[symbol], acTable.length[symbol]);
+                            writer.put(values[k] < 0 ? values[k] - 1 : values[k], s);
+                            run = 0;
+                        }
+                        if (run) writer.put(acTable.code[0], acTable.length[0]);
+                    }
+            }
+    writer.flush();
+    out = writer.out;
+    *out++ = 0xFF; *out++ = JPEGInfo::EOI;
+    result.stripTo((uint32)(out - result.getConstBuffer()));
+    return true;
+}
+
+bool JPEGDownscaler::cropScan(const uint8 * data, const size_t size, const int mcuX, const int mcuY, const int mcusX, const int mcusY, Utils::MemoryBlock & result)
+{
+    const int pictureMcusX = (width + 8 * maxH - 1) / (8 * maxH);
+    int blocks = 0;
+    for (int c = 0; c < componentCount; c++) blocks += components[c].h * components[c].v;
+    // Same worst case as the encoding (the buffer is not shrunk, so a recycled frame keeps its allocation)
+    uint32 start = result.getSize();
+    if (!result.setSize((uint32)(start + (size_t)mcusX * mcusY * blocks * 512 + 2))) return fail("Out of memory");
+    BitWriter writer(result.getBuffer() + start);
+    int dcPredictors[MaxComponents] = { 0 };
+
+    BitReader reader(data, size);
+    int restartsLeft = restartInterval, values[64];
+    for (int c = 0; c < componentCount; c++) components[c].dcPredictor = 0;
+    // The MCU after the region are not needed
+    for (int my = 0; my < mcuY + mcusY; my++)
+        for (int mx = 0; mx < pictureMcusX; mx++)
+        {
+            if (restartInterval && !restartsLeft--)
+            {
+                if (!reader.restart()) return fail("Missing restart marker");
+                for (int c = 0; c < componentCount; c++) components[c].dcPredictor = 0;
+                restartsLeft = restartInterval - 1;
+            }
+            bool inside = my >= mcuY && mx >= mcuX && mx < mcuX + mcusX;
+            for (int c = 0; c < componentCount; c++)
+            {
+                Component & comp = components[c];
+                const HuffmanTable & dcTable = dc[comp.dcTable], & acTable = ac[comp.acTable], & outDC = encDC[c ? 1 : 0], & outAC = encAC[c ? 1 : 0];
+                for (int b = 0; b < comp.h * comp.v; b++)
+                {
+                    int s = decodeSymbol(reader, dcTable);
+                    if (s < 0 || s > 11) return fail("Bad DC code");
+                    comp.dcPredictor += reader.receive(s);
+                    int last = 0;
+                    if (inside) memset(values, 0, sizeof(values));
+                    for (int k = 1; k < 64; )
+                    {
+                        int rs = decodeSymbol(reader, acTable);
+                        if (rs < 0) return fail("Bad AC code");
+                        int r = rs >> 4; s = rs & 15;
+                        if (!s) { if (r != 15) break; k += 16; continue; }
+                        k += r;
+                        if (k > 63 || s > 10) return fail("Bad AC code");
+                        int value = reader.receive(s);
+                        if (inside) { values[k] = value; last = k; }
+                        k++;
+                    }
+                    if (!inside) continue;
+
+                    // The DC coefficient is coded from the previous block of the cropped picture, the AC coefficients are the same
+                    int diff = comp.dcPredictor - dcPredictors[c];
+                    dcPredictors[c] = comp.dcPredictor;
+                    s = category(diff);
+                    if (s > 11) return fail("Bad DC value");
+                    writer.put(outDC.code[s], outDC.length[s]);
+                    if (s) writer.put(diff < 0 ? diff - 1 : diff, s);
+                    int run = 0;
+                    for (int k = 1; k <= last; k++)
+                    {
+                        if (!values[k]) { run++; continue; }
+                        while (run > 15) { writer.put(outAC.code[0xF0], outAC.length[0xF0]); run -= 16; }
+                        s = category(values[k]);
+                        int symbol = run << 4 | s;
+                        writer.put(outAC.code[symbol], outAC.length[symbol]);
+                        writer.put(values[k] < 0 ? values[k] - 1 : values[k], s);
+                        run = 0;
+                    }
+                    if (last < 63) writer.put(outAC.code[0], outAC.length[0]);
+                }
+            }
+        }
+    writer.flush();
+    uint8 * out = writer.out;
+    *out++ = 0xFF; *out++ = JPEGInfo::EOI;
+    result.stripTo((uint32)(out - result.getConstBuffer()));
+    return true;
+}
+
+String JPEGDownscaler::crop(const uint8 * data, const size_t size, const JPEGRegion & region, Utils::MemoryBlock & out, JPEGRegion * actual)
+{
+    size_t offset = parseHeader(data, size);
+    if (!offset) return error;
+    // The region starts on a MCU boundary, its size does not need to (the last MCU are cut by the decoders)
+    const int mcuWidth = 8 * maxH, mcuHeight = 8 * maxV;
+    int x = max(region.x, 0), y = max(region.y, 0);
+    if (x >= width || y >= height) return "The region is out of the picture";
+    int right = region.isSet() ? min(x + region.width, width) : width, bottom = region.isSet() ? min(y + region.height, height) : height;
+    x -= x % mcuWidth; y -= y % mcuHeight;
+    const int cropWidth = right - x, cropHeight = bottom - y;
+    if (actual) *actual = JPEGRegion(x, y, cropWidth, cropHeight);
+
+    // The header: the picture's quantization tables, the frame with the new size, the standard Huffman tables and the scan
+    uint8 used = 0;
+    for (int c = 0; c < componentCount; c++) used |= (uint8)(1 << components[c].quantTable);
+    size_t headerSize = 2 + 4 + 4 * 65 + 4 + 6 + componentCount * 3 + JPEGInfo::StandardHuffmanTablesSize + 4 + 4 + componentCount * 2;
+    if (!out.setSize((uint32)headerSize)) return "Out of memory";
+    uint8 * p = out.getBuffer();
+    *p++ = 0xFF; *p++ = JPEGInfo::SOI;
+    int tables = 0;
+    for (int t = 0; t < 4; t++) if (used & (1 << t)) tables++;
+    p = writeSegment(p, 0xDB, 2 + tables * 65);
+    for (int t = 0; t < 4; t++)
+    {
+        if (!(used & (1 << t))) continue;
+        *p++ = (uint8)t;
+        // A 16 bits table is only allowed in the extended pictures
+        for (int k = 0; k < 64; k++) { if (quant[t][k] > 255) return "Unsupported quantization table"; *p++ = (uint8)quant[t][k]; }
+    }
+    p = writeSegment(p, JPEGInfo::SOF0, 8 + componentCount * 3);
+    *p++ = 8; *p++ = (uint8)(cropHeight >> 8); *p++ = (uint8)cropHeight; *p++ = (uint8)(cropWidth >> 8); *p++ = (uint8)cropWidth;
+    *p++ = (uint8)componentCount;
+    for (int c = 0; c < componentCount; c++) { *p++ = components[c].id; *p++ = (uint8)(components[c].h << 4 | components[c].v); *p++ = components[c].quantTable; }
+    memcpy(p, JPEGInfo::standardHuffmanTables, JPEGInfo::StandardHuffmanTablesSize); p += JPEGInfo::StandardHuffmanTablesSize;
+    p = writeSegment(p, JPEGInfo::SOS, 6 + componentCount * 2);
+    *p++ = (uint8)componentCount;
+    for (int c = 0; c < componentCount; c++) { *p++ = components[c].id; *p++ = c ? 0x11 : 0x00; }
+    *p++ = 0; *p++ = 63; *p++ = 0;
+    out.stripTo((uint32)(p - out.getConstBuffer()));
+
+    if (!cropScan(data + offset, size - offset, x / mcuWidth, y / mcuHeight, (cropWidth + mcuWidth - 1) / mcuWidth, (cropHeight + mcuHeight - 1) / mcuHeight, out)) return error;
+    return "";
+}
+
+String JPEGDownscaler::downscale(const uint8 * data, const size_t size, const unsigned scale, Utils::MemoryBlock & out)
+{
+    if (scale != 2 && scale != 4 && scale != 8) return String::Print("Unsupported scale: %u", scale);
+    blockSize = 8 / scale;
+    // The tables not given by the picture are the standard ones
+    size_t offset = parseHeader(data, size);
+    if (!offset) return error;
+    outWidth = (width + (int)scale - 1) / (int)scale;
+    outHeight = (height + (int)scale - 1) / (int)scale;
+    if (!decodeScan(data + offset, size - offset, blockSize) || !encode(out)) return error;
+    return "";
+}
+
+String JPEGDownscaler::decodeDC(const uint8 * data, const size_t size)
+{
+    blockSize = 1;
+    size_t offset = parseHeader(data, size);
+    if (!offset) return error;
+    outWidth = (width + 7) / 8;
+    outHeight = (height + 7) / 8;
+    if (!decodeScan(data + offset, size - offset, 1)) return error;
+    return "";
+}
+
+bool JPEGDownscaler::getThumbnail(uint8 * const planes[MaxComponents], const int stride, const int maxWidth, const int maxHeight) const
+{
+    if (blockSize != 1 || !componentCount) return false;
+    const int w = min(outWidth, maxWidth), h = min(outHeight, maxHeight);
+    for (int c = 0; c < MaxComponents; c++)
+        for (int y = 0; y < h; y++)
+        {
+            uint8 * out = planes[c] + y * stride;
+            if (c >= componentCount) { memset(out, 128, w); continue; }
+            // A subsampled chroma block covers 2 luma blocks
+            const Component & comp = components[c];
+            const uint8 * row = comp.plane.getConstBuffer() + (y * comp.v / maxV) * comp.planeWidth;
+            if (comp.h == maxH) memcpy(out, row, w);
+            else for (int x = 0; x < w; x++) out[x] = row[x * comp.h / maxH];
+        }
+    return true;
+}
+
+String JPEGDownscaler::encodePlanes(const uint8 * const planes[MaxComponents], const int stride, const int width, const int height, Utils::MemoryBlock & out)
+{
+    if (width <= 0 || height <= 0 || width > MaxDimension || height > MaxDimension) return "Bad picture size";
+    // The planes are taken as a full scale 4:4:4 picture
+    blockSize = 8;
+    componentCount = MaxComponents;
+    maxH = maxV = 1;
+    for (int c = 0; c < componentCount; c++)
+    {
+        Component & comp = components[c];
+        comp.h = comp.v = 1;
+        comp.planeWidth = width; comp.planeHeight = height;
+        if (!comp.plane.ensureSize((uint32)(width * height), true)) return "Out of memory";
+        for (int y = 0; y < height; y++) memcpy(comp.plane.getBuffer() + y * width, planes[c] + y * stride, width);
+    }
+    outWidth = width; outHeight = height;
+    if (!encode(out)) return error;
+    return "";
+}
+
+bool JPEGRegion::parse(const String & text, JPEGRegion & region)
+{
+    String rest = text;
+    int values[4];
+    for (int i = 0; i < 4; i++)
+    {
+        String value = (i < 3 ? rest.splitUpTo(",") : rest).Trimmed();
+        int consumed = 0;
+        int64 number = value.parseInt(10, &consumed);
+        if (!value || consumed != value.getLength() || number < 0 || number > MaxRegionCoordinate) return false;
+        values[i] = (int)number;
+    }
+    region = JPEGRegion(values[0], values[1], values[2], values[3]);
+    return region.isSet();
+}
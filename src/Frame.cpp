@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/Frame.hpp"
+
+void Frame::prepareHeader()
+{
+    // The timestamp allows clients to measure the latency (like mjpg-streamer does)
+    int len = snprintf(header, sizeof(header), "\r\n--boundary\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %.6f\r\n%s\r\n", (uint32)getSize(), time, repeated ? "X-Frame-Repeat: 1\r\n" : "");
+    headerSize = len > 0 ? min((uint32)len, (uint32)sizeof(header) - 1) : 0;
+}
+
+void Frame::release()
+{
+    if (--refCount == 0) pool.recycle(this);
+}
+
+size_t FramePool::getSizeClass(const size_t size)
+{
+    if (size <= 16384) return 16384;
+    size_t power = 16384;
+    while (power * 2 <= size) power *= 2;
+    size_t step = power / 4;
+    return (size + step - 1) / step * step;
+}
+
+void FramePool::account(Frame * frame)
+{
+    uint32 allocated = frame->data.getAllocatedSize();
+    bytes = bytes + allocated - frame->pooledSize;
+    frame->pooledSize = allocated;
+    if (bytes > peakBytes) peakBytes = bytes;
+}
+
+bool FramePool::grow(Frame * frame, const size_t size)
+{
+    size_t wanted = getSizeClass(size);
+    if (wanted <= frame->data.getAllocatedSize()) return true;
+    if (limit && bytes - frame->pooledSize + wanted > limit) return false;
+    if (!frame->data.ensureSize((uint32)wanted)) return false;
+    account(frame);
+    return true;
+}
+
+FrameRef FramePool::get(const size_t size)
+{
+    Threading::ScopedLock scope(lock);
+    if (freeFrames.getSize())
+    {   // Prefer the most recently used frame that's large enough, its buffer is likely in the cache
+        size_t pos = freeFrames.getSize() - 1;
+        for (size_t i = freeFrames.getSize(); i > 0; i--)
+            if (freeFrames.getElementAtUncheckedPosition(i - 1)->data.getAllocatedSize() >= size) { pos = i - 1; break; }
+        Frame * frame = freeFrames.getElementAtUncheckedPosition(pos);
+        if (!grow(frame, size)) { ++rejected; return FrameRef(); }
+        freeFrames.Remove(pos);
+        return FrameRef(frame);
+    }
+    if (limit && bytes + getSizeClass(size) > limit) { ++rejected; return FrameRef(); }
+    Frame * frame = new Frame(*this);
+    if (!frame) return FrameRef();
+    frames.Append(frame);
+    if (size && !grow(frame, size)) { freeFrames.Append(frame); return FrameRef(); }
+    return FrameRef(frame);
+}
+
+bool FramePool::reserve(const size_t count, const size_t size)
+{
+    Container::PlainOldData<FrameRef *>::Array reserved;
+    bool success = true;
+    for (size_t i = 0; success && i < count; i++)
+    {
+        FrameRef * frame = new FrameRef(get(size));
+        success = *frame;
+        reserved.Append(frame);
+    }
+    // They are all given back to the pool
+    for (size_t i = 0; i < reserved.getSize(); i++) delete reserved.getElementAtUncheckedPosition(i);
+    return success;
+}
+
+void FramePool::recycle(Frame * frame)
+{
+    Threading::ScopedLock scope(lock);
+    // The frame's buffer might have been grown by its user
+    account(frame);
+    freeFrames.Append(frame);
+}
+
+FramePool::~FramePool()
+{
+    Threading::ScopedLock scope(lock);
+    freeFrames.Clear();
+    frames.Clear();
+}
+
+void FrameHistory::append(const FrameRef & frame, const bool noGrowth)
+{
+    Threading::ScopedLock scope(lock);
+    if (noGrowth && count) release();
+    if (count == capacity)
+    {   // Grow the ring, keeping the frames order
+        size_t larger = capacity ? capacity * 2 : 64;
+        FrameRef * frames = new FrameRef[larger];
+        for (size_t i = 0; i < count; i++) frames[i] = at(i);
+        delete[] ring;
+        ring = frames; capacity = larger; head = 0;
+    }
+    at(count++) = frame;
+    bytes += frame->data.getSize();
+    trim();
+}
+
+void FrameHistory::trim()
+{
+    // The newest frame is always kept
+    while (count > 1 && (bytes > maxBytes || at(count - 1)->time - at(0)->time > duration)) release();
+}
+
+void FrameHistory::release()
+{
+    bytes -= at(0)->data.getSize();
+    at(0).reset();
+    head = (head + 1) % capacity;
+    count--;
+}
+
+size_t FrameHistory::getFrames(FrameRef *& frames) const
+{
+    Threading::ScopedLock scope(lock);
+    frames = count ? new FrameRef[count] : 0;
+    for (size_t i = 0; i < count; i++) frames[i] = at(i);
+    return count;
+}
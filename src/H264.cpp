@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/H264.hpp"
+
+#include <string.h>
+
+/** Find the next start code (00 00 01) from the given offset, the 01 bytes are searched with memchr
+    @return The offset of the start code's first byte, or size if there is none */
+static size_t findStartCode(const uint8 * data, const size_t size, size_t from)
+{
+    while (from + 2 < size)
+    {
+        const uint8 * found = (const uint8*)memchr(data + from + 2, 0x01, size - from - 2);
+        if (!found) break;
+        size_t pos = (size_t)(found - data);
+        if (!data[pos - 1] && !data[pos - 2]) return pos - 2;
+        from = pos - 1;
+    }
+    return size;
+}
+
+bool H264Info::nextNAL(const uint8 * data, const size_t size, size_t & pos, const uint8 * & nal, size_t & nalSize)
+{
+    size_t start = findStartCode(data, size, pos);
+    if (start == size) { pos = size; return false; }
+    start += 3;
+    size_t end = findStartCode(data, size, start);
+    pos = end;
+    // The zero bytes before the next start code (its 4 bytes form, or a trailing padding) are not part of the NAL unit
+    while (end > start && !data[end - 1]) end--;
+    if (end == start) return nextNAL(data, size, pos, nal, nalSize);
+    nal = data + start;
+    nalSize = end - start;
+    return true;
+}
+
+bool H264Info::isKeyFrame(const uint8 * data, const size_t size)
+{
+    const uint8 * nal = 0; size_t nalSize = 0, pos = 0;
+    while (nextNAL(data, size, pos, nal, nalSize))
+    {
+        uint8 type = getType(nal);
+        if (type == IDR) return true;
+        // The first slice tells, there is a single picture per access unit
+        if (type == Slice) return false;
+    }
+    return false;
+}
+
+/** A bit reader on the NAL unit's payload, with the emulation prevention bytes removed */
+struct RBSPReader
+{
+    const uint8 * data;
+    size_t        size, bit;
+    bool          overflow;
+
+    uint32 readBit() { if (bit >= size * 8) { overflow = true; return 0; } uint32 ret = (data[bit / 8] >> (7 - bit % 8)) & 1; bit++; return ret; }
+    uint32 readBits(int count) { uint32 ret = 0; while (count--) ret = (ret << 1) | readBit(); return ret; }
+    /** Read an unsigned Exp-Golomb code */
+    uint32 readUE() { int zeros = 0; while (!readBit() && !overflow && zeros < 32) zeros++; return zeros >= 32 ? 0 : (1U << zeros) - 1 + readBits(zeros); }
+    /** Read a signed Exp-Golomb code */
+    int32 readSE() { uint32 code = readUE(); return code & 1 ? (int32)((code + 1) / 2) : -(int32)(code / 2); }
+
+    RBSPReader(const uint8 * data, const size_t size) : data(data), size(size), bit(0), overflow(false) {}
+};
+
+bool H264Info::parseSPS(const uint8 * nal, const size_t size, int & width, int & height)
+{
+    if (size < 4 || getType(nal) != SPS) return false;
+    // Remove the emulation prevention bytes (00 00 03 is 00 00 in the payload), the header fields fit the first bytes of the payload
+    uint8 rbsp[256];
+    size_t length = 0, zeros = 0;
+    for (size_t i = 1; i < size && length < sizeof(rbsp); i++)
+    {
+        if (zeros >= 2 && nal[i] == 3) { zeros = 0; continue; }
+        zeros = nal[i] ? 0 : zeros + 1;
+        rbsp[length++] = nal[i];
+    }
+
+    RBSPReader bits(rbsp, length);
+    uint32 profile = bits.readBits(8);
+    bits.readBits(16); // Constraints and level
+    bits.readUE(); // SPS identifier
+    uint32 chromaFormat = 1, separatePlanes = 0;
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 || profile == 83 || profile == 86 || profile == 118
+        || profile == 128 || profile == 138 || profile == 139 || profile == 134 || profile == 135)
+    {
+        chromaFormat = bits.readUE();
+        if (chromaFormat == 3) separatePlanes = bits.readBit();
+        bits.readUE(); bits.readUE(); // Luma and chroma bit depths
+        bits.readBit(); // Transform bypass
+        if (bits.readBit())
+        {   // The scaling lists are only skipped
+            for (int i = 0; i < (chromaFormat == 3 ? 12 : 8); i++)
+            {
+                if (!bits.readBit()) continue;
+                int32 last = 8, next = 8;
+                for (int j = 0; j < (i < 6 ? 16 : 64) && next; j++)
+                {
+                    next = (last + bits.readSE() + 256) % 256;
+                    if (next) last = next;
+                }
+            }
+        }
+    }
+    bits.readUE(); // Maximum frame number
+    uint32 pocType = bits.readUE();
+    if (!pocType) bits.readUE();
+    else if (pocType == 1)
+    {
+        bits.readBit(); bits.readSE(); bits.readSE();
+        for (uint32 i = bits.readUE(); i > 0 && !bits.overflow; i--) bits.readSE();
+    }
+    bits.readUE(); // Reference frames
+    bits.readBit(); // Gaps allowed
+    uint32 widthInMBs = bits.readUE() + 1, heightInMaps = bits.readUE() + 1, frameMBsOnly = bits.readBit();
+    if (!frameMBsOnly) bits.readBit(); // Adaptive frame/field
+    bits.readBit(); // Direct 8x8 inference
+    uint32 cropLeft = 0, cropRight = 0, cropTop = 0, cropBottom = 0;
+    if (bits.readBit()) { cropLeft = bits.readUE(); cropRight = bits.readUE(); cropTop = bits.readUE(); cropBottom = bits.readUE(); }
+    if (bits.overflow) return false;
+
+    // The cropping is in chroma samples (and in fields pairs for the interlaced pictures)
+    uint32 cropX = chromaFormat == 0 || separatePlanes ? 1 : (chromaFormat == 3 ? 1 : 2);
+    uint32 cropY = (chromaFormat == 0 || separatePlanes ? 1 : (chromaFormat == 1 ? 2 : 1)) * (2 - frameMBsOnly);
+    width = (int)(widthInMBs * 16 - cropX * (cropLeft + cropRight));
+    height = (int)((2 - frameMBsOnly) * heightInMaps * 16 - cropY * (cropTop + cropBottom));
+    return width > 0 && height > 0;
+}
@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/HLS.hpp"
+// We need the pictures parsers
+#include "../include/JPEG.hpp"
+#include "../include/H264.hpp"
+#include <string.h>
+#include <time.h>
+
+void HLSSegmenter::open(const bool h264, const unsigned segmentMs, const unsigned segments)
+{
+    close();
+    Threading::ScopedLock scope(lock);
+    this->h264 = h264;
+    target = (uint32)((uint64)max(segmentMs, 100U) * FMP4Muxer::Timescale / 1000);
+    this->segments = max(segments, 2U);
+    capacity = this->segments + ExtraSegments;
+    ring = new Segment[capacity];
+    run = (uint32)::time(0);
+    targetDuration = (max(segmentMs, 100U) + 999) / 1000;
+}
+
+void HLSSegmenter::close()
+{
+    Threading::ScopedLock scope(lock);
+    delete[] ring; ring = 0;
+    target = 0; first = count = 0; sequence = generation = discontinuities = 0;
+    init.stripTo(0); sps.stripTo(0); pps.stripTo(0); pending.stripTo(0);
+    samples.Clear();
+    startTime = 0; lastTick = decodeTime = 0; width = height = 0; pendingDuration = 0; discontinuity = false;
+}
+
+bool HLSSegmenter::checkFormat(const uint8 * data, const size_t size, const bool keyFrame)
+{
+    int w = 0, h = 0;
+    if (!h264)
+    {
+        JPEGInfo info;
+        if (!info.parse(data, size)) return false;
+        w = info.width; h = info.height;
+        if (w == width && h == height) return true;
+    }
+    else
+    {   // The parameter sets are sent with each key frame, so they are only checked there
+        if (!keyFrame) return init.getSize() != 0;
+        const uint8 * nal = 0, * spsNAL = 0, * ppsNAL = 0; size_t nalSize = 0, spsSize = 0, ppsSize = 0, pos = 0;
+        while (H264Info::nextNAL(data, size, pos, nal, nalSize))
+        {
+            uint8 type = H264Info::getType(nal);
+            if (type == H264Info::SPS) { spsNAL = nal; spsSize = nalSize; }
+            else if (type == H264Info::PPS) { ppsNAL = nal; ppsSize = nalSize; }
+        }
+        if (!spsNAL || !ppsNAL) return init.getSize() != 0;
+        if (spsSize == sps.getSize() && ppsSize == pps.getSize() && !memcmp(spsNAL, sps.getConstBuffer(), spsSize) && !memcmp(ppsNAL, pps.getConstBuffer(), ppsSize)) return true;
+        if (spsSize > 0xFFFF || ppsSize > 0xFFFF || !H264Info::parseSPS(spsNAL, spsSize, w, h)) return false;
+        sps.stripTo(0); sps.Append(spsNAL, (uint32)spsSize);
+        pps.stripTo(0); pps.Append(ppsNAL, (uint32)ppsSize);
+    }
+
+    // The format changed, the pending segment is stored with the previous format, and the window restarts with the new one
+    if (samples.getSize()) finishSegment();
+    width = w; height = h;
+    Utils::MemoryBlock next;
+    FMP4Muxer::makeInit(next, width, height, sps, pps);
+    Threading::ScopedLock scope(lock);
+    if (count)
+    {   // The previous segments can't be decoded with the new init segment
+        first = count = 0;
+        discontinuity = true;
+    }
+    init.swapWith(next);
+    generation++;
+    return true;
+}
+
+void HLSSegmenter::appendSample(const uint8 * data, const size_t size, const bool keyFrame)
+{
+    uint32 start = pending.getSize();
+    if (h264)
+    {   // Each NAL unit is prefixed with its size, the access unit delimiters and parameter sets are not needed in the segments
+        const uint8 * nal = 0; size_t nalSize = 0, pos = 0;
+        while (H264Info::nextNAL(data, size, pos, nal, nalSize))
+        {
+            uint8 type = H264Info::getType(nal);
+            if (type == H264Info::AUD || type == H264Info::SPS || type == H264Info::PPS) continue;
+            uint8 length[4] = { (uint8)(nalSize >> 24), (uint8)(nalSize >> 16), (uint8)(nalSize >> 8), (uint8)nalSize };
+            pending.Append(length, sizeof(length));
+            pending.Append(nal, (uint32)nalSize);
+        }
+    }
+    else
+    {   // The players decode the pictures alone, so they need the Huffman tables
+        size_t offset = JPEGInfo::getHuffmanTablesOffset(data, size);
+        if (offset)
+        {
+            pending.Append(data, (uint32)offset);
+            pending.Append(JPEGInfo::standardHuffmanTables, JPEGInfo::StandardHuffmanTablesSize);
+        }
+        pending.Append(data + offset, (uint32)(size - offset));
+    }
+    samples.Append(FMP4Muxer::Sample(pending.getSize() - start, 0, keyFrame));
+}
+
+bool HLSSegmenter::pictureReceived(const uint8 * data, const size_t size, const double time, const bool keyFrame)
+{
+    if (!isOpened()) return false;
+    if (!startTime) startTime = time;
+    uint64 tick = (uint64)((time - startTime) * FMP4Muxer::Timescale + 0.5);
+    if (samples.getSize())
+    {   // The previous picture lasts until this one
+        uint32 duration = (uint32)min(tick > lastTick ? tick - lastTick : (uint64)1, (uint64)MaxFrameTicks);
+        samples[samples.getSize() - 1].duration = duration;
+        pendingDuration += duration;
+        if (keyFrame && pendingDuration >= target) finishSegment();
+    }
+    lastTick = tick;
+
+    if (!checkFormat(data, size, keyFrame)) return false;
+    // A segment must start with a key frame
+    if (!samples.getSize() && !keyFrame) return true;
+    appendSample(data, size, keyFrame);
+    return true;
+}
+
+void HLSSegmenter::finishSegment()
+{
+    if (!samples.getSize()) return;
+    // The last picture's duration is not known yet when the format changes, so it lasts like the previous one
+    FMP4Muxer::Sample & last = samples[samples.getSize() - 1];
+    if (!last.duration)
+    {
+        last.duration = samples.getSize() > 1 ? samples[samples.getSize() - 2].duration : FMP4Muxer::Timescale / 30;
+        pendingDuration += last.duration;
+    }
+
+    Threading::ScopedLock scope(lock);
+    // Recycle the oldest segment when the window is full
+    if (count == capacity)
+    {
+        first = (first + 1) % capacity;
+        count--;
+    }
+    Segment & segment = ring[(first + count) % capacity];
+    count++;
+    segment.sequence = ++sequence;
+    segment.generation = generation;
+    segment.duration = pendingDuration;
+    segment.discontinuity = discontinuity;
+    if (discontinuity) discontinuities++;
+    segment.discontinuitySequence = discontinuities;
+    FMP4Muxer::makeFragmentHeader(header, sequence, decodeTime, samples);
+    segment.data.stripTo(0);
+    segment.data.Append(header.getConstBuffer(), header.getSize());
+    segment.data.Append(pending.getConstBuffer(), pending.getSize());
+    // The target duration is at least each segment's rounded duration, and can't decrease while the playlist is served
+    targetDuration = max(targetDuration, (unsigned)((pendingDuration + FMP4Muxer::Timescale / 2) / FMP4Muxer::Timescale));
+
+    decodeTime += pendingDuration;
+    pendingDuration = 0;
+    pending.stripTo(0);
+    samples.Clear();
+    discontinuity = false;
+}
+
+bool HLSSegmenter::getPlaylist(String & playlist, const String & query) const
+{
+    Threading::ScopedLock scope(lock);
+    if (!count) return false;
+    // The extra segments are not listed
+    unsigned listed = min(count, segments), from = first + count - listed;
+    const Segment & oldest = ring[from % capacity];
+    playlist = String::Print("#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:%u\n#EXT-X-MEDIA-SEQUENCE:%u\n#EXT-X-DISCONTINUITY-SEQUENCE:%u\n#EXT-X-INDEPENDENT-SEGMENTS\n",
+                             targetDuration, oldest.sequence, oldest.discontinuitySequence);
+    playlist += String::Print("#EXT-X-MAP:URI=\"init-%x-%u.mp4%s\"\n", run, oldest.generation, (const char*)query);
+    for (unsigned i = 0; i < listed; i++)
+    {
+        const Segment & segment = ring[(from + i) % capacity];
+        if (segment.discontinuity && i) playlist += "#EXT-X-DISCONTINUITY\n";
+        playlist += String::Print("#EXTINF:%.3f,\n%x-%u.m4s%s\n", (double)segment.duration / FMP4Muxer::Timescale, run, segment.sequence, (const char*)query);
+    }
+    return true;
+}
+
+size_t HLSSegmenter::getBytes(unsigned & segments) const
+{
+    Threading::ScopedLock scope(lock);
+    size_t bytes = init.getSize();
+    for (unsigned i = 0; i < count; i++) bytes += ring[(first + i) % capacity].data.getSize();
+    segments = count;
+    return bytes;
+}
+
+uint8 * HLSSegmenter::getFile(const String & name, size_t & size) const
+{
+    String base = name.upToFirst(".");
+    bool isInit = name.Find("init-") == 0;
+    if (isInit) base = base.fromFirst("init-");
+    String runText = base.upToFirst("-"), number = base.fromFirst("-");
+    if (!number || runText != String::Print("%x", run)) return 0;
+    uint32 index = (uint32)number.parseInt(10);
+
+    Threading::ScopedLock scope(lock);
+    const Utils::MemoryBlock * file = 0;
+    if (isInit) file = name.fromLast(".") == "mp4" && index == generation && init.getSize() ? &init : 0;
+    else if (name.fromLast(".") == "m4s")
+    {
+        for (unsigned i = 0; i < count && !file; i++)
+            if (ring[(first + i) % capacity].sequence == index) file = &ring[(first + i) % capacity].data;
+    }
+    if (!file) return 0;
+    size = file->getSize();
+    uint8 * copy = new uint8[size];
+    memcpy(copy, file->getConstBuffer(), size);
+    return copy;
+}
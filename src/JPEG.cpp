@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/JPEG.hpp"
+// We need the profiling probes
+#include "../include/Stats.hpp"
+
+#include <string.h>
+
+const uint8 JPEGInfo::standardHuffmanTables[StandardHuffmanTablesSize] = {
+    0xFF, 0xC4, 0x01, 0xA2, 0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,
+    0x0B, 0x10, 0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04, 0x04, 0x00, 0x00,
+    0x01, 0x7D, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51,
+    0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xA1, 0x08, 0x23, 0x42, 0xB1, 0xC1, 0x15, 0x52,
+    0xD1, 0xF0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0A, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x25, 0x26,
+    0x27, 0x28, 0x29, 0x2A, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46, 0x47,
+    0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66, 0x67,
+    0x68, 0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3, 0xA4, 0xA5,
+    0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xC2, 0xC3,
+    0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA,
+    0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6,
+    0xF7, 0xF8, 0xF9, 0xFA, 0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A,
+    0x0B, 0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04, 0x04, 0x00, 0x01,
+    0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07,
+    0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xA1, 0xB1, 0xC1, 0x09, 0x23, 0x33,
+    0x52, 0xF0, 0x15, 0x62, 0x72, 0xD1, 0x0A, 0x16, 0x24, 0x34, 0xE1, 0x25, 0xF1, 0x17, 0x18, 0x19,
+    0x1A, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x43, 0x44, 0x45, 0x46,
+    0x47, 0x48, 0x49, 0x4A, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x63, 0x64, 0x65, 0x66,
+    0x67, 0x68, 0x69, 0x6A, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x82, 0x83, 0x84, 0x85,
+    0x86, 0x87, 0x88, 0x89, 0x8A, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0xA2, 0xA3,
+    0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA,
+    0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8,
+    0xD9, 0xDA, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6,
+    0xF7, 0xF8, 0xF9, 0xFA,
+};
+
+size_t JPEGInfo::findMarker(const uint8 * data, const size_t size, size_t from)
+{
+    while (from + 1 < size)
+    {
+        const uint8 * found = (const uint8*)memchr(data + from, 0xFF, size - from - 1);
+        if (!found) break;
+        from = (size_t)(found - data);
+        // Stuffed bytes and fill bytes are not markers
+        if (data[from + 1] != 0x00 && data[from + 1] != 0xFF) return from;
+        from++;
+    }
+    return size;
+}
+
+size_t JPEGInfo::findEndOfImage(const uint8 * data, const size_t size)
+{
+    // Some devices report the whole buffer, padded with zeros, as used
+    size_t used = size;
+    while (used && !data[used - 1]) used--;
+    if (used < 2) return size;
+    size_t start = used > EndOfImageWindow ? used - EndOfImageWindow : 0, end = used - 1;
+    // Search backward, the marker is usually the last 2 bytes or followed by some padding
+    while (end > start)
+    {
+        const uint8 * found = (const uint8*)memrchr(data + start, 0xFF, end - start);
+        if (!found) return size;
+        if (found[1] == EOI) return (size_t)(found - data);
+        end = (size_t)(found - data);
+    }
+    return size;
+}
+
+bool JPEGInfo::parse(const uint8 * data, const size_t size)
+{
+    PROBE(Profiler::ParseJPEG);
+    width = height = 0;
+    hasHuffmanTables = false;
+    scanOffset = 0;
+    if (!hasStartOfImage(data, size)) return false;
+    size_t pos = 2;
+    while (pos + 1 < size)
+    {
+        // Some devices leave garbage between the segments, so resynchronize on the next marker
+        if (data[pos] != 0xFF || data[pos + 1] == 0x00) { pos = findMarker(data, size, pos); continue; }
+        uint8 marker = data[pos + 1];
+        if (marker == 0xFF) { pos++; continue; } // Fill byte
+        pos += 2;
+        // Standalone markers have no segment
+        if (marker == SOI || marker == TEM || (marker >= RST0 && marker <= RST7)) continue;
+        if (marker == EOI) return false;
+        if (marker == SOS) { scanOffset = pos - 2; return width && height; }
+        if (pos + 2 > size) return false;
+        size_t len = (data[pos] << 8) | data[pos + 1];
+        if (len < 2) return false;
+        if (marker == DHT) hasHuffmanTables = true;
+        // Any SOFn marker except DHT, JPG and DAC
+        else if (marker >= SOF0 && marker <= 0xCF && marker != JPG && marker != DAC)
+        {
+            if (pos + 7 > size) return false;
+            height = (data[pos + 3] << 8) | data[pos + 4];
+            width = (data[pos + 5] << 8) | data[pos + 6];
+        }
+        pos += len;
+    }
+    return false;
+}
+
+size_t JPEGInfo::getHuffmanTablesOffset(const uint8 * data, const size_t size)
+{
+    JPEGInfo info;
+    return info.parse(data, size) && !info.hasHuffmanTables ? info.scanOffset : 0;
+}
+
+uint64 JPEGInfo::fingerprint(const uint8 * data, const size_t size)
+{
+    size_t end = findEndOfImage(data, size);
+    if (end != size) end += 2;
+    // FNV-1a, on the whole picture if it's small, else on the runs (the last one ends at the picture's end)
+    uint32 hash = 2166136261U;
+    const size_t runs = end > FingerprintRuns * FingerprintRunSize ? FingerprintRuns : 1, runSize = runs > 1 ? (size_t)FingerprintRunSize : end;
+    const size_t step = runs > 1 ? (end - runSize) / (runs - 1) : 0;
+    for (size_t i = 0; i < runs; i++)
+    {
+        const uint8 * run = data + i * step;
+        for (size_t j = 0; j < runSize; j++) hash = (hash ^ run[j]) * 16777619U;
+    }
+    return (uint64)end << 32 | hash;
+}
+
+int JPEGInfo::gather(const uint8 * data, const size_t size, const size_t tablesOffset, const size_t from, const char ** buffers, int * sizes)
+{
+    // The pieces are the picture up to the offset, then the tables, then the end of the picture
+    const uint8 * pieces[3] = { data, standardHuffmanTables, data + tablesOffset };
+    size_t lengths[3] = { tablesOffset, tablesOffset ? (size_t)StandardHuffmanTablesSize : 0, size - tablesOffset }, skip = from;
+    int count = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        if (skip >= lengths[i]) { skip -= lengths[i]; continue; }
+        buffers[count] = (const char*)pieces[i] + skip; sizes[count++] = (int)(lengths[i] - skip);
+        skip = 0;
+    }
+    return count;
+}
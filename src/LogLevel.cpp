@@ -24,30 +24,261 @@ int log(LogLevel level, const char * format, ...)
     va_end(list);
     return ret;
 }
+// The messages are always written synchronously without ClassPath
+bool startAsyncLog() { return false; }
+void stopAsyncLog() {}
+size_t getLogMemory() { return 0; }
 #else
 #include "Logger/Logger.hpp"
+#include "Threading/Threads.hpp"
+#include <time.h>
+#include <string.h>
+
+// Convert from LogLevel to ClassPath's flags here
+static int toFlags(const int level)
+{
+    static const int flags[] = {
+        Logger::AllFlags, // Debug
+        Logger::Content | Logger::Network, // Default/Info
+        Logger::Warning | Logger::Content | Logger::Network, // Warning
+        Logger::Error | Logger::Content | Logger::Network, // Error 
+        0, // No logs 
+    };
+    return flags[level + 1];
+}
+
+/** The rate limiter for the repeated messages.
+    The messages are told apart by their format string, and each format is limited to a number of messages per second.
+    The table is lock-free, two formats colliding in a slot only reset each other's count, so it can only let more messages through */
+struct RateLimiter
+{
+    enum { Slots = 64, MaxPerSecond = 20 };
+    struct Slot
+    {
+        Threading::Atomic<uintptr_t> format;
+        Threading::Atomic<uint32>    second;
+        Threading::Atomic<uint32>    count;
+        Threading::Atomic<uint32>    suppressed;
+    };
+    Slot slots[Slots];
+
+    /** Check if a message can be logged now.
+        @param suppressed   Set to the number of messages with this format that were suppressed in the previous second, to report them
+        @return false if the message should be dropped */
+    bool allow(const char * format, uint32 & suppressed)
+    {
+        suppressed = 0;
+        uintptr_t key = (uintptr_t)format;
+        Slot & slot = slots[(key >> 3) % Slots];
+        uint32 now = (uint32)time(NULL);
+        if (slot.format.read() != key) { slot.format.save(key); slot.second.save(now); slot.count.save(0); slot.suppressed.save(0); }
+        else if (slot.second.read() != now) { slot.second.save(now); slot.count.save(0); suppressed = slot.suppressed.swap(0); }
+        if (++slot.count <= MaxPerSecond) return true;
+        ++slot.suppressed;
+        return false;
+    }
+    /** Take the count of a slot's messages suppressed in a past second, so it's reported even if no other message with its format comes
+        @param now      The current second
+        @param format   On output, the format of the suppressed messages
+        @return The number of suppressed messages, 0 if none */
+    uint32 takeSuppressed(const uint32 index, const uint32 now, const char *& format)
+    {
+        Slot & slot = slots[index];
+        if (!slot.suppressed.read() || slot.second.read() == now) return 0;
+        format = (const char*)slot.format.read();
+        return slot.suppressed.swap(0);
+    }
+};
+static RateLimiter rateLimiter;
+
+/** The asynchronous log writer.
+    The logging threads format their message in a slot of a bounded ring (claimed with a single compare and swap, so it's lock-free and does not allocate), 
+    and this thread writes them to the logger's sink. If the ring is full, the message is dropped (and counted) instead of waiting, 
+    so logging never stalls the capture or the fan-out threads.
+    This is a bounded multiple producer, single consumer queue with a sequence number per slot, based on: http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue */
+struct AsyncLog : public Threading::Thread
+{
+    enum { Slots = 256, MessageSize = 512 };
+    struct Slot
+    {
+        /** The slot's turn: equal to the enqueue position when it's free, to the position + 1 once written */
+        Threading::Atomic<uint32> sequence;
+        unsigned int              flags;
+        char                      text[MessageSize];
+    };
+    Slot                      slots[Slots];
+    /** The sink the messages are written to (the logger's sink when started, owned here until it's given back to the logger when stopped) */
+    Logger::OutputSink *      output;
+    /** The next position to write to (shared by the logging threads) */
+    Threading::Atomic<uint32> enqueuePos;
+    /** The next position to read from (only used by this thread) */
+    uint32                    dequeuePos;
+    /** The number of messages dropped because the ring was full */
+    Threading::Atomic<uint32> dropped;
+    /** Set while the messages are queued */
+    Threading::Atomic<uint32> enabled;
+    /** The last second the suppressed messages were reported (only used by this thread) */
+    uint32                    suppressedSecond;
+
+    /** Claim a slot to write a message to
+        @return 0 if the ring is full */
+    Slot * claim(uint32 & pos)
+    {
+        pos = enqueuePos.read();
+        while (true)
+        {
+            Slot & slot = slots[pos % Slots];
+            int32 diff = (int32)(slot.sequence.readSync() - pos);
+            if (diff == 0) { if (enqueuePos.compareAndSet(pos, pos + 1, true)) return &slot; } // pos is updated on failure
+            else if (diff < 0) return 0; // Full
+            else pos = enqueuePos.read();
+        }
+    }
+    /** Queue a message to format
+        @return The message length, or 0 if it was dropped */
+    int queue(const unsigned int flags, const char * format, va_list list)
+    {
+        uint32 pos;
+        Slot * slot = claim(pos);
+        if (!slot) { ++dropped; return 0; }
+        int ret = vsnprintf(slot->text, MessageSize, format, list);
+        slot->flags = flags;
+        slot->sequence.save(pos + 1);
+        return ret;
+    }
+    /** Queue an already formatted message */
+    void queue(const unsigned int flags, const char * message)
+    {
+        uint32 pos;
+        Slot * slot = claim(pos);
+        if (!slot) { ++dropped; return; }
+        strncpy(slot->text, message, MessageSize - 1);
+        slot->text[MessageSize - 1] = 0;
+        slot->flags = flags;
+        slot->sequence.save(pos + 1);
+    }
+    /** Write all the queued messages
+        @return true if any was written */
+    bool flush()
+    {
+        bool any = false;
+        while (true)
+        {
+            Slot & slot = slots[dequeuePos % Slots];
+            if (slot.sequence.readSync() != dequeuePos + 1) break; // Empty (or still being written)
+            output->gotMessage(slot.text, slot.flags);
+            slot.sequence.save(dequeuePos + Slots);
+            dequeuePos++;
+            any = true;
+        }
+        char buffer[128];
+        uint32 lost = dropped.swap(0);
+        if (lost)
+        {
+            snprintf(buffer, sizeof(buffer), "%u log messages dropped", lost);
+            output->gotMessage(buffer, toFlags(Warning));
+        }
+        // The messages suppressed by the rate limiter are reported once their second is over, even if no other message with their format follows
+        uint32 now = (uint32)time(NULL);
+        if (now != suppressedSecond)
+        {
+            suppressedSecond = now;
+            for (uint32 i = 0; i < RateLimiter::Slots; i++)
+            {
+                const char * format = 0;
+                uint32 suppressed = rateLimiter.takeSuppressed(i, now, format);
+                if (!suppressed) continue;
+                snprintf(buffer, sizeof(buffer), "%u similar messages suppressed: %.80s", suppressed, format);
+                output->gotMessage(buffer, toFlags(Warning));
+            }
+        }
+        return any;
+    }
+
+    uint32 runThread()
+    {
+        // Check more often while messages are coming, and back off when idle
+        uint32 idleMs = 1;
+        while (isRunning())
+        {
+            if (flush()) idleMs = 1;
+            else idleMs = idleMs < 64 ? idleMs * 2 : 100;
+            Sleep(idleMs);
+        }
+        return 0;
+    }
+
+    AsyncLog() : Threading::Thread("AsyncLog"), output(0), dequeuePos(0), suppressedSecond(0) { for (uint32 i = 0; i < Slots; i++) slots[i].sequence.save(i); }
+    ~AsyncLog() { destroyThread(); }
+};
+static AsyncLog asyncLog;
+
+/** The logger's sink while the messages are written asynchronously, so the messages from ClassPath (like the HTTP requests) are queued too.
+    It's never deleted (other threads might still use it once it's removed), it writes to the previous sink directly once the thread is stopped */
+struct QueueSink : public Logger::OutputSink
+{
+    Logger::OutputSink & output;
+
+    bool checkFlags(const unsigned int flags) const { return output.checkFlags(flags); }
+    void gotMessage(const char * message, const unsigned int flags)
+    {
+        if (!output.checkFlags(flags)) return;
+        if (asyncLog.enabled.read()) asyncLog.queue(flags, message);
+        else output.gotMessage(message, flags);
+    }
+    QueueSink(Logger::OutputSink & output) : Logger::OutputSink(output.logMask), output(output) {}
+};
+
+bool startAsyncLog()
+{
+    if (asyncLog.isRunning()) return true;
+    if (!asyncLog.output)
+    {   // The previous sink (like the daemon's syslog sink) must not be deleted while it's used, it's given back to the logger when stopped
+        QueueSink * sink = new QueueSink(Logger::getDefaultSink());
+        asyncLog.output = Logger::swapDefaultSink(sink);
+    }
+    if (!asyncLog.createThread()) return false;
+    asyncLog.enabled.save(1);
+    return true;
+}
+
+size_t getLogMemory() { return sizeof(asyncLog) + sizeof(rateLimiter); }
+
+void stopAsyncLog()
+{
+    asyncLog.enabled.save(0);
+    asyncLog.destroyThread();
+    if (!asyncLog.output) return;
+    // The messages queued while stopping, then the previous sink is the logger's again
+    asyncLog.flush();
+    Logger::swapDefaultSink(asyncLog.output);
+    asyncLog.output = 0;
+}
+
 int log(LogLevel level, const char * format, ...) 
 {
     if (level < logLevel) return 0; // Skip logging if set as-is
+    // The debug messages are asked for, so they are not limited
+    uint32 suppressed = 0;
+    if (level > Debug && !rateLimiter.allow(format, suppressed)) return 0;
+    if (suppressed) log(Warning, "%u similar messages suppressed: %.80s", suppressed, format);
+
     va_list list;
     va_start(list, format);
+    if (asyncLog.enabled.read())
+    {
+        int ret = asyncLog.queue(toFlags((int)level), format, list);
+        va_end(list);
+        return ret;
+    }
     char * buffer = 0;
     // We use vasprintf extension to avoid dual parsing of the format string to find out the required length
     const int err = vasprintf(&buffer, format, list);
-    if (err <= 0) return err;
     va_end(list);
+    if (err <= 0) return err;
 
-    // Convert from LogLevel to ClassPath's flags here
-    int flags[] = {
-        Logger::AllFlags, // Debug
-        Logger::Content | Logger::Network, // Default/Info
-        Logger::Warning | Logger::Content | Logger::Network, // Warning
-        Logger::Error | Logger::Content | Logger::Network, // Error 
-        0, // No logs 
-    };
-
-    Logger::getDefaultSink().gotMessage(buffer, flags[(int)level + 1]);
+    Logger::getDefaultSink().gotMessage(buffer, toFlags((int)level));
     ::free(buffer);
     return err;    
 }
-#endif
\ No newline at end of file
+#endif
@@ -4,6 +4,10 @@
 // We need our own include
 #include "../include/MJPGServer.hpp"
 #include "../include/JSON.hpp"
+// We need hashing for the configuration keys
+#include "Hash/StringHash.hpp"
+// We need scope guards for the parser tokens
+#include "Utils/ScopeGuard.hpp"
 
 
 // We need arguments parser for the command line interface
@@ -12,15 +16,21 @@
 // We need file function too
 #include "File/File.hpp"
 
+// For the threads scheduling and the memory locking
+#include <sched.h>
+#include <sys/mman.h>
 
 
-bool exitRequired = false;
+
+bool exitRequired = false, reloadRequired = false, profileRequired = false;
 void asyncProcess(int signal)
 {
     static const char stopping[] = "\n|  Stopping, please wait...  |\n";
     switch (signal)
     {
     case SIGINT: exitRequired = true; write(2, stopping, sizeof(stopping)); fsync(2); return;
+    case SIGHUP: reloadRequired = true; return;
+    case SIGUSR2: profileRequired = true; return;
     default: return;
     }
 }
@@ -28,51 +38,343 @@ void asyncProcess(int signal)
 
 int logLevel = LogLevel::Info;
 Configuration config;
+AddressLimits addressLimits;
+UplinkScheduler uplinkScheduler;
+
+// The configuration keys, with the member they set
+struct ConfigKey
+{
+    const char *                    name;
+    unsigned int Configuration::*   number;
+    bool Configuration::*           flag;
+    String Configuration::*         text;
+};
+#define NumberKey(name, member) { name, &Configuration::member, 0, 0 }
+#define FlagKey(name, member)   { name, 0, &Configuration::member, 0 }
+#define TextKey(name, member)   { name, 0, 0, &Configuration::member }
+static const ConfigKey configKeys[] = {
+    NumberKey( "port",                  port),
+    TextKey(   "device",                device),
+    FlagKey(   "daemonize",             daemonize),
+    FlagKey(   "monitorDev",            monitorDev),
+    NumberKey( "lowResWidth",           lowResWidth),
+    NumberKey( "lowResHeight",          lowResHeight),
+    NumberKey( "highResWidth",          highResWidth),
+    NumberKey( "highResHeight",         highResHeight),
+    NumberKey( "stabPicCount",          stabPicCount),
+    NumberKey( "maxFPS",                maxFPS),
+    NumberKey( "closeDeviceTimeoutSec", closeDevTimeoutSec),
+    NumberKey( "standbyTimeoutSec",     standbyTimeoutSec),
+    NumberKey( "watchdogTimeoutSec",    watchdogTimeoutSec),
+    NumberKey( "firstFrameMaxAgeSec",   firstFrameMaxAgeSec),
+    TextKey(   "securityToken",         securityToken),
+    NumberKey( "bufferCount",           bufferCount),
+    NumberKey( "highResBufferCount",    highResBufferCount),
+    NumberKey( "zeroCopyMinSize",       zeroCopyMinSize),
+    NumberKey( "fullResCacheMs",        fullResCacheMs),
+    FlagKey(   "fastSwitch",            fastSwitch),
+    NumberKey( "switchTimeoutMs",       switchTimeoutMs),
+    FlagKey(   "repeatOnSwitch",        repeatOnSwitch),
+    NumberKey( "minSwitchIntervalMs",   minSwitchIntervalMs),
+    TextKey(   "highResDevice",         highResDevice),
+    NumberKey( "httpClientsPerThread",  httpClientsPerThread),
+    NumberKey( "httpReactors",          httpReactors),
+    TextKey(   "fakeSource",            fakeSource),
+    TextKey(   "fakeTrace",             fakeTrace),
+    TextKey(   "captureTrace",          captureTrace),
+    TextKey(   "remoteSource",          remoteSource),
+    TextKey(   "remoteFullRes",         remoteFullRes),
+    FlagKey(   "insertHuffmanTables",   insertHuffmanTables),
+    NumberKey( "previewScale",          previewScale),
+    TextKey(   "streamCodec",           streamCodec),
+    TextKey(   "recordDir",             recordDir),
+    NumberKey( "recordIntervalSec",     recordIntervalSec),
+    FlagKey(   "recordFullRes",         recordFullRes),
+    NumberKey( "recordSegmentMB",       recordSegmentMB),
+    NumberKey( "recordSegments",        recordSegments),
+    NumberKey( "preEventSeconds",       preEventSeconds),
+    NumberKey( "preEventBytes",         preEventBytes),
+    NumberKey( "frameMemoryMB",         frameMemoryMB),
+    TextKey(   "sharedMemory",          sharedMemory),
+    NumberKey( "sharedMemorySlots",     sharedMemorySlots),
+    TextKey(   "multicastGroup",        multicastGroup),
+    NumberKey( "multicastTTL",          multicastTTL),
+    NumberKey( "hlsSegmentMs",          hlsSegmentMs),
+    NumberKey( "hlsSegments",           hlsSegments),
+    FlagKey(   "preEventFullRes",       preEventFullRes),
+    NumberKey( "activityThreshold",     activityThreshold),
+    NumberKey( "activityHoldSec",       activityHoldSec),
+    NumberKey( "activityIntervalMs",    activityIntervalMs),
+    NumberKey( "idleFPS",               idleFPS),
+    NumberKey( "duplicateKeepAliveSec", duplicateKeepAliveSec),
+    FlagKey(   "adaptiveFPS",           adaptiveFPS),
+    NumberKey( "lowResQuality",         lowResQuality),
+    NumberKey( "highResQuality",        highResQuality),
+    FlagKey(   "adaptiveQuality",       adaptiveQuality),
+    TextKey(   "controls",              controls),
+    TextKey(   "stillControls",         stillControls),
+    TextKey(   "formatsCacheFile",      formatsCacheFile),
+    TextKey(   "tlsCertificate",        tlsCertificate),
+    TextKey(   "tlsKey",                tlsKey),
+    NumberKey( "maxStreamsPerAddress",  maxStreamsPerAddress),
+    NumberKey( "maxKbpsPerAddress",     maxKbpsPerAddress),
+    NumberKey( "uplinkKbps",            uplinkKbps),
+    TextKey(   "streamClasses",         streamClasses),
+    NumberKey( "streamSendBuffer",      streamSendBuffer),
+    NumberKey( "streamNotSentLowAt",    streamNotSentLowAt),
+    TextKey(   "eventLoop",             eventLoop),
+    NumberKey( "senderThreads",         senderThreads),
+    TextKey(   "captureScheduling",     captureScheduling),
+    TextKey(   "captureCPUs",           captureCPUs),
+    TextKey(   "senderScheduling",      senderScheduling),
+    TextKey(   "senderCPUs",            senderCPUs),
+    FlagKey(   "lockMemory",            lockMemory),
+    TextKey(   "unixSocket",            unixSocket),
+    NumberKey( "rtspPort",              rtspPort),
+    NumberKey( "mosaicIntervalSec",     mosaicIntervalSec),
+    FlagKey(   "profiling",             profiling),
+    NumberKey( "memoryReportSec",       memoryReportSec),
+    TextKey(   "name",                  name)
+};
+#undef NumberKey
+#undef FlagKey
+#undef TextKey
+
+/** The configuration keys indexed by the hash of their name, so a key is found with a single string comparison (almost always).
+    The table is built once, when the program is loaded, and the slots are 4 times more than the keys, so the collisions are rare */
+static struct ConfigKeyIndex
+{
+    enum { Slots = 256 };
+    /** The position + 1 of the key in configKeys, or 0 for an empty slot */
+    uint8 slots[Slots];
+
+    ConfigKeyIndex()
+    {
+        memset(slots, 0, sizeof(slots));
+        for (size_t i = 0; i < ArrSz(configKeys); i++)
+        {
+            uint32 h = Hash::superFastHash(configKeys[i].name, (int)strlen(configKeys[i].name)) % Slots;
+            while (slots[h]) h = (h + 1) % Slots;
+            slots[h] = (uint8)(i + 1);
+        }
+    }
+    /** Find the key with the given name, or 0 if it's not a configuration key */
+    const ConfigKey * find(const String & name) const
+    {
+        for (uint32 h = Hash::superFastHash(name, name.getLength()) % Slots; slots[h]; h = (h + 1) % Slots)
+            if (name == configKeys[slots[h] - 1].name) return &configKeys[slots[h] - 1];
+        return 0;
+    }
+} configKeyIndex;
+
+// Set a configuration key, return false if the key is not supported
+static bool setKey(Configuration & c, const String & key, const String & val, JSON::Token & n, const String & content)
+{
+    // The log level is not a camera setting
+    if (key == "logLevel") { logLevel = (unsigned int)val; return true; }
+    const ConfigKey * k = configKeyIndex.find(key);
+    if (!k) return false;
+    if (k->number)      c.*k->number = (unsigned int)val;
+    else if (k->flag)   c.*k->flag = n.type == JSON::Token::True;
+    else                c.*k->text = n.unescape((char*)(const char*)content);
+    return true;
+}
+
+// Create an empty sockets pool using the eventLoop backend
+Network::Socket::MonitoringPool * createSocketPool(const bool own)
+{
+    if (config.eventLoop == "io_uring")
+    {
+        Network::Socket::URingPool * pool = new Network::Socket::URingPool(own);
+        if (pool->isValid()) return pool;
+        delete pool;
+        static bool warned = false;
+        if (!warned) log(Warning, "io_uring is not supported by the kernel, using epoll instead");
+        warned = true;
+    }
+    else if (config.eventLoop != "epoll")
+    {
+        static bool warned = false;
+        if (!warned) log(Warning, "Unknown eventLoop: %s, using epoll instead", (const char*)config.eventLoop);
+        warned = true;
+    }
+    return new Network::Socket::FastBerkeleyPool(own);
+}
+
+// Set the calling thread's scheduling policy and the CPUs it runs on
+String setThreadScheduling(const String & scheduling, const String & cpus)
+{
+    String policy = scheduling.Trimmed();
+    if (policy && policy != "other")
+    {
+        String name = policy.splitUpTo(":").Trimmed();
+        int value = name == "fifo" ? SCHED_FIFO : (name == "rr" ? SCHED_RR : -1);
+        if (value < 0) return String::Print("Unknown scheduling policy: %s", (const char*)scheduling);
+        struct sched_param param = {};
+        param.sched_priority = (int)policy.Trimmed().parseInt(10);
+        if (param.sched_priority < sched_get_priority_min(value) || param.sched_priority > sched_get_priority_max(value))
+            return String::Print("Invalid real time priority in: %s", (const char*)scheduling);
+        // The threads created by this one (like when starting a camera on demand) get the normal scheduling back
+        if (sched_setscheduler(0, value | SCHED_RESET_ON_FORK, &param) != 0)
+            return String::Print("Can't set the %s scheduling (CAP_SYS_NICE or RLIMIT_RTPRIO is required): %s", (const char*)scheduling, strerror(errno));
+    }
+    if (!cpus) return "";
+
+    uint64 mask = 0;
+    String list = cpus;
+    while (list)
+    {   // Like "0-1,3"
+        String range = list.splitUpTo(",").Trimmed(), first = range.splitUpTo("-").Trimmed();
+        int low = (int)first.parseInt(10), high = range ? (int)range.parseInt(10) : low;
+        if (!first || low < 0 || high < low || high >= 64) return String::Print("Invalid CPU list: %s", (const char*)cpus);
+        for (int i = low; i <= high; i++) mask |= (uint64)1 << i;
+    }
+    if (!Threading::Thread::setCurrentThreadOnProcessorMask(mask)) return String::Print("Can't run on the CPUs: %s", (const char*)cpus);
+    return "";
+}
+
+// Apply the sender scheduling to the HTTP server threads
+void senderThreadStarted()
+{
+    String error = setThreadScheduling(config.senderScheduling, config.senderCPUs);
+    if (error) log(Warning, "HTTP server thread: %s", (const char*)error);
+}
+
+// The server's start time, so the entity tags of a previous run (whose sequence numbers restarted from 1) never match
+static const uint32 runIdentifier = (uint32)time(NULL);
+
+String makeETag(const uint32 sequence, const char * kind)
+{
+    return String::Print("\"%x-%s%u\"", runIdentifier, kind, sequence);
+}
+
+String formatHTTPDate(const double time)
+{
+    char buffer[64];
+    time_t seconds = (time_t)time;
+    struct tm date;
+    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&seconds, &date));
+    return buffer;
+}
+
+String getCacheHeaders(const String & etag, const double modified, const int maxAge)
+{
+    return "ETag: " + etag + "\r\nLast-Modified: " + formatHTTPDate(modified) + (maxAge > 0 ? String::Print("\r\nCache-Control: max-age=%d\r\n", maxAge) : String("\r\nCache-Control: no-cache\r\n"));
+}
+
+bool isNotModified(Network::Server::URLRouting::Comm & comm, const String & etag, const double modified, const int maxAge)
+{
+    String * match = comm.headers.getValue("If-None-Match");
+    if (!match || (match->Trimmed() != "*" && match->Find(etag) == -1)) return false;
+    comm.addAnswerHeader("ETag", etag);
+    comm.addAnswerHeader("Last-Modified", formatHTTPDate(modified));
+    comm.addAnswerHeader("Cache-Control", maxAge > 0 ? String::Print("max-age=%d", maxAge) : String("no-cache"));
+    comm.statusCode = Protocol::HTTP::NotModified;
+    return true;
+}
 
-String Configuration::fromJSON(const String & path) 
+String Configuration::fromJSON(const String & path, Cameras & cameras) 
 {
     File::Info cfg(path, true);
     if (!cfg.doesExist()) return "Configuration file not found";
     String content = cfg.getContent();
 
-    // Then provide a parser for the JSON data now
+    // Then provide a parser for the JSON data now, its tokens are grown until the whole file fits (a value takes at least 2 bytes, like "1,")
     const char * buffer = content;
     JSON parser;
-    JSON::Token tokens[2000];    // Should be enough
-    IndexType res = parser.parse(buffer, content.getLength(), tokens, ArrSz(tokens));
+    JSON::Token * tokens = 0;
+    DeleteArrayOnScopeExit(tokens);
+    IndexType res = JSON::NotEnoughTokens;
+    for (IndexType count = 64; res == JSON::NotEnoughTokens && count / 4 <= content.getLength(); count *= 4)
+    {
+        delete[] tokens;
+        tokens = new JSON::Token[count];
+        parser = JSON();
+        res = parser.parse(buffer, content.getLength(), tokens, count);
+    }
          if (res == JSON::NotEnoughTokens) return "Not enough tokens";
     else if (res == JSON::Invalid)         return String::Print("Invalid configuration JSON at pos: %d\n", parser.pos);
     else if (res == JSON::Starving)        return String::Print("Configuration JSON too short at pos: %d\n", parser.pos);
 
-    // Then extract the token we are interested in
+    // Then extract the token we are interested in, the global keys are set first since the cameras start from them
+    IndexType camerasArray = JSON::InvalidPos;
     for (IndexType i = 0; i < res; i++) 
     {
         JSON::Token & t = tokens[i];
-        if (t.type == JSON::Token::Key && i < res-1 && (tokens[i+1].type == JSON::Token::String || tokens[i+1].type == JSON::Token::Number || tokens[i+1].type == JSON::Token::True || tokens[i+1].type == JSON::Token::False))
+        if (t.type != JSON::Token::Key || t.parent != 0 || i >= res-1) continue;
+        JSON::Token & n = tokens[i+1];
+        String key = content.midString(t.start, t.end - t.start), val = content.midString(n.start, n.end - n.start);
+        if (key == "cameras" && n.type == JSON::Token::Array) camerasArray = i+1;
+        else if (n.type == JSON::Token::String || n.type == JSON::Token::Number || n.type == JSON::Token::True || n.type == JSON::Token::False)
         {
-            JSON::Token & n = tokens[i+1];
-            String key = content.midString(t.start, t.end - t.start), val = content.midString(n.start, n.end - n.start);
-            if (key == "port")                       port = (unsigned int)val; 
-            else if (key == "device")                device = n.unescape((char*)(const char*)content); 
-            else if (key == "daemonize")             daemonize = n.type == JSON::Token::True; 
-            else if (key == "monitorDev")            monitorDev = n.type == JSON::Token::True; 
-            else if (key == "logLevel")              logLevel = (unsigned int)val; 
-            else if (key == "lowResWidth")           lowResWidth = (unsigned int)val; 
-            else if (key == "lowResHeight")          lowResHeight = (unsigned int)val; 
-            else if (key == "highResWidth")          highResWidth = (unsigned int)val; 
-            else if (key == "highResHeight")         highResHeight = (unsigned int)val; 
-            else if (key == "stabPicCount")          stabPicCount = (unsigned int)val; 
-            else if (key == "maxFPS")                maxFPS = (unsigned int)val; 
-            else if (key == "closeDeviceTimeoutSec") closeDevTimeoutSec = (unsigned int)val; 
-            else if (key == "securityToken")         securityToken = n.unescape((char*)(const char*)content); 
-            else log(Warning, "Ignoring unsupported key: %s", (const char*)key);
+            if (!setKey(*this, key, val, n, content)) log(Warning, "Ignoring unsupported key: %s", (const char*)key);
+            else setKeys += key + "=" + val + "\n";
+        }
+        else log(Warning, "Ignoring unsupported key: %s", (const char*)key);
+        i++;
+    }
+    if (camerasArray == JSON::InvalidPos) return "";
 
+    // Then each camera
+    for (IndexType j = camerasArray + 1; j < res && tokens[j].parent >= camerasArray; j++)
+    {
+        if (tokens[j].type != JSON::Token::Object || tokens[j].parent != camerasArray) continue;
+        Configuration * camera = new Configuration(*this);
+        camera->name = String::Print("%u", (unsigned)cameras.getSize());
+        cameras.Append(camera);
+        for (IndexType i = j + 1; i < res - 1 && tokens[i].parent >= j; i++)
+        {
+            JSON::Token & t = tokens[i], & n = tokens[i+1];
+            if (t.type != JSON::Token::Key || t.parent != j) continue;
+            if (n.type != JSON::Token::String && n.type != JSON::Token::Number && n.type != JSON::Token::True && n.type != JSON::Token::False) continue;
+            String key = content.midString(t.start, t.end - t.start), val = content.midString(n.start, n.end - n.start);
+            if (!setKey(*camera, key, val, n, content)) log(Warning, "Ignoring unsupported camera key: %s", (const char*)key);
+            else camera->setKeys += key + "=" + val + "\n";
             i++;
         }
+        // The name is used in the routes
+        if (!camera->name || camera->name.Find('/') != -1) return String::Print("Invalid camera name: %s", (const char*)camera->name);
+        for (size_t k = 0; k + 1 < cameras.getSize(); k++)
+            if (cameras.getElementAtUncheckedPosition(k)->name == camera->name) return String::Print("Duplicate camera name: %s", (const char*)camera->name);
     }
     return "";
 }
 
+// Get the last value recorded for the key in the "key=value" lines (a camera's keys are recorded after the global ones)
+static String getSetValue(String lines, const String & key, bool & found)
+{
+    String value;
+    found = false;
+    while (lines)
+    {
+        String line = lines.splitUpTo("\n");
+        if (line.splitUpTo("=") == key) { value = line; found = true; }
+    }
+    return value;
+}
+
+String Configuration::getChangedKeys(const Configuration & other) const
+{
+    String changed, keys = setKeys + other.setKeys;
+    while (keys)
+    {
+        String key = keys.splitUpTo("\n").upToFirst("=");
+        if (("," + changed + ",").Find("," + key + ",") != -1) continue;
+        bool was = false, is = false;
+        String before = getSetValue(setKeys, key, was), after = getSetValue(other.setKeys, key, is);
+        if (was != is || before != after) changed += changed ? "," + key : key;
+    }
+    return changed;
+}
+
+/** Log a fatal error once the log thread is started, and stop it so the message is written before exiting (the logger is gone once main returns) */
+static int fatal(const String & error)
+{
+    int ret = log(Error, "%s", (const char*)error);
+    stopAsyncLog();
+    return ret;
+}
+
 int main(int argc, const char ** argv)
 {
     signal(SIGINT, asyncProcess);
@@ -94,11 +396,19 @@ int main(int argc, const char ** argv)
     String error = Arguments::Core::parse(argc, argv);
     if (error) return log(Error, "%s", (const char*)error);
 
+    Configuration::Cameras cameras;
     if (cfgFile) {
-        error = config.fromJSON(cfgFile);
+        // The daemon changes its directory, so remember where the file is for reloading it
+        char cwd[PATH_MAX];
+        if (cfgFile[0] != '/' && getcwd(cwd, sizeof(cwd))) cfgFile = String(cwd) + "/" + cfgFile;
+        error = config.fromJSON(cfgFile, cameras);
         if (error) return log(Error, "%s", (const char*)error); 
     }
 
+    // The formats cache is shared by all the cameras
+    error = V4L2Thread::FormatCache::load(config.formatsCacheFile);
+    if (error) log(Warning, "Ignoring the formats cache: %s", (const char*)error);
+
     if (config.daemonize) {
         bool parent = false;
         if (!Platform::daemonize("/var/run/mjpgsrv.pid", "mjpgsrv", parent))
@@ -107,21 +417,83 @@ int main(int argc, const char ** argv)
 
         // Now we are the child daemon, we'll need to drop priviledges ASAP
     }
+    // The configuration is reloaded on SIGHUP (this must be done after daemonizing, since the daemon ignores it)
+    signal(SIGHUP, asyncProcess);
+    // The probes only time the hot paths when asked, and the profile is then logged on SIGUSR2 too (SIGUSR1 is used by the threads to dump their stack)
+    if (config.profiling)
+    {
+        if (Profiler::start()) signal(SIGUSR2, asyncProcess);
+        else log(Warning, "The profiling probes are not built (WantTimedProfiling), the profiling is disabled");
+    }
 
+    // The capture and the fan-out threads must not wait for the logs output
+    if (!startAsyncLog()) log(Warning, "Can't start the log thread, the messages are written synchronously");
 
-    MJPGServer srv;
-    error = srv.startV4L2Device();
-    if (error) {
-        if (!config.monitorDev) return log(Error, "%s", (const char*)error);
-        log(Warning, "Could not start the V4L2 device with error: %s, retrying in 2s", (const char*)error);
+    // The locks are not inherited, so this is done in the daemon
+    if (config.lockMemory)
+    {
+#ifdef MCL_ONFAULT
+        // Only lock the pages once they are used, so the threads stacks are not entirely locked
+        if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) != 0)
+#else
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+#endif
+            log(Warning, "Can't lock the memory (CAP_IPC_LOCK or RLIMIT_MEMLOCK is required): %s", strerror(errno));
     }
 
+
+    MJPGServer srv;
+    srv.configFile = cfgFile;
+    // Without a "cameras" array, the global configuration is the only camera
+    if (!cameras.getSize()) srv.addCamera(config);
+    for (size_t i = 0; i < cameras.getSize(); i++) srv.addCamera(*cameras.getElementAtUncheckedPosition(i));
+    error = srv.startRecorders();
+    if (error) return fatal(error);
+
+    // The device nodes are opened now, and set up while the server starts listening, the early requests wait for their device instead of failing
+    error = srv.startV4L2Devices();
+    if (error) return fatal(error);
+
     error = srv.startServer();
-    if (error) return log(Error, "%s\n", (const char*)error);
+    if (error) return fatal(error);
 
-    Platform::dropPrivileges(); // We don't need any priviledge anymore here, since we have opened the server socket and camera device already
-    while (!exitRequired && srv.loop()) {}
+    // This thread runs the HTTP server loop
+    senderThreadStarted();
+    Platform::dropPrivileges(); // We don't need any priviledge anymore here, since we have opened the server socket and camera device nodes already
+    bool starting = true;
+    double nextMemoryReport = config.memoryReportSec ? Time::getPreciseTime() + config.memoryReportSec : 0;
+    while (!exitRequired && srv.loop())
+    {
+        if (starting && !srv.isStarting())
+        {
+            starting = false;
+            String deviceError;
+            error = srv.getStartError(deviceError);
+            if (deviceError) {
+                if (!config.monitorDev) { srv.stopServer(); return fatal(deviceError); }
+                log(Warning, "Could not start the V4L2 device with error: %s, retrying in 2s", (const char*)deviceError);
+            }
+            if (error) { srv.stopServer(); return fatal(error); }
+        }
+        if (profileRequired)
+        {
+            profileRequired = false;
+            log(Info, "Profile: %s", (const char*)Profiler::toJSON());
+        }
+        if (nextMemoryReport && Time::getPreciseTime() >= nextMemoryReport)
+        {
+            nextMemoryReport = Time::getPreciseTime() + config.memoryReportSec;
+            log(Info, "Memory: %s", (const char*)srv.getMemoryReport());
+        }
+        // The configuration is reloaded once the devices are started
+        if (!reloadRequired || starting) continue;
+        reloadRequired = false;
+        String applied, pending;
+        error = srv.reload(applied, pending);
+        if (error) log(Error, "Can't reload the configuration: %s", (const char*)error);
+    }
 
     srv.stopServer();
+    stopAsyncLog();
     return 0;
 }
\ No newline at end of file
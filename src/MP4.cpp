@@ -0,0 +1,171 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/MP4.hpp"
+
+#include <string.h>
+
+// The MP4 values are big endian
+static void put8(Utils::MemoryBlock & out, const uint8 value) { out.Append(&value, 1); }
+static void put16(Utils::MemoryBlock & out, const uint16 value) { uint8 b[2] = { (uint8)(value >> 8), (uint8)value }; out.Append(b, sizeof(b)); }
+static void put32(Utils::MemoryBlock & out, const uint32 value) { uint8 b[4] = { (uint8)(value >> 24), (uint8)(value >> 16), (uint8)(value >> 8), (uint8)value }; out.Append(b, sizeof(b)); }
+static void put64(Utils::MemoryBlock & out, const uint64 value) { put32(out, (uint32)(value >> 32)); put32(out, (uint32)value); }
+static void putCC(Utils::MemoryBlock & out, const char * fourCC) { out.Append((const uint8*)fourCC, 4); }
+static void putZeros(Utils::MemoryBlock & out, const uint32 count) { for (uint32 i = 0; i < count; i++) put8(out, 0); }
+/** Start a box, its size is written by endBox
+    @return The box's offset */
+static uint32 beginBox(Utils::MemoryBlock & out, const char * type) { uint32 offset = out.getSize(); put32(out, 0); putCC(out, type); return offset; }
+/** Start a full box (with a version and flags) */
+static uint32 beginFullBox(Utils::MemoryBlock & out, const char * type, const uint8 version, const uint32 flags) { uint32 offset = beginBox(out, type); put32(out, ((uint32)version << 24) | flags); return offset; }
+static void endBox(Utils::MemoryBlock & out, const uint32 offset)
+{
+    uint32 size = out.getSize() - offset;
+    uint8 * p = out.getBuffer() + offset;
+    p[0] = (uint8)(size >> 24); p[1] = (uint8)(size >> 16); p[2] = (uint8)(size >> 8); p[3] = (uint8)size;
+}
+/** The identity transformation matrix of the movie and track headers */
+static void putMatrix(Utils::MemoryBlock & out)
+{
+    static const uint32 matrix[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+    for (int i = 0; i < 9; i++) put32(out, matrix[i]);
+}
+
+void FMP4Muxer::makeInit(Utils::MemoryBlock & out, const int width, const int height, const Utils::MemoryBlock & sps, const Utils::MemoryBlock & pps)
+{
+    bool h264 = sps.getSize() >= 4 && pps.getSize();
+    out.stripTo(0);
+    uint32 ftyp = beginBox(out, "ftyp");
+    putCC(out, "iso5"); put32(out, 512); putCC(out, "iso5"); putCC(out, "iso6"); putCC(out, "mp41");
+    endBox(out, ftyp);
+
+    uint32 moov = beginBox(out, "moov");
+    // The movie header, its duration is unknown (it's in the fragments)
+    uint32 mvhd = beginFullBox(out, "mvhd", 0, 0);
+    put32(out, 0); put32(out, 0); put32(out, 1000); put32(out, 0);
+    put32(out, 0x00010000); put16(out, 0x0100); putZeros(out, 10);
+    putMatrix(out);
+    putZeros(out, 24);
+    put32(out, 2); // Next track identifier
+    endBox(out, mvhd);
+
+    uint32 trak = beginBox(out, "trak");
+    // Enabled and in the movie
+    uint32 tkhd = beginFullBox(out, "tkhd", 0, 3);
+    put32(out, 0); put32(out, 0); put32(out, 1); put32(out, 0); put32(out, 0);
+    putZeros(out, 8); put16(out, 0); put16(out, 0); put16(out, 0); put16(out, 0);
+    putMatrix(out);
+    put32(out, (uint32)width << 16); put32(out, (uint32)height << 16);
+    endBox(out, tkhd);
+
+    uint32 mdia = beginBox(out, "mdia");
+    uint32 mdhd = beginFullBox(out, "mdhd", 0, 0);
+    put32(out, 0); put32(out, 0); put32(out, Timescale); put32(out, 0);
+    put16(out, 0x55C4); put16(out, 0); // "und" language
+    endBox(out, mdhd);
+    uint32 hdlr = beginFullBox(out, "hdlr", 0, 0);
+    put32(out, 0); putCC(out, "vide"); putZeros(out, 12);
+    out.Append((const uint8*)"VideoHandler", 13);
+    endBox(out, hdlr);
+
+    uint32 minf = beginBox(out, "minf");
+    uint32 vmhd = beginFullBox(out, "vmhd", 0, 1);
+    putZeros(out, 8);
+    endBox(out, vmhd);
+    uint32 dinf = beginBox(out, "dinf"), dref = beginFullBox(out, "dref", 0, 0);
+    put32(out, 1);
+    // The samples are in the same file
+    endBox(out, beginFullBox(out, "url ", 0, 1));
+    endBox(out, dref);
+    endBox(out, dinf);
+
+    uint32 stbl = beginBox(out, "stbl"), stsd = beginFullBox(out, "stsd", 0, 0);
+    put32(out, 1);
+    uint32 entry = beginBox(out, h264 ? "avc1" : "mp4v");
+    putZeros(out, 6); put16(out, 1); // Data reference index
+    putZeros(out, 16);
+    put16(out, (uint16)width); put16(out, (uint16)height);
+    put32(out, 0x00480000); put32(out, 0x00480000); put32(out, 0);
+    put16(out, 1); // Frame count per sample
+    putZeros(out, 32); // Compressor name
+    put16(out, 0x0018); put16(out, 0xFFFF);
+    if (h264)
+    {   // The decoder configuration: the profile, its constraints and the level from the SPS, the NAL units lengths on 4 bytes, and the parameter sets
+        uint32 avcC = beginBox(out, "avcC");
+        put8(out, 1); put8(out, sps.getConstBuffer()[1]); put8(out, sps.getConstBuffer()[2]); put8(out, sps.getConstBuffer()[3]);
+        put8(out, 0xFF); put8(out, 0xE1);
+        put16(out, (uint16)sps.getSize()); out.Append(sps.getConstBuffer(), sps.getSize());
+        put8(out, 1);
+        put16(out, (uint16)pps.getSize()); out.Append(pps.getConstBuffer(), pps.getSize());
+        endBox(out, avcC);
+    }
+    else
+    {   // The elementary stream descriptor: a visual stream of the JPEG object type, without any decoder specific information
+        uint32 esds = beginFullBox(out, "esds", 0, 0);
+        put8(out, 0x03); put8(out, 3 + 15 + 3); put16(out, 1); put8(out, 0);
+        put8(out, 0x04); put8(out, 13); put8(out, 0x6C); put8(out, (0x04 << 2) | 1); putZeros(out, 3 + 4 + 4);
+        put8(out, 0x06); put8(out, 1); put8(out, 2);
+        endBox(out, esds);
+    }
+    endBox(out, entry);
+    endBox(out, stsd);
+    // The samples tables are empty, the samples are in the fragments
+    uint32 stts = beginFullBox(out, "stts", 0, 0); put32(out, 0); endBox(out, stts);
+    uint32 stsc = beginFullBox(out, "stsc", 0, 0); put32(out, 0); endBox(out, stsc);
+    uint32 stsz = beginFullBox(out, "stsz", 0, 0); put32(out, 0); put32(out, 0); endBox(out, stsz);
+    uint32 stco = beginFullBox(out, "stco", 0, 0); put32(out, 0); endBox(out, stco);
+    endBox(out, stbl);
+    endBox(out, minf);
+    endBox(out, mdia);
+    endBox(out, trak);
+
+    uint32 mvex = beginBox(out, "mvex"), trex = beginFullBox(out, "trex", 0, 0);
+    put32(out, 1); put32(out, 1); put32(out, 0); put32(out, 0); put32(out, 0);
+    endBox(out, trex);
+    endBox(out, mvex);
+    endBox(out, moov);
+}
+
+void FMP4Muxer::makeFragmentHeader(Utils::MemoryBlock & out, const uint32 sequence, const uint64 decodeTime, const Container::PlainOldData<Sample>::Array & samples)
+{
+    out.stripTo(0);
+    uint32 moof = beginBox(out, "moof");
+    uint32 mfhd = beginFullBox(out, "mfhd", 0, 0);
+    put32(out, sequence);
+    endBox(out, mfhd);
+
+    uint32 traf = beginBox(out, "traf");
+    // The data offsets are relative to the moof box
+    uint32 tfhd = beginFullBox(out, "tfhd", 0, 0x020000);
+    put32(out, 1);
+    endBox(out, tfhd);
+    uint32 tfdt = beginFullBox(out, "tfdt", 1, 0);
+    put64(out, decodeTime);
+    endBox(out, tfdt);
+    // With the data offset, and each sample's duration, size and flags
+    uint32 trun = beginFullBox(out, "trun", 0, 0x000701);
+    put32(out, (uint32)samples.getSize());
+    uint32 dataOffset = out.getSize();
+    put32(out, 0);
+    uint32 dataSize = 0;
+    for (size_t i = 0; i < samples.getSize(); i++)
+    {
+        const Sample & sample = samples[i];
+        put32(out, sample.duration);
+        put32(out, sample.size);
+        // A key frame does not depend on others, the other samples do and are not sync samples
+        put32(out, sample.keyFrame ? 0x02000000 : 0x01010000);
+        dataSize += sample.size;
+    }
+    endBox(out, trun);
+    endBox(out, traf);
+    endBox(out, moof);
+
+    // The samples data follows the mdat header
+    uint32 offset = out.getSize() + MDATHeaderSize;
+    uint8 * p = out.getBuffer() + dataOffset;
+    p[0] = (uint8)(offset >> 24); p[1] = (uint8)(offset >> 16); p[2] = (uint8)(offset >> 8); p[3] = (uint8)offset;
+    put32(out, MDATHeaderSize + dataSize);
+    putCC(out, "mdat");
+}
@@ -0,0 +1,217 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+// The microbenchmarks for MJPGServer's request path primitives.
+// Each primitive is run in a loop on realistic inputs (a browser's and a timelapse plugin's requests, the server's routes, a large configuration,
+// a MJPEG stream buffer) and its time per call is reported, so an optimization of one of them can be measured alone, without the network.
+
+// We need the HTTP server (for its request parser)
+#include "Network/Servers/HTTP.hpp"
+// We need the routing table too
+#include "Network/Servers/URLRouting.hpp"
+// We need arguments parser for the command line interface
+#include "Platform/Arguments.hpp"
+// We need Utils::MemoryBlock here
+#include "Utils/MemoryBlock.hpp"
+// We need time functions too
+#include "Time/Time.hpp"
+// We need the JSON parser
+#include "../include/JSON.hpp"
+// We need logs too
+#include "../include/LogLevel.hpp"
+
+typedef Strings::FastString String;
+typedef Network::Server::URLRouting URLRouting;
+
+int logLevel = LogLevel::Info;
+
+/** The inputs of the benchmarks, built once */
+struct Fixture
+{
+    /** A browser's request for the stream, and a timelapse plugin's (Octolapse like) request for a snapshot */
+    String              browserRequest, timelapseRequest;
+    /** The request parser, with its connection state */
+    Network::Server::HTTP * server;
+    Network::Server::InternalObject intern;
+    Network::Server::TextualHeadersServer::Context context;
+    Network::Socket::BerkeleySocket client;
+    /** The server's routing table, and the requested resources (found or not) */
+    URLRouting::HTTPServer routes;
+    Strings::StringArray resources;
+    /** A configuration with many cameras */
+    String              config;
+    JSON::Token *       tokens;
+    IndexType           tokenCount;
+    /** A MJPEG stream buffer (a few pictures and their parts headers), a buffer full of partial boundaries (the worst case), and the boundary
+        searched in them */
+    Utils::MemoryBlock  stream, nearMatches;
+    String              boundary;
+
+    /** The routes' action (never called) */
+    Stream::InputStream * route(URLRouting::Comm &) { return 0; }
+
+    Fixture() : server(0), tokens(0), tokenCount(0) {}
+    ~Fixture() { intern.getPrivateField() = 0; delete server; delete[] tokens; }
+};
+
+static Fixture fixture;
+
+/** A benchmark: run the primitive the given number of times, and return a value depending on the results (so the calls are not optimized out) */
+typedef uint32 (*BenchFunc)(const uint32 iterations);
+
+static uint32 parseRequest(const String & request, const uint32 iterations)
+{
+    uint32 check = 0;
+    for (uint32 i = 0; i < iterations; i++)
+    {
+        fixture.intern.getRecvBuffer().Append((const uint8*)(const char*)request, request.getLength());
+        fixture.context.Reset();
+        check += fixture.server->parseRequest(fixture.intern, fixture.client) == Network::Server::TextualHeadersServer::Success;
+    }
+    return check;
+}
+static uint32 parseBrowserRequest(const uint32 iterations) { return parseRequest(fixture.browserRequest, iterations); }
+static uint32 parseTimelapseRequest(const uint32 iterations) { return parseRequest(fixture.timelapseRequest, iterations); }
+
+static uint32 routeRequest(const uint32 iterations)
+{
+    uint32 check = 0, captures[8];
+    for (uint32 i = 0; i < iterations; i++)
+    {
+        const String & resource = fixture.resources[i % fixture.resources.getSize()];
+        uint32 count = 4;
+        check += fixture.routes.findRoute(resource, captures, &count) != 0;
+    }
+    return check;
+}
+
+static uint32 parseConfig(const uint32 iterations)
+{
+    uint32 check = 0;
+    for (uint32 i = 0; i < iterations; i++)
+    {
+        // The parser modifies its input when unescaping, so it's parsed from a copy like when reading the file
+        String content((const char*)fixture.config, fixture.config.getLength());
+        JSON parser;
+        check += (uint32)parser.parse((const char*)content, content.getLength(), fixture.tokens, fixture.tokenCount);
+    }
+    return check;
+}
+
+static uint32 findBoundary(const Utils::MemoryBlock & block, const uint32 iterations)
+{
+    uint32 check = 0;
+    for (uint32 i = 0; i < iterations; i++)
+        check += block.lookFor((const uint8*)(const char*)fixture.boundary, fixture.boundary.getLength(), i % 64);
+    return check;
+}
+static uint32 findBoundaryInStream(const uint32 iterations) { return findBoundary(fixture.stream, iterations); }
+static uint32 findBoundaryInNearMatches(const uint32 iterations) { return findBoundary(fixture.nearMatches, iterations); }
+
+static uint32 printPartHeader(const uint32 iterations)
+{
+    uint32 check = 0;
+    for (uint32 i = 0; i < iterations; i++)
+    {
+        String header = String::Print("--%s\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\nX-Timestamp: %.6f\r\n\r\n", "myboundary", 40000 + i % 1000, 1700000000.123456 + i);
+        check += header.getLength();
+    }
+    return check;
+}
+
+/** Build the inputs */
+static void buildFixture()
+{
+    fixture.browserRequest = "GET /mjpg HTTP/1.1\r\nHost: 192.168.1.20:8080\r\nConnection: keep-alive\r\nCache-Control: max-age=0\r\n"
+        "Upgrade-Insecure-Requests: 1\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+        "Referer: http://192.168.1.20/\r\nAccept-Encoding: gzip, deflate\r\nAccept-Language: en-US,en;q=0.9,fr;q=0.8\r\n"
+        "Cookie: session_P80=.eJyrVkrOz83NzUtNSVKyUnI0MTMzMDQ0MjJRUqoFAFWFBlk; remember_token=3f2b1c0a\r\n\r\n";
+    fixture.timelapseRequest = "GET /full_res?token=verySecretToken HTTP/1.1\r\nHost: 127.0.0.1:8080\r\nUser-Agent: python-requests/2.31.0\r\n"
+        "Accept-Encoding: gzip, deflate\r\nAccept: */*\r\nConnection: keep-alive\r\n\r\n";
+    fixture.server = new Network::Server::HTTP(new Network::Socket::BerkeleyPool());
+    fixture.intern.getPrivateField() = &fixture.context;
+
+    // The server's routes, with a named camera
+    static const char * routes[] = { "full_res", "mjpg", "ws", "events", "snapshot", "stats", "metrics", "record", "replay", "timelapse.avi", "burst",
+                                     "control", "config", "hls/\"", "mosaic", "debug/profile", "debug/memory", "cam/\"/full_res", "cam/\"/mjpg", "cam/\"/ws",
+                                     "cam/\"/events", "cam/\"/snapshot", "cam/\"/record", "cam/\"/replay", "cam/\"/timelapse.avi", "cam/\"/burst", "cam/\"/control", "cam/\"/hls/\"" };
+    for (size_t i = 0; i < ArrSz(routes); i++) fixture.routes.addRoute(routes[i], new URLRouting::URLTrigger(MakeDel(URLRouting::URLTrigger, Fixture, route, fixture)));
+    static const char * resources[] = { "mjpg", "full_res", "snapshot", "cam/printer1/mjpg", "cam/printer2/full_res", "hls/5f3a2b1c-42.m4s", "metrics", "index.html" };
+    for (size_t i = 0; i < ArrSz(resources); i++) fixture.resources.Append(resources[i]);
+
+    // A configuration with many cameras, like a print farm
+    fixture.config = "{\n  \"port\": 8080,\n  \"daemonize\": false,\n  \"logLevel\": 1,\n  \"securityToken\": \"verySecretToken\",\n  \"cameras\": [\n";
+    for (int i = 0; i < 32; i++)
+        fixture.config += String::Print("    { \"name\": \"printer%d\", \"device\": \"/dev/video%d\", \"lowResWidth\": 640, \"lowResHeight\": 480, \"highResWidth\": 1920, "
+                                        "\"highResHeight\": 1080, \"maxFPS\": 15, \"closeDevTimeoutSec\": 15, \"fullResCacheMs\": 500, \"controls\": \"focus_automatic_continuous=0,"
+                                        "focus_absolute=%d\", \"recordDir\": \"/var/lib/mjpgserver/printer%d\", \"recordIntervalSec\": 60, \"adaptiveFPS\": true }%s\n",
+                                        i, i * 2, 100 + i, i, i < 31 ? "," : "");
+    fixture.config += "  ]\n}\n";
+    // A value takes at least 2 bytes, like when loading the configuration
+    fixture.tokenCount = (IndexType)fixture.config.getLength() / 2;
+    fixture.tokens = new JSON::Token[fixture.tokenCount];
+
+    // A MJPEG stream with pictures of random content (so the first bytes of the boundary are found often), the boundary is searched after them
+    fixture.boundary = "\r\n--myboundary\r\n";
+    uint8 picture[16384];
+    uint32 seed = 1;
+    for (int i = 0; i < 16; i++)
+    {
+        for (size_t j = 0; j < sizeof(picture); j++) { seed = seed * 1103515245 + 12345; picture[j] = (uint8)(j % 7 ? seed >> 16 : '-'); }
+        fixture.stream.Append(picture, sizeof(picture));
+    }
+    String part = fixture.boundary + "Content-Type: image/jpeg\r\nContent-Length: 40000\r\n\r\n";
+    fixture.stream.Append((const uint8*)(const char*)part, part.getLength());
+    String partial = fixture.boundary.midString(0, fixture.boundary.getLength() - 3);
+    while (fixture.nearMatches.getSize() < 65536) fixture.nearMatches.Append((const uint8*)(const char*)partial, partial.getLength());
+    fixture.nearMatches.Append((const uint8*)(const char*)part, part.getLength());
+}
+
+int main(int argc, const char ** argv)
+{
+    unsigned duration = 1000;
+    String filter;
+    Arguments::declare(duration,        "The duration of each benchmark in milliseconds (default 1000)", "duration", "t");
+    Arguments::declare(filter,          "Only run the benchmarks whose name contains this text", "filter", "f");
+    String error = Arguments::Core::parse(argc, argv);
+    if (error) return log(Error, "%s", (const char*)error);
+
+    buildFixture();
+    struct Benchmark { const char * name; BenchFunc func; size_t bytes; } benchmarks[] = {
+        { "http.parse.browser",         parseBrowserRequest,        (size_t)fixture.browserRequest.getLength() },
+        { "http.parse.timelapse",       parseTimelapseRequest,      (size_t)fixture.timelapseRequest.getLength() },
+        { "routing.lookup",             routeRequest,               0 },
+        { "json.parse.config",          parseConfig,                (size_t)fixture.config.getLength() },
+        { "memoryblock.lookfor",        findBoundaryInStream,       (size_t)fixture.stream.getSize() },
+        { "memoryblock.lookfor.near",   findBoundaryInNearMatches,  (size_t)fixture.nearMatches.getSize() },
+        { "string.print",               printPartHeader,            0 },
+    };
+
+    fprintf(stdout, "Benchmark                   Iterations     ns/call      MB/s\n");
+    for (size_t i = 0; i < ArrSz(benchmarks); i++)
+    {
+        const Benchmark & bench = benchmarks[i];
+        if (filter && String(bench.name).Find(filter) == -1) continue;
+        // Find how many calls take about a tenth of the duration, then measure enough of them to last the duration
+        uint32 iterations = 1, check = 0;
+        double elapsed = 0;
+        while (true)
+        {
+            double start = Time::getPreciseTime();
+            check += bench.func(iterations);
+            elapsed = Time::getPreciseTime() - start;
+            if (elapsed * 10000 >= duration || iterations >= 0x40000000) break;
+            iterations *= 2;
+        }
+        iterations = (uint32)min((double)0xFFFFFFFF, iterations * duration / 1000.0 / max(elapsed, 1e-9));
+        double start = Time::getPreciseTime();
+        check += bench.func(iterations);
+        elapsed = Time::getPreciseTime() - start;
+        double perCall = elapsed / max(iterations, 1U);
+        fprintf(stdout, "%-26s %11u  %10.1f  %8s\n", bench.name, iterations, perCall * 1e9,
+                bench.bytes ? (const char*)String::Print("%.1f", bench.bytes / perCall / 1048576) : "-");
+        if (!check) log(Warning, "%s: the primitive always failed", bench.name);
+    }
+    return 0;
+}
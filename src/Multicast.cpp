@@ -0,0 +1,215 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/Multicast.hpp"
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+
+static const uint8 multicastMagic[4] = { 'M', 'J', 'P', 'M' };
+
+static inline void writeBE32(uint8 * p, const uint32 value) { p[0] = (uint8)(value >> 24); p[1] = (uint8)(value >> 16); p[2] = (uint8)(value >> 8); p[3] = (uint8)value; }
+static inline void writeBE16(uint8 * p, const uint16 value) { p[0] = (uint8)(value >> 8); p[1] = (uint8)value; }
+static inline uint32 readBE32(const uint8 * p) { return ((uint32)p[0] << 24) | ((uint32)p[1] << 16) | ((uint32)p[2] << 8) | p[3]; }
+static inline uint16 readBE16(const uint8 * p) { return (uint16)((p[0] << 8) | p[1]); }
+
+String Multicast::parseGroup(const char * text, struct sockaddr_in & address)
+{
+    String group(text), host = group.upToLast(":");
+    int64 port = group.fromLast(":").parseInt(10);
+    if (!host || port <= 0 || port > 65535) return String::Print("Bad multicast group (expecting address:port): %s", text);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons((uint16)port);
+    if (inet_pton(AF_INET, host, &address.sin_addr) != 1 || !IN_MULTICAST(ntohl(address.sin_addr.s_addr)))
+        return String::Print("Not a multicast IPv4 address: %s", (const char*)host);
+    return "";
+}
+
+String MulticastSender::open(const char * group, const unsigned ttl)
+{
+    close();
+    struct sockaddr_in address;
+    String error = Multicast::parseGroup(group, address);
+    if (error) return error;
+    fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) return String::Print("Can't create the socket: %s", strerror(errno));
+    // The datagrams are sent to the group, the socket is connected so sendmmsg doesn't need the address
+    unsigned char value = (unsigned char)min(max(ttl, 1U), 255U);
+    // A picture is sent in a burst, so the send buffer must hold several pictures
+    int sendBuffer = 1024 * 1024;
+    if (::setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &value, sizeof(value)) != 0 || ::connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+        error = String::Print("Can't set up the socket for %s: %s", group, strerror(errno));
+        close();
+        return error;
+    }
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+    return "";
+}
+
+bool MulticastSender::send(const uint8 * data, const size_t size, const uint32 sequence)
+{
+    if (fd == -1 || !size || size > Multicast::MaxFrameSize) return false;
+    uint32 count = (uint32)((size + Multicast::FragmentSize - 1) / Multicast::FragmentSize);
+    if (!headers.setSize(count * Multicast::HeaderSize)) return false;
+
+    // Build all the headers first, then send the fragments in batches
+    uint8 * header = headers.getBuffer();
+    for (uint32 i = 0; i < count; i++, header += Multicast::HeaderSize)
+    {
+        memcpy(header, multicastMagic, sizeof(multicastMagic));
+        writeBE32(header + 4, sequence);
+        writeBE32(header + 8, (uint32)size);
+        writeBE32(header + 12, i * Multicast::FragmentSize);
+        writeBE16(header + 16, (uint16)i);
+        writeBE16(header + 18, (uint16)count);
+    }
+    struct mmsghdr messages[Multicast::BatchSize];
+    struct iovec vectors[Multicast::BatchSize][2];
+    for (uint32 first = 0; first < count;)
+    {
+        uint32 batch = min(count - first, (uint32)Multicast::BatchSize);
+        memset(messages, 0, batch * sizeof(messages[0]));
+        for (uint32 i = 0; i < batch; i++)
+        {
+            uint32 offset = (first + i) * Multicast::FragmentSize;
+            vectors[i][0].iov_base = headers.getBuffer() + (first + i) * Multicast::HeaderSize;
+            vectors[i][0].iov_len = Multicast::HeaderSize;
+            vectors[i][1].iov_base = (void*)(data + offset);
+            vectors[i][1].iov_len = min(size - offset, (size_t)Multicast::FragmentSize);
+            messages[i].msg_hdr.msg_iov = vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 2;
+        }
+        int sent = ::sendmmsg(fd, messages, batch, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        // A full send buffer drops the rest of the picture, it would be useless to the receivers anyway
+        if (sent <= 0) return false;
+        first += (uint32)sent;
+    }
+    return true;
+}
+
+void MulticastSender::close()
+{
+    if (fd != -1) ::close(fd);
+    fd = -1;
+}
+
+String MulticastReceiver::open(const char * group)
+{
+    close();
+    struct sockaddr_in address;
+    String error = Multicast::parseGroup(group, address);
+    if (error) return error;
+    fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd == -1) return String::Print("Can't create the socket: %s", strerror(errno));
+    // Several receivers can listen on the same host, and the receive buffer must hold a burst of datagrams
+    int reuse = 1, receiveBuffer = 4 * 1024 * 1024;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBuffer, sizeof(receiveBuffer));
+    // Bind on the group address, so only this group's datagrams are received on this port
+    struct ip_mreq membership;
+    membership.imr_multiaddr = address.sin_addr;
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (::bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || ::setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0)
+    {
+        error = String::Print("Can't join the group %s: %s", group, strerror(errno));
+        close();
+        return error;
+    }
+    if (!datagrams.ensureSize(Multicast::BatchSize * Multicast::DatagramSize, true)) { close(); return "Out of memory"; }
+    sequence = fragments = received = 0; ready = synced = false;
+    return "";
+}
+
+int MulticastReceiver::receive(const int wakeFd, const int timeoutMs)
+{
+    if (fd == -1) return -1;
+    struct pollfd fds[2] = { { fd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+    int ret = ::poll(fds, wakeFd != -1 ? 2 : 1, timeoutMs);
+    if (ret < 0) return errno == EINTR ? 0 : -1;
+    int result = 0;
+    if (wakeFd != -1 && (fds[1].revents & POLLIN))
+    {
+        eventfd_t value;
+        eventfd_read(wakeFd, &value);
+        result |= WokenUp;
+    }
+    if (!(fds[0].revents & POLLIN)) return result;
+
+    // Read all the pending datagrams, a batch at a time
+    struct mmsghdr messages[Multicast::BatchSize];
+    struct iovec vectors[Multicast::BatchSize];
+    while (true)
+    {
+        memset(messages, 0, sizeof(messages));
+        for (int i = 0; i < Multicast::BatchSize; i++)
+        {
+            vectors[i].iov_base = datagrams.getBuffer() + i * Multicast::DatagramSize;
+            vectors[i].iov_len = Multicast::DatagramSize;
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        int count = ::recvmmsg(fd, messages, Multicast::BatchSize, MSG_DONTWAIT, NULL);
+        if (count < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? result | DataReceived : -1;
+        for (int i = 0; i < count; i++) handle((const uint8*)vectors[i].iov_base, messages[i].msg_len);
+        result |= DataReceived;
+        if (count < Multicast::BatchSize) return result;
+    }
+}
+
+void MulticastReceiver::handle(const uint8 * datagram, const size_t size)
+{
+    if (size <= Multicast::HeaderSize || memcmp(datagram, multicastMagic, sizeof(multicastMagic))) return;
+    uint32 frameSequence = readBE32(datagram + 4), frameSize = readBE32(datagram + 8), offset = readBE32(datagram + 12);
+    uint16 index = readBE16(datagram + 16), count = readBE16(datagram + 18);
+    size_t length = size - Multicast::HeaderSize;
+    if (!count || index >= count || frameSize > Multicast::MaxFrameSize || offset + length > frameSize) return;
+
+    if (synced)
+    {   // A late fragment of an older (or already complete) picture is ignored, unless the sender restarted its sequence
+        int32 age = (int32)(sequence - frameSequence);
+        if ((age > 0 && age < Multicast::MaxReorder) || (!age && !fragments)) return;
+    }
+    if (!synced || frameSequence != sequence)
+    {   // A newer picture replaces the one being reassembled
+        if (fragments && received) incomplete++;
+        if (!assembling.setSize(frameSize) || !receivedMap.setSize(count)) { fragments = 0; return; }
+        memset(receivedMap.getBuffer(), 0, count);
+        sequence = frameSequence; fragments = count; received = 0; synced = true;
+    }
+    if (count != fragments || frameSize != assembling.getSize() || receivedMap.getBuffer()[index]) return;
+    memcpy(assembling.getBuffer() + offset, datagram + Multicast::HeaderSize, length);
+    receivedMap.getBuffer()[index] = 1;
+    if (++received < fragments) return;
+
+    // Complete, it replaces the previous complete picture (if it was not taken yet, it's too late for it anyway)
+    complete.swapWith(assembling);
+    ready = true;
+    // The next fragment with this sequence (a duplicate) is ignored, and the next picture starts a new reassembly
+    received = fragments = 0;
+}
+
+bool MulticastReceiver::nextFrame(const uint8 * & data, size_t & size)
+{
+    if (!ready) return false;
+    ready = false;
+    data = complete.getConstBuffer();
+    size = complete.getSize();
+    return true;
+}
+
+void MulticastReceiver::close()
+{
+    if (fd != -1) ::close(fd);
+    fd = -1;
+    fragments = received = 0; ready = synced = false;
+}
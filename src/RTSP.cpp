@@ -0,0 +1,734 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/RTSP.hpp"
+// We need the logging too
+#include "../include/LogLevel.hpp"
+// We need time functions too
+#include "Time/Time.hpp"
+// We need random numbers for the sessions identifiers and the RTP initial state
+#include "Crypto/Random.hpp"
+// We need base64 for the parameter sets
+#include "Encoding/Encode.hpp"
+// We need the NAL units parsing too
+#include "../include/H264.hpp"
+
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <math.h>
+
+static inline void writeBE32(uint8 * p, const uint32 value) { p[0] = (uint8)(value >> 24); p[1] = (uint8)(value >> 16); p[2] = (uint8)(value >> 8); p[3] = (uint8)value; }
+static inline void writeBE16(uint8 * p, const uint16 value) { p[0] = (uint8)(value >> 8); p[1] = (uint8)value; }
+static inline void writeBE24(uint8 * p, const uint32 value) { p[0] = (uint8)(value >> 16); p[1] = (uint8)(value >> 8); p[2] = (uint8)value; }
+
+/** Get the RTP timestamp of a time, in the 90kHz clock */
+static inline uint32 getRTPTime(const double time) { return (uint32)(uint64)(time * RTPPacketizer::ClockRate); }
+
+String RTPJPEG::prepare(const uint8 * data, const size_t size)
+{
+    packets.Clear();
+    payload = 0;
+    if (!JPEGInfo::hasStartOfImage(data, size)) return "Not a JPEG picture";
+
+    // Walk the header segments, for the quantization tables, the sampling, the restart interval and the start of the entropy coded data
+    const uint8 * tables[4] = { 0, 0, 0, 0 };
+    int width = 0, height = 0, type = -1, lumaTable = 0, chromaTable = 0;
+    uint16 restartInterval = 0;
+    size_t pos = 2, scanStart = 0;
+    while (pos + 1 < size && !scanStart)
+    {
+        // Some devices leave garbage between the segments, so resynchronize on the next marker
+        if (data[pos] != 0xFF || data[pos + 1] == 0x00) { pos = JPEGInfo::findMarker(data, size, pos); continue; }
+        uint8 marker = data[pos + 1];
+        if (marker == 0xFF) { pos++; continue; } // Fill byte
+        pos += 2;
+        if (marker == JPEGInfo::SOI || marker == JPEGInfo::TEM || (marker >= JPEGInfo::RST0 && marker <= JPEGInfo::RST7)) continue;
+        if (marker == JPEGInfo::EOI || pos + 2 > size) return "Truncated picture";
+        size_t len = (data[pos] << 8) | data[pos + 1];
+        if (len < 2 || pos + len > size) return "Truncated picture";
+        const uint8 * segment = data + pos + 2;
+        size_t segmentSize = len - 2;
+        if (marker == JPEGInfo::DQT)
+        {
+            for (size_t i = 0; i + 65 <= segmentSize; i += 65)
+            {
+                if (segment[i] >> 4) return "16 bits quantization tables can't be sent";
+                tables[segment[i] & 3] = segment + i + 1;
+            }
+        }
+        else if (marker == JPEGInfo::DRI && segmentSize >= 2) restartInterval = (uint16)((segment[0] << 8) | segment[1]);
+        else if (marker == JPEGInfo::SOS) scanStart = pos + len;
+        // Any SOFn marker except DHT, JPG and DAC
+        else if (marker >= JPEGInfo::SOF0 && marker <= 0xCF && marker != JPEGInfo::DHT && marker != JPEGInfo::JPG && marker != JPEGInfo::DAC)
+        {
+            if (marker != JPEGInfo::SOF0) return "Only the baseline pictures can be sent";
+            if (segmentSize < 15 || segment[5] != 3) return "Only the color pictures can be sent";
+            height = (segment[1] << 8) | segment[2];
+            width = (segment[3] << 8) | segment[4];
+            // The chroma components are not subsampled, the luma one is horizontally (4:2:2) or in both directions (4:2:0)
+            if (segment[10] != 0x11 || segment[13] != 0x11 || (segment[7] != 0x21 && segment[7] != 0x22)) return "Only the 4:2:2 and 4:2:0 pictures can be sent";
+            if ((segment[11] & 3) != (segment[14] & 3)) return "The chroma components must share their quantization table";
+            type = segment[7] == 0x21 ? 0 : 1;
+            lumaTable = segment[8] & 3;
+            chromaTable = segment[11] & 3;
+        }
+        pos += len;
+    }
+    if (!scanStart || type < 0) return "No picture found";
+    if (!tables[lumaTable] || !tables[chromaTable]) return "Missing quantization table";
+    if (!width || !height || width > 2040 || height > 2040) return String::Print("The picture size (%dx%d) can't be sent (2040x2040 at most)", width, height);
+    size_t end = JPEGInfo::findEndOfImage(data, size);
+    if (end == size || end <= scanStart) return "Truncated picture";
+    payload = data + scanStart;
+    uint32 scanSize = (uint32)(end - scanStart);
+    if (scanSize > 0xFFFFFF) return "Picture too large";
+
+    // The JPEG header is in all the packets, followed by the restart marker header (if any), the first packet also has the tables
+    uint32 headerSize = 8 + (restartInterval ? 4 : 0), tablesSize = 4 + 2 * 64;
+    uint32 firstRoom = MaxPacketSize - RTPHeaderSize - headerSize - tablesSize, room = MaxPacketSize - RTPHeaderSize - headerSize;
+    uint32 count = 1 + (scanSize > firstRoom ? (scanSize - firstRoom + room - 1) / room : 0);
+    if (!headers.setSize(count * headerSize + tablesSize)) return "Out of memory";
+    uint8 * header = headers.getBuffer();
+    for (uint32 i = 0, offset = 0; i < count; i++)
+    {
+        Packet packet;
+        packet.headerOffset = (uint32)(header - headers.getBuffer());
+        packet.dataOffset = offset;
+        packet.dataSize = min(scanSize - offset, i ? room : firstRoom);
+        // Type specific, fragment offset, type, Q (255: the tables are in the first packet), width and height in 8 pixels blocks
+        header[0] = 0;
+        writeBE24(header + 1, offset);
+        header[4] = (uint8)(type + (restartInterval ? 64 : 0));
+        header[5] = 255;
+        header[6] = (uint8)((width + 7) / 8);
+        header[7] = (uint8)((height + 7) / 8);
+        header += 8;
+        if (restartInterval)
+        {   // The packets are not aligned on the restart intervals, so the first and last bits are set, with the count to 0x3FFF
+            writeBE16(header, restartInterval);
+            writeBE16(header + 2, 0xFFFF);
+            header += 4;
+        }
+        if (!i)
+        {   // 8 bits precision tables, the luma one then the chroma one (in zigzag order, like in the picture)
+            header[0] = header[1] = 0;
+            writeBE16(header + 2, 2 * 64);
+            memcpy(header + 4, tables[lumaTable], 64);
+            memcpy(header + 4 + 64, tables[chromaTable], 64);
+            header += tablesSize;
+        }
+        packet.headerSize = (uint32)(header - headers.getBuffer()) - packet.headerOffset;
+        packets.Append(packet);
+        offset += packet.dataSize;
+    }
+    return "";
+}
+
+String RTPH264::prepare(const uint8 * data, const size_t size)
+{
+    packets.Clear();
+    payload = data;
+    if (!H264Info::hasStartCode(data, size)) return "Not a H.264 access unit";
+    if (!headers.setSize(0)) return "Out of memory";
+
+    const uint8 * nal = 0; size_t nalSize = 0, pos = 0;
+    uint32 room = MaxPacketSize - RTPHeaderSize;
+    while (H264Info::nextNAL(data, size, pos, nal, nalSize))
+    {
+        uint8 type = H264Info::getType(nal);
+        // The access unit delimiters are useless in RTP, the marker bit ends the access unit
+        if (type == H264Info::AUD) continue;
+        if ((type == H264Info::SPS || type == H264Info::PPS) && nalSize <= MaxParameterSetSize)
+        {
+            Utils::MemoryBlock & set = type == H264Info::SPS ? sps : pps;
+            if (!set.setSize((uint32)nalSize)) return "Out of memory";
+            memcpy(set.getBuffer(), nal, nalSize);
+        }
+        uint32 offset = (uint32)(nal - data);
+        if (nalSize <= room) { packets.Append(Packet(0, 0, offset, (uint32)nalSize)); continue; }
+
+        // Fragmented: the NAL header is replaced by the FU indicator (its NRI bits and the FU-A type) and the FU header (start, end and NAL type)
+        for (uint32 done = 1; done < nalSize;)
+        {
+            uint32 length = min((uint32)nalSize - done, room - 2), headerOffset = headers.getSize();
+            uint8 header[2] = { (uint8)((nal[0] & 0xE0) | FUA), (uint8)(H264Info::getType(nal) | (done == 1 ? 0x80 : 0) | (done + length == nalSize ? 0x40 : 0)) };
+            if (!headers.Append(header, sizeof(header))) return "Out of memory";
+            packets.Append(Packet(headerOffset, sizeof(header), offset + done, length));
+            done += length;
+        }
+    }
+    if (!packets.getSize()) return "Empty access unit";
+    return "";
+}
+
+String RTPH264::getMediaAttributes() const
+{
+    String parameters = "packetization-mode=1";
+    if (sps.getSize() >= 4 && pps.getSize())
+    {   // The profile, its constraints and the level follow the SPS NAL header
+        uint8 spsText[MaxParameterSetSize * 2] = {}, ppsText[MaxParameterSetSize * 2] = {};
+        uint32 spsLength = sizeof(spsText) - 1, ppsLength = sizeof(ppsText) - 1;
+        if (Encoding::encodeBase64(sps.getConstBuffer(), sps.getSize(), spsText, spsLength) && Encoding::encodeBase64(pps.getConstBuffer(), pps.getSize(), ppsText, ppsLength))
+            parameters += String::Print(";profile-level-id=%02X%02X%02X;sprop-parameter-sets=%.*s,%.*s", sps.getConstBuffer()[1], sps.getConstBuffer()[2], sps.getConstBuffer()[3],
+                                        (int)spsLength, (const char*)spsText, (int)ppsLength, (const char*)ppsText);
+    }
+    return String::Print("a=rtpmap:%d H264/%d\r\na=fmtp:%d %s\r\n", (int)PayloadType, (int)ClockRate, (int)PayloadType, (const char*)parameters);
+}
+
+void RTPPacketizer::writeHeader(uint8 * header, const bool marker, const uint16 sequence, const uint32 timestamp, const uint32 ssrc) const
+{
+    header[0] = 0x80; // Version 2, no padding, no extension, no contributing source
+    header[1] = (uint8)(payloadType | (marker ? 0x80 : 0));
+    writeBE16(header + 2, sequence);
+    writeBE32(header + 4, timestamp);
+    writeBE32(header + 8, ssrc);
+}
+
+RTSPServer::Connection::Connection(const int fd, const struct sockaddr_in & peer)
+    : fd(fd), peer(peer), outputSent(0), authorized(0), stream(0), interleaved(false), rtpChannel(0), rtcpChannel(1), playing(false),
+      rtpSequence(0), ssrc(0), timestampBase(0), lastTimestamp(0), packetsSent(0), octetsSent(0), lastFrame(0), framesSkipped(0), waitKeyFrame(false), lastSeen(0), lastReport(0)
+{
+    char text[INET_ADDRSTRLEN] = {};
+    inet_ntop(AF_INET, &peer.sin_addr, text, sizeof(text));
+    address = text;
+    memset(&rtpAddress, 0, sizeof(rtpAddress));
+    memset(&rtcpAddress, 0, sizeof(rtcpAddress));
+}
+
+RTSPServer::Connection::~Connection() { if (fd != -1) ::close(fd); }
+
+RTSPServer::RTSPServer() : Threading::Thread("RTSPServer"), listenFd(-1), rtpFd(-1), rtcpFd(-1), wakeFd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), rtpPort(0), nextSession(Random::numberBetween()) {}
+RTSPServer::~RTSPServer() { stop(); if (wakeFd != -1) ::close(wakeFd); }
+
+void RTSPServer::addStream(const String & path, RTSPSource & source)
+{
+    streams.Append(new Stream(path, &source));
+}
+
+String RTSPServer::start(const uint16 port)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    int reuse = 1;
+    listenFd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd == -1) return String::Print("Can't create the RTSP socket: %s", strerror(errno));
+    ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (::bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || ::listen(listenFd, 16) != 0)
+    {
+        String error = String::Print("Can't listen on the RTSP port %u: %s", (unsigned)port, strerror(errno));
+        stop();
+        return error;
+    }
+
+    // The RTP and RTCP server ports are a pair, the RTP one being even, so let the system pick a free port until it's so
+    for (int tries = 0; tries < 32 && rtcpFd == -1; tries++)
+    {
+        rtpFd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        address.sin_port = 0;
+        socklen_t len = sizeof(address);
+        if (rtpFd == -1 || ::bind(rtpFd, (struct sockaddr*)&address, sizeof(address)) != 0 || ::getsockname(rtpFd, (struct sockaddr*)&address, &len) != 0) break;
+        rtpPort = ntohs(address.sin_port);
+        if (!(rtpPort & 1) && rtpPort != 65534)
+        {
+            address.sin_port = htons(rtpPort + 1);
+            rtcpFd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (rtcpFd != -1 && ::bind(rtcpFd, (struct sockaddr*)&address, sizeof(address)) == 0) break;
+            if (rtcpFd != -1) ::close(rtcpFd);
+            rtcpFd = -1;
+        }
+        ::close(rtpFd);
+        rtpFd = -1;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+    if (rtcpFd == -1) { stop(); return "Can't find a pair of RTP ports"; }
+    // A picture is sent in a burst, so the send buffer must hold a few pictures
+    int sendBuffer = 1024 * 1024;
+    ::setsockopt(rtpFd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+    if (!createThread()) { stop(); return "Can't start the RTSP thread"; }
+    return "";
+}
+
+void RTSPServer::stop()
+{
+    if (isRunning()) { signalShouldStop(); wake(); destroyThread(); }
+    // The thread is gone, so the sessions can be ended from here
+    while (connections.getSize())
+    {
+        endSession(*connections.getElementAtUncheckedPosition(0), true);
+        connections.Remove(0);
+    }
+    for (size_t i = 0; i < streams.getSize(); i++) streams.getElementAtUncheckedPosition(i)->frame.reset();
+    if (listenFd != -1) ::close(listenFd);
+    if (rtpFd != -1) ::close(rtpFd);
+    if (rtcpFd != -1) ::close(rtcpFd);
+    listenFd = rtpFd = rtcpFd = -1;
+}
+
+uint32 RTSPServer::runThread()
+{
+    struct pollfd fds[3 + MaxConnections];
+    while (isRunning())
+    {
+        fds[0].fd = wakeFd; fds[1].fd = listenFd; fds[2].fd = rtcpFd;
+        size_t count = connections.getSize();
+        for (size_t i = 0; i < count; i++)
+        {
+            const Connection & connection = *connections.getElementAtUncheckedPosition(i);
+            fds[3 + i].fd = connection.fd;
+            // Only wait for writability while some data is pending
+            fds[3 + i].events = POLLIN | (connection.getPending() ? POLLOUT : 0);
+        }
+        for (size_t i = 0; i < 3; i++) fds[i].events = POLLIN;
+        for (size_t i = 0; i < 3 + count; i++) fds[i].revents = 0;
+        if (::poll(fds, (nfds_t)(3 + count), 1000) < 0 && errno != EINTR) { log(Error, "RTSP server: can't wait for the sockets: %s", strerror(errno)); break; }
+
+        double now = Time::getPreciseTime();
+        if (fds[0].revents & POLLIN)
+        {
+            eventfd_t value;
+            eventfd_read(wakeFd, &value);
+            deliverFrames();
+        }
+        if (fds[2].revents & POLLIN) receiveReports(now);
+        // Iterating from last to first allows to remove cleanly (the accepted connections are appended after)
+        for (size_t i = count; i != 0; i--)
+        {
+            Connection & connection = *connections.getElementAtUncheckedPosition(i - 1);
+            short events = fds[3 + i - 1].revents;
+            bool alive = !(events & (POLLERR | POLLNVAL));
+            if (alive && (events & (POLLIN | POLLHUP))) alive = receive(connection);
+            if (alive && (events & POLLOUT)) alive = flush(connection);
+            // The UDP sessions are only kept alive by the requests and the receiver reports
+            if (alive && connection.session && !connection.interleaved && now - connection.lastSeen > SessionTimeoutSec)
+            {
+                log(Info, "RTSP session %s of %s timed out", (const char*)connection.session, (const char*)connection.address);
+                alive = false;
+            }
+            if (alive && connection.playing && now - connection.lastReport >= ReportIntervalSec) sendReport(connection, now);
+            if (alive) continue;
+            log(Debug, "RTSP client %s disconnected", (const char*)connection.address);
+            endSession(connection, true);
+            connections.Remove(i - 1);
+        }
+        if (fds[1].revents & POLLIN) acceptConnections();
+    }
+    return 0;
+}
+
+void RTSPServer::acceptConnections()
+{
+    while (true)
+    {
+        struct sockaddr_in peer;
+        socklen_t len = sizeof(peer);
+        int fd = ::accept4(listenFd, (struct sockaddr*)&peer, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+        if (connections.getSize() >= MaxConnections || peer.sin_family != AF_INET)
+        {
+            log(Warning, "Too many RTSP connections, refusing a new one");
+            ::close(fd);
+            continue;
+        }
+        // The interleaved packets are sent as soon as possible
+        int noDelay = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        Connection * connection = new Connection(fd, peer);
+        log(Debug, "RTSP client %s connected", (const char*)connection->address);
+        connections.Append(connection);
+    }
+}
+
+bool RTSPServer::receive(Connection & connection)
+{
+    uint8 buffer[4096];
+    while (true)
+    {
+        ssize_t len = ::recv(connection.fd, buffer, sizeof(buffer), 0);
+        if (!len) return false;
+        if (len < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        if (!connection.input.Append(buffer, (uint32)len)) return false;
+    }
+
+    // Process the complete requests, and skip the interleaved packets (the receiver reports)
+    const uint8 * data = connection.input.getConstBuffer();
+    size_t size = connection.input.getSize(), used = 0;
+    bool alive = true;
+    while (alive && used < size)
+    {
+        if (data[used] == '\r' || data[used] == '\n') { used++; continue; }
+        if (data[used] == '$')
+        {
+            if (size - used < 4) break;
+            size_t len = (data[used + 2] << 8) | data[used + 3];
+            if (size - used < 4 + len) break;
+            if (connection.interleaved && data[used + 1] == connection.rtcpChannel) connection.lastSeen = Time::getPreciseTime();
+            used += 4 + len;
+            continue;
+        }
+        const uint8 * end = (const uint8*)memmem(data + used, size - used, "\r\n\r\n", 4);
+        if (!end)
+        {
+            if (size - used > MaxRequestSize) return false;
+            break;
+        }
+        String request((const char*)data + used, (int)(end + 4 - data - used));
+        // A request's body (like a SET_PARAMETER one) is not used, it's skipped
+        size_t bodySize = 0;
+        int pos = request.caselessFind("\r\nContent-Length:");
+        if (pos != -1) bodySize = (size_t)request.midString(pos + 17, request.getLength()).upToFirst("\r\n").Trimmed().parseInt(10);
+        if (bodySize > MaxRequestSize) return false;
+        if (size - used < (size_t)request.getLength() + bodySize) break;
+        used += request.getLength() + bodySize;
+        alive = processRequest(connection, request);
+    }
+    connection.input.Extract(0, (uint32)used);
+    return alive;
+}
+
+RTSPServer::Stream * RTSPServer::findStream(const String & url, String & token, String & base) const
+{
+    // rtsp://host:port/path?query, the path (or the query) might end with the track
+    String rest = url.Find("://") != -1 ? url.fromFirst("://") : url;
+    String authority = rest.upToFirst("/"), path = rest.Find('/') != -1 ? "/" + rest.fromFirst("/") : String("/");
+    String query = path.fromFirst("?");
+    path = path.upToFirst("?");
+    if (path.getLength() >= 7 && path.fromLast("/") == "track1") path = path.upToLast("/");
+    if (query.getLength() >= 7 && query.fromLast("/") == "track1") query = query.upToLast("/");
+    while (path.getLength() > 1 && path[path.getLength() - 1] == '/') path = path.midString(0, path.getLength() - 1);
+    if (!path) path = "/";
+
+    token = "";
+    while (query)
+    {
+        String param = query.splitUpTo("&");
+        if (param.upToFirst("=") == "token") token = param.fromFirst("=");
+    }
+    base = "rtsp://" + authority + (path == "/" ? String("/") : path + "/");
+    for (size_t i = 0; i < streams.getSize(); i++)
+        if (streams.getElementAtUncheckedPosition(i)->path == path) return streams.getElementAtUncheckedPosition(i);
+    return 0;
+}
+
+bool RTSPServer::processRequest(Connection & connection, const String & request)
+{
+    String line = request.upToFirst("\r\n"), method = line.upToFirst(" "), url = line.fromFirst(" ").upToLast(" ");
+    String cseq, transport, session, headers = request.fromFirst("\r\n");
+    while (headers)
+    {
+        String header = headers.splitUpTo("\r\n"), name = header.upToFirst(":").Trimmed(), value = header.fromFirst(":").Trimmed();
+        if (name.caselessEqual("CSeq")) cseq = value;
+        else if (name.caselessEqual("Transport")) transport = value;
+        else if (name.caselessEqual("Session")) session = value.upToFirst(";");
+    }
+    double now = Time::getPreciseTime();
+    connection.lastSeen = now;
+    log(Debug, "RTSP %s %s from %s", (const char*)method, (const char*)url, (const char*)connection.address);
+
+    if (method == "OPTIONS") answer(connection, cseq, "200 OK", "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n");
+    else if (method == "GET_PARAMETER" || method == "SET_PARAMETER")
+        // Used as keep alive
+        answer(connection, cseq, "200 OK", connection.session ? "Session: " + connection.session + "\r\n" : String());
+    else if (method == "DESCRIBE" || method == "SETUP")
+    {
+        String token, base;
+        Stream * stream = findStream(url, token, base);
+        if (!stream) { answer(connection, cseq, "404 Not Found"); return true; }
+        if (connection.authorized != stream && !stream->source->isAuthorized(token)) { answer(connection, cseq, "401 Unauthorized"); return true; }
+        connection.authorized = stream;
+        if (method == "DESCRIBE")
+        {
+            struct sockaddr_in local;
+            socklen_t len = sizeof(local);
+            char host[INET_ADDRSTRLEN] = "0.0.0.0";
+            if (::getsockname(connection.fd, (struct sockaddr*)&local, &len) == 0) inet_ntop(AF_INET, &local.sin_addr, host, sizeof(host));
+            String sdp = String::Print("v=0\r\no=- %u 1 IN IP4 %s\r\ns=MJPGServer\r\nc=IN IP4 0.0.0.0\r\nt=0 0\r\na=control:*\r\nm=video 0 RTP/AVP %d\r\n",
+                                       nextSession, host, (int)stream->packetizer->getPayloadType()) + stream->packetizer->getMediaAttributes() + "a=control:track1\r\n";
+            answer(connection, cseq, "200 OK", "Content-Base: " + base + "\r\nContent-Type: application/sdp\r\n", sdp);
+            return true;
+        }
+
+        // A connection only plays a single stream
+        if (connection.session && connection.stream != stream) { answer(connection, cseq, "459 Aggregate Operation Not Allowed"); return true; }
+        String answerTransport;
+        if (transport.Find("RTP/AVP/TCP") != -1)
+        {
+            String channels = transport.Find("interleaved=") != -1 ? transport.fromFirst("interleaved=").upToFirst(";") : String("0-1");
+            connection.rtpChannel = (uint8)channels.upToFirst("-").parseInt(10);
+            connection.rtcpChannel = channels.Find('-') != -1 ? (uint8)channels.fromFirst("-").parseInt(10) : (uint8)(connection.rtpChannel + 1);
+            connection.interleaved = true;
+            answerTransport = String::Print("RTP/AVP/TCP;unicast;interleaved=%u-%u", (unsigned)connection.rtpChannel, (unsigned)connection.rtcpChannel);
+        }
+        else if (transport.Find("multicast") == -1 && transport.Find("client_port=") != -1)
+        {
+            String ports = transport.fromFirst("client_port=").upToFirst(";");
+            int64 rtp = ports.upToFirst("-").parseInt(10), rtcp = ports.Find('-') != -1 ? ports.fromFirst("-").parseInt(10) : rtp + 1;
+            if (rtp <= 0 || rtp > 65535 || rtcp <= 0 || rtcp > 65535) { answer(connection, cseq, "461 Unsupported Transport"); return true; }
+            // The packets are sent to the client's address, whatever the transport's destination
+            connection.rtpAddress = connection.rtcpAddress = connection.peer;
+            connection.rtpAddress.sin_port = htons((uint16)rtp);
+            connection.rtcpAddress.sin_port = htons((uint16)rtcp);
+            connection.interleaved = false;
+            answerTransport = String::Print("RTP/AVP;unicast;client_port=%u-%u;server_port=%u-%u", (unsigned)rtp, (unsigned)rtcp, (unsigned)rtpPort, (unsigned)rtpPort + 1);
+        }
+        else { answer(connection, cseq, "461 Unsupported Transport"); return true; }
+
+        if (!connection.session)
+        {   // The RTP state starts at random values
+            connection.session = String::Print("%08X", nextSession++);
+            connection.stream = stream;
+            connection.ssrc = Random::numberBetween();
+            connection.timestampBase = Random::numberBetween();
+            connection.rtpSequence = (uint16)Random::numberBetween(0, 65535);
+            connection.packetsSent = connection.octetsSent = 0;
+        }
+        connection.trackURL = base + "track1";
+        answer(connection, cseq, "200 OK", String::Print("Transport: %s;ssrc=%08X\r\nSession: %s;timeout=%d\r\n", (const char*)answerTransport, connection.ssrc, (const char*)connection.session, (int)SessionTimeoutSec));
+    }
+    else if (method == "PLAY" || method == "PAUSE" || method == "TEARDOWN")
+    {
+        if (!connection.session || (session && session != connection.session)) { answer(connection, cseq, "454 Session Not Found"); return true; }
+        if (method == "TEARDOWN")
+        {
+            answer(connection, cseq, "200 OK", "Session: " + connection.session + "\r\n");
+            endSession(connection, true);
+            return true;
+        }
+        if (method == "PAUSE")
+        {
+            if (connection.playing) connection.stream->source->stopViewer();
+            connection.playing = false;
+            answer(connection, cseq, "200 OK", "Session: " + connection.session + "\r\n");
+            return true;
+        }
+        if (!connection.playing)
+        {
+            if (!connection.stream->source->startViewer()) { answer(connection, cseq, "503 Service Unavailable"); return true; }
+            connection.playing = true;
+            // The current frame is sent right away, not only when the next one is captured (a H.264 session waits for a key frame)
+            connection.lastFrame = 0;
+            connection.waitKeyFrame = connection.stream->source->getCodec() == RTSPSource::H264;
+            if (connection.waitKeyFrame) connection.stream->source->requestKeyFrame();
+            connection.lastReport = now;
+            log(Info, "RTSP client %s plays %s (%s)", (const char*)connection.address, (const char*)connection.stream->path, connection.interleaved ? "TCP" : "UDP");
+        }
+        answer(connection, cseq, "200 OK", String::Print("Range: npt=now-\r\nSession: %s\r\nRTP-Info: url=%s;seq=%u;rtptime=%u\r\n", (const char*)connection.session,
+                                                         (const char*)connection.trackURL, (unsigned)connection.rtpSequence, connection.timestampBase + getRTPTime(now)));
+        wake();
+    }
+    else answer(connection, cseq, "501 Not Implemented");
+    return true;
+}
+
+void RTSPServer::answer(Connection & connection, const String & cseq, const char * status, const String & headers, const String & body)
+{
+    String text = String::Print("RTSP/1.0 %s\r\nCSeq: %s\r\nServer: MJPGServer\r\n", status, (const char*)cseq) + headers;
+    if (body) text += String::Print("Content-Length: %d\r\n", body.getLength());
+    text += "\r\n" + body;
+    // An error is seen when the connection is read next
+    if (!connection.output.Append((const uint8*)(const char*)text, (uint32)text.getLength()) || !flush(connection)) ::shutdown(connection.fd, SHUT_RDWR);
+}
+
+bool RTSPServer::flush(Connection & connection)
+{
+    while (connection.getPending())
+    {
+        ssize_t sent = ::send(connection.fd, connection.output.getConstBuffer() + connection.outputSent, connection.getPending(), MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return false;
+        }
+        connection.outputSent += (size_t)sent;
+    }
+    // Keep the allocation for the next picture, and don't let the sent bytes accumulate
+    if (!connection.getPending()) { connection.output.stripTo(0); connection.outputSent = 0; }
+    else if (connection.outputSent > connection.output.getSize() / 2) { connection.output.Extract(0, (uint32)connection.outputSent); connection.outputSent = 0; }
+    return true;
+}
+
+void RTSPServer::deliverFrames()
+{
+    for (size_t i = 0; i < connections.getSize(); i++)
+    {
+        Connection & connection = *connections.getElementAtUncheckedPosition(i);
+        if (!connection.playing) continue;
+        Stream & stream = *connection.stream;
+        // The picture is only packetized once for all the sessions
+        FrameRef frame = stream.source->getLatestFrame();
+        if (!frame) continue;
+        if (!(frame == stream.frame))
+        {
+            stream.frame = frame;
+            String error = stream.packetizer->prepare(frame->getData(), frame->data.getSize());
+            if (error && error != stream.error) log(Warning, "RTSP stream %s: %s", (const char*)stream.path, (const char*)error);
+            stream.error = error;
+        }
+        if (stream.error || connection.lastFrame == frame->sequence) continue;
+        // A H.264 picture depends on the previous one, so a picture missed by this thread (or skipped) breaks the decoding until the next key frame
+        bool missed = connection.lastFrame && frame->sequence != connection.lastFrame + 1;
+        connection.lastFrame = frame->sequence;
+        if (stream.source->getCodec() == RTSPSource::H264 && !connection.waitKeyFrame && !frame->keyFrame && missed)
+        {
+            connection.waitKeyFrame = true;
+            stream.source->requestKeyFrame();
+        }
+        if (connection.waitKeyFrame && !frame->keyFrame) { connection.framesSkipped++; continue; }
+        connection.waitKeyFrame = false;
+        // A TCP session whose connection is still busy with the previous picture skips this one, the next one replaces it anyway
+        if (connection.interleaved && connection.getPending())
+        {
+            connection.framesSkipped++;
+            if (stream.source->getCodec() == RTSPSource::H264) { connection.waitKeyFrame = true; stream.source->requestKeyFrame(); }
+            continue;
+        }
+        sendPicture(connection, *stream.packetizer, connection.timestampBase + getRTPTime(frame->time - frame->captureAge));
+    }
+}
+
+void RTSPServer::sendPicture(Connection & connection, const RTPPacketizer & packetizer, const uint32 timestamp)
+{
+    size_t count = packetizer.getPacketCount();
+    connection.lastTimestamp = timestamp;
+    if (connection.interleaved)
+    {   // Each packet is prefixed with its channel and length
+        for (size_t i = 0; i < count; i++)
+        {
+            uint8 prefix[4 + RTPPacketizer::RTPHeaderSize];
+            struct iovec payload[2];
+            uint32 size = RTPPacketizer::RTPHeaderSize + packetizer.getPayloadSize(i);
+            prefix[0] = '$';
+            prefix[1] = connection.rtpChannel;
+            writeBE16(prefix + 2, (uint16)size);
+            packetizer.writeHeader(prefix + 4, i + 1 == count, connection.rtpSequence++, timestamp, connection.ssrc);
+            packetizer.getPayload(i, payload);
+            if (!connection.output.Append(prefix, sizeof(prefix)) || !connection.output.Append((const uint8*)payload[0].iov_base, (uint32)payload[0].iov_len)
+                || !connection.output.Append((const uint8*)payload[1].iov_base, (uint32)payload[1].iov_len)) break;
+            connection.packetsSent++;
+            connection.octetsSent += packetizer.getPayloadSize(i);
+        }
+        if (!flush(connection)) ::shutdown(connection.fd, SHUT_RDWR);
+        return;
+    }
+
+    // Over UDP, the packets are sent in batches
+    struct mmsghdr messages[BatchSize];
+    struct iovec vectors[BatchSize][3];
+    uint8 rtpHeaders[BatchSize][RTPPacketizer::RTPHeaderSize];
+    for (size_t first = 0; first < count;)
+    {
+        size_t batch = min(count - first, (size_t)BatchSize);
+        memset(messages, 0, batch * sizeof(messages[0]));
+        for (size_t i = 0; i < batch; i++)
+        {
+            packetizer.writeHeader(rtpHeaders[i], first + i + 1 == count, (uint16)(connection.rtpSequence + first + i), timestamp, connection.ssrc);
+            vectors[i][0].iov_base = rtpHeaders[i];
+            vectors[i][0].iov_len = RTPPacketizer::RTPHeaderSize;
+            packetizer.getPayload(first + i, vectors[i] + 1);
+            messages[i].msg_hdr.msg_name = &connection.rtpAddress;
+            messages[i].msg_hdr.msg_namelen = sizeof(connection.rtpAddress);
+            messages[i].msg_hdr.msg_iov = vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 3;
+        }
+        int sent = ::sendmmsg(rtpFd, messages, (unsigned)batch, 0);
+        if (sent < 0 && errno == EINTR) continue;
+        // A full send buffer drops the rest of the picture, the receiver sees the lost packets from the sequence numbers
+        if (sent <= 0) break;
+        for (int i = 0; i < sent; i++) connection.octetsSent += packetizer.getPayloadSize(first + i);
+        connection.packetsSent += (uint32)sent;
+        first += (size_t)sent;
+    }
+    connection.rtpSequence = (uint16)(connection.rtpSequence + count);
+}
+
+void RTSPServer::sendReport(Connection & connection, const double now, const bool bye)
+{
+    static const char cname[] = "mjpgserver";
+    uint8 packet[4 + 28 + 8 + 4 + sizeof(cname) + 4 + 8], * report = packet + 4;
+    // The sender report, with the wall clock time (NTP format) and the matching RTP time
+    double seconds = floor(now);
+    report[0] = 0x80; report[1] = 200;
+    writeBE16(report + 2, 6);
+    writeBE32(report + 4, connection.ssrc);
+    writeBE32(report + 8, (uint32)((uint64)seconds + 2208988800ULL));
+    writeBE32(report + 12, (uint32)((now - seconds) * 4294967296.0));
+    writeBE32(report + 16, connection.timestampBase + getRTPTime(now));
+    writeBE32(report + 20, connection.packetsSent);
+    writeBE32(report + 24, connection.octetsSent);
+    // The source description with the canonical name (required in each compound packet), padded to 32 bits
+    uint8 * sdes = report + 28;
+    size_t sdesSize = (4 + 4 + 2 + sizeof(cname) - 1 + 1 + 3) & ~(size_t)3;
+    memset(sdes, 0, sdesSize);
+    sdes[0] = 0x81; sdes[1] = 202;
+    writeBE16(sdes + 2, (uint16)(sdesSize / 4 - 1));
+    writeBE32(sdes + 4, connection.ssrc);
+    sdes[8] = 1; sdes[9] = (uint8)(sizeof(cname) - 1);
+    memcpy(sdes + 10, cname, sizeof(cname) - 1);
+    size_t size = 28 + sdesSize;
+    if (bye)
+    {
+        uint8 * goodbye = report + size;
+        goodbye[0] = 0x81; goodbye[1] = 203;
+        writeBE16(goodbye + 2, 1);
+        writeBE32(goodbye + 4, connection.ssrc);
+        size += 8;
+    }
+    connection.lastReport = now;
+    if (!connection.interleaved)
+    {
+        ::sendto(rtcpFd, report, size, MSG_DONTWAIT, (struct sockaddr*)&connection.rtcpAddress, sizeof(connection.rtcpAddress));
+        return;
+    }
+    // Not queued behind a picture if the connection is busy, the next report is soon anyway
+    if (connection.getPending()) return;
+    packet[0] = '$';
+    packet[1] = connection.rtcpChannel;
+    writeBE16(packet + 2, (uint16)size);
+    if (!connection.output.Append(packet, (uint32)(4 + size)) || !flush(connection)) ::shutdown(connection.fd, SHUT_RDWR);
+}
+
+void RTSPServer::receiveReports(const double now)
+{
+    uint8 buffer[1500];
+    while (true)
+    {
+        struct sockaddr_in from;
+        socklen_t len = sizeof(from);
+        ssize_t size = ::recvfrom(rtcpFd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr*)&from, &len);
+        if (size < 0) return;
+        for (size_t i = 0; i < connections.getSize(); i++)
+        {
+            Connection & connection = *connections.getElementAtUncheckedPosition(i);
+            if (connection.session && !connection.interleaved && connection.rtcpAddress.sin_addr.s_addr == from.sin_addr.s_addr && connection.rtcpAddress.sin_port == from.sin_port)
+                connection.lastSeen = now;
+        }
+    }
+}
+
+void RTSPServer::endSession(Connection & connection, const bool bye)
+{
+    if (!connection.session) return;
+    if (connection.playing)
+    {
+        if (bye) sendReport(connection, Time::getPreciseTime(), true);
+        connection.stream->source->stopViewer();
+        log(Info, "RTSP client %s stopped playing %s", (const char*)connection.address, (const char*)connection.stream->path);
+    }
+    connection.playing = false;
+    connection.session = "";
+    connection.stream = 0;
+}
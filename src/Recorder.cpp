@@ -0,0 +1,280 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/Recorder.hpp"
+// We need time functions too
+#include "Time/Time.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+
+static const char segmentMagic[8] = "MJPGSEG";
+
+String SegmentStore::open(const char * path, const char * namePrefix, const uint32 size, const unsigned segments)
+{
+    close();
+    if (size < MinSegmentSize) return String::Print("Segment size too small (at least %u bytes)", (unsigned)MinSegmentSize);
+    if (!segments) return "No segment";
+    if (::mkdir(path, 0755) != 0 && errno != EEXIST) return String::Print("Can't create the directory %s: %s", path, strerror(errno));
+    dir = path; prefix = namePrefix; segmentSize = size;
+
+    // Resume in the most recent segment, if any
+    unsigned last = 0; bool found = false;
+    for (unsigned i = 0; i < segments; i++)
+    {
+        int file = ::open(getSegmentPath(i), O_RDONLY | O_CLOEXEC);
+        if (file == -1) continue;
+        Header existing = {};
+        bool valid = ::pread(file, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) && !memcmp(existing.magic, segmentMagic, sizeof(segmentMagic))
+                  && existing.version == Version && existing.segmentSize == size;
+        ::close(file);
+        if (!valid || (found && existing.generation <= generation)) continue;
+        generation = existing.generation; last = i; found = true;
+    }
+    count = segments;
+    String error = mapSegment(last, !found);
+    if (error) { close(); return error; }
+    lastTimestamp = header->frameCount ? getIndex()[header->frameCount - 1].timestamp : 0;
+    return "";
+}
+
+String SegmentStore::mapSegment(const unsigned index, const bool reset)
+{
+    unmapSegment();
+    String path = getSegmentPath(index);
+    fd = ::open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) return String::Print("Can't open %s: %s", (const char*)path, strerror(errno));
+    struct stat st = {};
+    if (::fstat(fd, &st) != 0) return String::Print("Can't stat %s: %s", (const char*)path, strerror(errno));
+    bool empty = reset || st.st_size != (off_t)segmentSize;
+    if (st.st_size != (off_t)segmentSize)
+    {   // Allocate the whole segment now, so writing to the mapping never fails for a lack of space
+        if (st.st_size > (off_t)segmentSize && ::ftruncate(fd, segmentSize) != 0) return String::Print("Can't resize %s: %s", (const char*)path, strerror(errno));
+        int ret = ::posix_fallocate(fd, 0, segmentSize);
+        if (ret) return String::Print("Can't allocate %s: %s", (const char*)path, strerror(ret));
+    }
+    void * map = ::mmap(NULL, segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) return String::Print("Can't map %s: %s", (const char*)path, strerror(errno));
+    header = (Header*)map;
+    current = index;
+
+    // A resumed segment must be consistent, else it's started again
+    if (!empty && (memcmp(header->magic, segmentMagic, sizeof(segmentMagic)) || header->version != Version || header->segmentSize != segmentSize
+                   || header->dataOffset < HeaderSize + (uint64)header->indexCapacity * sizeof(IndexEntry) || header->frameCount > header->indexCapacity
+                   || header->dataUsed < header->dataOffset || header->dataUsed > segmentSize))
+        empty = true;
+    if (!empty) return "";
+
+    // The index is sized for the smallest expected pictures, and the pictures start on a page boundary
+    uint32 capacity = (segmentSize - HeaderSize) / (MinPictureSize + sizeof(IndexEntry));
+    header->frameCount = 0;
+    memcpy(header->magic, segmentMagic, sizeof(segmentMagic));
+    header->version = Version;
+    header->indexCapacity = capacity;
+    header->generation = ++generation;
+    header->dataOffset = (uint32)((HeaderSize + capacity * sizeof(IndexEntry) + HeaderSize - 1) / HeaderSize * HeaderSize);
+    header->segmentSize = segmentSize;
+    header->dataUsed = header->dataOffset;
+    return "";
+}
+
+void SegmentStore::unmapSegment()
+{
+    if (header) ::munmap(header, segmentSize);
+    header = 0;
+    if (fd != -1) ::close(fd);
+    fd = -1;
+}
+
+String SegmentStore::append(const uint8 * data, const size_t size, const uint64 timestamp)
+{
+    if (!header) return "Store not opened";
+    if (size > segmentSize - header->dataOffset) return String::Print("Picture too large for the segments (%u bytes)", (unsigned)size);
+    if (header->frameCount == header->indexCapacity || size > segmentSize - header->dataUsed)
+    {   // Start writing back the full segment, and recycle the next one
+        ::msync(header, segmentSize, MS_ASYNC);
+        String error = mapSegment((current + 1) % count, true);
+        if (error) { unmapSegment(); return error; }
+    }
+    memcpy((uint8*)header + header->dataUsed, data, size);
+    IndexEntry & entry = getIndex()[header->frameCount];
+    entry.offset = header->dataUsed;
+    entry.size = (uint32)size;
+    entry.timestamp = timestamp;
+    header->dataUsed += (uint32)size;
+    // The picture and its entry must be written before they are counted
+    __sync_synchronize();
+    header->frameCount++;
+    lastTimestamp = timestamp;
+    return "";
+}
+
+void SegmentStore::close()
+{
+    if (header) ::msync(header, segmentSize, MS_SYNC);
+    unmapSegment();
+    count = 0;
+    generation = lastTimestamp = 0;
+}
+
+bool SegmentStore::Cursor::seek(const SegmentStore & source, const uint64 from)
+{
+    unmap();
+    store = &source;
+    segments.Clear();
+    // List the segments with pictures, in generation order (so the oldest pictures come first)
+    for (unsigned i = 0; i < source.count; i++)
+    {
+        int file = ::open(source.getSegmentPath(i), O_RDONLY | O_CLOEXEC);
+        if (file == -1) continue;
+        Header existing = {};
+        IndexEntry first = {};
+        bool valid = ::pread(file, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) && !memcmp(existing.magic, segmentMagic, sizeof(segmentMagic))
+                  && existing.version == Version && existing.segmentSize == source.segmentSize && existing.frameCount
+                  && ::pread(file, &first, sizeof(first), HeaderSize) == (ssize_t)sizeof(first);
+        ::close(file);
+        if (!valid) continue;
+        Segment segment(i, existing.generation, first.timestamp);
+        size_t pos = segments.getSize();
+        while (pos && segments[pos - 1].generation > segment.generation) pos--;
+        segments.insertBefore(pos, segment);
+    }
+
+    // The pictures are in time order across the segments, so start in the last segment starting before the time
+    size_t start = 0;
+    for (size_t i = 1; i < segments.getSize(); i++) if (segments[i].first <= from) start = i;
+    if (!map(start)) return false;
+    if (position != start) return true;
+    // Then find the picture in the segment's index
+    const IndexEntry * entries = (const IndexEntry*)((const uint8*)header + HeaderSize);
+    uint32 low = 0, high = header->frameCount;
+    while (low < high)
+    {
+        uint32 middle = low + (high - low) / 2;
+        if (entries[middle].timestamp < from) low = middle + 1;
+        else high = middle;
+    }
+    index = low;
+    return true;
+}
+
+bool SegmentStore::Cursor::map(size_t from)
+{
+    for (position = from; position < segments.getSize(); position++)
+    {
+        unmap();
+        const Segment & segment = segments[position];
+        fd = ::open(store->getSegmentPath(segment.index), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) continue;
+        void * mapped = ::mmap(NULL, store->segmentSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapped == MAP_FAILED) continue;
+        header = (const Header*)mapped;
+        // It might have been recycled since it was listed
+        if (header->generation != segment.generation) continue;
+        generation = segment.generation;
+        index = 0;
+        return true;
+    }
+    unmap();
+    return false;
+}
+
+void SegmentStore::Cursor::unmap()
+{
+    if (header) ::munmap((void*)header, store->segmentSize);
+    header = 0;
+    if (fd != -1) ::close(fd);
+    fd = -1;
+}
+
+bool SegmentStore::Cursor::next(uint32 & pictureSize, uint64 & timestamp)
+{
+    while (header)
+    {
+        uint32 count = header->frameCount;
+        // The pictures are counted once they are written
+        __sync_synchronize();
+        bool recycled = header->generation != generation;
+        if (!recycled && index < count)
+        {
+            const IndexEntry & entry = ((const IndexEntry*)((const uint8*)header + HeaderSize))[index++];
+            if (entry.offset < header->dataOffset || (uint64)entry.offset + entry.size > store->segmentSize) continue;
+            offset = entry.offset; size = entry.size;
+            pictureSize = size; timestamp = entry.timestamp;
+            return true;
+        }
+        // The newest segment might still get pictures
+        if (position + 1 >= segments.getSize()) return false;
+        // Else, this segment is done (or it was recycled while reading it), so continue with the next one
+        if (!map(position + 1)) return false;
+    }
+    return false;
+}
+
+bool SegmentStore::Cursor::sendTo(const int socket) const
+{
+    off_t from = offset;
+    size_t remaining = size;
+    while (remaining)
+    {
+        ssize_t ret = ::sendfile(socket, fd, &from, remaining);
+        if (ret > 0) { remaining -= (size_t)ret; continue; }
+        if (ret == 0 || (errno != EAGAIN && errno != EINTR)) return false;
+        // A non blocking socket, so wait for it to accept more data
+        struct pollfd fds = { socket, POLLOUT, 0 };
+        if (errno == EAGAIN && ::poll(&fds, 1, SendTimeoutMs) <= 0) return false;
+    }
+    return true;
+}
+
+String Recorder::open(const char * dir, const char * prefix, const uint32 segmentSize, const unsigned segmentCount, const unsigned intervalSec)
+{
+    Threading::ScopedLock scope(lock);
+    interval = intervalSec;
+    // The first picture is recorded as soon as possible
+    nextTime = 0;
+    triggered = false;
+    return store.open(dir, prefix, segmentSize, segmentCount);
+}
+
+bool Recorder::record(const uint8 * data, const size_t len, const uint64 timestamp)
+{
+    Threading::ScopedLock scope(lock);
+    if (!store.isOpened() || timestamp <= store.getLastTimestamp()) return false;
+    String error = store.append(data, len, timestamp);
+    if (error) { log(Error, "Can't record the picture: %s", (const char*)error); ++recordErrors; return false; }
+    ++framesRecorded;
+    return true;
+}
+
+void Recorder::skip(const double now)
+{
+    Threading::ScopedLock scope(lock);
+    ++recordErrors;
+    schedule(now);
+}
+
+void Recorder::schedule(const double now)
+{
+    triggered = false;
+    // Keep the schedule's pace, unless it's late by more than an interval
+    nextTime = nextTime && now - nextTime < interval ? nextTime + interval : now + interval;
+}
+
+bool Recorder::pictureReceived(const uint8 * data, const size_t len, const double age)
+{
+    double now = Time::getPreciseTime();
+    Threading::ScopedLock scope(lock);
+    if (!store.isOpened() || !isScheduled(now)) return true;
+    String error = store.append(data, len, (uint64)((now - age) * 1000000));
+    if (error) { log(Error, "Can't record the picture: %s", (const char*)error); ++recordErrors; }
+    else ++framesRecorded;
+    schedule(now);
+    return true;
+}
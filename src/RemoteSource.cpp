@@ -0,0 +1,280 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/RemoteSource.hpp"
+// We need URL parsing here
+#include "Network/Address.hpp"
+// We need time functions too
+#include "Time/Time.hpp"
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <poll.h>
+
+uint8 * MultipartParser::getReceiveBuffer(const uint32 size)
+{
+    if (!buffer.ensureSize(used + size, true)) return 0;
+    return buffer.getBuffer() + used;
+}
+
+int64 MultipartParser::find(const char * pattern, const uint32 length)
+{
+    uint32 from = max(scanned, start);
+    const uint8 * data = buffer.getConstBuffer();
+    const uint8 * found = used > from ? (const uint8*)memmem(data + from, used - from, pattern, length) : 0;
+    if (found) { scanned = (uint32)(found - data) + length; return found - data; }
+    // The pattern might be split, so the next search starts where it could start
+    scanned = used >= length ? max(from, used - length + 1) : from;
+    return -1;
+}
+
+bool MultipartParser::parseAnswerHeader(const String & header)
+{
+    String status = header.upToFirst("\r\n");
+    if (status.Find(" 200") == -1) { fail("Unexpected answer: " + status); return false; }
+    int pos = header.caselessFind("Content-Type:");
+    String type = pos != -1 ? header.midString(pos + 13, header.getLength()).upToFirst("\r\n") : String();
+    pos = type.caselessFind("boundary=");
+    if (type.caselessFind("multipart") == -1 || pos == -1) { fail("Not a multipart stream: " + type.Trimmed()); return false; }
+    String boundary = type.midString(pos + 9, type.getLength()).upToFirst(";").Trimmed(" \t\"");
+    if (!boundary) { fail("Empty boundary"); return false; }
+    delimiter = "\r\n--" + boundary;
+    return true;
+}
+
+String MultipartParser::getSingleAnswer(Utils::MemoryBlock & content) const
+{
+    const uint8 * data = buffer.getConstBuffer();
+    const uint8 * end = used ? (const uint8*)memmem(data, used, "\r\n\r\n", 4) : 0;
+    if (!end) return "Incomplete answer";
+    String header((const void*)data, (int)(end - data));
+    String status = header.upToFirst("\r\n");
+    if (status.Find(" 200") == -1) return "Unexpected answer: " + status;
+    uint32 offset = (uint32)(end - data) + 4, size = used - offset;
+    int pos = header.caselessFind("Content-Length:");
+    if (pos != -1)
+    {
+        int64 length = header.midString(pos + 15, header.getLength()).Trimmed().parseInt(10);
+        if (length < 0 || length > size) return "Truncated answer";
+        size = (uint32)length;
+    }
+    if (!content.setSize(size)) return "Out of memory";
+    memcpy(content.getBuffer(), data + offset, size);
+    return "";
+}
+
+int MultipartParser::nextPart(const uint8 * & data, size_t & size)
+{
+    while (true)
+    {
+        const uint8 * buf = buffer.getConstBuffer();
+        if (state == PartContent)
+        {
+            uint32 end = start + partSize;
+            if (!partSize)
+            {   // No length given, so the part ends at the next delimiter (which starts the next part's header)
+                int64 pos = find(delimiter, delimiter.getLength());
+                if (pos < 0) { if (used - start > MaxPartSize) return fail("Part too large"); break; }
+                end = (uint32)pos;
+            }
+            else if (used < end) break;
+            data = buf + start; size = end - start;
+            start = scanned = end;
+            partSize = 0;
+            state = PartHeader;
+            return 1;
+        }
+
+        // Skip the line ending after the previous part's content
+        if (state == PartHeader) while (start < used && (buf[start] == '\r' || buf[start] == '\n')) start++;
+        int64 pos = find("\r\n\r\n", 4);
+        if (pos < 0) { if (used - start > MaxHeaderSize) return fail("Header too large"); break; }
+        String header((const void*)(buf + start), (int)(pos - start));
+        start = scanned = (uint32)pos + 4;
+        if (state == AnswerHeader)
+        {
+            if (!parseAnswerHeader(header)) return -1;
+            state = PartHeader;
+            continue;
+        }
+        // The part header starts with the boundary
+        pos = header.caselessFind("Content-Length:");
+        int64 length = pos != -1 ? header.midString((int)pos + 15, header.getLength()).Trimmed().parseInt(10) : 0;
+        if (length < 0 || length > MaxPartSize) return fail(String::Print("Bad part length: " PF_LLD, length));
+        partSize = (uint32)length;
+        state = PartContent;
+    }
+
+    // More data is needed, so only keep the data that's not parsed yet
+    if (start)
+    {
+        memmove(buffer.getBuffer(), buffer.getConstBuffer() + start, used - start);
+        used -= start;
+        scanned = scanned > start ? scanned - start : 0;
+        start = 0;
+        buffer.stripTo(used);
+    }
+    return 0;
+}
+
+String RemoteSource::Connection::connect(const RemoteURL & url)
+{
+    close();
+    struct addrinfo hints = {}, * addresses = 0;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(url.host, String::Print("%hu", url.port), &hints, &addresses) != 0 || !addresses) return "Can't resolve " + url.host;
+
+    String error = "Can't connect";
+    for (struct addrinfo * address = addresses; address && fd == -1; address = address->ai_next)
+    {
+        fd = ::socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+        if (fd == -1) continue;
+        if (::connect(fd, address->ai_addr, address->ai_addrlen) == 0) break;
+        int result = errno;
+        if (result == EINPROGRESS)
+        {   // Wait for the connection to complete
+            struct pollfd fds = { fd, POLLOUT, 0 };
+            socklen_t len = sizeof(result);
+            if (::poll(&fds, 1, ConnectTimeoutMs) <= 0) result = ETIMEDOUT;
+            else if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &result, &len) != 0) result = errno;
+        }
+        if (result) { error = strerror(result); close(); }
+    }
+    freeaddrinfo(addresses);
+    if (fd == -1) return error;
+
+    // HTTP/1.0, so the stream is not chunked
+    String request = String::Print("GET %s HTTP/1.0\r\nHost: %s:%hu\r\nUser-Agent: MJPGServer\r\n\r\n", (const char*)url.path, (const char*)url.host, url.port);
+    if (::send(fd, (const char*)request, request.getLength(), MSG_NOSIGNAL) != request.getLength()) { close(); return "Can't send the request"; }
+    parser.reset();
+    return "";
+}
+
+int RemoteSource::Connection::receive(const int wakeFd, const int timeoutMs)
+{
+    struct pollfd fds[2] = { { fd, POLLIN, 0 }, { wakeFd, POLLIN, 0 } };
+    int ret = ::poll(fds, wakeFd != -1 ? 2 : 1, timeoutMs);
+    if (ret < 0) return errno == EINTR ? 0 : -1;
+    int ready = 0;
+    if (fds[1].revents & POLLIN)
+    {
+        eventfd_t value;
+        eventfd_read(wakeFd, &value);
+        ready |= WokenUp;
+    }
+    if (!(fds[0].revents & (POLLIN | POLLERR | POLLHUP))) return ready;
+
+    uint8 * buffer = parser.getReceiveBuffer(ReceiveSize);
+    if (!buffer) return -1;
+    ssize_t received = ::recv(fd, buffer, ReceiveSize, 0);
+    if (received < 0 && (errno == EAGAIN || errno == EINTR)) return ready;
+    if (received <= 0) return -1;
+    parser.received((uint32)received);
+    return ready | DataReceived;
+}
+
+void RemoteSource::Connection::close()
+{
+    if (fd != -1) ::close(fd);
+    fd = -1;
+}
+
+String RemoteURL::parse(const char * url)
+{
+    clear();
+    Network::Address::URL address(url);
+    if (address.getScheme() == "udp")
+    {   // A multicast group, the address is checked when joining it
+        uint16 value = address.stripPortFromAuthority(0);
+        if (!address.getAuthority() || !value) return String::Print("Bad multicast URL (expecting udp://group:port): %s", url);
+        host = address.getAuthority();
+        port = value;
+        multicast = true;
+        return "";
+    }
+    if (address.getScheme() != "http") return String::Print("Only http and udp URLs are supported: %s", url);
+    uint16 value = address.stripPortFromAuthority(80);
+    if (!address.getAuthority()) return String::Print("Bad URL: %s", url);
+    host = address.getAuthority();
+    port = value;
+    path = address.getPath() ? address.getPath() : String("/");
+    if (address.getQuery()) path += "?" + address.getQuery();
+    return "";
+}
+
+String RemoteSource::open(const char * url, const unsigned fps, const char * fullResURL)
+{
+    close();
+    String error = stream.parse(url);
+    if (!error && fullResURL && *fullResURL) error = fullRes.parse(fullResURL);
+    if (error) { close(); return error; }
+    minFrameDuration = fps ? 1.0 / fps : 0.0;
+    return "";
+}
+
+String RemoteSource::fetchPicture(Utils::MemoryBlock & pic, const unsigned timeoutMs)
+{
+    if (stream.multicast)
+    {   // Join the group until a complete picture is received
+        MulticastReceiver receiver;
+        String error = receiver.open(stream.getGroup());
+        if (error) return error;
+        double deadline = Time::getPreciseTime() + timeoutMs / 1000.0;
+        while (true)
+        {
+            const uint8 * data = 0; size_t size = 0;
+            if (receiver.nextFrame(data, size))
+            {
+                if (!pic.setSize((uint32)size)) return "Out of memory";
+                memcpy(pic.getBuffer(), data, size);
+                return "";
+            }
+            double remaining = deadline - Time::getPreciseTime();
+            if (remaining <= 0) return "No picture received in time";
+            if (receiver.receive(-1, (int)(remaining * 1000) + 1) < 0) return "Can't receive from the multicast group";
+        }
+    }
+    Connection connection;
+    String error = connection.connect(stream);
+    if (error) return error;
+    double deadline = Time::getPreciseTime() + timeoutMs / 1000.0;
+    while (true)
+    {
+        const uint8 * data = 0; size_t size = 0;
+        int ret = connection.parser.nextPart(data, size);
+        if (ret < 0) return connection.parser.getError();
+        if (ret > 0)
+        {
+            if (!pic.setSize((uint32)size)) return "Out of memory";
+            memcpy(pic.getBuffer(), data, size);
+            return "";
+        }
+        double remaining = deadline - Time::getPreciseTime();
+        if (remaining <= 0) return "No picture received in time";
+        if (connection.receive(-1, (int)(remaining * 1000) + 1) < 0) return "Disconnected";
+    }
+}
+
+String RemoteSource::fetchFullResPicture(Utils::MemoryBlock & pic)
+{
+    Connection connection;
+    String error = connection.connect(fullRes);
+    if (error) return error;
+    // The answer ends when the remote server closes the connection (it's a HTTP/1.0 request)
+    double deadline = Time::getPreciseTime() + FullResTimeoutMs / 1000.0;
+    int ret = 0;
+    while (ret >= 0)
+    {
+        double remaining = deadline - Time::getPreciseTime();
+        if (remaining <= 0) return "No picture received in time";
+        ret = connection.receive(-1, (int)(remaining * 1000) + 1);
+    }
+    error = connection.parser.getSingleAnswer(pic);
+    if (!error && (pic.getSize() < 2 || pic.getConstBuffer()[0] != 0xFF || pic.getConstBuffer()[1] != 0xD8)) return "Not a JPEG picture";
+    return error;
+}
@@ -0,0 +1,92 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/SharedOutput.hpp"
+
+#include <errno.h>
+
+String SharedFrameRing::open(const char * name, const unsigned slots, const uint32 slotSize)
+{
+    close();
+    if (slots < MinSlots || slots > MaxSlots) return String::Print("Invalid slot count %u (from %u to %u)", slots, (unsigned)MinSlots, (unsigned)MaxSlots);
+    uint32 pageSize = (uint32)sysconf(_SC_PAGESIZE);
+    uint32 size = (max(slotSize, (uint32)MinSlotSize) + pageSize - 1) / pageSize * pageSize;
+    uint64 mapSize = MJPGSRV_SHM_HEADER_SIZE + (uint64)size * slots;
+    if (mapSize > 0xFFFFFFFFULL) return "Shared memory too large";
+
+    // A previous object is removed, so its consumers (if any) keep their mapping and don't see this one
+    String objectPath = String("/") + name;
+    ::shm_unlink(objectPath);
+    int fd = ::shm_open(objectPath, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd == -1) return String::Print("Can't create the shared memory %s: %s", (const char*)objectPath, strerror(errno));
+    // Allocate the whole object now, so writing to the mapping never fails for a lack of memory
+    int ret = ::posix_fallocate(fd, 0, (off_t)mapSize);
+    if (ret) { ::close(fd); ::shm_unlink(objectPath); return String::Print("Can't allocate the shared memory %s: %s", (const char*)objectPath, strerror(ret)); }
+    void * map = ::mmap(NULL, (size_t)mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) { ::shm_unlink(objectPath); return String::Print("Can't map the shared memory %s: %s", (const char*)objectPath, strerror(errno)); }
+
+    mjpgsrv_shm_header * ring = (mjpgsrv_shm_header *)map;
+    memset(ring, 0, sizeof(*ring));
+    ring->version = MJPGSRV_SHM_VERSION;
+    ring->slot_count = slots;
+    ring->slot_size = size;
+    ring->map_size = (uint32)mapSize;
+    ring->latest = slots;
+    ring->pid = (uint32)getpid();
+    for (unsigned i = 0; i < slots; i++) ring->slots[i].offset = MJPGSRV_SHM_HEADER_SIZE + i * size;
+    // The magic is written last, so a consumer only accepts a complete header
+    __atomic_store_n(&ring->magic, (uint32)MJPGSRV_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    Threading::ScopedLock scope(lock);
+    header = ring; path = objectPath; next = 0;
+    return "";
+}
+
+bool SharedFrameRing::publish(const uint8 * data, const size_t size, const uint64 sequence, const uint64 timestamp)
+{
+    Threading::ScopedLock scope(lock);
+    if (!header) return false;
+    if (size > header->slot_size) { header->skipped++; return false; }
+
+    // Find a slot no one reads, starting after the last written one (so it's likely the oldest), the latest one is kept for the consumers
+    uint32 count = header->slot_count, slot = count;
+    for (uint32 i = 0; i < count && slot == count; i++)
+    {
+        uint32 candidate = (next + i) % count, expected = 0;
+        if (candidate == header->latest) continue;
+        if (__atomic_compare_exchange_n(&header->slots[candidate].readers, &expected, (uint32)MJPGSRV_SHM_WRITING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            slot = candidate;
+    }
+    if (slot == count) { header->skipped++; return false; }
+
+    mjpgsrv_shm_slot & entry = header->slots[slot];
+    memcpy((uint8*)header + entry.offset, data, size);
+    entry.size = (uint32)size;
+    entry.sequence = sequence;
+    entry.timestamp = timestamp;
+    // The consumers that tried to read it while it was written have counted themselves and will uncount themselves
+    __atomic_fetch_sub(&entry.readers, (uint32)MJPGSRV_SHM_WRITING, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->latest, slot, __ATOMIC_RELEASE);
+    next = (slot + 1) % count;
+
+    // The futex word is written before checking for the waiters, and the waiters count themselves before checking it
+    __atomic_store_n(&header->futex, (uint32)sequence, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST)) syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    return true;
+}
+
+void SharedFrameRing::close()
+{
+    Threading::ScopedLock scope(lock);
+    if (!header) return;
+    // Tell the consumers the ring is dead, and wake them so they notice it
+    __atomic_store_n(&header->magic, 0U, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&header->futex, 1U, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    ::munmap(header, header->map_size);
+    ::shm_unlink(path);
+    header = 0;
+}
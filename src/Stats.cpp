@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/Stats.hpp"
+
+#include <stdio.h>
+#include <malloc.h>
+
+const double LatencyHistogram::bounds[BucketCount - 1] = { 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000 };
+
+void LatencyHistogram::record(const double latency)
+{
+    double ms = latency * 1000;
+    if (ms < 0) ms = 0;
+    size_t i = 0;
+    while (i < BucketCount - 1 && ms > bounds[i]) i++;
+    ++buckets[i];
+
+    uint64 us = (uint64)(ms * 1000);
+    totalUs += us;
+    // Each histogram is only recorded by a single thread, so there is no race on the maximum here
+    if (us > maxUs.read()) maxUs.save(us);
+}
+
+uint32 LatencyHistogram::getCount() const
+{
+    uint32 count = 0;
+    for (size_t i = 0; i < BucketCount; i++) count += buckets[i].read();
+    return count;
+}
+
+double LatencyHistogram::getMean() const
+{
+    uint32 count = getCount();
+    return count ? totalUs.read() / 1000.0 / count : 0;
+}
+
+double LatencyHistogram::getPercentile(const double percentile) const
+{
+    uint32 count = getCount();
+    if (!count) return 0;
+    // The rank of the percentile, then find the bucket containing it
+    uint32 rank = (uint32)(percentile * count / 100), seen = 0;
+    for (size_t i = 0; i < BucketCount - 1; i++)
+    {
+        uint32 inBucket = buckets[i].read();
+        if (seen + inBucket > rank)
+        {   // Assume the latencies are evenly spread in the bucket
+            double lower = i ? bounds[i - 1] : 0;
+            return min(lower + (bounds[i] - lower) * (rank - seen + 1) / inBucket, getMax());
+        }
+        seen += inBucket;
+    }
+    return getMax();
+}
+
+Strings::FastString LatencyHistogram::toJSON() const
+{
+    return Strings::FastString::Print("{\"count\":%u,\"mean\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}",
+                                      getCount(), getMean(), getPercentile(50), getPercentile(90), getPercentile(99), getMax());
+}
+
+Strings::FastString LatencyHistogram::toPrometheus(const char * name, const Strings::FastString & labels) const
+{
+    Strings::FastString out, sep = labels ? "," : "";
+    // Prometheus' buckets are cumulative
+    uint32 count = 0;
+    for (size_t i = 0; i < BucketCount - 1; i++)
+    {
+        count += buckets[i].read();
+        out += Strings::FastString::Print("%s_bucket{%s%sle=\"%g\"} %u\n", name, (const char*)labels, (const char*)sep, bounds[i] / 1000, count);
+    }
+    count += buckets[BucketCount - 1].read();
+    out += Strings::FastString::Print("%s_bucket{%s%sle=\"+Inf\"} %u\n", name, (const char*)labels, (const char*)sep, count);
+    out += Strings::FastString::Print("%s_sum{%s} %.6f\n", name, (const char*)labels, totalUs.read() / 1e6);
+    out += Strings::FastString::Print("%s_count{%s} %u\n", name, (const char*)labels, count);
+    return out;
+}
+
+Strings::FastString FrameLatency::toJSON() const
+{
+    return "{\"capture\":" + capture.toJSON() + ",\"firstByte\":" + firstByte.toJSON() + ",\"lastByte\":" + lastByte.toJSON() + "}";
+}
+
+#if (WantTimedProfiling==1)
+// The probes are numbered like the library's ones
+typedef char CheckProbes[(int)Profiler::FetchFrame == (int)Time::ScopedProbe::FirstApplicationProbe ? 1 : -1];
+
+static LatencyHistogram probes[Profiler::ProbeCount];
+static void recordProbe(const int probe, const double duration) { if (probe >= 0 && probe < Profiler::ProbeCount) probes[probe].record(duration * 1000); }
+
+bool Profiler::start() { Time::ScopedProbe::sink = &recordProbe; return true; }
+bool Profiler::isStarted() { return Time::ScopedProbe::sink != 0; }
+#else
+bool Profiler::start() { return false; }
+bool Profiler::isStarted() { return false; }
+#endif
+
+Strings::FastString Profiler::toJSON()
+{
+    static const char * names[ProbeCount] = { "parseRequest", "sendPendingData", "fetchFrame", "parseJPEG", "switchRes", "pictureReceived" };
+    Strings::FastString out;
+#if (WantTimedProfiling==1)
+    for (int i = 0; i < ProbeCount; i++) out += Strings::FastString::Print("%s\"%s\":%s", i ? "," : "", names[i], (const char*)probes[i].toJSON());
+#else
+    (void)names;
+#endif
+    return "{" + out + "}";
+}
+
+bool ProcessMemory::read()
+{
+    FILE * f = fopen("/proc/self/status", "r");
+    if (!f) return false;
+    char line[128]; unsigned long long value = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "VmRSS: %llu kB", &value) == 1) rss = value * 1024;
+        else if (sscanf(line, "VmHWM: %llu kB", &value) == 1) rssPeak = value * 1024;
+    }
+    fclose(f);
+
+#ifdef __GLIBC__
+  #if (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 info = mallinfo2();
+  #else
+    // The older structure's counters are 32 bits, so they wrap above 4GB (unlikely on the boards this runs on)
+    struct mallinfo info = mallinfo();
+  #endif
+    heapMapped = (uint64)info.hblkhd;
+    heapUsed = (uint64)info.uordblks + heapMapped;
+    heapFree = (uint64)info.fordblks;
+#endif
+    // The peak is only known from the previous reads, a race between two readers only loses a peak that's read again next time
+    static Threading::Atomic<uint64> peak;
+    if (heapUsed > peak.read()) peak.save(heapUsed);
+    heapPeak = peak.read();
+    return true;
+}
+
+Strings::FastString ProcessMemory::toJSON() const
+{
+    return Strings::FastString::Print("{\"rss\":" PF_LLU ",\"rssPeak\":" PF_LLU ",\"heapUsed\":" PF_LLU ",\"heapPeak\":" PF_LLU ",\"heapFree\":" PF_LLU ",\"heapMapped\":" PF_LLU "}",
+                                      rss, rssPeak, heapUsed, heapPeak, heapFree, heapMapped);
+}
@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/TLS.hpp"
+
+#if (WantTLS == 1)
+  #include <openssl/ssl.h>
+  #include <openssl/err.h>
+#endif
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#ifndef TCP_ULP
+  #define TCP_ULP 31
+#endif
+
+// Check if the kernel accepts the TLS upper layer protocol (it needs a connected socket, so a loopback connection is made)
+static bool isKernelTLSAvailable()
+{
+    int server = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), client = -1, accepted = -1;
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    bool available = false;
+    if (server >= 0 && !bind(server, (struct sockaddr*)&addr, sizeof(addr)) && !listen(server, 1) && !getsockname(server, (struct sockaddr*)&addr, &len)
+        && (client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) >= 0 && !connect(client, (struct sockaddr*)&addr, sizeof(addr))
+        && (accepted = ::accept(server, 0, 0)) >= 0)
+        available = setsockopt(accepted, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0;
+    if (accepted >= 0) close(accepted);
+    if (client >= 0) close(client);
+    if (server >= 0) close(server);
+    return available;
+}
+
+#if (WantTLS == 1)
+// Get the last OpenSSL error (or the system error) as a message
+static String getSSLError(const char * what)
+{
+    unsigned long code = ERR_get_error();
+    char buffer[256] = {};
+    if (code) ERR_error_string_n(code, buffer, sizeof(buffer));
+    ERR_clear_error();
+    return String::Print("%s: %s", what, code ? buffer : strerror(errno));
+}
+#endif
+
+String TLSServer::init(const String & certificate, const String & key)
+{
+#if (WantTLS == 1)
+    if (!isKernelTLSAvailable()) return "The kernel TLS module is not available (try modprobe tls)";
+    SSL_CTX * ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx) return getSSLError("Can't create the TLS context");
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  #if OPENSSL_VERSION_NUMBER < 0x30200000L
+    // The kernel's receive path is only used for TLS 1.2 before OpenSSL 3.2
+    SSL_CTX_set_max_proto_version(ctx, TLS1_2_VERSION);
+  #endif
+    // Only the ciphers the kernel implements, and no session resumption (the streams connections are long lived)
+    SSL_CTX_set_cipher_list(ctx, "ECDHE+AESGCM:ECDHE+CHACHA20");
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_NO_COMPRESSION | SSL_OP_NO_TICKET);
+    SSL_CTX_set_num_tickets(ctx, 0);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    if (SSL_CTX_use_certificate_chain_file(ctx, certificate) != 1)
+    {
+        String error = getSSLError("Can't load the TLS certificate " + certificate);
+        SSL_CTX_free(ctx);
+        return error;
+    }
+    if (SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1)
+    {
+        String error = getSSLError("Can't load the TLS private key " + key);
+        SSL_CTX_free(ctx);
+        return error;
+    }
+    context = ctx;
+    return "";
+#else
+    (void)certificate; (void)key; (void)isKernelTLSAvailable;
+    return "The TLS support is not built in (build with make TLS=1)";
+#endif
+}
+
+TLSServer::Progress TLSServer::handshake(void *& session, const int fd, String & error)
+{
+#if (WantTLS == 1)
+    SSL * ssl = (SSL*)session;
+    if (!ssl)
+    {
+        ssl = SSL_new((SSL_CTX*)context);
+        if (!ssl || SSL_set_fd(ssl, fd) != 1)
+        {
+            error = getSSLError("Can't create the TLS session");
+            if (ssl) SSL_free(ssl);
+            return Failed;
+        }
+        session = ssl;
+    }
+    int ret = SSL_accept(ssl);
+    if (ret != 1)
+    {
+        int code = SSL_get_error(ssl, ret);
+        if (code == SSL_ERROR_WANT_READ) return WantRead;
+        if (code == SSL_ERROR_WANT_WRITE) return WantWrite;
+        error = getSSLError("TLS handshake failed");
+    }
+    // The socket is used as a plain socket from now on, so the kernel must handle both directions, and nothing must be left in OpenSSL's buffers
+    else if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) || !BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+        error = String::Print("The kernel can't handle the negotiated cipher (%s)", SSL_get_cipher_name(ssl));
+    else if (SSL_has_pending(ssl)) error = "Data received during the TLS handshake";
+    abortHandshake(session);
+    return error ? Failed : Done;
+#else
+    (void)session; (void)fd;
+    error = "The TLS support is not built in";
+    return Failed;
+#endif
+}
+
+void TLSServer::abortHandshake(void *& session)
+{
+#if (WantTLS == 1)
+    // This does not close the socket, nor send anything
+    if (session) SSL_free((SSL*)session);
+#endif
+    session = 0;
+}
+
+TLSServer::~TLSServer()
+{
+#if (WantTLS == 1)
+    if (context) SSL_CTX_free((SSL_CTX*)context);
+#endif
+    context = 0;
+}
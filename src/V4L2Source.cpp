@@ -5,50 +5,71 @@
 // We need our declaration
 #include "../include/V4L2Source.hpp"
 #include "Time/Time.hpp"
+// We need files for the fake source
+#include "File/File.hpp"
+// We need the JPEG header parser too
+#include "../include/JPEG.hpp"
+// We need the H.264 access units checks too
+#include "../include/H264.hpp"
 
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <linux/usbdevice_fs.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
 
 #define Zero(X) memset(&X, 0, sizeof(X))
 #define DQBUFTimeoutMs 5000
 
-bool V4L2Thread::Context::setBlockingState(bool blocking)
+// Find the picture size from the JPEG start of frame marker
+
+int V4L2Thread::Context::waitForDevice(const int timeoutMs, const bool wakeable)
 {
-    int socketFlags = fcntl((int)fd, F_GETFL, 0);
-    if (socketFlags == -1) return false;
-    if (fcntl((int)fd, F_SETFL, (socketFlags & ~O_NONBLOCK) | (blocking ? O_NONBLOCK : 0)) != 0) return false;
-    return true;
+    struct pollfd fds[2] = { { (int)fd, POLLIN | POLLPRI, 0 }, { wakeFd, POLLIN, 0 } };
+    int ret = ::poll(fds, wakeable && wakeFd != -1 ? 2 : 1, timeoutMs);
+    if (ret < 0) return errno == EINTR ? 0 : -1;
+    int ready = 0;
+    // An error is reported as a frame, so dequeuing it will report the actual error (like a disconnection)
+    if (fds[0].revents & (POLLIN | POLLERR | POLLHUP | POLLNVAL)) ready |= FrameReady;
+    if (fds[0].revents & POLLPRI) ready |= EventReady;
+    if (fds[1].revents & POLLIN) {
+        eventfd_t value;
+        eventfd_read(wakeFd, &value);
+        ready |= WokenUp;
+    }
+    return ready;
 }
 
+void V4L2Thread::Context::wakeUp()
+{
+    if (wakeFd != -1) eventfd_write(wakeFd, 1);
+}
 
 int V4L2Thread::Context::ioctl(int method, void *arg, const bool throwOnDisconnect, const bool interruptible) 
 {
     if (interruptible) {
-        if (!setBlockingState(false)) {
-            state = Disconnected;
-            if (throwOnDisconnect) throw DisconnectedError();
-            return -1;
-        }
-
-        // Wait for DQBUF availability
-        if (!fd.isReadPossible(DQBUFTimeoutMs)) return -1;
-
-        if (!setBlockingState(true)) {
-            state = Disconnected;
-            if (throwOnDisconnect) throw DisconnectedError();
-            return -1;
-        }
-        
+        // The device is opened in non blocking mode, so only wait if there's nothing to dequeue yet
         int ret = ::ioctl((int)fd, method, arg);
         if (!ret) return 0;
+        if (errno == EAGAIN) {
+            if (waitForDevice(DQBUFTimeoutMs, false) <= 0) return -1;
+            ret = ::ioctl((int)fd, method, arg);
+            if (!ret) return 0;
+        }
     } else {
         for (int tries = IOCTLRetry; tries; tries--) {
             int ret = ::ioctl((int)fd, method, arg);
             if (!ret) return 0;
             if (errno != EINTR && errno != EAGAIN && errno != ETIMEDOUT) break;
+            if (counters && tries > 1) ++counters->ioctlRetries;
         }
     }
 
+    if (counters) ++counters->ioctlFailures;
     log(Error, "Failure in IOCTL(%08X): %d:%s", method, errno, strerror(errno));
     if (errno == ENODEV) { 
         state = Disconnected;
@@ -57,52 +78,49 @@ int V4L2Thread::Context::ioctl(int method, void *arg, const bool throwOnDisconne
     return -1;
 }
 
-String V4L2Thread::Context::openDevice(const char * path, int preferredVideoWidth, int preferredVideoHeight, int picWidth, int picHeight, unsigned stabPicCount, double minFrameDurationInS)
+String V4L2Thread::Context::openNode(const char * path)
 {
-    fd.Mutate(::open(path, O_RDWR));
+    fd.Mutate(::open(path, O_RDWR | O_NONBLOCK));
+    nodeOpened = fd != -1;
+    return nodeOpened ? String() : String::Print("Can't open: %s", path);
+}
+
+String V4L2Thread::Context::openDevice(const char * path, int preferredVideoWidth, int preferredVideoHeight, int picWidth, int picHeight, unsigned stabPicCount, double minFrameDurationInS, unsigned lowResBufferCount, unsigned highResBufferCount)
+{
+    // Non blocking, since the capture thread waits for the device with poll (and can be woken up while waiting), unless it's already opened
+    if (!nodeOpened) fd.Mutate(::open(path, O_RDWR | O_NONBLOCK));
+    nodeOpened = false;
     if (fd == -1) return String::Print("Can't open: %s", path);
 
     Zero(caps);
     int ret = ioctl(VIDIOC_QUERYCAP, &caps, false);
     if(ret < 0) return "Can't fetch video device capabilities";
-    if(!(caps.capabilities & V4L2_CAP_VIDEO_CAPTURE)) return "Device is not a video capture";
-    supportsStream = caps.capabilities & V4L2_CAP_STREAMING;
-    if (!supportsStream && !(caps.capabilities & V4L2_CAP_READWRITE)) return "Device does not support streaming or read/write mode";
-
-    // Enumerate all formats supported by the device
-    struct v4l2_fmtdesc fmtdesc = {0};
-    fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    bool compatible = false;
-    while (::ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0)
-    {   
-        if (fmtdesc.pixelformat == V4L2_PIX_FMT_MJPEG || fmtdesc.pixelformat == V4L2_PIX_FMT_JPEG) { compatible = true; break; }
-        fmtdesc.index++;
+    // The capabilities of this node, not the whole device's
+    uint32 capabilities = caps.capabilities & V4L2_CAP_DEVICE_CAPS ? caps.device_caps : caps.capabilities;
+    if (capabilities & V4L2_CAP_VIDEO_CAPTURE) bufferType = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    else if (capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE) bufferType = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    else return "Device is not a video capture";
+    supportsStream = capabilities & V4L2_CAP_STREAMING;
+    if (!supportsStream && !(capabilities & V4L2_CAP_READWRITE)) return "Device does not support streaming or read/write mode";
+    if (isMultiPlanar()) log(Info, "Device is multi-planar");
+
+    // Enumerate all formats supported by the device, unless they are already known
+    DeviceFormats formats;
+    bool cached = FormatCache::find(FormatCache::getKey(caps), formats);
+    if (cached) log(Debug, "Using the cached formats for %s", (const char*)formats.key);
+    else {
+        String error = enumerateFormats(formats);
+        if (error) return error;
+        FormatCache::store(formats);
     }
-    if (!compatible) return "This device does not support MJPEG or JPEG pixel format";
 
     // Then find out the largest frame size supported for this format
-    struct v4l2_frmsizeenum frmsize = {0};
-    frmsize.pixel_format = fmtdesc.pixelformat;
     int maxWidth = 0, maxHeight = 0;
     bool foundExpectedPicSize = false;
-    while (::ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == 0) {
-        if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
-            if (frmsize.discrete.width > maxWidth) { maxWidth = frmsize.discrete.width; maxHeight = frmsize.discrete.height; }
-            if (picWidth && !foundExpectedPicSize && picWidth == frmsize.discrete.width && picHeight == frmsize.discrete.height)
-                foundExpectedPicSize = true;
-
-            log(Debug, "Enumerated video format: %d x %d for MJPG", frmsize.discrete.width, frmsize.discrete.height);
-        }
-        else {
-            if (frmsize.stepwise.max_width > maxWidth) { maxWidth = frmsize.stepwise.max_width; maxHeight = frmsize.stepwise.max_height; }
-            if (picWidth && !foundExpectedPicSize && picWidth == frmsize.stepwise.max_width && picHeight == frmsize.stepwise.max_height)
-                foundExpectedPicSize = true;
-
-            log(Debug, "Enumerated video format: %d x %d for MJPG", frmsize.stepwise.max_width, frmsize.stepwise.max_height);
-        }
-
-
-        frmsize.index++;
+    for (size_t i = 0; i < formats.sizes.getSize(); i++) {
+        const DeviceFormats::Size & size = formats.sizes[i];
+        if ((int)size.width > maxWidth) { maxWidth = size.width; maxHeight = size.height; }
+        if (picWidth && picWidth == (int)size.width && picHeight == (int)size.height) foundExpectedPicSize = true;
     }
 
     log(Info, "Detected maximum picture size as %d x %d", maxWidth, maxHeight); 
@@ -114,23 +132,35 @@ String V4L2Thread::Context::openDevice(const char * path, int preferredVideoWidt
 
     // Remember the highest resolution format for the picture
     Zero(highres);
-    highres.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    highres.type = bufferType;
     highres.fmt.pix.width = maxWidth;
     highres.fmt.pix.height = maxHeight;
-    highres.fmt.pix.pixelformat = fmtdesc.pixelformat;
+    highres.fmt.pix.pixelformat = formats.pixelFormat;
     highres.fmt.pix.field = V4L2_FIELD_ANY;
     ret = ioctl(VIDIOC_S_FMT, &highres, false);
+    if(ret < 0 && cached) {
+        // The device might have changed (like a firmware update), so enumerate its formats again
+        log(Warning, "Cached formats refused for %s, enumerating them again", (const char*)formats.key);
+        FormatCache::remove(formats.key);
+        // The node is kept, it might not be opened again once the privileges are dropped
+        nodeOpened = true;
+        return openDevice(path, preferredVideoWidth, preferredVideoHeight, picWidth, picHeight, stabPicCount, minFrameDurationInS, lowResBufferCount, highResBufferCount);
+    }
     if(ret < 0) return "Can't set format to the maximum picture size";
 
+    // When the preview is downscaled by the server, the stream is in full resolution
+    if (fullResStream) { preferredVideoWidth = highres.fmt.pix.width; preferredVideoHeight = highres.fmt.pix.height; }
 
     // Check format
     Zero(format);
-    format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    format.type = bufferType;
     format.fmt.pix.width = preferredVideoWidth;
     format.fmt.pix.height = preferredVideoHeight;
-    format.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
+    format.fmt.pix.pixelformat = h264Stream ? V4L2_PIX_FMT_H264 : V4L2_PIX_FMT_MJPEG;
     format.fmt.pix.field = V4L2_FIELD_ANY;
     ret = ioctl(VIDIOC_S_FMT, &format, false);
+    // The driver picks another format if it does not support the one asked for
+    if (h264Stream && (ret < 0 || format.fmt.pix.pixelformat != V4L2_PIX_FMT_H264)) return String::Print("Can't set H.264 format (w:%d, h:%d)", preferredVideoWidth, preferredVideoHeight);
     if(ret < 0) 
     {
         // Try JPEG format as well before giving up
@@ -148,15 +178,157 @@ String V4L2Thread::Context::openDevice(const char * path, int preferredVideoWidt
                                 (format.fmt.pix.pixelformat & 0x80000000U) ? " - BigEndian" : " - LittleEndian");
 
     framesToDrop = stabPicCount;
-    minFrameDuration = minFrameDurationInS;
+    minFrameDuration = configuredFrameDuration = minFrameDurationInS;
+    intervalChanged = false;
+    lowResBuffers = min(max(lowResBufferCount, 1U), (unsigned)MaxBuffersCount);
+    highResBuffers = min(max(highResBufferCount, 1U), (unsigned)MaxBuffersCount);
     try {
         state = Off;
-        return switchRes(&format, false);
+        String ret = switchRes(&format, lowResBuffers, false);
+        if (ret) return ret;
+        // Remember the default frame interval, to restore it when the rate governor stops limiting the frame rate
+        struct v4l2_streamparm parm;
+        Zero(parm);
+        parm.type = bufferType;
+        canSetFrameRate = ioctl(VIDIOC_G_PARM, &parm, false) == 0 && (parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME);
+        defaultInterval = parm.parm.capture.timeperframe;
+        setFrameRate();
+        // Not fatal, the controls are only changed on request
+        String cret = queryControls();
+        if (cret) log(Warning, "Can't read the device controls: %s", (const char*)cret);
+        else log(Debug, "Device has %u controls", (unsigned)controls.getSize());
+        // The JPEG quality is either a control, or in the older JPEG compression parameters
+        struct v4l2_jpegcompression compression;
+        Zero(compression);
+        int pos = findControl(V4L2_CID_JPEG_COMPRESSION_QUALITY);
+        canSetQuality = pos >= 0 || ::ioctl(fd, VIDIOC_G_JPEGCOMP, &compression) == 0;
+        if ((streamQuality || fullResQuality) && !canSetQuality) log(Warning, "Device can't set the JPEG quality, using its default");
+        if (canSetQuality) {
+            // The unset qualities are the device's current one, so it's restored after each switch
+            unsigned current = pos >= 0 ? (unsigned)controls[pos].value : (unsigned)compression.quality;
+            if (!streamQuality) streamQuality = current;
+            if (!fullResQuality) fullResQuality = current;
+            if (!h264Stream && streamQuality != current && !setJPEGQuality(streamQuality)) log(Warning, "Can't set the stream's JPEG quality to %u", streamQuality);
+        }
+        return ret;
     } catch (DisconnectedError e) {
         return closeDevice();
     }
 }
 
+// The formats cache, shared by all the capture threads
+static struct FormatCacheStore
+{
+    Threading::FastLock lock;
+    Container::WithCopyConstructor<V4L2Thread::DeviceFormats>::Array devices;
+    String path;
+
+    int find(const String & key) const { for (size_t i = 0; i < devices.getSize(); i++) if (devices[i].key == key) return (int)i; return -1; }
+    // Save the cache file, the lock must be taken
+    void save() const
+    {
+        if (!path) return;
+        // One device per line: the pixel format, the frame sizes and the device key
+        String content;
+        for (size_t i = 0; i < devices.getSize(); i++) {
+            const V4L2Thread::DeviceFormats & formats = devices[i];
+            content += String::Print("%08X\t", formats.pixelFormat);
+            for (size_t j = 0; j < formats.sizes.getSize(); j++) content += String::Print(j ? " %ux%u" : "%ux%u", formats.sizes[j].width, formats.sizes[j].height);
+            content += "\t" + formats.key + "\n";
+        }
+        if (!File::Info(path, true).setContent(content)) log(Warning, "Can't save the formats cache to %s", (const char*)path);
+    }
+} formatCache;
+
+String V4L2Thread::FormatCache::getKey(const struct v4l2_capability & caps)
+{
+    return String::Print("%.*s/%.*s/%.*s", (int)sizeof(caps.driver), (const char*)caps.driver, (int)sizeof(caps.card), (const char*)caps.card, (int)sizeof(caps.bus_info), (const char*)caps.bus_info).Trimmed();
+}
+
+String V4L2Thread::FormatCache::load(const char * path)
+{
+    Threading::ScopedLock scope(formatCache.lock);
+    formatCache.path = path;
+    formatCache.devices.Clear();
+    if (!formatCache.path || !File::Info(path, true).doesExist()) return "";
+
+    String content = File::Info(path, true).getContent();
+    for (unsigned lineNumber = 1; content; lineNumber++)
+    {
+        String line = content.splitUpTo("\n"), format = line.splitUpTo("\t"), sizes = line.splitUpTo("\t").Trimmed();
+        DeviceFormats formats;
+        int consumed = 0;
+        formats.pixelFormat = (uint32)format.parseInt(16, &consumed);
+        formats.key = line.Trimmed();
+        if (!formats.key || consumed != format.getLength() || (formats.pixelFormat != V4L2_PIX_FMT_MJPEG && formats.pixelFormat != V4L2_PIX_FMT_JPEG))
+        {
+            formatCache.devices.Clear();
+            return String::Print("Invalid line %u in %s", lineNumber, path);
+        }
+        while (sizes)
+        {
+            String size = sizes.splitUpTo(" "), width = size.splitUpTo("x");
+            formats.sizes.Append(DeviceFormats::Size((uint32)width.parseInt(10), (uint32)size.parseInt(10)));
+        }
+        formatCache.devices.Append(formats);
+    }
+    log(Debug, "Loaded the formats of %u devices from %s", (unsigned)formatCache.devices.getSize(), path);
+    return "";
+}
+
+bool V4L2Thread::FormatCache::find(const String & key, DeviceFormats & formats)
+{
+    Threading::ScopedLock scope(formatCache.lock);
+    int pos = formatCache.find(key);
+    if (pos < 0) return false;
+    formats = formatCache.devices[pos];
+    return true;
+}
+
+void V4L2Thread::FormatCache::store(const DeviceFormats & formats)
+{
+    Threading::ScopedLock scope(formatCache.lock);
+    int pos = formatCache.find(formats.key);
+    if (pos < 0) formatCache.devices.Append(formats);
+    else formatCache.devices[pos] = formats;
+    formatCache.save();
+}
+
+void V4L2Thread::FormatCache::remove(const String & key)
+{
+    Threading::ScopedLock scope(formatCache.lock);
+    int pos = formatCache.find(key);
+    if (pos < 0) return;
+    formatCache.devices.Remove(pos);
+    formatCache.save();
+}
+
+String V4L2Thread::Context::enumerateFormats(DeviceFormats & formats)
+{
+    formats.key = FormatCache::getKey(caps);
+    formats.sizes.Clear();
+    struct v4l2_fmtdesc fmtdesc = {0};
+    fmtdesc.type = bufferType;
+    bool compatible = false;
+    while (::ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0)
+    {   
+        if (fmtdesc.pixelformat == V4L2_PIX_FMT_MJPEG || fmtdesc.pixelformat == V4L2_PIX_FMT_JPEG) { compatible = true; break; }
+        fmtdesc.index++;
+    }
+    if (!compatible) return "This device does not support MJPEG or JPEG pixel format";
+    formats.pixelFormat = fmtdesc.pixelformat;
+
+    struct v4l2_frmsizeenum frmsize = {0};
+    frmsize.pixel_format = fmtdesc.pixelformat;
+    while (::ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == 0) {
+        if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) formats.sizes.Append(DeviceFormats::Size(frmsize.discrete.width, frmsize.discrete.height));
+        else formats.sizes.Append(DeviceFormats::Size(frmsize.stepwise.max_width, frmsize.stepwise.max_height));
+        log(Debug, "Enumerated video format: %d x %d for MJPG", formats.sizes[formats.sizes.getSize() - 1].width, formats.sizes[formats.sizes.getSize() - 1].height);
+        frmsize.index++;
+    }
+    return "";
+}
+
 String V4L2Thread::Context::closeDevice()
 {
     String ret;
@@ -167,36 +339,113 @@ String V4L2Thread::Context::closeDevice()
     
     // Then close the device
     fd.Mutate(-1);
+    nodeOpened = false;
 
     // Clean all remnant data
+    freeUserBuffers();
     state = Off;
     Zero(mem);
+    mappedCount = 0;
+    memory = V4L2_MEMORY_MMAP;
+    bufferType = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     if (ret) return ret;
     if (uret) return uret;
     return "";    
 }
 
+void V4L2Thread::Context::freeUserBuffers()
+{
+    for (unsigned i = 0; i < userCount; i++) { free(mem[i]); mem[i] = 0; }
+    userCount = 0;
+    userBufferSize = 0;
+}
+
+String V4L2Thread::Context::allocateUserBuffers(unsigned count, size_t size)
+{
+    // Round to the page size, some drivers require this
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size = (size + pageSize - 1) & ~(pageSize - 1);
+    if (count <= userCount && size <= userBufferSize) return "";
+
+    freeUserBuffers();
+    for (unsigned i = 0; i < count; i++) {
+        if (posix_memalign(&mem[i], pageSize, size) != 0) { mem[i] = 0; freeUserBuffers(); return "Can't allocate user video buffers"; }
+        userCount = i + 1;
+    }
+    userBufferSize = size;
+    log(Debug, "Allocated %u user buffers of %u bytes each", count, (unsigned)size);
+    return "";
+}
+
+void V4L2Thread::Context::prepareBuffer(const unsigned index)
+{
+    Zero(buffer);
+    buffer.index = index;
+    buffer.type = bufferType;
+    buffer.memory = memory;
+    if (isMultiPlanar()) {
+        // The length is the number of planes in the array
+        Zero(planes);
+        buffer.m.planes = planes;
+        buffer.length = VIDEO_MAX_PLANES;
+    }
+}
+
+void V4L2Thread::Context::exportBuffers()
+{
+    for (unsigned i = 0; i < mappedCount; i++) {
+        struct v4l2_exportbuffer exported;
+        Zero(exported);
+        exported.type = bufferType;
+        exported.index = i;
+        exported.flags = O_RDONLY | O_CLOEXEC;
+        if (ioctl(VIDIOC_EXPBUF, &exported, false) < 0) {
+            // Not fatal, the buffers are still mapped
+            log(Debug, "Device can't export its buffers as DMABUF");
+            closeExportedBuffers();
+            return;
+        }
+        dmabuf[i] = exported.fd;
+    }
+}
+
+void V4L2Thread::Context::closeExportedBuffers()
+{
+    for (unsigned i = 0; i < MaxBuffersCount; i++) if (dmabuf[i] != -1) { ::close(dmabuf[i]); dmabuf[i] = -1; }
+}
+
 String V4L2Thread::Context::unmapBuffers()
 {
-    if (state != Disconnected) {
+    // The exported buffers must be released too, so the driver can free them
+    closeExportedBuffers();
+    if (memory == V4L2_MEMORY_USERPTR) {
+        // The user buffers are kept for the next switch, only release the driver's queue
+        if (state == Disconnected) return "Device is disconnected";
+        Zero(requestBuffers);
+        requestBuffers.count = 0;
+        requestBuffers.type = bufferType;
+        requestBuffers.memory = V4L2_MEMORY_USERPTR;
+        if (ioctl(VIDIOC_REQBUFS, &requestBuffers) < 0) return "Can't free video buffers";
+        return "";
+    }
+
+    if (state != Disconnected && mappedCount) {
         // Need to find the buffer size to unmap it
-        Zero(buffer);
-        buffer.index = 0;
-        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buffer.memory = V4L2_MEMORY_MMAP;
+        prepareBuffer(0);
         if (ioctl(VIDIOC_QUERYBUF, &buffer) < 0) return String::Print("Can't query buffer %d", 0);
     }
 
-    for (int i = 0; i < BuffersCount; i++) {
-        if (::munmap(mem[i], buffer.length)) return String::Print("Can't unmap buffer %d", i);
+    for (unsigned i = 0; i < mappedCount; i++) {
+        if (::munmap(mem[i], getBufferLength())) return String::Print("Can't unmap buffer %u", i);
     }
+    mappedCount = 0;
 
     if (state == Disconnected) return "Device is disconnected";
 
 
     Zero(requestBuffers);
     requestBuffers.count = 0;
-    requestBuffers.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    requestBuffers.type = bufferType;
     requestBuffers.memory = V4L2_MEMORY_MMAP;
 
     if (ioctl(VIDIOC_REQBUFS, &requestBuffers) < 0) return "Can't free video buffers";
@@ -204,8 +453,9 @@ String V4L2Thread::Context::unmapBuffers()
     return "";
 }
 
-String V4L2Thread::Context::switchRes(struct v4l2_format * f, bool unmapFirst)
+String V4L2Thread::Context::switchRes(struct v4l2_format * f, unsigned count, bool unmapFirst)
 {
+    PROBE(Profiler::SwitchRes);
     if (unmapFirst) {
         String ret = unmapBuffers();
         if (ret) return ret;
@@ -214,48 +464,116 @@ String V4L2Thread::Context::switchRes(struct v4l2_format * f, bool unmapFirst)
     int ret = ioctl(VIDIOC_S_FMT, f);
     if (ret < 0) return String::Print("Can't set JPEG or MJPEG format (w:%d, h:%d)", f->fmt.pix.width, f->fmt.pix.height);
 
+    // In fast switch mode, use our buffers, sized for the largest picture, so they are allocated once for both resolutions
+    if (fastSwitch) {
+        size_t size = max(getImageSize(highres), getImageSize(*f));
+        String uret = allocateUserBuffers(max(lowResBuffers, highResBuffers), size);
+        if (uret) return uret;
+
+        Zero(requestBuffers);
+        requestBuffers.count = min(count, userCount);
+        requestBuffers.type = bufferType;
+        requestBuffers.memory = V4L2_MEMORY_USERPTR;
+        if (ioctl(VIDIOC_REQBUFS, &requestBuffers) == 0 && requestBuffers.count) {
+            memory = V4L2_MEMORY_USERPTR;
+            return queueBuffers();
+        }
+        // Not supported by the driver, so fallback to memory mapped buffers
+        log(Warning, "Device does not support user pointer buffers, disabling fast switching");
+        fastSwitch = false;
+        freeUserBuffers();
+    }
+    memory = V4L2_MEMORY_MMAP;
+
     // Set up buffers now
     Zero(requestBuffers);
-    requestBuffers.count = BuffersCount;
-    requestBuffers.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    requestBuffers.count = count;
+    requestBuffers.type = bufferType;
     requestBuffers.memory = V4L2_MEMORY_MMAP;
 
     if (ioctl(VIDIOC_REQBUFS, &requestBuffers) < 0)  return "Can't allocate video buffers";
-    
-    for (int i = 0; i < BuffersCount; i++) {
-        Zero(buffer);
-        buffer.index = i;
-        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buffer.memory = V4L2_MEMORY_MMAP;
+    // The driver is free to allocate a different number of buffers than requested
+    if (!requestBuffers.count) return "No video buffer allocated by the driver";
+    if (requestBuffers.count != count) log(Debug, "Driver allocated %u buffers instead of %u", requestBuffers.count, count);
+    unsigned buffersCount = min(requestBuffers.count, (unsigned)MaxBuffersCount);
+
+    for (unsigned i = 0; i < buffersCount; i++) {
+        prepareBuffer(i);
         if (ioctl(VIDIOC_QUERYBUF, &buffer) < 0) return String::Print("Can't query buffer %d", i);
 
-        mem[i] = ::mmap(0, buffer.length, PROT_READ | PROT_WRITE, MAP_SHARED, (int)fd, buffer.m.offset);
-        if (mem[i] == MAP_FAILED)   return String::Print("Memory mapping of the buffer %d failed", i);
+        mem[i] = ::mmap(0, getBufferLength(), PROT_READ | PROT_WRITE, MAP_SHARED, (int)fd, getBufferOffset());
+        if (mem[i] == MAP_FAILED)   return String::Print("Memory mapping of the buffer %u failed", i);
+        mappedCount = i + 1;
 
-        if (!unmapFirst) log(Debug, "Buffer %d (len: %u bytes) mapped at %p", i, buffer.length, mem[i]);
+        if (!unmapFirst) log(Debug, "Buffer %d (len: %u bytes) mapped at %p", i, getBufferLength(), mem[i]);
     }
+    // The multi-planar devices are usually the ones feeding the hardware encoders, that import DMABUF descriptors
+    if (isMultiPlanar()) exportBuffers();
 
     // Queue them now
-    for (int i = 0; i < BuffersCount; i++) {
-        Zero(buffer);
-        buffer.index = i;
-        buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buffer.memory = V4L2_MEMORY_MMAP;
-        if (ioctl(VIDIOC_QBUF, &buffer) < 0) return String::Print("Can't queue buffer %d", i);  
-    }      
+    return queueBuffers();
+}
+
+String V4L2Thread::Context::queueBuffers()
+{
+    unsigned buffersCount = memory == V4L2_MEMORY_USERPTR ? min(requestBuffers.count, userCount) : mappedCount;
+    for (unsigned i = 0; i < buffersCount; i++) {
+        prepareBuffer(i);
+        if (memory == V4L2_MEMORY_USERPTR && isMultiPlanar()) {
+            planes[0].m.userptr = (unsigned long)mem[i];
+            planes[0].length = (__u32)userBufferSize;
+            buffer.length = 1;
+        } else if (memory == V4L2_MEMORY_USERPTR) {
+            buffer.m.userptr = (unsigned long)mem[i];
+            buffer.length = (__u32)userBufferSize;
+        }
+        if (ioctl(VIDIOC_QBUF, &buffer) < 0) return String::Print("Can't queue buffer %u", i);
+    }
     return "";
 }
 
+bool V4L2Thread::Context::enterStandby()
+{
+    if (state != On) return true;
+    // Stopping the stream gives back all the buffers, so they are queued again for the next start
+    if (!stopStreaming()) return false;
+    String ret = queueBuffers();
+    if (ret) {
+        log(Error, "Error while entering standby: %s", (const char*)ret);
+        return false;
+    }
+    return true;
+}
+
+
+bool V4L2Thread::Context::setJPEGQuality(const unsigned quality)
+{
+    if (!quality || !canSetQuality) return true;
+    int pos = findControl(V4L2_CID_JPEG_COMPRESSION_QUALITY);
+    if (pos >= 0) {
+        ControlValues values;
+        values.ids.Append(V4L2_CID_JPEG_COMPRESSION_QUALITY);
+        values.values.Append(min(max((int64)quality, controls[pos].minimum), controls[pos].maximum));
+        return !setControls(values);
+    }
+    struct v4l2_jpegcompression compression;
+    Zero(compression);
+    if (ioctl(VIDIOC_G_JPEGCOMP, &compression, false) < 0) return false;
+    compression.quality = (int)quality;
+    return ioctl(VIDIOC_S_JPEGCOMP, &compression, false) == 0;
+}
 
 bool V4L2Thread::Context::switchToFullRes()
 {
     struct v4l2_format f;
     memcpy(&f, &highres, sizeof(f));
-    String ret = switchRes(&f);
+    String ret = switchRes(&f, highResBuffers);
     if (ret) {
         log(Error, "Error while switching resolution: %s", (const char*)ret);
         return false;
     }
+    // Not fatal, the picture is captured with the stream's quality
+    if (fullResQuality != streamQuality && !setJPEGQuality(fullResQuality)) log(Warning, "Can't set the full resolution JPEG quality to %u", fullResQuality);
     return true;
 }
 
@@ -263,25 +581,327 @@ bool V4L2Thread::Context::switchToLowRes()
 {
     struct v4l2_format f;
     memcpy(&f, &format, sizeof(f));
-    String ret = switchRes(&f);
+    String ret = switchRes(&f, lowResBuffers);
     if (ret) {
         log(Error, "Error while switching resolution: %s", (const char*)ret);
         return false;
     }
+    // The frame interval might be reset when the format changes
+    setFrameRate();
+    if (fullResQuality != streamQuality && !h264Stream && !setJPEGQuality(streamQuality)) log(Warning, "Can't set the stream's JPEG quality to %u", streamQuality);
+    return true;
+}
+
+bool V4L2Thread::Context::changeLowRes(const unsigned width, const unsigned height)
+{
+    bool running = state == On;
+    if (running && !stopStreaming()) return false;
+    struct v4l2_format f;
+    memcpy(&f, &format, sizeof(f));
+    f.fmt.pix.width = width;
+    f.fmt.pix.height = height;
+    String ret = switchRes(&f, lowResBuffers);
+    if (ret) {
+        // Like a size the driver rejects, the capture goes on in the previous format
+        log(Error, "Error while switching resolution, keeping w:%d, h:%d: %s", format.fmt.pix.width, format.fmt.pix.height, (const char*)ret);
+        if (!switchToLowRes()) return false;
+        return !running || startStreaming();
+    }
+    if (f.fmt.pix.width != width || f.fmt.pix.height != height)
+        log(Warning, "Resolution not supported, using w:%d, h:%d", f.fmt.pix.width, f.fmt.pix.height);
+    else log(Info, "Video set up for width:%d, height:%d", f.fmt.pix.width, f.fmt.pix.height);
+    // Remember the format the driver picked, for the next full resolution switches
+    memcpy(&format, &f, sizeof(f));
+    // The frame interval might be reset when the format changes
+    setFrameRate();
+    return !running || startStreaming();
+}
+
+bool V4L2Thread::Context::setFrameRate()
+{
+    driverPaced = false;
+    // Unless the default frame interval must be restored
+    if (minFrameDuration == 0 && (!intervalChanged || !defaultInterval.denominator)) return true;
+
+    struct v4l2_streamparm parm;
+    Zero(parm);
+    parm.type = bufferType;
+    if (ioctl(VIDIOC_G_PARM, &parm, false) < 0 || !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
+        log(Info, "Device can't set its frame rate, dropping frames instead");
+        return false;
+    }
+    if (minFrameDuration == 0) {
+        parm.parm.capture.timeperframe = defaultInterval;
+        if (ioctl(VIDIOC_S_PARM, &parm, false) < 0) return false;
+        intervalChanged = false;
+        log(Info, "Device frame rate set back to %u/%u fps", parm.parm.capture.timeperframe.denominator, parm.parm.capture.timeperframe.numerator);
+        return true;
+    }
+
+    unsigned fps = (unsigned)(1.0 / minFrameDuration + 0.5);
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = fps ? fps : 1;
+    if (ioctl(VIDIOC_S_PARM, &parm, false) < 0) return false;
+    intervalChanged = true;
+
+    // The driver picks the closest supported interval, check it's not faster than expected
+    const struct v4l2_fract & actual = parm.parm.capture.timeperframe;
+    if (!actual.denominator || (double)actual.numerator / actual.denominator < minFrameDuration * 0.95) {
+        log(Info, "Device does not support %u fps (got %u/%u), dropping frames instead", fps, actual.denominator, actual.numerator);
+        return false;
+    }
+    log(Info, "Device frame rate set to %u/%u fps", actual.denominator, actual.numerator);
+    driverPaced = true;
     return true;
 }
 
+bool V4L2Thread::Context::changeFrameRate(const double duration)
+{
+    minFrameDuration = duration;
+    // The frames are dropped instead if the device can't pace itself
+    if (!canSetFrameRate) return true;
+    if (state != On) { setFrameRate(); return true; }
+    // Most drivers (like UVC) refuse to change the frame interval while streaming, so the stream is restarted
+    return stopStreaming() && switchToLowRes() && startStreaming();
+}
+
+// Get the control name like v4l2-ctl does (lower case, the other characters replaced by a single underscore)
+static String controlName(const char * name, const size_t size)
+{
+    char out[64]; size_t len = 0; bool separator = false;
+    for (size_t i = 0; i < size && name[i] && len + 2 < sizeof(out); i++)
+    {
+        char c = name[i];
+        if (c >= 'A' && c <= 'Z') c = (char)(c - 'A' + 'a');
+        if ((c < 'a' || c > 'z') && (c < '0' || c > '9')) { separator = true; continue; }
+        if (separator && len) out[len++] = '_';
+        out[len++] = c;
+        separator = false;
+    }
+    return String(out, (int)len);
+}
+
+String V4L2Thread::Control::toJSON() const
+{
+    static const char * types[] = { "", "integer", "boolean", "menu", "button", "integer64", "class", "string", "bitmask", "integer_menu" };
+    String out = String::Print("{\"id\":\"0x%08x\",\"name\":\"%s\",\"type\":\"%s\",\"min\":" PF_LLD ",\"max\":" PF_LLD ",\"step\":" PF_LLD ",\"default\":" PF_LLD, 
+                               id, (const char*)name, type < ArrSz(types) ? types[type] : "", minimum, maximum, step, defaultValue);
+    if (!(flags & V4L2_CTRL_FLAG_WRITE_ONLY) && type != V4L2_CTRL_TYPE_BUTTON) out += String::Print(",\"value\":" PF_LLD, value);
+    if (flags & V4L2_CTRL_FLAG_INACTIVE) out += ",\"inactive\":true";
+    if (flags & V4L2_CTRL_FLAG_READ_ONLY) out += ",\"readOnly\":true";
+    if (menu) out += ",\"menu\":" + menu;
+    return out + "}";
+}
+
+String V4L2Thread::Context::queryControls()
+{
+    controls.Clear();
+    bool extended = true;
+    uint32 next = V4L2_CTRL_FLAG_NEXT_CTRL;
+    while (true)
+    {
+        Control control;
+        if (extended) {
+            struct v4l2_query_ext_ctrl query;
+            Zero(query);
+            query.id = next;
+            // The enumeration ends with an error, so the ioctl is called directly (it's not an error to log)
+            if (::ioctl((int)fd, VIDIOC_QUERY_EXT_CTRL, &query) < 0) {
+                // The older kernels only have the legacy query
+                if (errno == ENOTTY && next == V4L2_CTRL_FLAG_NEXT_CTRL) { extended = false; continue; }
+                break;
+            }
+            next = query.id | V4L2_CTRL_FLAG_NEXT_CTRL;
+            // The arrays are not supported
+            if (query.nr_of_dims) continue;
+            control.id = query.id; control.type = query.type; control.flags = query.flags; control.name = controlName(query.name, sizeof(query.name));
+            control.minimum = query.minimum; control.maximum = query.maximum; control.step = (int64)query.step; control.defaultValue = query.default_value;
+        } else {
+            struct v4l2_queryctrl query;
+            Zero(query);
+            query.id = next;
+            if (::ioctl((int)fd, VIDIOC_QUERYCTRL, &query) < 0) break;
+            next = query.id | V4L2_CTRL_FLAG_NEXT_CTRL;
+            control.id = query.id; control.type = query.type; control.flags = query.flags; control.name = controlName((const char*)query.name, sizeof(query.name));
+            control.minimum = query.minimum; control.maximum = query.maximum; control.step = query.step; control.defaultValue = query.default_value;
+        }
+        // Only the numerical controls are supported
+        if ((control.flags & V4L2_CTRL_FLAG_DISABLED) || control.type == V4L2_CTRL_TYPE_CTRL_CLASS || control.type == V4L2_CTRL_TYPE_STRING || control.type >= V4L2_CTRL_COMPOUND_TYPES) continue;
+
+        if (control.type == V4L2_CTRL_TYPE_MENU || control.type == V4L2_CTRL_TYPE_INTEGER_MENU) {
+            for (int64 i = max(control.minimum, (int64)0); i <= control.maximum && i < 256; i++) {
+                struct v4l2_querymenu item;
+                Zero(item);
+                item.id = control.id;
+                item.index = (uint32)i;
+                // The menus can have holes
+                if (::ioctl((int)fd, VIDIOC_QUERYMENU, &item) < 0) continue;
+                String label = control.type == V4L2_CTRL_TYPE_MENU ? String((const char*)item.name) : String::Print(PF_LLD, (int64)item.value);
+                control.menu += String::Print("%s\"" PF_LLD "\":\"%s\"", control.menu ? "," : "{", i, (const char*)label.findAndReplace("\"", "'"));
+            }
+            if (control.menu) control.menu += "}";
+        }
+        controls.Append(control);
+    }
+    return readControls();
+}
+
+int V4L2Thread::Context::findControl(const uint32 id) const
+{
+    for (size_t i = 0; i < controls.getSize(); i++) if (controls[i].id == id) return (int)i;
+    return -1;
+}
+
+String V4L2Thread::Context::readControls(const uint32 * ids, const size_t count)
+{
+    // The readable controls
+    size_t total = ids ? count : controls.getSize(), size = 0;
+    Utils::MemoryBlock block((uint32)(total * sizeof(struct v4l2_ext_control)));
+    struct v4l2_ext_control * list = (struct v4l2_ext_control *)block.getBuffer();
+    for (size_t i = 0; i < total; i++) {
+        int pos = ids ? findControl(ids[i]) : (int)i;
+        if (pos < 0 || (controls[pos].flags & V4L2_CTRL_FLAG_WRITE_ONLY) || controls[pos].type == V4L2_CTRL_TYPE_BUTTON) continue;
+        Zero(list[size]);
+        list[size++].id = controls[pos].id;
+    }
+    if (!size) return "";
+
+    // All at once, then one by one if the driver refuses one of them
+    struct v4l2_ext_controls request;
+    Zero(request);
+    request.which = V4L2_CTRL_WHICH_CUR_VAL;
+    request.count = (uint32)size;
+    request.controls = list;
+    bool batch = ioctl(VIDIOC_G_EXT_CTRLS, &request, false) == 0;
+    String error;
+    for (size_t i = 0; i < size; i++) {
+        if (!batch) {
+            request.count = 1;
+            request.controls = &list[i];
+            if (ioctl(VIDIOC_G_EXT_CTRLS, &request, false) < 0) { error = String::Print("Can't read the control 0x%08x", list[i].id); continue; }
+        }
+        Control & control = controls[findControl(list[i].id)];
+        control.value = control.type == V4L2_CTRL_TYPE_INTEGER64 ? list[i].value64 : list[i].value;
+    }
+    return error;
+}
+
+String V4L2Thread::Context::parseControls(const String & assignments, ControlValues & out) const
+{
+    String rest = assignments;
+    while (rest)
+    {
+        String assignment = rest.splitUpTo("&"), name = assignment.splitUpTo("=").Trimmed(), value = assignment.Trimmed();
+        if (!name) continue;
+        // By name, or by identifier
+        int pos = -1;
+        for (size_t i = 0; i < controls.getSize() && pos < 0; i++) if (controls[i].name == name) pos = (int)i;
+        if (pos < 0 && name.midString(0, 2) == "0x") pos = findControl((uint32)name.parseInt(16));
+        if (pos < 0) return "Unknown control: " + name;
+        const Control & control = controls[pos];
+        if (control.flags & V4L2_CTRL_FLAG_READ_ONLY) return "Read only control: " + name;
+
+        int consumed = 0;
+        bool boolean = value == "true" || value == "false";
+        int64 number = boolean ? (value == "true") : value.parseInt(10, &consumed);
+        if (!value || (!boolean && consumed != value.getLength())) return "Invalid value for the control: " + name;
+        if (control.type != V4L2_CTRL_TYPE_BUTTON && control.type != V4L2_CTRL_TYPE_BITMASK && (number < control.minimum || number > control.maximum))
+            return String::Print("Out of range value for the control %s: " PF_LLD " (" PF_LLD " to " PF_LLD ")", (const char*)name, number, control.minimum, control.maximum);
+        out.ids.Append(control.id);
+        out.values.Append(number);
+    }
+    return "";
+}
+
+String V4L2Thread::Context::setControls(const ControlValues & values, const bool updateCache)
+{
+    if (!values.ids.getSize()) return "";
+    size_t size = values.ids.getSize();
+    Utils::MemoryBlock block((uint32)(size * sizeof(struct v4l2_ext_control)));
+    struct v4l2_ext_control * list = (struct v4l2_ext_control *)block.getBuffer();
+    for (size_t i = 0; i < size; i++) {
+        Zero(list[i]);
+        list[i].id = values.ids[i];
+        int pos = findControl(list[i].id);
+        if (pos >= 0 && controls[pos].type == V4L2_CTRL_TYPE_INTEGER64) list[i].value64 = values.values[i];
+        else list[i].value = (int32)values.values[i];
+    }
+    // All the controls are set in a single call (the driver applies them in order)
+    struct v4l2_ext_controls request;
+    Zero(request);
+    request.which = V4L2_CTRL_WHICH_CUR_VAL;
+    request.count = (uint32)size;
+    request.controls = list;
+    if (ioctl(VIDIOC_S_EXT_CTRLS, &request, false) < 0) {
+        int err = errno;
+        // The controls before the failing one might be set, so read them back
+        if (updateCache) readControls(&values.ids[0], values.ids.getSize());
+        if (request.error_idx < request.count) return String::Print("Can't set the control 0x%08x: %s", list[request.error_idx].id, strerror(err));
+        return String::Print("Can't set the controls: %s", strerror(err));
+    }
+    // The driver might have adjusted the values
+    return updateCache ? readControls(&values.ids[0], values.ids.getSize()) : String();
+}
+
+void V4L2Thread::Context::getCachedControls(ControlValues & values) const
+{
+    values.values.Clear();
+    for (size_t i = 0; i < values.ids.getSize(); i++) {
+        int pos = findControl(values.ids[i]);
+        values.values.Append(pos < 0 ? 0 : controls[pos].value);
+    }
+}
+
+String V4L2Thread::Context::controlsToJSON() const
+{
+    String out;
+    for (size_t i = 0; i < controls.getSize(); i++) out += (i ? "," : "") + controls[i].toJSON();
+    return "[" + out + "]";
+}
+
+String V4L2Thread::setControls(const String & assignments)
+{
+    if (fake.isLoaded() || remote.isOpened()) return "The source has no control";
+    Threading::ScopedLock scope(controlsLock);
+    ControlValues values;
+    String error = context.parseControls(assignments, values);
+    if (error) return error;
+    return context.setControls(values);
+}
+
+double V4L2Thread::Context::getFrameTime() const
+{
+    if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC && (buffer.timestamp.tv_sec || buffer.timestamp.tv_usec))
+        return buffer.timestamp.tv_sec + buffer.timestamp.tv_usec / 1e6;
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+double V4L2Thread::Context::getFrameAge() const
+{
+    if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) != V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC || (!buffer.timestamp.tv_sec && !buffer.timestamp.tv_usec)) return 0;
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double age = (now.tv_sec - buffer.timestamp.tv_sec) + now.tv_nsec / 1e9 - buffer.timestamp.tv_usec / 1e6;
+    return age > 0 ? age : 0;
+}
+
 
 bool V4L2Thread::Context::startStreaming()
 {
     if (state == On || state == Paused) return true;
 
-    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int type = (int)bufferType;
     int ret = ioctl(VIDIOC_STREAMON, &type);
     if (ret) {
         log(Error, "Can't start stream: %d (errno: %d)", ret, errno);
         return false;
     }
+    // Remember when the stream started to detect stale frames (the buffers timestamps are using the monotonic clock)
+    struct timespec now = {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    streamStart = now.tv_sec + now.tv_nsec / 1e9;
     state = On;
     return true;
 }
@@ -290,7 +910,7 @@ bool V4L2Thread::Context::stopStreaming()
 {
     if (state == Off || state == Disconnected) return true;
 
-    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int type = (int)bufferType;
     int ret = ioctl(VIDIOC_STREAMOFF, &type);
     if (ret) {
         log(Error, "Can't start stream: %d (errno: %d)", ret, errno);
@@ -303,11 +923,8 @@ bool V4L2Thread::Context::stopStreaming()
 bool V4L2Thread::Context::eventLoop()
 {
     struct v4l2_event ev;
-    // We don't want to block here, so switch the file descriptor to non blocking first
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    // The device is non blocking, so this does not wait
     int ret = ::ioctl(fd, VIDIOC_DQEVENT, &ev); // Don't retry on error and don't log error here if there's no event to fetch
-    // Set it blocking again here
-    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
     if (!ret) {
         switch (ev.type) {
         // End of stream should stop streaming thread
@@ -330,14 +947,19 @@ bool V4L2Thread::Context::eventLoop()
 
 bool V4L2Thread::Context::fetchFrame(uint8 * & ptr, size_t & size)
 {
-    Zero(buffer);
-    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buffer.memory = V4L2_MEMORY_MMAP;
+    PROBE(Profiler::FetchFrame);
+    prepareBuffer(0);
 
     int ret = ioctl(VIDIOC_DQBUF, &buffer, true, true);
     if(ret < 0) return false;
 
-    ptr = (uint8*)mem[buffer.index];
+    if (isMultiPlanar()) {
+        // The picture might not start at the beginning of the plane
+        ptr = (memory == V4L2_MEMORY_USERPTR ? (uint8*)planes[0].m.userptr : (uint8*)mem[buffer.index]) + planes[0].data_offset;
+        size = planes[0].bytesused > planes[0].data_offset ? planes[0].bytesused - planes[0].data_offset : 0;
+        return true;
+    }
+    ptr = memory == V4L2_MEMORY_USERPTR ? (uint8*)buffer.m.userptr : (uint8*)mem[buffer.index];
     size = buffer.bytesused;
     return true;
 }
@@ -351,106 +973,259 @@ bool V4L2Thread::Context::returnFrame()
 
 
 
-String V4L2Thread::captureFullResPicture(Utils::MemoryBlock & block)
+static String copyPicture(Utils::MemoryBlock & to, const Utils::MemoryBlock & from)
+{
+    if (!to.setSize(from.getSize())) return "ERROR: Out of memory";
+    memcpy(to.getBuffer(), from.getConstBuffer(), from.getSize());
+    return "";
+}
+
+bool V4L2Thread::getLastFullResPicture(Utils::MemoryBlock & block, double & time)
+{
+    Threading::ScopedLock scope(fullResLock);
+    time = fullResTime;
+    return fullResCache && !copyPicture(block, fullResCache->data);
+}
+
+String V4L2Thread::captureFullResPicture(Utils::MemoryBlock & block, const uint32 maxAgeMs)
+{
+    FrameRef frame;
+    String error = captureFullResFrame(frame, maxAgeMs);
+    return error ? error : copyPicture(block, frame->data);
+}
+
+bool V4L2Thread::getCachedFullResFrame(FrameRef & frame, const uint32 maxAgeMs) const
+{
+    Threading::ScopedLock scope(fullResLock);
+    if (!fullResCache || (Time::getPreciseTime() - fullResTime) * 1000 > maxAgeMs) return false;
+    frame = fullResCache;
+    return true;
+}
+
+uint32 V4L2Thread::getSwitchDelayMs(const uint32 maxAgeMs) const
+{
+    // Only a capture by the stream's device interrupts the stream
+    if (!minSwitchInterval || !isRunning() || stillContext.fd != -1 || remote.fullRes.isSet()) return 0;
+    Threading::ScopedLock scope(fullResLock);
+    double now = Time::getPreciseTime();
+    if (maxAgeMs && fullResCache && (now - fullResTime) * 1000 <= maxAgeMs) return 0;
+    double wait = lastSwitchTime + minSwitchInterval - now;
+    return wait > 0 ? (uint32)(wait * 1000) + 1 : 0;
+}
+
+String V4L2Thread::captureFullResFrame(FrameRef & frame, const uint32 maxAgeMs)
 {
+    uint32 generation = 0;
+    {
+        Threading::ScopedLock scope(fullResLock);
+        if (maxAgeMs && fullResCache && (Time::getPreciseTime() - fullResTime) * 1000 <= maxAgeMs) { frame = fullResCache; return ""; }
+        generation = fullResGeneration;
+    }
 
-    if (fullResPic) return "ERROR: Already busy capturing";
-    fullResPic = &block;
-    if (!isRunning()) {
-        // The thread is not running, let's capture a frame and exit
-        if (!fetchFullRes()) { fullResPic = 0; return "ERROR: While fetching full resolution picture"; }
-        fullResPic = 0;
-        return "";        
+    // Only one capture at a time, the other requests wait for it to complete
+    Threading::ScopedLock capture(captureLock);
+    {
+        Threading::ScopedLock scope(fullResLock);
+        if (generation != fullResGeneration)
+        {   // A capture completed while we were waiting, so use it
+            if (fullResError) return fullResError;
+            frame = fullResCache;
+            return "";
+        }
     }
 
-    // Else tell the thread to do it
-    captureFullRes.Set();
-    if (!captureDone.Wait(30000)) {
-        fullResPic = 0;
-        return "ERROR: Capture thread not answering";
+    // The picture is captured in a recycled frame, so there is no allocation once the pool has enough frames
+    FrameRef captured = fullResPool.get();
+    if (!captured) return "ERROR: Out of memory";
+    String error;
+    double start = Time::getPreciseTime();
+    fullResPic = &captured->data;
+    if (fake.isLoaded() && !isRunning()) {
+        // Nothing to switch, use the first picture
+        if (copyPicture(captured->data, *fake.pictures.getElementAtUncheckedPosition(0))) error = "ERROR: Out of memory";
+    } else if (remote.fullRes.isSet()) {
+        // Forwarded to the remote server (it's cached and shared by the concurrent requests like a local capture)
+        String ret = remote.fetchFullResPicture(captured->data);
+        if (ret) error = "ERROR: While fetching the remote full resolution picture: " + ret;
+        else {
+            JPEGInfo info;
+            if (info.parse(captured->getData(), captured->data.getSize())) { remote.fullResWidth = info.width; remote.fullResHeight = info.height; }
+        }
+    } else if (remote.isOpened() && !isRunning()) {
+        // The stream is not pulled, so fetch a single picture from it
+        String ret = remote.fetchPicture(captured->data, context.switchTimeoutMs);
+        if (ret) error = "ERROR: While fetching the remote picture: " + ret;
+    } else if (stillContext.fd != -1 || !isRunning()) {
+        // There's a dedicated still device (so the stream is not interrupted) or the thread is not running, let's capture a frame and exit
+        Context & ctx = stillContext.fd != -1 ? stillContext : context;
+        try {
+            if (!fetchFullRes(ctx)) error = "ERROR: While fetching full resolution picture";
+        } catch (DisconnectedError e) {
+            error = String::Print("ERROR: Device disconnected: %s", (const char*)ctx.closeDevice());
+        }
+    } else {
+        // Else tell the thread to do it
+        fullResSuccess = false;
+        switching.save(1);
+        captureFullRes.Set();
+        context.wakeUp();
+        if (!captureDone.Wait(30000)) error = "ERROR: Capture thread not answering";
+        else if (!fullResSuccess) error = "ERROR: While fetching full resolution picture";
+        switching.save(0);
+        Threading::ScopedLock scope(fullResLock);
+        lastSwitchTime = Time::getPreciseTime();
     }
     fullResPic = 0;
-    return ""; // Done
+
+    // Publish the result for the waiting requests
+    Threading::ScopedLock scope(fullResLock);
+    fullResGeneration++;
+    fullResError = error;
+    if (error) return error;
+    fullResTime = Time::getPreciseTime();
+    captured->time = fullResTime;
+    captured->sequence = fullResGeneration;
+    fullResCache = captured;
+    counters.fullResDuration.record(fullResTime - start);
+    frame = captured;
+    return "";
 }
 
-static bool getJPEGPicSize(uint8 * data, size_t size, uint16 & width, uint16 & height)
+bool V4L2Thread::Context::isFrameInFormat(const struct v4l2_format & f, uint8 * ptr, size_t size)
 {
-    if(data[0] != 0xFF || data[1] != 0xD8) return false;
-    size_t off = 0;
-    while (off < size) {
-        while(off < size && data[off] == 0xff) off++;
-        if (off + 7 >= size) return false;
-        uint8 marker = data[off]; off++;
-
-        if(marker == 0xd8) continue;    // SOI
-        if(marker == 0xd9) break;       // EOI
-        if(0xd0 <= marker && marker <= 0xd7) continue;
-        if(marker == 0x01) continue;    // TEM
-
-        unsigned len = (data[off]<<8) | data[off+1];  off+=2;  
+    // Cheap checks first: empty frames or frames larger than the format allows can't be in this format
+    if (!size || (getImageSize(f) && size > getImageSize(f))) return false;
+    // Frames captured before the stream started are stale
+    if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC && (buffer.timestamp.tv_sec || buffer.timestamp.tv_usec)) {
+        double timestamp = buffer.timestamp.tv_sec + buffer.timestamp.tv_usec / 1e6;
+        if (timestamp < streamStart) return false;
+    }
+    // An access unit's content can't be checked cheaply, only its start
+    if (f.fmt.pix.pixelformat == V4L2_PIX_FMT_H264) return H264Info::hasStartCode(ptr, size);
+    // Then check the picture itself, since some sources leak previous data in the new format (it's a bug)
+    JPEGInfo info;
+    bool valid = info.parse(ptr, size) && info.width == (int)f.fmt.pix.width;
+    if (!valid) log(Debug, "Got buffer with JPEG picture of %d x %d (seq: %u), expecting %u x %u", info.width, info.height, buffer.sequence, f.fmt.pix.width, f.fmt.pix.height);
+    return valid;
+}
 
-        if(marker == 0xc0) {
-            height = (data[off+1]<<8) | data[off+2];
-            width = (data[off+3]<<8) | data[off+4];
-            return true;
+bool V4L2Thread::Context::fetchFrameInFormat(const struct v4l2_format & f, uint8 * & ptr, size_t & size)
+{
+    double deadline = Time::getPreciseTime() + switchTimeoutMs / 1000.0;
+    while (true) {
+        if (!fetchFrame(ptr, size)) return false;
+        if (isFrameInFormat(f, ptr, size)) return true;
+        if (counters) ++counters->framesStale;
+        if (!returnFrame()) return false;
+        if (Time::getPreciseTime() > deadline) {
+            log(Error, "No valid %u x %u frame received after %ums", f.fmt.pix.width, f.fmt.pix.height, switchTimeoutMs);
+            return false;
         }
-        off += len-2;
+    }
+}
+
+bool V4L2Thread::enterStandby()
+{
+    if (fake.isLoaded() || remote.isOpened() || isRunning()) return true;
+    // Not while a full resolution picture is captured
+    Threading::ScopedLock capture(captureLock);
+    try {
+        if (!context.enterStandby()) return false;
+        log(Info, "Device in standby");
+        return true;
+    } catch (DisconnectedError e) {
+        log(Error, "Device disconnected: %s", (const char*)context.closeDevice());
     }
     return false;
-} 
+}
 
-bool V4L2Thread::fetchFullRes() 
+String V4L2Thread::resetUSBDevice(const char * path)
 {
-    bool running = context.state == On;
-    if (running && !context.stopStreaming()) return false;
+    // The node's sysfs entry links to the USB interface, its parent is the USB device with its bus and device numbers
+    char node[PATH_MAX], device[PATH_MAX];
+    if (!realpath(path, node)) return String::Print("Can't find the device %s", path);
+    String entry = String::Print("/sys/class/video4linux/%s/device/..", (const char*)String(node).fromLast("/"));
+    if (!realpath(entry, device)) return String::Print("%s is not a USB device", path);
+    unsigned numbers[2] = { 0, 0 };
+    const char * names[2] = { "busnum", "devnum" };
+    for (int i = 0; i < 2; i++)
+    {
+        FILE * file = fopen(String::Print("%s/%s", device, names[i]), "r");
+        bool valid = file && fscanf(file, "%u", &numbers[i]) == 1;
+        if (file) fclose(file);
+        if (!valid) return String::Print("%s is not a USB device", path);
+    }
+    String usb = String::Print("/dev/bus/usb/%03u/%03u", numbers[0], numbers[1]);
+    int fd = ::open(usb, O_WRONLY);
+    if (fd < 0) return String::Print("Can't open %s: %s", (const char*)usb, strerror(errno));
+    int ret = ioctl(fd, USBDEVFS_RESET, 0);
+    int error = errno;
+    ::close(fd);
+    if (ret < 0) return String::Print("Can't reset %s: %s", (const char*)usb, strerror(error));
+    log(Info, "Device %s reset (USB %s)", path, (const char*)usb);
+    return "";
+}
+
+bool V4L2Thread::fetchFullRes(Context & ctx)
+{
+    // The full resolution controls profile is only applied while capturing, the cached values are the stream's ones
+    ControlValues profile, previous;
+    {
+        Threading::ScopedLock scope(controlsLock);
+        String error = stillControls ? ctx.parseControls(stillControls, profile) : String();
+        if (error) log(Warning, "Ignoring the full resolution controls: %s", (const char*)error);
+        previous.ids = profile.ids;
+        ctx.getCachedControls(previous);
+        if (!error) error = ctx.setControls(profile, false);
+        if (error) { log(Warning, "Can't set the full resolution controls: %s", (const char*)error); previous.ids.Clear(); }
+    }
+    bool success = switchAndFetch(ctx);
+    Threading::ScopedLock scope(controlsLock);
+    String error = ctx.setControls(previous, false);
+    if (error) log(Warning, "Can't restore the stream's controls: %s", (const char*)error);
+    return success;
+}
+
+bool V4L2Thread::switchAndFetch(Context & ctx) 
+{
+    // The still device is only streaming while capturing, so there is nothing to restore
+    bool running = ctx.state == On, restore = &ctx == &context;
+    double start = Time::getPreciseTime();
+    if (running && !ctx.stopStreaming()) return false;
     // Start the stream as full res now
-    if (!context.switchToFullRes()) return false;
+    if (!ctx.switchToFullRes()) return false;
     // Start the stream here
-    if (!context.startStreaming()) return false;
+    if (!ctx.startStreaming()) return false;
     log(Info, "Switched to highres");
 
     // Capture a single frame
     uint8 * ptr = 0; size_t size = 0;
-    // Some V4L2 source leaks previous data in the new format (it's a bug)
-    int retry = 10; 
-    uint16 width = 0, height = 0;
-    do {
-        if (!context.fetchFrame(ptr, size)) return false;
-        // Try to parse the data as a JPEG frame
-        if (getJPEGPicSize(ptr, size, width, height) && width == context.highres.fmt.pix.width) break;
-        log(Debug, "(FR) Got buffer with JPEG picture of %u x %u (retry: %d)", width, height, retry);
-        if (!context.returnFrame()) return false;
-    } while(--retry);
-    // No MJPG frame in the previous picture, so let's break here
-    if (!retry) return false;
+    if (!ctx.fetchFrameInFormat(ctx.highres, ptr, size)) return false;
+    counters.switchDuration.record(Time::getPreciseTime() - start);
 
     // Then drop as many frames as requested
-    for (unsigned i = 0; i < context.framesToDrop; i++) {
-        if (!context.returnFrame()) return false;
-        if (!context.fetchFrame(ptr, size)) return false;
+    for (unsigned i = 0; i < ctx.framesToDrop; i++) {
+        if (!ctx.returnFrame()) return false;
+        if (!ctx.fetchFrame(ptr, size)) return false;
     }
 
-    if (!fullResPic->ensureSize(size, true)) return false;
+    if (!fullResPic->setSize(size)) return false;
     memcpy(fullResPic->getBuffer(), ptr, size);
 
     // Stop full res picture fetching now
-    if (!context.returnFrame()) return false;
-    if (!context.stopStreaming()) return false;
+    if (!ctx.returnFrame()) return false;
+    if (!ctx.stopStreaming()) return false;
+
+    if (!restore) return true;
 
     // Switch back to low res now
-    if (!context.switchToLowRes()) return false;
+    if (!ctx.switchToLowRes()) return false;
     if (running) {
-        if (!context.startStreaming()) return false;
+        if (!ctx.startStreaming()) return false;
 
         // Fix for buggy V4L2 source requiring purging the buffers
-        bool foundSmallFrame = false; width = 0; height = 0;
-        while(!foundSmallFrame) {
-            if (!context.fetchFrame(ptr, size)) return false;
-            // Wait until we get small frame
-            if (getJPEGPicSize(ptr, size, width, height) && width == context.format.fmt.pix.width) foundSmallFrame = true;     
-            log(Debug, "(LR) Got buffer with JPEG picture of %u x %u", width, height);
-            if (!context.returnFrame()) return false;
-        }
+        if (!ctx.fetchFrameInFormat(ctx.format, ptr, size)) return false;
+        if (!ctx.returnFrame()) return false;
         log(Info, "Switched back to lowres");
     }
 
@@ -458,8 +1233,331 @@ bool V4L2Thread::fetchFullRes()
 }
 
 
+String V4L2Thread::FakeSource::load(const char * path, const unsigned fps)
+{
+    unload();
+    frameDuration = 1.0 / fps;
+    File::Info info(path, true);
+    if (info.isDir()) {
+        File::DirectoryIterator dir = File::General::listFilesIn(info.getFullPath());
+        Strings::StringArray files, names;
+        if (!dir.getAllFilesAtOnce(files, true)) return String::Print("Can't list: %s", path);
+        // Keep the JPEG files, sorted by name
+        for (size_t i = 0; i < files.getSize(); i++) {
+            String ext = files[i].fromLast(".").asLowercase();
+            if (ext != "jpg" && ext != "jpeg") continue;
+            size_t pos = 0;
+            while (pos < names.getSize() && names[pos] < files[i]) pos++;
+            names.insertBefore(pos, files[i]);
+        }
+        for (size_t i = 0; i < names.getSize(); i++) {
+            String content = File::Info(names[i]).getContent();
+            if (content.getLength() < 4) continue;
+            pictures.Append(new Utils::MemoryBlock((const uint8*)(const char*)content, content.getLength()));
+        }
+    } else {
+        String content = info.getContent();
+        const uint8 * data = (const uint8*)(const char*)content;
+        size_t size = content.getLength(), start = size;
+        // Split on the start of image (FFD8) and end of image (FFD9) markers
+        for (size_t i = 0; i + 1 < size; i++) {
+            if (data[i] != 0xFF) continue;
+            if (data[i + 1] == 0xD8 && start == size) start = i;
+            else if (data[i + 1] == 0xD9 && start != size) {
+                pictures.Append(new Utils::MemoryBlock(data + start, i + 2 - start));
+                start = size;
+                i++;
+            }
+        }
+    }
+    if (!pictures.getSize()) return String::Print("No JPEG picture found in: %s", path);
+    const Utils::MemoryBlock & first = *pictures.getElementAtUncheckedPosition(0);
+    JPEGInfo header;
+    if (header.parse(first.getConstBuffer(), first.getSize())) { width = header.width; height = header.height; }
+    log(Info, "Replaying %u pictures (%dx%d) from %s", (unsigned)pictures.getSize(), width, height, path);
+    return "";
+}
+
+String V4L2Thread::FakeSource::loadTrace(const char * path)
+{
+    static const char * names[TraceStatusCount] = { "valid", "errored", "truncated", "throttled" };
+    intervals.Clear(); switches.Clear(); statuses.Clear(); nextFrame = nextSwitch = 0;
+    String content = File::Info(path, true).getContent();
+    if (!content) return String::Print("Can't read the capture trace: %s", path);
+    for (unsigned number = 1; content; number++) {
+        String text = content.splitUpTo("\n"), line = text.Trimmed();
+        if (!line || line[0] == '#') continue;
+        String kind = line.splitUpTo(" "), value = line.splitUpTo(" ").Trimmed();
+        if (kind == "frame") {
+            // The size is not used, the pictures are replayed instead
+            line.splitUpTo(" ");
+            String status = line.Trimmed();
+            uint8 code = 0;
+            while (code < TraceStatusCount && status != names[code]) code++;
+            if (code == TraceStatusCount) return String::Print("Invalid frame status at line %u: %s", number, (const char*)status);
+            intervals.Append(value.parseDouble() / 1000);
+            statuses.Append(code);
+        }
+        else if (kind == "switch") switches.Append((line.Trimmed() == "failed" ? -1 : 1) * value.parseDouble() / 1000);
+        else return String::Print("Invalid capture trace line %u: %s", number, (const char*)text);
+    }
+    if (!intervals.getSize()) return String::Print("No frame in the capture trace: %s", path);
+    log(Info, "Replaying %u frames and %u full resolution captures from %s", (unsigned)intervals.getSize(), (unsigned)switches.getSize(), path);
+    return "";
+}
+
+String V4L2Thread::startCaptureTrace(const char * path)
+{
+    if (trace) fclose(trace);
+    // Appended, since the device is closed and opened again when it's idle
+    trace = fopen(path, "a");
+    if (!trace) return String::Print("Can't open the capture trace %s: %s", path, strerror(errno));
+    if (!ftell(trace)) fprintf(trace, "# frame <interval ms> <size> <valid|errored|truncated|throttled>, switch <duration ms> <ok|failed>\n");
+    traceTime = 0;
+    return "";
+}
+
+void V4L2Thread::traceFrame(const double time, const size_t size, const TraceStatus status)
+{
+    static const char * names[TraceStatusCount] = { "valid", "errored", "truncated", "throttled" };
+    // The first frame of a stream has no interval
+    fprintf(trace, "frame %.3f %u %s\n", traceTime ? (time - traceTime) * 1000 : 0, (unsigned)size, names[status]);
+    traceTime = time;
+}
+
+void V4L2Thread::traceSwitch(const double duration, const bool success)
+{
+    fprintf(trace, "switch %.3f %s\n", duration * 1000, success ? "ok" : "failed");
+    // The stream restarts after a switch, so the next interval is not meaningful
+    traceTime = 0;
+}
+
+void V4L2Thread::applyMaxFPS()
+{
+    uint32 fps = maxFPSRequest.swap(0);
+    if (!fps--) return;
+    log(Info, "Maximum frame rate set to %s", fps ? (const char*)String::Print("%u fps", fps) : "the device's maximum");
+    context.configuredFrameDuration = fps ? 1.0 / fps : 0;
+    fake.frameDuration = 1.0 / (fps ? fps : 30);
+    remote.minFrameDuration = fps ? 1.0 / fps : 0;
+}
+
+uint32 V4L2Thread::runFakeSource()
+{
+    double nextTime = Time::getPreciseTime();
+    size_t index = 0;
+    while (isRunning() && !stopRequested)
+    {
+        // Wait until the next frame is due (can be woken up for a full resolution picture or when stopping)
+        double now = Time::getPreciseTime();
+        if (now < nextTime) {
+            struct pollfd fds = { context.wakeFd, POLLIN, 0 };
+            if (::poll(&fds, 1, (int)((nextTime - now) * 1000) + 1) > 0) {
+                eventfd_t value;
+                eventfd_read(context.wakeFd, &value);
+            }
+            if (!(captureFullRes.Wait(Threading::TimeOut::InstantCheck))) continue;
+            // A traced capture takes the recorded time and can fail like it did (the frames are late after it, like with the device)
+            bool success = true;
+            if (fake.switches.getSize()) {
+                double recorded = fake.switches[fake.nextSwitch];
+                fake.nextSwitch = (fake.nextSwitch + 1) % fake.switches.getSize();
+                Threading::Thread::Sleep((uint32)(fabs(recorded) * 1000));
+                success = recorded >= 0;
+            }
+            // The pictures are the same for both resolution
+            fullResSuccess = success && fullResPic && !copyPicture(*fullResPic, *fake.pictures.getElementAtUncheckedPosition(index));
+            captureDone.Set();
+            continue;
+        }
+        // Don't try to catch up if we are late
+        applyMaxFPS();
+        double duration = getGovernedDuration(fake.frameDuration);
+        uint8 status = TraceValid;
+        if (fake.intervals.getSize()) {
+            // The traced intervals are replayed as is (the device's jitter included), unless the governor slows the capture down
+            status = fake.statuses[fake.nextFrame];
+            duration = max(duration == fake.frameDuration ? 0 : duration, fake.intervals[fake.nextFrame]);
+            fake.nextFrame = (fake.nextFrame + 1) % fake.intervals.getSize();
+        }
+        nextTime = now - nextTime > duration ? now + duration : nextTime + duration;
+
+        ++counters.framesCaptured;
+        // The frames the device failed to give are dropped like the capture loop does
+        if (status == TraceErrored) { ++counters.framesErrored; continue; }
+        if (status == TraceTruncated) { ++counters.framesTruncated; continue; }
+        if (status == TraceThrottled) { ++counters.framesThrottled; continue; }
+        const Utils::MemoryBlock & pic = *fake.pictures.getElementAtUncheckedPosition(index);
+        index = (index + 1) % fake.pictures.getSize();
+        if (!publishPicture(pic.getConstBuffer(), pic.getSize(), 0)) return 0;
+    }
+    return 0;
+}
+
+bool V4L2Thread::requestKeyFrame()
+{
+    if (!context.h264Stream || context.fd == -1) return false;
+    // The controls are set under the same lock as the other controls changes
+    Threading::ScopedLock scope(controlsLock);
+    struct v4l2_control control;
+    Zero(control);
+    control.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+    return ::ioctl(context.fd, VIDIOC_S_CTRL, &control) == 0;
+}
+
+bool V4L2Thread::publishPicture(const uint8 * data, const size_t size, const double age)
+{
+    if (!previewScale) return sink.pictureReceived(data, size, age);
+    String error = downscaler.downscale(data, size, previewScale, preview);
+    if (error) {
+        log(Debug, "Can't downscale the picture: %s", (const char*)error);
+        ++counters.framesNotScaled;
+        return true;
+    }
+    return sink.pictureReceived(preview.getConstBuffer(), preview.getSize(), age);
+}
+
+void V4L2Thread::answerFullRes(const uint8 * data, const size_t size)
+{
+    fullResSuccess = data && fullResPic && fullResPic->setSize((uint32)size);
+    if (fullResSuccess) memcpy(fullResPic->getBuffer(), data, size);
+    fullResRequested = false;
+    captureDone.Set();
+}
+
+uint32 V4L2Thread::runMulticastSource()
+{
+    MulticastReceiver receiver;
+    // The time the next frame is expected when decimating
+    double nextTime = 0;
+    while (isRunning() && !stopRequested)
+    {
+        String error = receiver.open(remote.stream.getGroup());
+        if (error)
+        {
+            log(Error, "Can't receive %s: %s", (const char*)remote.getURL(), (const char*)error);
+            if (fullResRequested) answerFullRes(0, 0);
+            // Retry later (the network might not be up yet), unless woken up
+            struct pollfd fds = { context.wakeFd, POLLIN, 0 };
+            if (::poll(&fds, 1, RemoteSource::RetryDelayMs) > 0) {
+                eventfd_t value;
+                eventfd_read(context.wakeFd, &value);
+                if (captureFullRes.Wait(Threading::TimeOut::InstantCheck)) { fullResSuccess = false; captureDone.Set(); }
+            }
+            continue;
+        }
+        log(Info, "Receiving the multicast stream from %s", (const char*)remote.getURL());
+        break;
+    }
+
+    while (isRunning() && !stopRequested)
+    {
+        int ready = receiver.receive(context.wakeFd, DQBUFTimeoutMs);
+        if (ready < 0) { log(Error, "Can't receive from %s", (const char*)remote.getURL()); break; }
+        if (!ready) { log(Debug, "No picture from the multicast stream %s in %ums", (const char*)remote.getURL(), (unsigned)DQBUFTimeoutMs); continue; }
+        // The pictures are the same for both resolution, so the next received picture is used
+        if ((ready & MulticastReceiver::WokenUp) && captureFullRes.Wait(Threading::TimeOut::InstantCheck)) fullResRequested = true;
+        // The pictures missing a fragment are counted as truncated
+        uint32 incomplete = receiver.takeIncomplete();
+        if (incomplete) { counters.framesCaptured += (uint64)incomplete; counters.framesTruncated += (uint64)incomplete; }
+
+        const uint8 * data = 0; size_t size = 0;
+        if (!receiver.nextFrame(data, size)) continue;
+        ++counters.framesCaptured;
+        if (!JPEGInfo::isComplete(data, size)) { ++counters.framesTruncated; continue; }
+        JPEGInfo info;
+        if (info.parse(data, size)) { remote.width = info.width; remote.height = info.height; }
+        if (fullResRequested) answerFullRes(data, size);
+
+        // Drop the frames that come too early to respect the desired FPS
+        applyMaxFPS();
+        double duration = getGovernedDuration(remote.minFrameDuration);
+        if (duration != 0) {
+            double current = Time::getPreciseTime();
+            if (current + duration / 4 < nextTime) { ++counters.framesThrottled; continue; }
+            nextTime = current - nextTime > duration ? current + duration : nextTime + duration;
+        }
+        // The sender's clock is unknown, so the picture's age is too
+        if (!publishPicture(data, size, 0)) break;
+    }
+    if (fullResRequested) answerFullRes(0, 0);
+    return 0;
+}
+
+uint32 V4L2Thread::runRemoteSource()
+{
+    if (remote.stream.multicast) return runMulticastSource();
+    RemoteSource::Connection connection;
+    // The time the next frame is expected when decimating
+    double nextTime = 0;
+    bool stop = false;
+    while (isRunning() && !stopRequested && !stop)
+    {
+        if (connection.fd == -1)
+        {
+            String error = connection.connect(remote.stream);
+            if (error) {
+                log(Error, "Can't connect to %s: %s", (const char*)remote.getURL(), (const char*)error);
+                if (fullResRequested) answerFullRes(0, 0);
+                // Retry later (the remote camera might be rebooting), unless woken up
+                struct pollfd fds = { context.wakeFd, POLLIN, 0 };
+                if (::poll(&fds, 1, RemoteSource::RetryDelayMs) > 0) {
+                    eventfd_t value;
+                    eventfd_read(context.wakeFd, &value);
+                    if (captureFullRes.Wait(Threading::TimeOut::InstantCheck)) { fullResSuccess = false; captureDone.Set(); }
+                }
+                continue;
+            }
+            log(Info, "Pulling the remote stream from %s", (const char*)remote.getURL());
+        }
+
+        int ready = connection.receive(context.wakeFd, DQBUFTimeoutMs);
+        if (ready <= 0) {
+            log(Error, ready ? "Remote stream %s disconnected" : "No data from the remote stream %s in %ums", (const char*)remote.getURL(), (unsigned)DQBUFTimeoutMs);
+            connection.close();
+            continue;
+        }
+        // The pictures are the same for both resolution, so the next received picture is used
+        if ((ready & RemoteSource::WokenUp) && captureFullRes.Wait(Threading::TimeOut::InstantCheck)) fullResRequested = true;
+
+        // Publish all the pictures received (they are in the connection's buffer, so they are not copied here)
+        const uint8 * data = 0; size_t size = 0;
+        int ret = 0;
+        while ((ret = connection.parser.nextPart(data, size)) > 0) {
+            ++counters.framesCaptured;
+            // Skip the truncated or corrupt pictures here
+            if (!JPEGInfo::isComplete(data, size)) { ++counters.framesTruncated; continue; }
+            // Follow the remote resolution
+            JPEGInfo info;
+            if (info.parse(data, size)) { remote.width = info.width; remote.height = info.height; }
+            if (fullResRequested) answerFullRes(data, size);
+
+            // Drop the frames that come too early to respect the desired FPS
+            applyMaxFPS();
+            double duration = getGovernedDuration(remote.minFrameDuration);
+            if (duration != 0) {
+                double current = Time::getPreciseTime();
+                if (current + duration / 4 < nextTime) { ++counters.framesThrottled; continue; }
+                nextTime = current - nextTime > duration ? current + duration : nextTime + duration;
+            }
+            // The remote clock is unknown, so the picture's age is too
+            if (!publishPicture(data, size, 0)) { stop = true; break; }
+        }
+        if (!stop && ret < 0) {
+            log(Error, "Bad remote stream from %s: %s", (const char*)remote.getURL(), (const char*)connection.parser.getError());
+            connection.close();
+        }
+    }
+    if (fullResRequested) answerFullRes(0, 0);
+    return 0;
+}
+
 uint32 V4L2Thread::runThread()
 {
+    fullResRequested = false;
+    sink.captureStarted();
+    if (fake.isLoaded()) return runFakeSource();
+    if (remote.isOpened()) return runRemoteSource();
     try {
         // Don't continue if we are not started yet
         if (context.fd == -1) return 0;
@@ -467,41 +1565,80 @@ uint32 V4L2Thread::runThread()
         // Ok, let's start the stream now
         if (!context.startStreaming()) return 0; // Failed.
 
-        double lastTime = 0;
+        // The time the next frame is expected when decimating
+        double nextTime = 0;
 
-        while (isRunning())
+        while (isRunning() && !stopRequested)
         {
-            // Fetch pictures from the source now
-            if (!context.eventLoop()) return 0;
-
-            // Check if capture a full frame is requested
-            if (captureFullRes.Wait(Threading::TimeOut::InstantCheck)) {
-                // It is, let's re-initialize the camera
-                bool success = fetchFullRes();
-                // Don't block the main thread here
-                captureDone.Set();
-                // Upon any failure, we can't recover here
-                if (!success) return 0;
+            // Follow the configuration changes (no frame is held here, so the stream can be restarted)
+            // The request is kept while the stream is in full resolution (it's applied once the stream is in the low resolution again)
+            uint32 lowRes = context.fullResStream ? 0 : lowResRequest.swap(0);
+            if (lowRes && !context.changeLowRes(lowRes >> 16, lowRes & 0xFFFF)) return 0;
+            applyMaxFPS();
+            // And the quality governor
+            uint32 quality = qualityRequest.swap(0);
+            if (quality && quality != context.streamQuality && !context.h264Stream && context.canSetQuality) {
+                context.streamQuality = quality;
+                if (context.setJPEGQuality(quality)) log(Info, "Stream's JPEG quality set to %u", quality);
+            }
+            // And the rate governor
+            double duration = getGovernedDuration(context.configuredFrameDuration);
+            if (duration != context.minFrameDuration) {
+                log(Info, "Capture frame rate set to %s", duration ? (const char*)String::Print("%.1f fps", 1.0 / duration) : "the device's maximum");
+                if (!context.changeFrameRate(duration)) return 0;
             }
 
-            // Check if we need to throttle the capture a bit not to overcome the desired FPS
-            if (context.minFrameDuration != 0) {
-                double current = Time::getPreciseTime();
-                if (current - lastTime < context.minFrameDuration)
-                    Sleep((current - lastTime) * 1000);
-                lastTime = current;
+            // Wait for a frame, a device event or a wake up
+            int ready = context.waitForDevice(DQBUFTimeoutMs, true);
+            if (ready < 0) return 0;
+            if (!ready) { log(Error, "No frame from the device in %ums", (unsigned)DQBUFTimeoutMs); return 0; }
+
+            // Handle the source events now
+            if ((ready & Context::EventReady) && !context.eventLoop()) return 0;
+
+            // Check if capture a full frame is requested
+            if ((ready & Context::WokenUp) && captureFullRes.Wait(Threading::TimeOut::InstantCheck)) {
+                // The stream is already in full resolution when downscaling the preview, so the next valid frame is used
+                if (context.fullResStream) fullResRequested = true;
+                else {
+                    // It is, let's re-initialize the camera
+                    double start = Time::getPreciseTime();
+                    bool success = fetchFullRes(context);
+                    if (trace) traceSwitch(Time::getPreciseTime() - start, success);
+                    fullResSuccess = success;
+                    // Don't block the main thread here
+                    captureDone.Set();
+                    // Upon any failure, we can't recover here
+                    if (!success) return 0;
+                    continue;
+                }
             }
+            if (!(ready & Context::FrameReady)) continue;
 
             // Fetch a frame
             uint8 * ptr = 0; size_t size = 0;
             if (!context.fetchFrame(ptr, size)) return 0;
-
-            // Skip very small or corrupt picture here
-            if (size > 200) {
-                // Call the sink now
-                if (!sink.pictureReceived(ptr, size)) return 0;
+            ++counters.framesCaptured;
+
+            // Skip the corrupt pictures here (before throttling, so a valid frame is not dropped in their place).
+            // A partial USB transfer is flagged by the driver, else a (cheap) check for the end of image marker finds the truncated ones
+            bool skip = false; TraceStatus status = TraceValid;
+            if (context.buffer.flags & V4L2_BUF_FLAG_ERROR) { skip = true; ++counters.framesErrored; status = TraceErrored; }
+            else if (context.h264Stream ? !H264Info::hasStartCode(ptr, size) : !JPEGInfo::isComplete(ptr, size)) { skip = true; ++counters.framesTruncated; status = TraceTruncated; }
+
+            // If the device can't limit its frame rate itself, drop the frames that come too early to respect the desired FPS (not the H.264 ones, the next pictures depend on them)
+            if (!skip && context.minFrameDuration != 0 && !context.driverPaced && !context.h264Stream) {
+                double current = context.getFrameTime(), duration = context.minFrameDuration;
+                // Allow some jitter, else a frame arriving slightly early would halve the frame rate
+                if (current + duration / 4 < nextTime) { skip = true; ++counters.framesThrottled; status = TraceThrottled; }
+                else nextTime = current - nextTime > duration ? current + duration : nextTime + duration;
             }
 
+            if (trace) traceFrame(context.getFrameTime(), size, status);
+            if (!skip && fullResRequested) answerFullRes(ptr, size);
+            // Call the sink now
+            if (!skip && !publishPicture(ptr, size, context.getFrameAge())) return 0;
+
             // Tell the context, we are done with the frame now
             if (!context.returnFrame()) return 0;
         }
@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: (GPL-3.0-or-later) */
+/* Copyright (C) 2021 X-Ryl669  */
+
+
+// We need our declaration
+#include "../include/WebSocket.hpp"
+// We need Base64 encoding
+#include "Encoding/Encode.hpp"
+
+#include <string.h>
+
+// The SHA-1 digest, only used for the handshake (so it's not optimized)
+static void sha1(const uint8 * data, const size_t size, uint8 (&digest)[20])
+{
+    uint32 h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    // The message is padded with 0x80, zeros and its size in bits, to a multiple of 64 bytes
+    size_t blocks = (size + 8) / 64 + 1;
+    for (size_t b = 0; b < blocks; b++)
+    {
+        uint32 w[80];
+        for (int i = 0; i < 16; i++)
+        {
+            uint32 word = 0;
+            for (int j = 0; j < 4; j++)
+            {
+                size_t pos = b * 64 + i * 4 + j;
+                uint8 byte = pos < size ? data[pos] : pos == size ? 0x80 : 0;
+                // The size is in the last 8 bytes of the last block
+                if (b == blocks - 1 && i >= 14) byte = (uint8)((uint64)size * 8 >> ((7 - ((i - 14) * 4 + j)) * 8));
+                word = (word << 8) | byte;
+            }
+            w[i] = word;
+        }
+        for (int i = 16; i < 80; i++) { uint32 x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16]; w[i] = (x << 1) | (x >> 31); }
+
+        uint32 a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++)
+        {
+            uint32 f, k;
+            if (i < 20)      { f = (bb & c) | (~bb & d);           k = 0x5A827999; }
+            else if (i < 40) { f = bb ^ c ^ d;                     k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (bb & c) | (bb & d) | (c & d);  k = 0x8F1BBCDC; }
+            else             { f = bb ^ c ^ d;                     k = 0xCA62C1D6; }
+            uint32 t = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+            e = d; d = c; c = (bb << 30) | (bb >> 2); bb = a; a = t;
+        }
+        h[0] += a; h[1] += bb; h[2] += c; h[3] += d; h[4] += e;
+    }
+    for (int i = 0; i < 20; i++) digest[i] = (uint8)(h[i / 4] >> ((3 - i % 4) * 8));
+}
+
+String WebSocket::getAcceptKey(const String & key)
+{
+    String input = key.Trimmed() + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    uint8 digest[20];
+    sha1((const uint8*)(const char*)input, (size_t)input.getLength(), digest);
+    uint8 out[32] = {};
+    uint32 outLen = sizeof(out) - 1;
+    if (!Encoding::encodeBase64(digest, sizeof(digest), out, outLen)) return "";
+    return String((const char*)out, (int)outLen);
+}
+
+size_t WebSocket::makeHeader(uint8 * header, const Opcode opcode, const uint64 length)
+{
+    // A single final frame for each message
+    header[0] = (uint8)(0x80 | opcode);
+    if (length < 126) { header[1] = (uint8)length; return 2; }
+    if (length < 65536) { header[1] = 126; header[2] = (uint8)(length >> 8); header[3] = (uint8)length; return 4; }
+    header[1] = 127;
+    for (int i = 0; i < 8; i++) header[2 + i] = (uint8)(length >> ((7 - i) * 8));
+    return 10;
+}
+
+int WebSocket::Reader::next(Opcode & opcode, const uint8 *& payload, size_t & length)
+{
+    // Forget the previous message
+    if (consumed) { memmove(buffer, buffer + consumed, used - consumed); used -= consumed; consumed = 0; }
+    if (used < 2) return 0;
+    // The client's frames must be masked, and only small messages are expected (so no extended length)
+    bool final = (buffer[0] & 0x80) != 0, masked = (buffer[1] & 0x80) != 0;
+    size_t size = buffer[1] & 0x7F;
+    if (!masked || size > MaxMessageSize || (buffer[0] & 0x70)) return -1;
+    if (used < MaxClientHeader + size) return 0;
+
+    const uint8 * mask = buffer + 2;
+    uint8 * data = buffer + MaxClientHeader;
+    for (size_t i = 0; i < size; i++) data[i] ^= mask[i & 3];
+    opcode = (Opcode)(buffer[0] & 0x0F);
+    // The acknowledgements are not fragmented, a fragmented message is still counted once (on its final frame)
+    if (!final && opcode >= Close) return -1;
+    if (!final) opcode = Continuation;
+    payload = data;
+    length = size;
+    consumed = MaxClientHeader + size;
+    return 1;
+}